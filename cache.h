@@ -0,0 +1,879 @@
+//In-memory cache of complete HTTP responses. A cached response is stored
+//exactly as it goes out on the wire (status line, headers and body in one
+//reference-counted wq_buf), so a hit is a single srv_send_buf with no
+//copying. Each entry also gets a ready-made 304 response, which is what
+//you get back if the request's If-None-Match or If-Modified-Since says the
+//client already has it.
+//
+//Entries are keyed on the method, path, query, and the values of whatever
+//request headers you list as "vary" headers when making the cache. If
+//Accept-Encoding is one of them, what goes in the key is the order of
+//encodings the header asks for rather than the header itself, so "gzip, br"
+//and "br, gzip;q=1.0" share entries (see enc_ranking).
+//
+//The cache is split into CACHE_SHARDS shards, each with its share of the
+//byte budget and its own CLOCK hand for eviction. Entries also expire after
+//their TTL.
+//
+//Lookups never take a lock, so any number of threads can call cache_lookup
+//at once. Adding entries takes the shard's lock. Removed entries are only
+//freed once no lookup could still be looking at them (a simple epoch
+//scheme), and a hit hands you its own reference to the buffer, so there's
+//no lifetime to worry about on the reading side.
+//
+//Typical use, with server.h doing the lookup side for you:
+//
+//    params.cache = new_cache(64 << 20, 4096, NULL, 0, &err);
+//    ...
+//    //In on_request, after building a response
+//    cache_put(params.cache, req, resp, resp_len, 10000, &err);
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef CACHE_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define CACHE_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef CACHE_H
+        #define SHOULD_INCLUDE 1
+        #define CACHE_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "cache.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include "mm_err.h"
+#include "http_parse.h"
+#include "write_queue.h"
+#include "encoding.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Must be a power of two
+    #define CACHE_SHARDS 16
+    //Most vary headers a cache can have
+    #define CACHE_MAX_VARY 4
+    //Longest key (method, path, query and vary header values together).
+    //Requests with longer keys are never cached
+    #define CACHE_MAX_KEY 1024
+    //Most threads that can do lookups. Past this, extra threads still work
+    //but take the shard lock
+    #define CACHE_MAX_THREADS 64
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(CACHE_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(CACHE_INVALID_ARG, "invalid argument");
+MM_ERR(CACHE_OOM, "out of memory");
+MM_ERR(CACHE_NOT_CACHEABLE, "only complete 200 responses to GET or HEAD can be cached");
+MM_ERR(CACHE_KEY_TOO_LONG, "cache key longer than CACHE_MAX_KEY");
+MM_ERR(CACHE_TOO_BIG, "response is bigger than a cache shard");
+
+/////////////////////////
+// Cache structs/enums //
+/////////////////////////
+#ifndef MM_IMPLEMENT
+    #define CACHE_RESULT_IDS \
+        X(CACHE_MISS), \
+        X(CACHE_HIT), \
+        X(CACHE_NOT_MODIFIED)
+
+    typedef enum _cache_result_t {
+    #define X(x) x
+        CACHE_RESULT_IDS
+    #undef X
+    } cache_result_t;
+
+    extern char const *const cache_result_strs[];
+
+    typedef struct _cache_entry {
+        unsigned long hash;
+        wq_buf *resp;               //The full response
+        wq_buf *not_modified;       //Its 304
+        char const *etag;           //Points into resp, quotes included
+        int etag_len;
+        time_t last_modified;       //0 if the response didn't say
+        unsigned long expires;      //In cache_now() milliseconds
+        int used;                   //CLOCK reference bit
+        long bytes;                 //What this entry counts for in the budget
+
+        //Internal fields. Don't touch!
+        struct {
+            //For the list of entries waiting to be freed
+            struct _cache_entry *retired_next;
+            unsigned long retired_epoch;
+        } __internal;
+
+        int key_len;
+        char key[];
+    } cache_entry;
+
+    //Open-addressed hash table of entries. Readers load slots with atomics
+    typedef struct _cache_table {
+        int cap; //Power of two
+        //Internal fields. Don't touch!
+        struct {
+            struct _cache_table *retired_next;
+            unsigned long retired_epoch;
+        } __internal;
+        cache_entry *slots[];
+    } cache_table;
+
+    typedef struct _cache_shard {
+        pthread_mutex_t lock; //Only for writers
+        cache_table *table;
+        int num;              //Live entries
+        int tombs;            //Deleted slots
+        int hand;             //CLOCK hand
+        long bytes;
+        long max_bytes;
+        cache_entry *retired;
+        cache_table *retired_tables;
+    } cache_shard;
+
+    typedef struct _cache {
+        int num_vary;
+        char const *vary[CACHE_MAX_VARY];
+
+        //Only roughly right if several threads are using the cache
+        unsigned long hits;
+        unsigned long not_modified;
+        unsigned long misses;
+        unsigned long evictions;
+
+        //Internal fields. Don't touch!
+        struct {
+            cache_shard shards[CACHE_SHARDS];
+        } __internal;
+    } cache;
+#else
+    #define X(x) #x
+    char const *const cache_result_strs[] = {
+        CACHE_RESULT_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+//Marks deleted slots. Readers skip over these
+#define CACHE_TOMB ((cache_entry *) 1)
+
+//Epoch-based reclamation. Every thread that does lookups gets a slot in
+//cache_readers, where it writes the epoch it saw on the way in (and 0 on the
+//way out). Something removed in epoch e can be freed once every nonzero slot
+//is past e. Shared by all caches, since a thread is only ever in one lookup
+//at a time
+static unsigned long cache_epoch = 1;
+static unsigned long cache_readers[CACHE_MAX_THREADS];
+static int cache_num_readers = 0;
+static __thread int cache_my_slot = -1;
+
+//Returns 0 if this thread doesn't have a reader slot (and never will)
+static int cache_enter(void) {
+    if (cache_my_slot < 0) {
+        int slot = __atomic_fetch_add(&cache_num_readers, 1, __ATOMIC_SEQ_CST);
+        cache_my_slot = slot < CACHE_MAX_THREADS ? slot : CACHE_MAX_THREADS;
+    }
+    if (cache_my_slot == CACHE_MAX_THREADS) return 0;
+
+    unsigned long e = __atomic_load_n(&cache_epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&cache_readers[cache_my_slot], e, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+static void cache_exit(void) {
+    __atomic_store_n(&cache_readers[cache_my_slot], 0, __ATOMIC_RELEASE);
+}
+
+//Oldest epoch any reader might still be in, or ~0 if nobody is reading
+static unsigned long cache_min_epoch(void) {
+    unsigned long min = ~0UL;
+    int n = __atomic_load_n(&cache_num_readers, __ATOMIC_SEQ_CST);
+    if (n > CACHE_MAX_THREADS) n = CACHE_MAX_THREADS;
+    int i;
+    for (i = 0; i < n; i++) {
+        unsigned long e = __atomic_load_n(&cache_readers[i], __ATOMIC_SEQ_CST);
+        if (e && e < min) min = e;
+    }
+    return min;
+}
+
+static unsigned long cache_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+//FNV-1a
+static unsigned long cache_hash(char const *s, int len) {
+    unsigned long h = 14695981039346656037UL;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static cache_shard *cache_shard_of(cache *c, unsigned long hash) {
+    return c->__internal.shards + (hash >> 60) % CACHE_SHARDS;
+}
+
+//Request header names aren't necessarily lower-case, so search ignoring
+//case. Returns NULL if there isn't one
+static char const *cache_req_hdr(http_req const *req, char const *name) {
+    int i;
+    for (i = 0; i < req->num_hdrs; i++) {
+        if (!strcasecmp(req->hdrs[i].name, name)) return req->hdrs[i].args;
+    }
+    return NULL;
+}
+
+//Finds the header called name in a serialized response (between hdrs and
+//end). Returns a pointer to its value, with leading spaces skipped, and puts
+//the value's length in *len. NULL if it isn't there
+static char const *cache_resp_hdr(char const *hdrs, char const *end, char const *name, int *len) {
+    int name_len = strlen(name);
+    char const *line = hdrs;
+    while (line < end) {
+        char const *eol = memmem(line, end - line, "\r\n", 2);
+        if (!eol) eol = end;
+        if (eol - line > name_len && line[name_len] == ':' && !strncasecmp(line, name, name_len)) {
+            char const *val = line + name_len + 1;
+            while (val < eol && (*val == ' ' || *val == '\t')) val++;
+            *len = eol - val;
+            return val;
+        }
+        line = eol + 2;
+    }
+    return NULL;
+}
+
+//Parses an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns 0 if it
+//can't
+static time_t cache_parse_date(char const *s, int len) {
+    char buf[64];
+    if (len <= 0 || len >= (int) sizeof(buf)) return 0;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char const *end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) return 0;
+    return timegm(&tm);
+}
+
+//Does the If-None-Match list in inm contain etag? Uses the weak comparison
+//(RFC 9110 13.1.2), so W/ prefixes are ignored
+static int cache_etag_matches(char const *inm, char const *etag, int etag_len) {
+    if (etag_len >= 2 && !strncmp(etag, "W/", 2)) {
+        etag += 2;
+        etag_len -= 2;
+    }
+
+    char const *p = inm;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p) break;
+        if (*p == '*') return 1;
+
+        if (!strncmp(p, "W/", 2)) p += 2;
+        int len = strcspn(p, ", \t");
+        if (len == etag_len && !memcmp(p, etag, len)) return 1;
+        p += len;
+    }
+    return 0;
+}
+
+static void cache_free_entry(cache_entry *e) {
+    wq_buf_unref(e->resp);
+    wq_buf_unref(e->not_modified);
+    free(e);
+}
+
+//Frees whatever was removed long enough ago. Shard lock must be held
+static void cache_reclaim(cache_shard *s) {
+    unsigned long min = cache_min_epoch();
+
+    cache_entry **pe = &s->retired;
+    while (*pe) {
+        cache_entry *e = *pe;
+        if (e->__internal.retired_epoch < min) {
+            *pe = e->__internal.retired_next;
+            cache_free_entry(e);
+        } else {
+            pe = &e->__internal.retired_next;
+        }
+    }
+
+    cache_table **pt = &s->retired_tables;
+    while (*pt) {
+        cache_table *t = *pt;
+        if (t->__internal.retired_epoch < min) {
+            *pt = t->__internal.retired_next;
+            free(t);
+        } else {
+            pt = &t->__internal.retired_next;
+        }
+    }
+}
+
+//Takes slot i out of the table and queues its entry to be freed. Shard lock
+//must be held
+static void cache_retire_slot(cache_shard *s, int i) {
+    cache_entry *e = s->table->slots[i];
+    __atomic_store_n(&s->table->slots[i], CACHE_TOMB, __ATOMIC_SEQ_CST);
+    s->num--;
+    s->tombs++;
+    s->bytes -= e->bytes;
+
+    e->__internal.retired_epoch = __atomic_fetch_add(&cache_epoch, 1, __ATOMIC_SEQ_CST);
+    e->__internal.retired_next = s->retired;
+    s->retired = e;
+}
+
+//Moves every live entry into a fresh table without tombstones, then swaps
+//it in. Readers that still have the old one keep working with it until
+//they're done. Shard lock must be held
+static void cache_rebuild(cache_shard *s, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    cache_table *old = s->table;
+    cache_table *t = calloc(1, sizeof(cache_table) + old->cap * sizeof(cache_entry *));
+    if (!t) {
+        *err = CACHE_OOM;
+        return;
+    }
+    t->cap = old->cap;
+
+    int i;
+    for (i = 0; i < old->cap; i++) {
+        cache_entry *e = old->slots[i];
+        if (!e || e == CACHE_TOMB) continue;
+        int j = e->hash & (t->cap - 1);
+        while (t->slots[j]) j = (j + 1) & (t->cap - 1);
+        t->slots[j] = e;
+    }
+
+    __atomic_store_n(&s->table, t, __ATOMIC_SEQ_CST);
+    s->tombs = 0;
+    s->hand = 0;
+
+    old->__internal.retired_epoch = __atomic_fetch_add(&cache_epoch, 1, __ATOMIC_SEQ_CST);
+    old->__internal.retired_next = s->retired_tables;
+    s->retired_tables = old;
+}
+
+//Runs the CLOCK hand until there's room for an entry of this many bytes.
+//Expired entries go first no matter where the hand is. Returns -1 if
+//everything got evicted and there still isn't room. Shard lock must be held
+static int cache_make_room(cache *c, cache_shard *s, long bytes) {
+    if (bytes > s->max_bytes) return -1;
+
+    cache_table *t = s->table;
+    unsigned long now = cache_now();
+    //Leave at least a quarter of the slots empty so probes stay short
+    int max_used = t->cap - t->cap / 4;
+
+    //Two full sweeps is always enough: the first clears every used bit
+    int steps = 2 * t->cap;
+    while ((s->bytes + bytes > s->max_bytes || s->num + 1 > max_used) && steps-- > 0) {
+        int i = s->hand;
+        s->hand = (s->hand + 1) & (t->cap - 1);
+
+        cache_entry *e = t->slots[i];
+        if (!e || e == CACHE_TOMB) continue;
+        if (e->expires > now && __atomic_exchange_n(&e->used, 0, __ATOMIC_RELAXED)) continue;
+
+        cache_retire_slot(s, i);
+        __atomic_add_fetch(&c->evictions, 1, __ATOMIC_RELAXED);
+    }
+
+    return (s->bytes + bytes > s->max_bytes || s->num + 1 > max_used) ? -1 : 0;
+}
+
+//Makes the 304 that goes with a response. It gets copies of the response's
+//headers that a 304 is supposed to repeat (RFC 9110 15.4.5). hdrs..end is
+//the response's header block
+static wq_buf *cache_make_304(char const *hdrs, char const *end, mm_err *err) {
+    if (*err != MM_SUCCESS) return NULL;
+
+    static char const *const keep[] = {"ETag", "Last-Modified", "Vary", "Cache-Control", "Content-Location", "Expires"};
+
+    char buf[1024];
+    int len = snprintf(buf, sizeof(buf), "HTTP/1.1 304 Not Modified\r\n");
+    int i;
+    for (i = 0; i < (int) (sizeof(keep) / sizeof(*keep)); i++) {
+        int val_len;
+        char const *val = cache_resp_hdr(hdrs, end, keep[i], &val_len);
+        if (val && len < (int) sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - len, "%s: %.*s\r\n", keep[i], val_len, val);
+        }
+    }
+    if (len < (int) sizeof(buf)) len += snprintf(buf + len, sizeof(buf) - len, "\r\n");
+    if (len >= (int) sizeof(buf)) {
+        *err = CACHE_NOT_CACHEABLE;
+        return NULL;
+    }
+
+    wq_buf *ret = new_wq_buf_from(buf, len, err);
+    if (*err != MM_SUCCESS) *err = CACHE_OOM;
+    return ret;
+}
+
+//Copies resp into a wq_buf, adding an ETag header (a hash of the body) if it
+//doesn't have one. hdr_end points at the blank line that ends the headers
+static wq_buf *cache_copy_resp(char const *resp, int len, char const *hdr_end, int has_etag, mm_err *err) {
+    if (*err != MM_SUCCESS) return NULL;
+
+    char etag[48];
+    int etag_len = 0;
+    if (!has_etag) {
+        char const *body = hdr_end + 4;
+        etag_len = snprintf(etag, sizeof(etag), "ETag: \"%016lx\"\r\n", cache_hash(body, resp + len - body));
+    }
+
+    wq_buf *ret = new_wq_buf(len + etag_len, err);
+    if (*err != MM_SUCCESS) {
+        *err = CACHE_OOM;
+        return NULL;
+    }
+
+    //The new header goes right before the blank line
+    int split = hdr_end + 2 - resp;
+    memcpy(ret->data, resp, split);
+    memcpy(ret->data + split, etag, etag_len);
+    memcpy(ret->data + split + etag_len, resp + split, len - split);
+    return ret;
+}
+
+#endif
+
+/////////////////////////////
+// Managing cache structs //
+/////////////////////////////
+
+/* new_cache:
+
+Makes a cache that holds at most max_bytes (headers, bodies and bookkeeping
+all count) and at most max_entries responses. Both are split evenly between
+the shards, so a single response can't be bigger than max_bytes/CACHE_SHARDS.
+
+vary lists request headers whose values go in the key, like
+"Accept-Encoding". Can be NULL if num_vary is 0. The strings must outlive
+the cache.
+
+Returns NULL and sets *err on error. Free with del_cache.
+*/
+cache *new_cache(long max_bytes, int max_entries, char const *const *vary, int num_vary, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (max_bytes <= 0 || max_entries <= 0 || num_vary < 0 || num_vary > CACHE_MAX_VARY) {
+        *err = CACHE_INVALID_ARG;
+        return NULL;
+    }
+    if (num_vary > 0 && !vary) {
+        *err = CACHE_NULL_ARG;
+        return NULL;
+    }
+
+    cache *ret = calloc(1, sizeof(cache));
+    if (!ret) {
+        *err = CACHE_OOM;
+        return NULL;
+    }
+
+    ret->num_vary = num_vary;
+    int i;
+    for (i = 0; i < num_vary; i++) ret->vary[i] = vary[i];
+
+    //Enough slots that the shard's share of max_entries fits in 3/4 of them
+    int per_shard = (max_entries + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    int cap = 8;
+    while (cap - cap / 4 < per_shard) cap *= 2;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *s = ret->__internal.shards + i;
+        pthread_mutex_init(&s->lock, NULL);
+        s->max_bytes = max_bytes / CACHE_SHARDS;
+        s->table = calloc(1, sizeof(cache_table) + cap * sizeof(cache_entry *));
+        if (!s->table) {
+            del_cache(ret);
+            *err = CACHE_OOM;
+            return NULL;
+        }
+        s->table->cap = cap;
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Frees a cache and everything in it. Nobody can be using it at the same
+//time. Gracefully ignores NULL input
+void del_cache(cache *c)
+#ifdef MM_IMPLEMENT
+{
+    if (!c) return;
+
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *s = c->__internal.shards + i;
+        if (s->table) {
+            int j;
+            for (j = 0; j < s->table->cap; j++) {
+                cache_entry *e = s->table->slots[j];
+                if (e && e != CACHE_TOMB) cache_free_entry(e);
+            }
+            free(s->table);
+        }
+        while (s->retired) {
+            cache_entry *e = s->retired;
+            s->retired = e->__internal.retired_next;
+            cache_free_entry(e);
+        }
+        while (s->retired_tables) {
+            cache_table *t = s->retired_tables;
+            s->retired_tables = t->__internal.retired_next;
+            free(t);
+        }
+        pthread_mutex_destroy(&s->lock);
+    }
+
+    free(c);
+}
+#else
+;
+#endif
+
+/////////////////////
+// Using the cache //
+/////////////////////
+
+//Writes the key req would be cached under into buf, which needs room for
+//CACHE_MAX_KEY bytes. Returns its length, or -1 if it's too long. You only
+//need this for cache_put_key
+int cache_key(cache const *c, http_req const *req, char *buf)
+#ifdef MM_IMPLEMENT
+{
+    char const *method = http_req_strs[req->req_type];
+    int len = snprintf(buf, CACHE_MAX_KEY, "%s %.*s?%.*s",
+        method, req->path_len, req->path, req->query_len, req->query
+    );
+    int i;
+    for (i = 0; i < c->num_vary && len < CACHE_MAX_KEY; i++) {
+        char const *val = cache_req_hdr(req, c->vary[i]);
+        if (!strcasecmp(c->vary[i], "Accept-Encoding")) {
+            len += snprintf(buf + len, CACHE_MAX_KEY - len, "\n%x", enc_ranking(val));
+        } else {
+            len += snprintf(buf + len, CACHE_MAX_KEY - len, "\n%s", val ? val : "");
+        }
+    }
+    return len < CACHE_MAX_KEY ? len : -1;
+}
+#else
+;
+#endif
+
+/* cache_lookup:
+
+Looks for a cached response to req. On CACHE_HIT, *out is the full response;
+on CACHE_NOT_MODIFIED it's a 304 (the request's validators matched). Either
+way it's your own reference, so wq_buf_unref it once you've sent it. On
+CACHE_MISS, *out is set to NULL.
+
+Only GET and HEAD requests can hit. Never takes a lock (unless more than
+CACHE_MAX_THREADS threads use caches) and never allocates. Assumes all
+arguments are non-NULL.
+*/
+cache_result_t cache_lookup(cache *c, http_req const *req, wq_buf **out)
+#ifdef MM_IMPLEMENT
+{
+    *out = NULL;
+
+    if (req->req_type != HTTP_GET && req->req_type != HTTP_HEAD) {
+        __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+        return CACHE_MISS;
+    }
+
+    char key[CACHE_MAX_KEY];
+    int key_len = cache_key(c, req, key);
+    if (key_len < 0) {
+        __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+        return CACHE_MISS;
+    }
+    unsigned long hash = cache_hash(key, key_len);
+    cache_shard *s = cache_shard_of(c, hash);
+
+    int locked = !cache_enter();
+    if (locked) pthread_mutex_lock(&s->lock);
+
+    cache_table *t = __atomic_load_n(&s->table, __ATOMIC_SEQ_CST);
+    cache_entry *found = NULL;
+    int i = hash & (t->cap - 1);
+    int n;
+    for (n = 0; n < t->cap; n++, i = (i + 1) & (t->cap - 1)) {
+        cache_entry *e = __atomic_load_n(&t->slots[i], __ATOMIC_SEQ_CST);
+        if (!e) break;
+        if (e == CACHE_TOMB || e->hash != hash) continue;
+        if (e->key_len == key_len && !memcmp(e->key, key, key_len)) {
+            found = e;
+            break;
+        }
+    }
+
+    cache_result_t ret = CACHE_MISS;
+    if (found && found->expires > cache_now()) {
+        if (!__atomic_load_n(&found->used, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&found->used, 1, __ATOMIC_RELAXED);
+        }
+
+        ret = CACHE_HIT;
+        //If-None-Match wins over If-Modified-Since when both are there
+        char const *inm = cache_req_hdr(req, "If-None-Match");
+        char const *ims = cache_req_hdr(req, "If-Modified-Since");
+        if (inm) {
+            if (cache_etag_matches(inm, found->etag, found->etag_len)) ret = CACHE_NOT_MODIFIED;
+        } else if (ims && found->last_modified) {
+            time_t since = cache_parse_date(ims, strlen(ims));
+            if (since && found->last_modified <= since) ret = CACHE_NOT_MODIFIED;
+        }
+
+        *out = (ret == CACHE_HIT) ? found->resp : found->not_modified;
+        wq_buf_ref(*out);
+    }
+
+    if (locked) pthread_mutex_unlock(&s->lock);
+    else cache_exit();
+
+    if (ret == CACHE_HIT) __atomic_add_fetch(&c->hits, 1, __ATOMIC_RELAXED);
+    else if (ret == CACHE_NOT_MODIFIED) __atomic_add_fetch(&c->not_modified, 1, __ATOMIC_RELAXED);
+    else __atomic_add_fetch(&c->misses, 1, __ATOMIC_RELAXED);
+
+    return ret;
+}
+#else
+;
+#endif
+
+/* cache_put_key:
+
+Stores resp[0..len), a complete serialized response, under a key you got
+from cache_key, for ttl_ms milliseconds. It has to be a 200 with a
+Content-Length (or no body at all). If it doesn't have an ETag header, one
+is added (a hash of the body). If it has Last-Modified, that's used for
+If-Modified-Since. Replaces whatever was cached under the same key, and
+evicts other entries if the shard is full.
+
+resp is copied, so you can send it and throw it away as usual. Safe to call
+from any thread, which is the point: the request is usually long gone by
+the time a worker thread has the response ready.
+*/
+void cache_put_key(cache *c, char const *key, int key_len, char const *resp, int len, unsigned ttl_ms, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!c || !key || !resp) {
+        *err = CACHE_NULL_ARG;
+        return;
+    }
+    if (key_len < 0 || key_len >= CACHE_MAX_KEY) {
+        *err = CACHE_KEY_TOO_LONG;
+        return;
+    }
+
+    if (len < 12 || (strncmp(resp, "HTTP/1.1 200", 12) && strncmp(resp, "HTTP/1.0 200", 12))) {
+        *err = CACHE_NOT_CACHEABLE;
+        return;
+    }
+    char const *hdr_end = memmem(resp, len, "\r\n\r\n", 4);
+    if (!hdr_end) {
+        *err = CACHE_NOT_CACHEABLE;
+        return;
+    }
+    char const *hdrs = memchr(resp, '\n', len) + 1;
+    int etag_len = 0;
+    char const *etag = cache_resp_hdr(hdrs, hdr_end + 2, "ETag", &etag_len);
+    int lm_len = 0;
+    char const *lm = cache_resp_hdr(hdrs, hdr_end + 2, "Last-Modified", &lm_len);
+    int cl_len = 0;
+    char const *cl = cache_resp_hdr(hdrs, hdr_end + 2, "Content-Length", &cl_len);
+    //Without a Content-Length, a body would only end when the connection
+    //does, and we can't send it that way on keep-alive connections
+    if (!cl && resp + len != hdr_end + 4) {
+        *err = CACHE_NOT_CACHEABLE;
+        return;
+    }
+
+    cache_entry *e = calloc(1, sizeof(cache_entry) + key_len);
+    if (!e) {
+        *err = CACHE_OOM;
+        return;
+    }
+    memcpy(e->key, key, key_len);
+    e->key_len = key_len;
+    e->hash = cache_hash(key, key_len);
+    e->expires = cache_now() + ttl_ms;
+    e->last_modified = lm ? cache_parse_date(lm, lm_len) : 0;
+
+    e->resp = cache_copy_resp(resp, len, hdr_end, etag != NULL, err);
+    if (*err != MM_SUCCESS) {
+        free(e);
+        return;
+    }
+    //Find the ETag again, since it now has to point into our copy
+    char const *our_end = memmem(e->resp->data, e->resp->len, "\r\n\r\n", 4);
+    e->etag = cache_resp_hdr(e->resp->data, our_end + 2, "ETag", &e->etag_len);
+
+    e->not_modified = cache_make_304(e->resp->data, our_end + 2, err);
+    if (*err != MM_SUCCESS) {
+        cache_free_entry(e);
+        return;
+    }
+    e->bytes = sizeof(cache_entry) + key_len + e->resp->len + e->not_modified->len;
+
+    cache_shard *s = cache_shard_of(c, e->hash);
+    pthread_mutex_lock(&s->lock);
+
+    //Take out the old version first, so it doesn't count against the budget
+    cache_table *t = s->table;
+    int i = e->hash & (t->cap - 1);
+    int n;
+    for (n = 0; n < t->cap; n++, i = (i + 1) & (t->cap - 1)) {
+        cache_entry *old = t->slots[i];
+        if (!old) break;
+        if (old == CACHE_TOMB || old->hash != e->hash) continue;
+        if (old->key_len == key_len && !memcmp(old->key, key, key_len)) {
+            cache_retire_slot(s, i);
+            break;
+        }
+    }
+
+    if (cache_make_room(c, s, e->bytes) < 0) {
+        pthread_mutex_unlock(&s->lock);
+        cache_free_entry(e);
+        *err = CACHE_TOO_BIG;
+        return;
+    }
+
+    //Too many tombstones makes misses slow (they have to probe until they
+    //find an empty slot)
+    if (s->num + s->tombs + 1 > t->cap - t->cap / 4) {
+        cache_rebuild(s, err);
+        if (*err != MM_SUCCESS) {
+            pthread_mutex_unlock(&s->lock);
+            cache_free_entry(e);
+            return;
+        }
+        t = s->table;
+    }
+
+    i = e->hash & (t->cap - 1);
+    while (t->slots[i] && t->slots[i] != CACHE_TOMB) i = (i + 1) & (t->cap - 1);
+    if (t->slots[i] == CACHE_TOMB) s->tombs--;
+    __atomic_store_n(&t->slots[i], e, __ATOMIC_SEQ_CST);
+    s->num++;
+    s->bytes += e->bytes;
+
+    cache_reclaim(s);
+    pthread_mutex_unlock(&s->lock);
+}
+#else
+;
+#endif
+
+/* cache_put:
+
+Same as cache_put_key, for a response to req, which has to be a GET or
+HEAD.
+*/
+void cache_put(cache *c, http_req const *req, char const *resp, int len, unsigned ttl_ms, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!c || !req) {
+        *err = CACHE_NULL_ARG;
+        return;
+    }
+    if (req->req_type != HTTP_GET && req->req_type != HTTP_HEAD) {
+        *err = CACHE_NOT_CACHEABLE;
+        return;
+    }
+
+    char key[CACHE_MAX_KEY];
+    int key_len = cache_key(c, req, key);
+    if (key_len < 0) {
+        *err = CACHE_KEY_TOO_LONG;
+        return;
+    }
+
+    cache_put_key(c, key, key_len, resp, len, ttl_ms, err);
+}
+#else
+;
+#endif
+
+//Throws away everything in the cache. Safe to call while other threads are
+//doing lookups
+void cache_clear(cache *c)
+#ifdef MM_IMPLEMENT
+{
+    if (!c) return;
+
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        cache_shard *s = c->__internal.shards + i;
+        pthread_mutex_lock(&s->lock);
+        int j;
+        for (j = 0; j < s->table->cap; j++) {
+            cache_entry *e = s->table->slots[j];
+            if (e && e != CACHE_TOMB) cache_retire_slot(s, j);
+        }
+        mm_err err = MM_SUCCESS;
+        cache_rebuild(s, &err); //If this fails, the tombstones just stay
+        cache_reclaim(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,451 @@
+//Traffic capture. Every chunk of bytes the server reads gets appended to a
+//log file, along with which connection it came from and when, so the exact
+//same traffic (same segment sizes, same pipelining, same bursts of frames)
+//can be replayed later. See replay.c for the other end.
+//
+//The log is memory-mapped, so recording a chunk is a memcpy and a few
+//stores; there are no system calls except when the file has to grow (every
+//CAP_GROW_SIZE bytes). The header's data_len is only bumped once a record is
+//completely written, so if the server dies halfway through, the log is
+//still readable up to the last whole record.
+//
+//File layout (native byte order, since it's meant to be read back on the
+//same kind of machine):
+//
+//    cap_file_hdr
+//    records, each a cap_file_rec followed by len bytes of data, padded to
+//    a multiple of 8
+//
+//Writing is not thread-safe: give each event loop its own log.
+//
+//Typical use:
+//
+//    cap_log *log = new_cap_log("traffic.cap", 1L << 30, &err);
+//    params.capture = log;
+//    ...
+//    del_cap_log(log);
+//
+//    cap_reader *r = new_cap_reader("traffic.cap", &err);
+//    cap_rec rec;
+//    while (cap_next(r, &rec, &err) > 0) ...
+//    del_cap_reader(r);
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef CAPTURE_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define CAPTURE_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef CAPTURE_H
+        #define SHOULD_INCLUDE 1
+        #define CAPTURE_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "capture.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    #define CAP_MAGIC "MMCAP01"
+    //How much the file grows by when it runs out of room. Bigger means
+    //fewer ftruncate/mremap calls
+    #define CAP_GROW_SIZE (4L << 20)
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(CAP_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(CAP_OOM, "out of memory");
+MM_ERR(CAP_IO_ERROR, "could not open or map capture file (check errno)");
+MM_ERR(CAP_BAD_FILE, "not a capture file, or it's corrupted");
+
+///////////////////////////
+// Capture structs/enums //
+///////////////////////////
+#ifndef MM_IMPLEMENT
+    #define CAP_REC_TYPE_IDS \
+        X(CAP_OPEN), \
+        X(CAP_DATA), \
+        X(CAP_CLOSE)
+
+    typedef enum _cap_rec_type_t {
+    #define X(x) x
+        CAP_REC_TYPE_IDS
+    #undef X
+    } cap_rec_type_t;
+
+    extern char const *const cap_rec_type_strs[];
+
+    //What's actually in the file. All sizes are fixed on 64-bit Linux,
+    //which is all we run on anyway
+    typedef struct _cap_file_hdr {
+        char magic[8];
+        //Wall clock time the capture started, in ns since the epoch
+        unsigned long start_ns;
+        //Bytes of records after this header. Only ever points at the end
+        //of a complete record
+        unsigned long data_len;
+        unsigned long num_recs;
+        //Records that didn't fit under max_bytes
+        unsigned long dropped;
+        unsigned long reserved[3];
+    } cap_file_hdr;
+
+    typedef struct _cap_file_rec {
+        //Since the start of the capture (monotonic clock)
+        unsigned long ts_ns;
+        unsigned long conn;
+        unsigned len;
+        unsigned short type;
+        unsigned short reserved;
+    } cap_file_rec;
+
+    typedef struct _cap_log {
+        //Set once max_bytes is reached. Everything after that is dropped
+        int full;
+
+        //Internal fields. Don't touch!
+        struct {
+            int fd;
+            char *map;
+            //Current size of the file (and the mapping)
+            long map_len;
+            //0 means no limit
+            long max_bytes;
+            unsigned long start_mono_ns;
+        } __internal;
+    } cap_log;
+
+    //One record, as handed out by cap_next. data points into the mapped
+    //file, so it's only good until del_cap_reader
+    typedef struct _cap_rec {
+        unsigned long ts_ns;
+        unsigned long conn;
+        cap_rec_type_t type;
+        int len;
+        char const *data;
+    } cap_rec;
+
+    typedef struct _cap_reader {
+        //Straight from the file header
+        unsigned long start_ns;
+        unsigned long num_recs;
+        unsigned long dropped;
+
+        //Internal fields. Don't touch!
+        struct {
+            char const *map;
+            long map_len;
+            //Offset of the next record, and where the records stop
+            long pos;
+            long end;
+        } __internal;
+    } cap_reader;
+#else
+    #define X(x) #x
+    char const *const cap_rec_type_strs[] = {
+        CAP_REC_TYPE_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+static unsigned long cap_clock_ns(clockid_t which) {
+    struct timespec ts;
+    clock_gettime(which, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static long cap_padded(long len) {
+    return (len + 7) & ~7L;
+}
+
+//Makes the file (and the mapping) at least want bytes long. Returns -1 if
+//it can't
+static int cap_grow(cap_log *log, long want) {
+    long new_len = log->__internal.map_len;
+    while (new_len < want) new_len += CAP_GROW_SIZE;
+
+    if (ftruncate(log->__internal.fd, new_len) < 0) return -1;
+    char *map = mremap(log->__internal.map, log->__internal.map_len, new_len, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED) return -1;
+
+    log->__internal.map = map;
+    log->__internal.map_len = new_len;
+    return 0;
+}
+
+#endif
+
+//////////////////////////
+// Writing capture logs //
+//////////////////////////
+
+//Creates (or truncates) the log file at path. Once the log would go past
+//max_bytes, further records are dropped and counted instead; 0 means no
+//limit. Returns NULL and sets *err on error
+cap_log *new_cap_log(char const *path, long max_bytes, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!path) {
+        *err = CAP_NULL_ARG;
+        return NULL;
+    }
+
+    cap_log *ret = calloc(1, sizeof(cap_log));
+    if (!ret) {
+        *err = CAP_OOM;
+        return NULL;
+    }
+    ret->__internal.max_bytes = max_bytes;
+    ret->__internal.start_mono_ns = cap_clock_ns(CLOCK_MONOTONIC);
+
+    ret->__internal.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (ret->__internal.fd < 0) {
+        free(ret);
+        *err = CAP_IO_ERROR;
+        return NULL;
+    }
+
+    ret->__internal.map_len = CAP_GROW_SIZE;
+    if (ftruncate(ret->__internal.fd, CAP_GROW_SIZE) < 0
+        || (ret->__internal.map = mmap(NULL, CAP_GROW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ret->__internal.fd, 0)) == MAP_FAILED
+    ) {
+        close(ret->__internal.fd);
+        free(ret);
+        *err = CAP_IO_ERROR;
+        return NULL;
+    }
+
+    cap_file_hdr *hdr = (cap_file_hdr *) ret->__internal.map;
+    memcpy(hdr->magic, CAP_MAGIC, sizeof(CAP_MAGIC));
+    hdr->start_ns = cap_clock_ns(CLOCK_REALTIME);
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Cuts the file down to what was actually written and closes it. Gracefully
+//ignores NULL input
+void del_cap_log(cap_log *log)
+#ifdef MM_IMPLEMENT
+{
+    if (!log) return;
+
+    cap_file_hdr *hdr = (cap_file_hdr *) log->__internal.map;
+    long len = sizeof(cap_file_hdr) + hdr->data_len;
+    munmap(log->__internal.map, log->__internal.map_len);
+    if (ftruncate(log->__internal.fd, len) < 0) {
+        //Nothing to be done. The extra zeroes don't hurt the reader
+    }
+    close(log->__internal.fd);
+    free(log);
+}
+#else
+;
+#endif
+
+//Appends one record. conn is whatever identifies the connection (the
+//server uses srv_conn's id). Returns 0 on success, or -1 if the record was
+//dropped (log full, or the file couldn't grow). Gracefully ignores a NULL
+//log, so callers can pass whatever's in their params
+int cap_record(cap_log *log, cap_rec_type_t type, unsigned long conn, char const *buf, int len)
+#ifdef MM_IMPLEMENT
+{
+    if (!log) return 0;
+
+    cap_file_hdr *hdr = (cap_file_hdr *) log->__internal.map;
+    if (len < 0 || (len > 0 && !buf)) len = 0;
+    long rec_len = sizeof(cap_file_rec) + cap_padded(len);
+    long end = sizeof(cap_file_hdr) + hdr->data_len + rec_len;
+
+    if (log->full || (log->__internal.max_bytes > 0 && end > log->__internal.max_bytes)) {
+        log->full = 1;
+        hdr->dropped++;
+        return -1;
+    }
+    if (end > log->__internal.map_len) {
+        if (cap_grow(log, end) < 0) {
+            hdr->dropped++;
+            return -1;
+        }
+        hdr = (cap_file_hdr *) log->__internal.map;
+    }
+
+    cap_file_rec *rec = (cap_file_rec *) (log->__internal.map + sizeof(cap_file_hdr) + hdr->data_len);
+    rec->ts_ns = cap_clock_ns(CLOCK_MONOTONIC) - log->__internal.start_mono_ns;
+    rec->conn = conn;
+    rec->len = len;
+    rec->type = type;
+    rec->reserved = 0;
+    if (len > 0) memcpy(rec + 1, buf, len);
+
+    //Only now does the record "exist"
+    hdr->data_len += rec_len;
+    hdr->num_recs++;
+    return 0;
+}
+#else
+;
+#endif
+
+//////////////////////////
+// Reading capture logs //
+//////////////////////////
+
+//Maps the log at path for reading. It's fine if the log is still being
+//written; you get whatever was complete when this was called. Returns NULL
+//and sets *err on error
+cap_reader *new_cap_reader(char const *path, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!path) {
+        *err = CAP_NULL_ARG;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        *err = CAP_IO_ERROR;
+        return NULL;
+    }
+    if (st.st_size < (long) sizeof(cap_file_hdr)) {
+        close(fd);
+        *err = CAP_BAD_FILE;
+        return NULL;
+    }
+
+    char const *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *err = CAP_IO_ERROR;
+        return NULL;
+    }
+
+    cap_file_hdr const *hdr = (cap_file_hdr const *) map;
+    if (memcmp(hdr->magic, CAP_MAGIC, sizeof(CAP_MAGIC)) || hdr->data_len > st.st_size - sizeof(cap_file_hdr)) {
+        munmap((void *) map, st.st_size);
+        *err = CAP_BAD_FILE;
+        return NULL;
+    }
+
+    cap_reader *ret = calloc(1, sizeof(cap_reader));
+    if (!ret) {
+        munmap((void *) map, st.st_size);
+        *err = CAP_OOM;
+        return NULL;
+    }
+    ret->start_ns = hdr->start_ns;
+    ret->num_recs = hdr->num_recs;
+    ret->dropped = hdr->dropped;
+    ret->__internal.map = map;
+    ret->__internal.map_len = st.st_size;
+    ret->__internal.pos = sizeof(cap_file_hdr);
+    ret->__internal.end = sizeof(cap_file_hdr) + hdr->data_len;
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Gracefully ignores NULL input
+void del_cap_reader(cap_reader *r)
+#ifdef MM_IMPLEMENT
+{
+    if (!r) return;
+    munmap((void *) r->__internal.map, r->__internal.map_len);
+    free(r);
+}
+#else
+;
+#endif
+
+//Fills in rec with the next record. Returns 1 if there was one, 0 at the
+//end of the log, or -1 and sets *err if the log is corrupted
+int cap_next(cap_reader *r, cap_rec *rec, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!r || !rec) {
+        *err = CAP_NULL_ARG;
+        return -1;
+    }
+
+    long pos = r->__internal.pos;
+    if (pos == r->__internal.end) return 0;
+
+    cap_file_rec const *fr = (cap_file_rec const *) (r->__internal.map + pos);
+    if (pos + (long) sizeof(cap_file_rec) > r->__internal.end
+        || pos + (long) sizeof(cap_file_rec) + cap_padded(fr->len) > r->__internal.end
+        || fr->type > CAP_CLOSE
+    ) {
+        *err = CAP_BAD_FILE;
+        return -1;
+    }
+
+    rec->ts_ns = fr->ts_ns;
+    rec->conn = fr->conn;
+    rec->type = fr->type;
+    rec->len = fr->len;
+    rec->data = (char const *) (fr + 1);
+
+    r->__internal.pos = pos + sizeof(cap_file_rec) + cap_padded(fr->len);
+    return 1;
+}
+#else
+;
+#endif
+
+//Goes back to the first record
+void cap_rewind(cap_reader *r)
+#ifdef MM_IMPLEMENT
+{
+    r->__internal.pos = sizeof(cap_file_hdr);
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,370 @@
+//C++20 coroutines on top of server.h. Instead of callbacks, you write one
+//coroutine per connection that reads like blocking code:
+//
+//    mm::conn_task handle(mm::connection &c) {
+//        while (http_req *req = co_await c.next_request()) {
+//            co_await c.send("HTTP/1.1 204 No Content\r\n\r\n");
+//        }
+//    }
+//
+//    mm_err err = MM_SUCCESS;
+//    mm::co_server srv("8080", handle, nullptr, &err);
+//    srv.run(&err);
+//
+//It's all still one thread and one epoll loop. A connection waiting on
+//co_await is just its coroutine frame, which lives inside the connection
+//object if it's small enough (co_frame_inline bytes) and otherwise comes
+//from the slab allocator. Either way, no malloc per connection.
+//
+//The rules:
+//
+//  - next_request/next_message give you nullptr once the connection is
+//    closed. Return from the handler when that happens
+//  - A request (or message) stays valid until you ask for the next one,
+//    even if you co_await other things in between. While you hang on to
+//    it, the server stops reading from that connection (see srv_hold)
+//  - send/send_message return once the data is sent or queued, but if the
+//    connection's output queue is over its high watermark they wait until
+//    it drains. They give back an mm_err
+//  - Returning from the handler closes the connection (gracefully)
+//  - Handlers must be plain functions taking a connection &, and only
+//    co_await things from this file. Exceptions that escape a handler
+//    terminate the program
+
+#ifndef CO_SERVER_HPP
+#define CO_SERVER_HPP 1
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <string_view>
+#include <type_traits>
+
+extern "C" {
+#include "mm_err.h"
+#include "mm_alloc.h"
+#include "http_parse.h"
+#include "websock.h"
+#include "server.h"
+}
+
+namespace mm {
+
+//Coroutine frames up to this size live inside the connection itself
+inline constexpr std::size_t co_frame_inline = 384;
+
+class connection;
+
+//Return type of a connection handler
+class conn_task {
+public:
+    struct promise_type {
+        conn_task get_return_object() {
+            return conn_task{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+        //Run straight away, and stay around after finishing so the
+        //connection can tell that we're done
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        //Frames come from the connection (see connection::alloc_frame)
+        static void *operator new(std::size_t sz, connection &c);
+        static void *operator new(std::size_t sz);
+        static void operator delete(void *p, std::size_t sz);
+    };
+
+    std::coroutine_handle<promise_type> h;
+};
+
+class co_server;
+
+class connection {
+public:
+    connection(connection const &) = delete;
+    connection &operator=(connection const &) = delete;
+
+    srv_conn *raw() { return c_; }
+    bool closed() const { return closed_; }
+
+    //co_await gives the next request, or nullptr once the connection is
+    //closed
+    auto next_request() { return next_awaiter<http_req>{*this}; }
+    //Same, for websocket data frames (after accept_websock)
+    auto next_message() { return next_awaiter<websock_pkt>{*this}; }
+
+    //co_await gives an mm_err. See the rules at the top of the file
+    auto send(std::string_view data) { return send_awaiter{*this, SEND_RAW, WEBSOCK_BIN, data}; }
+    auto send_message(websock_pkt_type_t type, std::string_view payload) {
+        return send_awaiter{*this, SEND_WEBSOCK, type, payload};
+    }
+
+    //Answers the websocket handshake in req. After this, use next_message
+    mm_err accept_websock(http_req const *req, char const *prot = nullptr) {
+        mm_err err = MM_SUCCESS;
+        srv_accept_websock(c_, req, prot, &err);
+        return err;
+    }
+
+    void close() { srv_close(c_); }
+
+private:
+    friend class co_server;
+    friend struct conn_task::promise_type;
+
+    enum wait_t { WAIT_NONE, WAIT_REQUEST, WAIT_MESSAGE, WAIT_SEND };
+    enum send_t { SEND_RAW, SEND_WEBSOCK };
+
+    static constexpr std::size_t frame_hdr_sz = alignof(std::max_align_t);
+
+    //Keeps the connection alive while we're inside one of its callbacks,
+    //and cleans up afterwards if it was closed in the meantime
+    struct busy_guard {
+        connection &c;
+        explicit busy_guard(connection &c) : c(c) { c.busy_++; }
+        ~busy_guard() {
+            if (--c.busy_ == 0 && c.closed_) c.cleanup();
+        }
+    };
+
+    template <class T>
+    struct next_awaiter {
+        connection &c;
+
+        static constexpr wait_t kind = std::is_same_v<T, http_req> ? WAIT_REQUEST : WAIT_MESSAGE;
+
+        T *&pending() {
+            if constexpr (kind == WAIT_REQUEST) return c.pending_req_;
+            else return c.pending_pkt_;
+        }
+
+        bool await_ready() {
+            if (c.closed_ || pending()) return true;
+            //Asking for the next one means we're done with the last one
+            if (c.held_) {
+                c.held_ = false;
+                srv_release(c.c_);
+            }
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<>) { c.waiting_ = kind; }
+        T *await_resume() {
+            c.waiting_ = WAIT_NONE;
+            T *ret = pending();
+            pending() = nullptr;
+            return c.closed_ ? nullptr : ret;
+        }
+    };
+
+    struct send_awaiter {
+        connection &c;
+        send_t how;
+        websock_pkt_type_t type;
+        std::string_view data;
+        mm_err err = MM_SUCCESS;
+
+        bool await_ready() {
+            if (how == SEND_RAW) srv_send(c.c_, data.data(), data.size(), &err);
+            else srv_send_websock(c.c_, type, data.data(), data.size(), &err);
+            return err != MM_SUCCESS || !c.blocked_ || c.closed_;
+        }
+        void await_suspend(std::coroutine_handle<>) { c.waiting_ = WAIT_SEND; }
+        mm_err await_resume() {
+            c.waiting_ = WAIT_NONE;
+            if (err == MM_SUCCESS && c.closed_) return SRV_CLOSED;
+            return err;
+        }
+    };
+
+    explicit connection(srv_conn *c) : c_(c) {}
+
+    void *alloc_frame(std::size_t sz) {
+        std::size_t total = sz + frame_hdr_sz;
+        void *mem;
+        if (!frame_used_ && total <= sizeof(frame_buf_)) {
+            frame_used_ = true;
+            mem = frame_buf_;
+        } else {
+            mem = mm_slab_alloc.alloc(nullptr, total);
+            if (!mem) throw std::bad_alloc{};
+        }
+        *static_cast<connection **>(mem) = this;
+        return static_cast<char *>(mem) + frame_hdr_sz;
+    }
+
+    static void free_frame(void *p, std::size_t sz) {
+        char *mem = static_cast<char *>(p) - frame_hdr_sz;
+        connection *owner = *reinterpret_cast<connection **>(mem);
+        if (owner && mem == reinterpret_cast<char *>(owner->frame_buf_)) owner->frame_used_ = false;
+        else mm_slab_alloc.free(nullptr, mem, sz + frame_hdr_sz);
+    }
+
+    void resume() {
+        handler_.resume();
+        if (handler_.done()) {
+            handler_.destroy();
+            handler_ = {};
+            if (!closed_) srv_close(c_);
+        }
+    }
+
+    //After a request/message has been handed over: if the handler might
+    //still be using it, tell the server not to throw it away yet
+    void maybe_hold() {
+        if (closed_ || !handler_ || held_) return;
+        bool waiting_for_next = (waiting_ == WAIT_REQUEST || waiting_ == WAIT_MESSAGE);
+        if (pending_req_ || pending_pkt_ || !waiting_for_next) {
+            held_ = true;
+            srv_hold(c_);
+        }
+    }
+
+    //The connection is closed. Let the handler see that (our awaitables all
+    //complete immediately now), then get rid of everything
+    void cleanup() {
+        busy_++;
+        while (handler_ && waiting_ != WAIT_NONE) resume();
+        if (handler_) {
+            //Stuck on something that isn't ours
+            handler_.destroy();
+            handler_ = {};
+        }
+        this->~connection();
+        mm_slab_alloc.free(nullptr, this, sizeof(connection));
+    }
+
+    srv_conn *c_;
+    std::coroutine_handle<> handler_;
+    http_req *pending_req_ = nullptr;
+    websock_pkt *pending_pkt_ = nullptr;
+    wait_t waiting_ = WAIT_NONE;
+    int busy_ = 0;
+    bool held_ = false;
+    bool blocked_ = false;
+    bool closed_ = false;
+    bool frame_used_ = false;
+    alignas(std::max_align_t) unsigned char frame_buf_[co_frame_inline];
+};
+
+inline void *conn_task::promise_type::operator new(std::size_t sz, connection &c) {
+    return c.alloc_frame(sz);
+}
+
+//Only used if the handler has an unexpected signature
+inline void *conn_task::promise_type::operator new(std::size_t sz) {
+    void *mem = mm_slab_alloc.alloc(nullptr, sz + connection::frame_hdr_sz);
+    if (!mem) throw std::bad_alloc{};
+    *static_cast<connection **>(mem) = nullptr;
+    return static_cast<char *>(mem) + connection::frame_hdr_sz;
+}
+
+inline void conn_task::promise_type::operator delete(void *p, std::size_t sz) {
+    connection::free_frame(p, sz);
+}
+
+class co_server {
+public:
+    using handler_fn = conn_task (*)(connection &);
+
+    //params can be NULL for the defaults. On error, sets *err and leaves
+    //the server unusable
+    co_server(char const *port, handler_fn handler, srv_params const *params, mm_err *err) : handler_(handler) {
+        srv_callbacks cb = {
+            .on_request = on_request,
+            .on_message = on_message,
+            .on_close = on_close,
+            .on_send_blocked = on_send_blocked,
+            .on_send_resumed = on_send_resumed,
+            .on_open = on_open
+        };
+        loop_ = new_srv_loop(port, params, &cb, this, err);
+    }
+
+    co_server(co_server const &) = delete;
+    co_server &operator=(co_server const &) = delete;
+
+    ~co_server() { del_srv_loop(loop_); }
+
+    int run(mm_err *err) { return srv_run(loop_, err); }
+    //Safe from signal handlers
+    void stop() { srv_stop(loop_); }
+    srv_loop *raw() { return loop_; }
+
+private:
+    static connection *conn_of(srv_conn *c) { return static_cast<connection *>(c->user); }
+
+    static void on_open(srv_conn *c, void *user) {
+        co_server *self = static_cast<co_server *>(user);
+
+        void *mem = mm_slab_alloc.alloc(nullptr, sizeof(connection));
+        if (!mem) {
+            srv_close(c);
+            return;
+        }
+        connection *conn = new (mem) connection(c);
+        c->user = conn;
+
+        connection::busy_guard g{*conn};
+        try {
+            conn->handler_ = self->handler_(*conn).h;
+        } catch (std::bad_alloc const &) {
+            srv_close(c);
+            return;
+        }
+        if (conn->handler_.done()) {
+            conn->handler_.destroy();
+            conn->handler_ = {};
+            srv_close(c);
+        }
+    }
+
+    static void on_request(srv_conn *c, http_req *req, void *user) {
+        connection *conn = conn_of(c);
+        if (!conn) return;
+        connection::busy_guard g{*conn};
+        conn->pending_req_ = req;
+        if (conn->waiting_ == connection::WAIT_REQUEST) conn->resume();
+        conn->maybe_hold();
+    }
+
+    static void on_message(srv_conn *c, websock_pkt *pkt, void *user) {
+        connection *conn = conn_of(c);
+        if (!conn) return;
+        connection::busy_guard g{*conn};
+        conn->pending_pkt_ = pkt;
+        if (conn->waiting_ == connection::WAIT_MESSAGE) conn->resume();
+        conn->maybe_hold();
+    }
+
+    static void on_send_blocked(srv_conn *c, void *user) {
+        connection *conn = conn_of(c);
+        if (conn) conn->blocked_ = true;
+    }
+
+    static void on_send_resumed(srv_conn *c, void *user) {
+        connection *conn = conn_of(c);
+        if (!conn) return;
+        connection::busy_guard g{*conn};
+        conn->blocked_ = false;
+        if (conn->waiting_ == connection::WAIT_SEND) conn->resume();
+    }
+
+    static void on_close(srv_conn *c, void *user) {
+        connection *conn = conn_of(c);
+        if (!conn) return;
+        c->user = nullptr;
+        conn->closed_ = true;
+        //If we're inside one of this connection's callbacks, the guard
+        //there does the cleanup
+        if (conn->busy_ == 0) conn->cleanup();
+    }
+
+    handler_fn handler_;
+    srv_loop *loop_ = nullptr;
+};
+
+} //namespace mm
+
+#endif
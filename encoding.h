@@ -0,0 +1,619 @@
+//Content-Encoding support: working out what the client will accept (from
+//Accept-Encoding, q-values and all), finding precompressed versions of
+//static files, and compressing responses with zlib, either inline or on a
+//pool of worker threads so the event loop doesn't stall on big bodies.
+//
+//Brotli is only served precompressed (foo.css.br next to foo.css). Doing it
+//on the fly would mean another library for not much gain over gzip at the
+//compression levels you can afford per request.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef ENCODING_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define ENCODING_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef ENCODING_H
+        #define SHOULD_INCLUDE 1
+        #define ENCODING_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "encoding.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+#include "mm_err.h"
+#include "write_queue.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Most entries enc_parse_accept looks at. Real browsers send 3 or 4
+    #define ENC_MAX_PREFS 8
+    //Default zlib level. 6 is zlib's own default; lower is faster
+    #define ENC_DEFAULT_LEVEL 6
+    //How much output we ask zlib for at a time
+    #define ENC_CHUNK 16384
+    //Bodies smaller than this aren't worth compressing (the gzip header and
+    //trailer alone are 18 bytes, and it costs a round trip through a worker)
+    #define ENC_MIN_SIZE 256
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(ENC_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(ENC_INVALID_ARG, "invalid argument");
+MM_ERR(ENC_OOM, "out of memory");
+MM_ERR(ENC_ZLIB_ERROR, "zlib failed to compress");
+MM_ERR(ENC_NOT_FOUND, "file not found");
+MM_ERR(ENC_QUEUE_FULL, "compression queue is full");
+MM_ERR(ENC_THREAD_ERROR, "could not start compression thread");
+
+////////////////////////////
+// Encoding structs/enums //
+////////////////////////////
+#ifndef MM_IMPLEMENT
+    //In the order we prefer them when the client likes several equally
+    #define ENC_IDS \
+        X(ENC_BR), \
+        X(ENC_GZIP), \
+        X(ENC_DEFLATE), \
+        X(ENC_IDENTITY)
+
+    typedef enum _enc_t {
+    #define X(x) x
+        ENC_IDS,
+    #undef X
+        ENC_NUM_TYPES //Not a real encoding; just counts them
+    } enc_t;
+
+    extern char const *const enc_strs[];
+    //What goes in Accept-Encoding/Content-Encoding
+    extern char const *const enc_names[];
+    //Extensions of precompressed files (see enc_open_precompressed)
+    extern char const *const enc_exts[];
+
+    #define ENC_BIT(e) (1u << (e))
+    //What enc_compress can do
+    #define ENC_COMPRESSIBLE (ENC_BIT(ENC_GZIP) | ENC_BIT(ENC_DEFLATE))
+    //Returned by enc_choose when the client won't take anything we have
+    //(answer with 406, or just send identity anyway, which most servers do)
+    #define ENC_NOT_ACCEPTABLE (-1)
+
+    typedef struct _enc_pref {
+        enc_t enc;
+        int q; //In thousandths, so 1.0 is 1000
+    } enc_pref;
+
+    //Called on a worker thread when a job finishes. out is the compressed
+    //data (your reference; unref it when done) or NULL if err says why not
+    typedef void enc_done_cb(wq_buf *out, mm_err err, void *arg);
+
+    typedef struct _enc_job {
+        enc_t enc;
+        int level;
+        char *data;
+        int len;
+        enc_done_cb *done;
+        void *arg;
+    } enc_job;
+
+    typedef struct _enc_pool {
+        int num_threads;
+        //Jobs done, and jobs turned away because the queue was full
+        unsigned long completed;
+        unsigned long rejected;
+
+        //Internal fields. Don't touch!
+        struct {
+            pthread_mutex_t lock;
+            pthread_cond_t wake;
+            pthread_t *threads;
+            //Ring buffer of pending jobs
+            enc_job *jobs;
+            int head;
+            int num;
+            int cap;
+            int stop;
+        } __internal;
+    } enc_pool;
+#else
+    #define X(x) #x
+    char const *const enc_strs[] = {
+        ENC_IDS
+    };
+    #undef X
+
+    char const *const enc_names[] = {"br", "gzip", "deflate", "identity"};
+    //Nobody precompresses to deflate, so it doesn't get one
+    char const *const enc_exts[] = {".br", ".gz", "", ""};
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+//Parses a qvalue ("0", "0.5", "1.000"...). Returns -1 if it's malformed
+static int enc_parse_q(char const *s, int len) {
+    if (len < 1 || (s[0] != '0' && s[0] != '1')) return -1;
+    int q = (s[0] - '0') * 1000;
+    if (len == 1) return q;
+    if (s[1] != '.' || len > 5) return -1;
+
+    int scale = 100, i;
+    for (i = 2; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        q += (s[i] - '0') * scale;
+        scale /= 10;
+    }
+    return q > 1000 ? -1 : q;
+}
+
+//Goes through Accept-Encoding, calling back for each coding with its q.
+//name is "*" for the wildcard. Malformed entries are skipped
+static void enc_walk(char const *hdr, void (*cb)(char const *name, int len, int q, void *arg), void *arg) {
+    char const *p = hdr;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        if (!*p) break;
+
+        char const *name = p;
+        int name_len = strcspn(p, " \t,;");
+        p += name_len;
+
+        int q = 1000;
+        //Parameters. The only one that means anything is q
+        while (1) {
+            while (*p == ' ' || *p == '\t') p++;
+            if (*p != ';') break;
+            p++;
+            while (*p == ' ' || *p == '\t') p++;
+            char const *param = p;
+            int param_len = strcspn(p, " \t,;");
+            p += param_len;
+            if (param_len >= 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = enc_parse_q(param + 2, param_len - 2);
+            }
+        }
+        //Skip anything we didn't understand up to the next comma
+        p += strcspn(p, ",");
+
+        if (name_len > 0 && q >= 0) cb(name, name_len, q, arg);
+    }
+}
+
+//Scratch space for enc_get_qs: q for every encoding, and for "*"
+typedef struct _enc_qs {
+    int q[ENC_NUM_TYPES];
+    int star;
+} enc_qs;
+
+static void enc_collect(char const *name, int len, int q, void *arg) {
+    enc_qs *qs = arg;
+    if (len == 1 && name[0] == '*') {
+        qs->star = q;
+        return;
+    }
+    int i;
+    for (i = 0; i < ENC_NUM_TYPES; i++) {
+        if ((int) strlen(enc_names[i]) == len && !strncasecmp(enc_names[i], name, len)) {
+            qs->q[i] = q;
+            return;
+        }
+    }
+    //x-gzip is an old alias that some clients still send
+    if (len == 6 && !strncasecmp(name, "x-gzip", 6)) qs->q[ENC_GZIP] = q;
+}
+
+//Works out the q of every encoding, following RFC 9110 12.5.3: anything
+//not listed gets the q of "*" if there is one, except identity, which is
+//always fine unless ruled out explicitly
+static void enc_get_qs(char const *hdr, enc_qs *qs) {
+    int i;
+    for (i = 0; i < ENC_NUM_TYPES; i++) qs->q[i] = -1;
+    qs->star = -1;
+
+    if (hdr) enc_walk(hdr, enc_collect, qs);
+
+    for (i = 0; i < ENC_NUM_TYPES; i++) {
+        if (qs->q[i] >= 0) continue;
+        if (qs->star >= 0) qs->q[i] = qs->star;
+        else qs->q[i] = (i == ENC_IDENTITY) ? 1 : 0;
+    }
+    //No header at all means the client didn't say, so identity is best
+    if (!hdr) qs->q[ENC_IDENTITY] = 1000;
+}
+
+static int enc_zlib_bits(enc_t enc) {
+    //15 is the biggest window. +16 asks for a gzip wrapper instead of zlib's
+    return enc == ENC_GZIP ? 15 + 16 : 15;
+}
+
+static void *enc_worker(void *arg) {
+    enc_pool *p = arg;
+
+    pthread_mutex_lock(&p->__internal.lock);
+    while (1) {
+        while (p->__internal.num == 0 && !p->__internal.stop) {
+            pthread_cond_wait(&p->__internal.wake, &p->__internal.lock);
+        }
+        if (p->__internal.num == 0) break; //Stopping, and nothing left to do
+
+        enc_job job = p->__internal.jobs[p->__internal.head];
+        p->__internal.head = (p->__internal.head + 1) % p->__internal.cap;
+        p->__internal.num--;
+        pthread_mutex_unlock(&p->__internal.lock);
+
+        mm_err err = MM_SUCCESS;
+        wq_buf *out = enc_compress(job.enc, job.data, job.len, job.level, &err);
+        free(job.data);
+        job.done(out, err, job.arg);
+
+        pthread_mutex_lock(&p->__internal.lock);
+        p->completed++;
+    }
+    pthread_mutex_unlock(&p->__internal.lock);
+
+    return NULL;
+}
+
+#endif
+
+/////////////////
+// Negotiation //
+/////////////////
+
+/* enc_parse_accept:
+
+Parses an Accept-Encoding header into at most max preferences, best first.
+Ties keep our preference order (br, gzip, deflate, identity). Encodings we
+don't know are left out, and so is anything with q=0. "*" is expanded into
+whatever known encodings weren't listed, and identity is included unless
+the header rules it out. Returns how many were written.
+
+A NULL hdr (no header at all) gives just identity.
+*/
+int enc_parse_accept(char const *hdr, enc_pref *prefs, int max)
+#ifdef MM_IMPLEMENT
+{
+    enc_qs qs;
+    enc_get_qs(hdr, &qs);
+
+    //There are only a handful of encodings, so sort all of them and then
+    //keep the first max
+    enc_pref all[ENC_NUM_TYPES];
+    int n = 0, i;
+    for (i = 0; i < ENC_NUM_TYPES; i++) {
+        if (qs.q[i] <= 0) continue;
+        //Insertion sort. Strict < keeps ties in enum order
+        int j = n++;
+        while (j > 0 && all[j - 1].q < qs.q[i]) {
+            all[j] = all[j - 1];
+            j--;
+        }
+        all[j].enc = i;
+        all[j].q = qs.q[i];
+    }
+
+    if (n > max) n = max;
+    for (i = 0; i < n; i++) prefs[i] = all[i];
+
+    return n;
+}
+#else
+;
+#endif
+
+//Packs the order of encodings hdr asks for into an int, 4 bits each (enc + 1,
+//best first, in the low bits). Lots of different header strings mean the
+//same thing, so this is what goes in cache keys instead of the header
+unsigned enc_ranking(char const *hdr)
+#ifdef MM_IMPLEMENT
+{
+    enc_pref prefs[ENC_MAX_PREFS];
+    int n = enc_parse_accept(hdr, prefs, ENC_MAX_PREFS);
+
+    unsigned ret = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--) ret = (ret << 4) | (prefs[i].enc + 1);
+    return ret;
+}
+#else
+;
+#endif
+
+//Picks the best encoding out of available (a mask of ENC_BIT()s) for a
+//client that sent hdr (NULL if it didn't send Accept-Encoding). Returns
+//ENC_NOT_ACCEPTABLE if none of them will do
+int enc_choose(char const *hdr, unsigned available)
+#ifdef MM_IMPLEMENT
+{
+    enc_pref prefs[ENC_MAX_PREFS];
+    int n = enc_parse_accept(hdr, prefs, ENC_MAX_PREFS);
+
+    int i;
+    for (i = 0; i < n; i++) {
+        if (available & ENC_BIT(prefs[i].enc)) return prefs[i].enc;
+    }
+    return ENC_NOT_ACCEPTABLE;
+}
+#else
+;
+#endif
+
+/* enc_open_precompressed:
+
+Opens the best version of the file at path that the client accepts: path.br
+or path.gz if they exist and hdr allows them, otherwise path itself. If the
+client rules out everything we have, you get path anyway (like most servers,
+we'd rather do that than send a 406). The encoding that was picked goes in
+*enc. Returns an fd (yours to close), or -1 with *err set to ENC_NOT_FOUND
+if path doesn't exist.
+
+Assumes path is a real file path you've already sanitized.
+*/
+int enc_open_precompressed(char const *path, char const *hdr, enc_t *enc, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!path || !enc) {
+        *err = ENC_NULL_ARG;
+        return -1;
+    }
+
+    enc_pref prefs[ENC_MAX_PREFS];
+    int n = enc_parse_accept(hdr, prefs, ENC_MAX_PREFS);
+
+    char buf[4096];
+    int i;
+    for (i = 0; i < n; i++) {
+        //Only look for files we'd know how to label
+        if (prefs[i].enc == ENC_DEFLATE) continue;
+        int len = snprintf(buf, sizeof(buf), "%s%s", path, enc_exts[prefs[i].enc]);
+        if (len >= (int) sizeof(buf)) continue;
+
+        int fd = open(buf, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            *enc = prefs[i].enc;
+            return fd;
+        }
+    }
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        *enc = ENC_IDENTITY;
+        return fd;
+    }
+
+    *err = ENC_NOT_FOUND;
+    return -1;
+}
+#else
+;
+#endif
+
+/////////////////
+// Compression //
+/////////////////
+
+//Compresses in[0..len) with ENC_GZIP or ENC_DEFLATE (zlib format, which is
+//what "deflate" means in HTTP) at the given zlib level (-1 for
+//ENC_DEFAULT_LEVEL). Returns a new buffer with the result, or NULL with *err
+//set on error
+wq_buf *enc_compress(enc_t enc, char const *in, int len, int level, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!in && len > 0) {
+        *err = ENC_NULL_ARG;
+        return NULL;
+    }
+    if (!(ENC_COMPRESSIBLE & ENC_BIT(enc)) || len < 0 || level < -1 || level > 9) {
+        *err = ENC_INVALID_ARG;
+        return NULL;
+    }
+    if (level < 0) level = ENC_DEFAULT_LEVEL;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, level, Z_DEFLATED, enc_zlib_bits(enc), 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        *err = ENC_ZLIB_ERROR;
+        return NULL;
+    }
+
+    //deflateBound is the worst case, so one buffer is enough. We still
+    //feed it in ENC_CHUNK pieces so a huge body doesn't go in one call
+    unsigned long cap = deflateBound(&zs, len);
+    wq_buf *ret = new_wq_buf(cap, err);
+    if (*err != MM_SUCCESS) {
+        deflateEnd(&zs);
+        *err = ENC_OOM;
+        return NULL;
+    }
+
+    zs.next_out = (unsigned char *) ret->data;
+    zs.avail_out = cap;
+    int pos = 0;
+    int rc;
+    do {
+        int n = len - pos < ENC_CHUNK ? len - pos : ENC_CHUNK;
+        zs.next_in = (unsigned char *) in + pos;
+        zs.avail_in = n;
+        pos += n;
+        rc = deflate(&zs, pos == len ? Z_FINISH : Z_NO_FLUSH);
+    } while (rc == Z_OK && pos < len);
+
+    if (rc == Z_OK) rc = deflate(&zs, Z_FINISH);
+    ret->len = zs.total_out;
+    deflateEnd(&zs);
+
+    if (rc != Z_STREAM_END) {
+        wq_buf_unref(ret);
+        *err = ENC_ZLIB_ERROR;
+        return NULL;
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//////////////////
+// Worker pools //
+//////////////////
+
+//Starts num_threads compression threads, with room for max_jobs waiting
+//jobs. Returns NULL and sets *err on error. Free with del_enc_pool
+enc_pool *new_enc_pool(int num_threads, int max_jobs, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (num_threads <= 0 || max_jobs <= 0) {
+        *err = ENC_INVALID_ARG;
+        return NULL;
+    }
+
+    enc_pool *ret = calloc(1, sizeof(enc_pool));
+    pthread_t *threads = calloc(num_threads, sizeof(pthread_t));
+    enc_job *jobs = calloc(max_jobs, sizeof(enc_job));
+    if (!ret || !threads || !jobs) {
+        free(ret);
+        free(threads);
+        free(jobs);
+        *err = ENC_OOM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&ret->__internal.lock, NULL);
+    pthread_cond_init(&ret->__internal.wake, NULL);
+    ret->__internal.threads = threads;
+    ret->__internal.jobs = jobs;
+    ret->__internal.cap = max_jobs;
+
+    int i;
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(threads + i, NULL, enc_worker, ret)) {
+            *err = ENC_THREAD_ERROR;
+            break;
+        }
+        ret->num_threads++;
+    }
+
+    if (*err != MM_SUCCESS) {
+        del_enc_pool(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Finishes whatever jobs are queued, stops the threads, and frees the pool.
+//Gracefully ignores NULL input
+void del_enc_pool(enc_pool *p)
+#ifdef MM_IMPLEMENT
+{
+    if (!p) return;
+
+    pthread_mutex_lock(&p->__internal.lock);
+    p->__internal.stop = 1;
+    pthread_cond_broadcast(&p->__internal.wake);
+    pthread_mutex_unlock(&p->__internal.lock);
+
+    int i;
+    for (i = 0; i < p->num_threads; i++) pthread_join(p->__internal.threads[i], NULL);
+
+    pthread_mutex_destroy(&p->__internal.lock);
+    pthread_cond_destroy(&p->__internal.wake);
+    free(p->__internal.threads);
+    free(p->__internal.jobs);
+    free(p);
+}
+#else
+;
+#endif
+
+/* enc_submit:
+
+Queues data[0..len) to be compressed with enc on one of the pool's threads.
+The data is copied, so it doesn't have to stay around. When it's done, done
+is called with the result and arg, on that worker thread, so whatever it
+touches has to be thread-safe (cache_put is).
+
+If the queue is full, nothing is queued, done is never called, and *err is
+set to ENC_QUEUE_FULL. Since compression is only ever an optimization,
+the usual thing to do then is nothing.
+*/
+void enc_submit(enc_pool *p, enc_t enc, char const *data, int len, int level, enc_done_cb *done, void *arg, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!p || !done || (!data && len > 0)) {
+        *err = ENC_NULL_ARG;
+        return;
+    }
+    if (!(ENC_COMPRESSIBLE & ENC_BIT(enc)) || len < 0) {
+        *err = ENC_INVALID_ARG;
+        return;
+    }
+
+    char *copy = malloc(len > 0 ? len : 1);
+    if (!copy) {
+        *err = ENC_OOM;
+        return;
+    }
+    memcpy(copy, data, len);
+
+    pthread_mutex_lock(&p->__internal.lock);
+    if (p->__internal.num == p->__internal.cap) {
+        p->rejected++;
+        pthread_mutex_unlock(&p->__internal.lock);
+        free(copy);
+        *err = ENC_QUEUE_FULL;
+        return;
+    }
+
+    int slot = (p->__internal.head + p->__internal.num) % p->__internal.cap;
+    p->__internal.jobs[slot] = (enc_job) {enc, level, copy, len, done, arg};
+    p->__internal.num++;
+    pthread_cond_signal(&p->__internal.wake);
+    pthread_mutex_unlock(&p->__internal.lock);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
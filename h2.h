@@ -0,0 +1,1912 @@
+//Cleartext HTTP/2 (h2c), so one connection can carry lots of requests at
+//once. This is just the protocol: it takes bytes from the socket, deals with
+//SETTINGS, PING, flow control and friends by itself, and hands back
+//complete requests one stream at a time. It never touches a socket; frames
+//it wants to send pile up in out, and it's up to you to send them.
+//
+//To keep everything downstream the same, each request is turned back into
+//HTTP/1.1 text and run through the usual parser (see h2_stream_req), so
+//handlers get the same http_req they always did, with the same limits.
+//Going the other way, h2_respond takes an HTTP/1.1 response (the kind
+//handlers already write) and sends it as HEADERS and DATA frames.
+//
+//No server push, no priorities (streams are answered in the order they
+//finish coming in), and, same as http_parse.h, only GET, HEAD and POST.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef H2_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define H2_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef H2_H
+        #define SHOULD_INCLUDE 1
+        #define H2_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "h2.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "mm_err.h"
+#include "http_parse.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    #define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+    #define H2_PREFACE_LEN 24
+    #define H2_FRAME_HDR_LEN 9
+
+    //Protocol defaults, before SETTINGS says otherwise
+    #define H2_DEFAULT_WINDOW 65535
+    #define H2_DEFAULT_FRAME_SIZE 16384
+    #define H2_MAX_WINDOW 0x7FFFFFFFL
+
+    //What we tell clients. The receive window is per stream, and also what
+    //we top the connection's window back up to
+    #define H2_MAX_STREAMS 100
+    #define H2_RECV_WINDOW (1L << 20)
+
+    //HPACK. The dynamic table never grows past the default size, since we
+    //never tell the client it can
+    #define HPACK_TABLE_SIZE 4096
+    #define HPACK_STATIC_LEN 61
+    #define HPACK_ENTRY_OVERHEAD 32
+    #define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+
+    //A response header bigger than this isn't something we wrote
+    #define H2_MAX_RESP_HDR (64 * 1024)
+
+    //Frame flags. Some of them mean different things on different frames
+    #define H2_FLAG_END_STREAM 0x1
+    #define H2_FLAG_ACK 0x1
+    #define H2_FLAG_END_HEADERS 0x4
+    #define H2_FLAG_PADDED 0x8
+    #define H2_FLAG_PRIORITY 0x20
+
+    //Error codes for RST_STREAM and GOAWAY
+    #define H2_NO_ERROR 0x0
+    #define H2_PROTOCOL_ERR 0x1
+    #define H2_INTERNAL_ERR 0x2
+    #define H2_FLOW_CONTROL_ERR 0x3
+    #define H2_STREAM_CLOSED_ERR 0x5
+    #define H2_FRAME_SIZE_ERR 0x6
+    #define H2_REFUSED_STREAM 0x7
+    #define H2_CANCEL 0x8
+    #define H2_COMPRESSION_ERR 0x9
+
+    //SETTINGS identifiers
+    #define H2_SETTINGS_HEADER_TABLE_SIZE 0x1
+    #define H2_SETTINGS_ENABLE_PUSH 0x2
+    #define H2_SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+    #define H2_SETTINGS_INITIAL_WINDOW_SIZE 0x4
+    #define H2_SETTINGS_MAX_FRAME_SIZE 0x5
+    #define H2_SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(H2_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(H2_OOM, "out of memory");
+MM_ERR(H2_BAD_PREFACE, "connection did not start with the HTTP/2 preface");
+MM_ERR(H2_PROTOCOL_ERROR, "client broke the HTTP/2 protocol");
+MM_ERR(H2_FRAME_SIZE_ERROR, "HTTP/2 frame has the wrong size");
+MM_ERR(H2_FLOW_CONTROL_ERROR, "client broke HTTP/2 flow control");
+MM_ERR(H2_COMPRESSION_ERROR, "bad HPACK header block");
+MM_ERR(H2_NO_STREAM, "no such HTTP/2 stream (it may have been reset)");
+MM_ERR(H2_BAD_RESPONSE, "could not turn response into HTTP/2 frames");
+
+//////////////////////
+// h2 structs/enums //
+//////////////////////
+#ifndef MM_IMPLEMENT
+    #define H2_FRAME_TYPE_IDS \
+        X(H2_DATA), \
+        X(H2_HEADERS), \
+        X(H2_PRIORITY), \
+        X(H2_RST_STREAM), \
+        X(H2_SETTINGS), \
+        X(H2_PUSH_PROMISE), \
+        X(H2_PING), \
+        X(H2_GOAWAY), \
+        X(H2_WINDOW_UPDATE), \
+        X(H2_CONTINUATION)
+
+    typedef enum _h2_frame_t {
+    #define X(x) x
+        H2_FRAME_TYPE_IDS,
+    #undef X
+        H2_NUM_FRAME_TYPES
+    } h2_frame_t;
+
+    extern char const *const h2_frame_strs[];
+
+    //A growable byte buffer
+    typedef struct _h2_buf {
+        char *data;
+        long len;
+        long cap;
+    } h2_buf;
+
+    //Called for each header field in a block. name and value are not
+    //NUL-terminated, and only live until the callback returns. Set *err to
+    //stop decoding
+    typedef void hpack_hdr_fn(void *arg, char const *name, int name_len, char const *value, int value_len, mm_err *err);
+
+    typedef struct _hpack_entry {
+        char *data; //Name, then value, in one allocation
+        int name_len;
+        int value_len;
+    } hpack_entry;
+
+    //HPACK decoder state
+    typedef struct _hpack_table {
+        //Current size (as HPACK counts it) and the most it can be right now
+        int size;
+        int max_size;
+
+        //Internal fields. Don't touch!
+        struct {
+            //Ring of entries. Dynamic index 0 (HPACK index 62) is the newest
+            hpack_entry ents[HPACK_MAX_ENTRIES];
+            int first;
+            int num;
+            //Where Huffman-decoded strings go
+            char *scratch;
+            int scratch_cap;
+        } __internal;
+    } hpack_table;
+
+    typedef enum _h2_stream_state_t {
+        H2_STREAM_OPEN, //Still receiving the request
+        H2_STREAM_HALF_CLOSED //Request is all in; we're answering
+    } h2_stream_state_t;
+
+    typedef enum _h2_resp_state_t {
+        H2_RESP_HEAD, //Waiting for the end of the (HTTP/1.1) response header
+        H2_RESP_BODY,
+        H2_RESP_DONE //END_STREAM has been sent (or queued)
+    } h2_resp_state_t;
+
+    typedef struct _h2_stream {
+        unsigned id;
+        h2_stream_state_t state;
+        h2_resp_state_t resp_state;
+        //Flow control windows, in each direction
+        long send_window;
+        long recv_window;
+
+        //Internal fields. Don't touch!
+        struct {
+            //The request, rebuilt as HTTP/1.1. The pseudo-headers are kept
+            //to the side until we can write the request line
+            h2_buf head;
+            h2_buf body;
+            char method[16];
+            h2_buf path;
+            h2_buf authority;
+            int has_scheme;
+            int started; //Request line has been written
+            int is_head;
+            //Malformed (gets a RST_STREAM) or too big (gets a 431/413)
+            int bad;
+            int too_big;
+
+            //Response bytes we haven't been able to translate yet, and how
+            //much body is left to come (-1 if the response didn't say)
+            h2_buf resp_hdr;
+            long resp_left;
+
+            //DATA waiting on flow control, and whether END_STREAM goes out
+            //after it
+            h2_buf pending;
+            int end_pending;
+
+            int queued; //On the ready list
+            struct _h2_stream *next;
+            struct _h2_stream *ready_next;
+        } __internal;
+    } h2_stream;
+
+    typedef struct _h2_conn {
+        //Frames waiting to be sent. Send them, then set out.len to 0
+        h2_buf out;
+
+        //Same meaning as in http_req. Also used for the stream receive
+        //buffers
+        http_limits limits;
+
+        //Connection-level flow control windows
+        long send_window;
+        long recv_window;
+        //What the client's SETTINGS said
+        long peer_initial_window;
+        long peer_max_frame;
+
+        //Highest stream the client has opened
+        unsigned last_stream;
+        int num_streams;
+        //Response bytes held back by flow control, across all streams
+        long pending_bytes;
+
+        int goaway_sent;
+        int goaway_recv;
+
+        //Internal fields. Don't touch!
+        struct {
+            //Bytes of the client preface we still have to see
+            int preface_left;
+            //A partial frame from the last write
+            h2_buf in;
+            //Header block being put together, and the stream it's for (0 if
+            //we're not in the middle of one)
+            h2_buf hblock;
+            unsigned cont_stream;
+            int cont_end_stream;
+            //For encoding response headers
+            h2_buf enc;
+            hpack_table dec;
+            h2_stream *streams;
+            //Streams whose requests are complete, oldest first
+            h2_stream *ready_head;
+            h2_stream *ready_tail;
+        } __internal;
+    } h2_conn;
+#else
+    #define X(x) #x
+    char const *const h2_frame_strs[] = {
+        H2_FRAME_TYPE_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+typedef struct _hpack_static_entry {
+    char const *name;
+    char const *value;
+} hpack_static_entry;
+
+//RFC 7541, Appendix A
+static hpack_static_entry const hpack_static[HPACK_STATIC_LEN + 1] = {
+    {NULL, NULL}, //Indices start at 1
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+//RFC 7541, Appendix B. The code is canonical, so for each bit length all we
+//need is its first code, how many codes have that length, and where their
+//symbols start in hpack_huff_syms (which is sorted by code). Symbol 256 is
+//EOS, which must never show up
+static unsigned const hpack_huff_first[31] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x14, 0x5c, 0xf8, 0x0, 0x3f8, 0x7fa, 0xffa, 0x1ff8, 0x3ffc, 0x7ffc, 0x0, 0x0, 0x0, 0x7fff0, 0xfffe6, 0x1fffdc, 0x3fffd2, 0x7fffd8, 0xffffea, 0x1ffffec, 0x3ffffe0, 0x7ffffde, 0xfffffe2, 0x0, 0x3ffffffc};
+static unsigned short const hpack_huff_count[31] = {0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4};
+static unsigned short const hpack_huff_offset[31] = {0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79, 82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145, 174, 186, 190, 205, 224, 0, 253};
+static unsigned short const hpack_huff_syms[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+static void h2_buf_append(h2_buf *b, void const *data, long len, mm_err *err) {
+    if (*err != MM_SUCCESS || len <= 0) return;
+
+    if (b->len + len > b->cap) {
+        long cap = b->cap ? b->cap : 256;
+        while (cap < b->len + len) cap *= 2;
+        char *tmp = realloc(b->data, cap);
+        if (!tmp) {
+            *err = H2_OOM;
+            return;
+        }
+        b->data = tmp;
+        b->cap = cap;
+    }
+
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void h2_buf_free(h2_buf *b) {
+    free(b->data);
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+}
+
+//Drops the first n bytes
+static void h2_buf_consume(h2_buf *b, long n) {
+    memmove(b->data, b->data + n, b->len - n);
+    b->len -= n;
+}
+
+/////////////
+// Decoder //
+/////////////
+
+//Reads an HPACK integer with an n-bit prefix. Returns -1 if it runs off the
+//end or is silly big
+static long hpack_get_int(unsigned char const **p, unsigned char const *end, int n) {
+    if (*p >= end) return -1;
+
+    long mask = (1 << n) - 1;
+    long val = *(*p)++ & mask;
+    if (val < mask) return val;
+
+    int shift = 0;
+    while (*p < end) {
+        unsigned char b = *(*p)++;
+        if (shift > 28) return -1;
+        val += (long) (b & 0x7F) << shift;
+        if (val > 0x7FFFFFFF) return -1;
+        if (!(b & 0x80)) return val;
+        shift += 7;
+    }
+    return -1;
+}
+
+//Returns number of bytes written to dst (which has room for at least 8/5
+//of len), or -1 if the string isn't valid Huffman
+static int hpack_huff_decode(char *dst, unsigned char const *src, int len) {
+    unsigned code = 0;
+    int bits = 0;
+    int out = 0;
+
+    int i;
+    for (i = 0; i < len; i++) {
+        int j;
+        for (j = 7; j >= 0; j--) {
+            code = (code << 1) | ((src[i] >> j) & 1);
+            bits++;
+            if (bits > 30) return -1;
+
+            unsigned idx = code - hpack_huff_first[bits];
+            if (idx < hpack_huff_count[bits]) {
+                unsigned sym = hpack_huff_syms[hpack_huff_offset[bits] + idx];
+                if (sym == 256) return -1;
+                dst[out++] = sym;
+                code = 0;
+                bits = 0;
+            }
+        }
+    }
+
+    //Whatever's left must be padding: fewer than 8 bits, all ones (i.e. the
+    //start of EOS)
+    if (bits >= 8 || code != (1U << bits) - 1) return -1;
+
+    return out;
+}
+
+//Reads a string literal. Huffman-coded ones are decoded into the scratch
+//buffer at *scratch_pos. Returns the length, or -1 on error
+static int hpack_get_str(hpack_table *t, unsigned char const **p, unsigned char const *end, char const **str, int *scratch_pos) {
+    if (*p >= end) return -1;
+    int huff = **p & 0x80;
+    long len = hpack_get_int(p, end, 7);
+    if (len < 0 || len > end - *p) return -1;
+
+    if (!huff) {
+        *str = (char const *) *p;
+        *p += len;
+        return len;
+    }
+
+    char *dst = t->__internal.scratch + *scratch_pos;
+    int n = hpack_huff_decode(dst, *p, len);
+    if (n < 0) return -1;
+    *p += len;
+    *str = dst;
+    *scratch_pos += n;
+    return n;
+}
+
+static hpack_entry *hpack_dyn_at(hpack_table *t, int i) {
+    return &t->__internal.ents[(t->__internal.first + i) % HPACK_MAX_ENTRIES];
+}
+
+static void hpack_evict(hpack_table *t, int max) {
+    while (t->size > max && t->__internal.num > 0) {
+        hpack_entry *e = hpack_dyn_at(t, --t->__internal.num);
+        t->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+        free(e->data);
+        e->data = NULL;
+    }
+}
+
+static void hpack_add(hpack_table *t, char const *name, int name_len, char const *value, int value_len, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    int sz = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    if (sz > t->max_size) {
+        //Not an error; it just empties the table
+        hpack_evict(t, 0);
+        return;
+    }
+
+    //Copy first, since name might point at an entry we're about to evict
+    char *data = malloc(name_len + value_len + 1);
+    if (!data) {
+        *err = H2_OOM;
+        return;
+    }
+    memcpy(data, name, name_len);
+    memcpy(data + name_len, value, value_len);
+
+    hpack_evict(t, t->max_size - sz);
+    t->__internal.first = (t->__internal.first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    hpack_entry *e = hpack_dyn_at(t, 0);
+    e->data = data;
+    e->name_len = name_len;
+    e->value_len = value_len;
+    t->__internal.num++;
+    t->size += sz;
+}
+
+//Looks up an HPACK index (static or dynamic). Returns 0 if there's no such
+//entry
+static int hpack_lookup(hpack_table *t, long idx, char const **name, int *name_len, char const **value, int *value_len) {
+    if (idx <= 0) return 0;
+
+    if (idx <= HPACK_STATIC_LEN) {
+        *name = hpack_static[idx].name;
+        *name_len = strlen(*name);
+        *value = hpack_static[idx].value;
+        *value_len = strlen(*value);
+        return 1;
+    }
+
+    idx -= HPACK_STATIC_LEN + 1;
+    if (idx >= t->__internal.num) return 0;
+    hpack_entry *e = hpack_dyn_at(t, idx);
+    *name = e->data;
+    *name_len = e->name_len;
+    *value = e->data + e->name_len;
+    *value_len = e->value_len;
+    return 1;
+}
+
+/////////////
+// Encoder //
+/////////////
+
+//We never Huffman-code or index anything. Responses are small, and this way
+//there's no encoder state to keep in sync
+static void hpack_put_int(h2_buf *b, unsigned char bits, int n, long val, mm_err *err) {
+    unsigned char tmp[8];
+    int len = 0;
+    long mask = (1 << n) - 1;
+
+    if (val < mask) {
+        tmp[len++] = bits | val;
+    } else {
+        tmp[len++] = bits | mask;
+        val -= mask;
+        while (val >= 0x80) {
+            tmp[len++] = (val & 0x7F) | 0x80;
+            val >>= 7;
+        }
+        tmp[len++] = val;
+    }
+    h2_buf_append(b, tmp, len, err);
+}
+
+static void hpack_put_str(h2_buf *b, char const *s, int len, mm_err *err) {
+    hpack_put_int(b, 0, 7, len, err);
+    h2_buf_append(b, s, len, err);
+}
+
+//Encodes one (lower-case) header as a literal without indexing, using the
+//static table for the name if it's in there
+static void hpack_put_hdr(h2_buf *b, char const *name, int name_len, char const *value, int value_len, mm_err *err) {
+    int idx;
+    for (idx = 15; idx <= HPACK_STATIC_LEN; idx++) {
+        char const *s = hpack_static[idx].name;
+        if ((int) strlen(s) == name_len && !memcmp(s, name, name_len)) break;
+    }
+
+    if (idx <= HPACK_STATIC_LEN) {
+        hpack_put_int(b, 0x00, 4, idx, err);
+    } else {
+        hpack_put_int(b, 0x00, 4, 0, err);
+        hpack_put_str(b, name, name_len, err);
+    }
+    hpack_put_str(b, value, value_len, err);
+}
+
+static void hpack_put_status(h2_buf *b, int status, mm_err *err) {
+    //The common ones are in the static table
+    static int const indexed[] = {200, 204, 206, 304, 400, 404, 500};
+    int i;
+    for (i = 0; i < (int) (sizeof(indexed) / sizeof(*indexed)); i++) {
+        if (indexed[i] == status) {
+            hpack_put_int(b, 0x80, 7, 8 + i, err);
+            return;
+        }
+    }
+
+    char digits[4];
+    snprintf(digits, sizeof(digits), "%03d", status);
+    hpack_put_int(b, 0x00, 4, 8, err);
+    hpack_put_str(b, digits, 3, err);
+}
+
+////////////
+// Frames //
+////////////
+
+static void h2_put_frame(h2_conn *h, int type, int flags, unsigned id, void const *payload, long len, mm_err *err) {
+    unsigned char hdr[H2_FRAME_HDR_LEN] = {
+        len >> 16, len >> 8, len,
+        type, flags,
+        (id >> 24) & 0x7F, id >> 16, id >> 8, id
+    };
+    h2_buf_append(&h->out, hdr, sizeof(hdr), err);
+    h2_buf_append(&h->out, payload, len, err);
+}
+
+static void h2_put_u32(unsigned char *dst, unsigned long v) {
+    dst[0] = v >> 24;
+    dst[1] = v >> 16;
+    dst[2] = v >> 8;
+    dst[3] = v;
+}
+
+static unsigned long h2_get_u32(unsigned char const *src) {
+    return ((unsigned long) src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+static void h2_put_rst(h2_conn *h, unsigned id, unsigned code, mm_err *err) {
+    unsigned char payload[4];
+    h2_put_u32(payload, code);
+    h2_put_frame(h, H2_RST_STREAM, 0, id, payload, 4, err);
+}
+
+static void h2_put_window_update(h2_conn *h, unsigned id, long incr, mm_err *err) {
+    unsigned char payload[4];
+    h2_put_u32(payload, incr);
+    h2_put_frame(h, H2_WINDOW_UPDATE, 0, id, payload, 4, err);
+}
+
+//Sends a header block, split into CONTINUATIONs if it has to be
+static void h2_put_headers(h2_conn *h, unsigned id, h2_buf const *block, int end_stream, mm_err *err) {
+    long max = h->peer_max_frame;
+    long n = block->len < max ? block->len : max;
+    int flags = (end_stream ? H2_FLAG_END_STREAM : 0) | (n == block->len ? H2_FLAG_END_HEADERS : 0);
+    h2_put_frame(h, H2_HEADERS, flags, id, block->data, n, err);
+
+    long off;
+    for (off = n; off < block->len; off += n) {
+        n = block->len - off < max ? block->len - off : max;
+        h2_put_frame(h, H2_CONTINUATION, off + n == block->len ? H2_FLAG_END_HEADERS : 0, id, block->data + off, n, err);
+    }
+}
+
+//Sends len bytes as DATA frames, without looking at flow control. If end is
+//set, the last frame has END_STREAM (so len can be 0)
+static void h2_put_data(h2_conn *h, unsigned id, char const *data, long len, int end, mm_err *err) {
+    do {
+        long n = len < h->peer_max_frame ? len : h->peer_max_frame;
+        h2_put_frame(h, H2_DATA, (end && n == len) ? H2_FLAG_END_STREAM : 0, id, data, n, err);
+        data += n;
+        len -= n;
+    } while (len > 0);
+}
+
+/////////////
+// Streams //
+/////////////
+
+static h2_stream *h2_find(h2_conn *h, unsigned id) {
+    h2_stream *s;
+    for (s = h->__internal.streams; s; s = s->__internal.next) {
+        if (s->id == id) return s;
+    }
+    return NULL;
+}
+
+static h2_stream *h2_new_stream(h2_conn *h, unsigned id, mm_err *err) {
+    if (*err != MM_SUCCESS) return NULL;
+
+    h2_stream *s = calloc(1, sizeof(h2_stream));
+    if (!s) {
+        *err = H2_OOM;
+        return NULL;
+    }
+    s->id = id;
+    s->state = H2_STREAM_OPEN;
+    s->resp_state = H2_RESP_HEAD;
+    s->send_window = h->peer_initial_window;
+    s->recv_window = H2_RECV_WINDOW;
+    s->__internal.resp_left = -1;
+
+    s->__internal.next = h->__internal.streams;
+    h->__internal.streams = s;
+    h->num_streams++;
+    if (id > h->last_stream) h->last_stream = id;
+    return s;
+}
+
+static void h2_free_stream(h2_conn *h, h2_stream *s) {
+    h2_stream **pp;
+    for (pp = &h->__internal.streams; *pp; pp = &(*pp)->__internal.next) {
+        if (*pp == s) {
+            *pp = s->__internal.next;
+            break;
+        }
+    }
+
+    if (s->__internal.queued) {
+        h2_stream *prev = NULL;
+        for (pp = &h->__internal.ready_head; *pp; prev = *pp, pp = &(*pp)->__internal.ready_next) {
+            if (*pp == s) {
+                *pp = s->__internal.ready_next;
+                if (h->__internal.ready_tail == s) h->__internal.ready_tail = prev;
+                break;
+            }
+        }
+    }
+
+    h->pending_bytes -= s->__internal.pending.len;
+    h->num_streams--;
+    h2_buf_free(&s->__internal.head);
+    h2_buf_free(&s->__internal.body);
+    h2_buf_free(&s->__internal.path);
+    h2_buf_free(&s->__internal.authority);
+    h2_buf_free(&s->__internal.resp_hdr);
+    h2_buf_free(&s->__internal.pending);
+    free(s);
+}
+
+//Once both sides are done with a stream, it's closed and we forget it
+static void h2_maybe_free(h2_conn *h, h2_stream *s) {
+    if (s->state == H2_STREAM_HALF_CLOSED
+        && s->resp_state == H2_RESP_DONE
+        && s->__internal.pending.len == 0
+        && !s->__internal.end_pending
+        && !s->__internal.queued
+    ) {
+        h2_free_stream(h, s);
+    }
+}
+
+static void h2_reset(h2_conn *h, h2_stream *s, unsigned code, mm_err *err) {
+    h2_put_rst(h, s->id, code, err);
+    h2_free_stream(h, s);
+}
+
+//Request is all in. Queue it up for h2_next_request
+static void h2_stream_done(h2_conn *h, h2_stream *s) {
+    s->state = H2_STREAM_HALF_CLOSED;
+    s->__internal.queued = 1;
+    s->__internal.ready_next = NULL;
+    if (h->__internal.ready_tail) h->__internal.ready_tail->__internal.ready_next = s;
+    else h->__internal.ready_head = s;
+    h->__internal.ready_tail = s;
+}
+
+//Answers a stream ourselves (used when the request is too big to buffer),
+//and tells the client to stop sending the rest of it
+static void h2_refuse(h2_conn *h, h2_stream *s, int status, mm_err *err) {
+    h2_buf *b = &h->__internal.enc;
+    b->len = 0;
+    hpack_put_status(b, status, err);
+    hpack_put_hdr(b, "content-length", 14, "0", 1, err);
+    h2_put_headers(h, s->id, b, 1, err);
+    if (s->state == H2_STREAM_OPEN) h2_put_rst(h, s->id, H2_NO_ERROR, err);
+    h2_free_stream(h, s);
+}
+
+//Sends as much of data as flow control allows, and holds on to the rest
+static void h2_send_data(h2_conn *h, h2_stream *s, char const *data, long len, int end, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    if (s->__internal.pending.len == 0 && !s->__internal.end_pending) {
+        long win = s->send_window < h->send_window ? s->send_window : h->send_window;
+        long now = len < win ? len : win;
+        if (now < 0) now = 0;
+
+        if (now > 0 || (len == 0 && end)) h2_put_data(h, s->id, data, now, end && now == len, err);
+        s->send_window -= now;
+        h->send_window -= now;
+        data += now;
+        len -= now;
+        if (len == 0) return;
+    }
+
+    h2_buf_append(&s->__internal.pending, data, len, err);
+    h->pending_bytes += len;
+    if (end) s->__internal.end_pending = 1;
+}
+
+//Some window opened up. Send whatever was waiting on it
+static void h2_pump(h2_conn *h, mm_err *err) {
+    h2_stream *s = h->__internal.streams;
+    while (s && h->send_window > 0 && *err == MM_SUCCESS) {
+        h2_stream *next = s->__internal.next;
+        h2_buf *p = &s->__internal.pending;
+
+        if (p->len > 0 || s->__internal.end_pending) {
+            long win = s->send_window < h->send_window ? s->send_window : h->send_window;
+            long now = p->len < win ? p->len : win;
+            if (now < 0) now = 0;
+
+            if (now > 0 || p->len == 0) {
+                int end = s->__internal.end_pending && now == p->len;
+                h2_put_data(h, s->id, p->data, now, end, err);
+                s->send_window -= now;
+                h->send_window -= now;
+                h->pending_bytes -= now;
+                h2_buf_consume(p, now);
+                if (end) {
+                    s->__internal.end_pending = 0;
+                    h2_maybe_free(h, s);
+                }
+            }
+        }
+        s = next;
+    }
+}
+
+////////////////////////
+// Receiving requests //
+////////////////////////
+
+static int h2_name_is(char const *name, int len, char const *lit) {
+    return (int) strlen(lit) == len && !memcmp(name, lit, len);
+}
+
+//Field names have to be lower-case tokens, and values can't have anything
+//that would let them break out of the HTTP/1.1 text we turn them into
+static int h2_valid_name(char const *s, int len) {
+    if (len == 0) return 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c <= ' ' || c >= 0x7F || c == ':' || (c >= 'A' && c <= 'Z')) return 0;
+    }
+    return 1;
+}
+
+static int h2_valid_value(char const *s, int len) {
+    int i;
+    for (i = 0; i < len; i++) {
+        if (s[i] == '\0' || s[i] == '\r' || s[i] == '\n') return 0;
+    }
+    return 1;
+}
+
+//Writes the request line, and Host if there was an :authority
+static void h2_start_line(h2_stream *s, mm_err *err) {
+    s->__internal.started = 1;
+    if (!s->__internal.method[0] || !s->__internal.path.len || !s->__internal.has_scheme) {
+        s->__internal.bad = 1;
+        return;
+    }
+
+    h2_buf *b = &s->__internal.head;
+    h2_buf_append(b, s->__internal.method, strlen(s->__internal.method), err);
+    h2_buf_append(b, " ", 1, err);
+    h2_buf_append(b, s->__internal.path.data, s->__internal.path.len, err);
+    h2_buf_append(b, " HTTP/1.1\r\n", 11, err);
+    if (s->__internal.authority.len) {
+        h2_buf_append(b, "Host: ", 6, err);
+        h2_buf_append(b, s->__internal.authority.data, s->__internal.authority.len, err);
+        h2_buf_append(b, "\r\n", 2, err);
+    }
+    s->__internal.is_head = !strcmp(s->__internal.method, "HEAD");
+}
+
+typedef struct _h2_hdr_ctx {
+    h2_conn *h;
+    h2_stream *s; //NULL means decode, but throw the headers away
+} h2_hdr_ctx;
+
+//hpack_hdr_fn that adds each header to the HTTP/1.1 version of the request
+static void h2_on_hdr(void *arg, char const *name, int name_len, char const *value, int value_len, mm_err *err) {
+    h2_hdr_ctx *ctx = arg;
+    h2_stream *s = ctx->s;
+    if (!s || s->__internal.bad || s->__internal.too_big) return;
+
+    if (name_len == 0 || !h2_valid_value(value, value_len)) {
+        s->__internal.bad = 1;
+        return;
+    }
+
+    if (name[0] == ':') {
+        //Pseudo-headers all come first, and only once each
+        if (s->__internal.started) {
+            s->__internal.bad = 1;
+        } else if (h2_name_is(name, name_len, ":method")) {
+            if (s->__internal.method[0] || value_len == 0 || value_len >= (int) sizeof(s->__internal.method) || memchr(value, ' ', value_len)) {
+                s->__internal.bad = 1;
+                return;
+            }
+            memcpy(s->__internal.method, value, value_len);
+            s->__internal.method[value_len] = '\0';
+        } else if (h2_name_is(name, name_len, ":path")) {
+            if (s->__internal.path.len || value_len == 0 || value[0] != '/' || memchr(value, ' ', value_len) || memchr(value, '\t', value_len)) {
+                s->__internal.bad = 1;
+                return;
+            }
+            h2_buf_append(&s->__internal.path, value, value_len, err);
+        } else if (h2_name_is(name, name_len, ":scheme")) {
+            if (s->__internal.has_scheme) s->__internal.bad = 1;
+            s->__internal.has_scheme = 1;
+        } else if (h2_name_is(name, name_len, ":authority")) {
+            if (s->__internal.authority.len) s->__internal.bad = 1;
+            h2_buf_append(&s->__internal.authority, value, value_len, err);
+        } else {
+            s->__internal.bad = 1;
+        }
+        return;
+    }
+
+    //Connection-specific headers mean nothing in HTTP/2, so they aren't
+    //allowed (RFC 9113, 8.2.2)
+    if (!h2_valid_name(name, name_len)
+        || h2_name_is(name, name_len, "connection")
+        || h2_name_is(name, name_len, "keep-alive")
+        || h2_name_is(name, name_len, "proxy-connection")
+        || h2_name_is(name, name_len, "transfer-encoding")
+        || h2_name_is(name, name_len, "upgrade")
+        || (h2_name_is(name, name_len, "te") && !(value_len == 8 && !memcmp(value, "trailers", 8)))
+    ) {
+        s->__internal.bad = 1;
+        return;
+    }
+
+    if (!s->__internal.started) {
+        h2_start_line(s, err);
+        if (s->__internal.bad) return;
+    }
+
+    //We write our own Content-Length once the body is in, and :authority
+    //already became Host
+    if (h2_name_is(name, name_len, "content-length")) return;
+    if (h2_name_is(name, name_len, "host") && s->__internal.authority.len) return;
+
+    h2_buf *b = &s->__internal.head;
+    int max = http_hdr_limit(&ctx->h->limits);
+    if (b->len + name_len + value_len + 4 > max) {
+        s->__internal.too_big = 1;
+        return;
+    }
+    h2_buf_append(b, name, name_len, err);
+    h2_buf_append(b, ": ", 2, err);
+    h2_buf_append(b, value, value_len, err);
+    h2_buf_append(b, "\r\n", 2, err);
+}
+
+static void h2_fail(h2_conn *h, unsigned code, mm_err e, mm_err *err);
+static void h2_apply_settings(h2_conn *h, unsigned char const *p, long len, mm_err *err);
+
+//A whole header block is in (HEADERS plus any CONTINUATIONs)
+static void h2_handle_hdr_block(h2_conn *h, unsigned id, int end_stream, mm_err *err) {
+    h2_stream *s = h2_find(h, id);
+    int refused = 0;
+
+    if (!s) {
+        //Client streams are odd, and new ones have to go up
+        if (!(id & 1) || id <= h->last_stream) {
+            h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+            return;
+        }
+        if (h->num_streams >= H2_MAX_STREAMS || h->goaway_sent) {
+            refused = 1;
+            h->last_stream = id;
+        } else {
+            s = h2_new_stream(h, id, err);
+            if (*err != MM_SUCCESS) return;
+        }
+    } else if (s->state != H2_STREAM_OPEN || !end_stream) {
+        //Trailers have to end the stream, and nothing comes after that
+        s = NULL;
+        refused = -1;
+    }
+
+    //Even if we don't want the headers, the block still has to be decoded,
+    //or our table would no longer match the client's
+    h2_hdr_ctx ctx = {h, (s && !s->__internal.started) ? s : NULL};
+    hpack_decode(&h->__internal.dec, h->__internal.hblock.data, h->__internal.hblock.len, h2_on_hdr, &ctx, err);
+    h->__internal.hblock.len = 0;
+    if (*err == H2_COMPRESSION_ERROR) {
+        *err = MM_SUCCESS;
+        h2_fail(h, H2_COMPRESSION_ERR, H2_COMPRESSION_ERROR, err);
+        return;
+    }
+    if (*err != MM_SUCCESS) return;
+
+    if (refused) {
+        h2_stream *old = h2_find(h, id);
+        if (old) h2_reset(h, old, H2_STREAM_CLOSED_ERR, err);
+        else h2_put_rst(h, id, refused > 0 ? H2_REFUSED_STREAM : H2_STREAM_CLOSED_ERR, err);
+        return;
+    }
+
+    if (!s->__internal.started) h2_start_line(s, err);
+    if (s->__internal.bad) {
+        h2_reset(h, s, H2_PROTOCOL_ERR, err);
+        return;
+    }
+    if (s->__internal.too_big) {
+        if (end_stream) s->state = H2_STREAM_HALF_CLOSED;
+        h2_refuse(h, s, 431, err);
+        return;
+    }
+    if (end_stream) h2_stream_done(h, s);
+}
+
+static void h2_handle_data(h2_conn *h, unsigned id, int flags, unsigned char const *p, long len, mm_err *err) {
+    //The whole frame counts against flow control, padding and all
+    h->recv_window -= len;
+    if (h->recv_window < 0) {
+        h2_fail(h, H2_FLOW_CONTROL_ERR, H2_FLOW_CONTROL_ERROR, err);
+        return;
+    }
+    if (h->recv_window < H2_RECV_WINDOW / 2) {
+        h2_put_window_update(h, 0, H2_RECV_WINDOW - h->recv_window, err);
+        h->recv_window = H2_RECV_WINDOW;
+    }
+
+    long frame_len = len;
+    if (flags & H2_FLAG_PADDED) {
+        if (len < 1 || p[0] >= len) {
+            h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+            return;
+        }
+        len -= 1 + p[0];
+        p++;
+    }
+
+    h2_stream *s = h2_find(h, id);
+    if (!s || s->state != H2_STREAM_OPEN) {
+        if (id > h->last_stream) h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+        //Otherwise it's for a stream we already reset or answered; the
+        //client just hasn't noticed yet
+        return;
+    }
+
+    s->recv_window -= frame_len;
+    if (s->recv_window < 0) {
+        h2_reset(h, s, H2_FLOW_CONTROL_ERR, err);
+        return;
+    }
+
+    int max = http_body_limit(&h->limits);
+    if (s->__internal.body.len + len > max) {
+        h2_refuse(h, s, 413, err);
+        return;
+    }
+    h2_buf_append(&s->__internal.body, p, len, err);
+
+    if (flags & H2_FLAG_END_STREAM) {
+        h2_stream_done(h, s);
+    } else if (s->recv_window < H2_RECV_WINDOW / 2) {
+        h2_put_window_update(h, id, H2_RECV_WINDOW - s->recv_window, err);
+        s->recv_window = H2_RECV_WINDOW;
+    }
+}
+
+//Starts (or continues) a header block
+static void h2_handle_headers(h2_conn *h, int type, unsigned id, int flags, unsigned char const *p, long len, mm_err *err) {
+    if (type == H2_HEADERS) {
+        if (flags & H2_FLAG_PADDED) {
+            if (len < 1 || p[0] >= len) {
+                h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+                return;
+            }
+            len -= 1 + p[0];
+            p++;
+        }
+        //We don't do priorities
+        if (flags & H2_FLAG_PRIORITY) {
+            if (len < 5) {
+                h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+                return;
+            }
+            p += 5;
+            len -= 5;
+        }
+        h->__internal.cont_end_stream = flags & H2_FLAG_END_STREAM;
+    }
+
+    //The compressed block can't be any bigger than what we'd accept once
+    //it's decoded. We have to decode the whole thing no matter what (see
+    //h2_handle_hdr_block), so this is a connection error
+    int max = http_hdr_limit(&h->limits);
+    if (h->__internal.hblock.len + len > max) {
+        h2_fail(h, H2_PROTOCOL_ERR, HTTP_HDRS_TOO_LARGE, err);
+        return;
+    }
+    h2_buf_append(&h->__internal.hblock, p, len, err);
+
+    if (flags & H2_FLAG_END_HEADERS) {
+        h->__internal.cont_stream = 0;
+        h2_handle_hdr_block(h, id, h->__internal.cont_end_stream, err);
+    } else {
+        h->__internal.cont_stream = id;
+    }
+}
+
+static void h2_handle_frame(h2_conn *h, unsigned char const *f, mm_err *err) {
+    long len = ((long) f[0] << 16) | (f[1] << 8) | f[2];
+    int type = f[3];
+    int flags = f[4];
+    unsigned id = h2_get_u32(f + 5) & 0x7FFFFFFF;
+    unsigned char const *p = f + H2_FRAME_HDR_LEN;
+
+    //Nothing is allowed in the middle of a header block
+    if (h->__internal.cont_stream && (type != H2_CONTINUATION || id != h->__internal.cont_stream)) {
+        h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+        return;
+    }
+
+    switch (type) {
+    case H2_DATA:
+        if (id == 0) break;
+        h2_handle_data(h, id, flags, p, len, err);
+        return;
+    case H2_HEADERS:
+        if (id == 0) break;
+        h2_handle_headers(h, type, id, flags, p, len, err);
+        return;
+    case H2_CONTINUATION:
+        if (!h->__internal.cont_stream) break;
+        h2_handle_headers(h, type, id, flags, p, len, err);
+        return;
+    case H2_PRIORITY:
+        if (id == 0) break;
+        if (len != 5) {
+            h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+        }
+        return;
+    case H2_RST_STREAM: {
+        if (id == 0) break;
+        if (len != 4) {
+            h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+            return;
+        }
+        if (id > h->last_stream) break;
+        h2_stream *s = h2_find(h, id);
+        if (s) h2_free_stream(h, s);
+        return;
+    }
+    case H2_SETTINGS:
+        if (id != 0) break;
+        if (flags & H2_FLAG_ACK) {
+            if (len != 0) h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+            return;
+        }
+        if (len % 6) {
+            h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+            return;
+        }
+        h2_apply_settings(h, p, len, err);
+        h2_put_frame(h, H2_SETTINGS, H2_FLAG_ACK, 0, NULL, 0, err);
+        h2_pump(h, err);
+        return;
+    case H2_PUSH_PROMISE:
+        //Clients can't push
+        break;
+    case H2_PING:
+        if (id != 0) break;
+        if (len != 8) {
+            h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+            return;
+        }
+        if (!(flags & H2_FLAG_ACK)) h2_put_frame(h, H2_PING, H2_FLAG_ACK, 0, p, 8, err);
+        return;
+    case H2_GOAWAY:
+        if (id != 0) break;
+        h->goaway_recv = 1;
+        return;
+    case H2_WINDOW_UPDATE: {
+        if (len != 4) {
+            h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+            return;
+        }
+        long incr = h2_get_u32(p) & 0x7FFFFFFF;
+        if (id == 0) {
+            if (incr == 0) break;
+            h->send_window += incr;
+            if (h->send_window > H2_MAX_WINDOW) {
+                h2_fail(h, H2_FLOW_CONTROL_ERR, H2_FLOW_CONTROL_ERROR, err);
+                return;
+            }
+        } else {
+            h2_stream *s = h2_find(h, id);
+            if (!s) return;
+            s->send_window += incr;
+            if (incr == 0 || s->send_window > H2_MAX_WINDOW) {
+                h2_reset(h, s, incr ? H2_FLOW_CONTROL_ERR : H2_PROTOCOL_ERR, err);
+                return;
+            }
+        }
+        h2_pump(h, err);
+        return;
+    }
+    default:
+        //Unknown frame types are ignored
+        return;
+    }
+
+    h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+}
+
+//Tells the client which of its streams we got to and hangs up. e is what
+//goes in *err
+static void h2_fail(h2_conn *h, unsigned code, mm_err e, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+    h2_goaway(h, code);
+    *err = e;
+}
+
+static void h2_apply_settings(h2_conn *h, unsigned char const *p, long len, mm_err *err) {
+    long off;
+    for (off = 0; off + 6 <= len && *err == MM_SUCCESS; off += 6) {
+        int ident = (p[off] << 8) | p[off + 1];
+        unsigned long val = h2_get_u32(p + off + 2);
+
+        switch (ident) {
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (val > H2_MAX_WINDOW) {
+                h2_fail(h, H2_FLOW_CONTROL_ERR, H2_FLOW_CONTROL_ERROR, err);
+                return;
+            }
+            //Applies to every stream, retroactively
+            long delta = (long) val - h->peer_initial_window;
+            h->peer_initial_window = val;
+            h2_stream *s;
+            for (s = h->__internal.streams; s; s = s->__internal.next) {
+                s->send_window += delta;
+                if (s->send_window > H2_MAX_WINDOW) {
+                    h2_fail(h, H2_FLOW_CONTROL_ERR, H2_FLOW_CONTROL_ERROR, err);
+                    return;
+                }
+            }
+            break;
+        }
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (val < H2_DEFAULT_FRAME_SIZE || val > 0xFFFFFF) {
+                h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+                return;
+            }
+            h->peer_max_frame = val;
+            break;
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (val > 1) h2_fail(h, H2_PROTOCOL_ERR, H2_PROTOCOL_ERROR, err);
+            break;
+        default:
+            //We don't push, don't use the client's table size (since we
+            //never index anything), and ignore everything else
+            break;
+        }
+    }
+}
+
+static int h2_has_token(char *args, char const *token) {
+    int len = strlen(token);
+    http_list_iter it;
+    http_slice item;
+    http_list_begin(&it, args);
+    while (http_list_next(&it, &item)) {
+        if (item.len == len && !strncasecmp(item.ptr, token, len)) return 1;
+    }
+    return 0;
+}
+
+static int h2_b64url_val(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '-' || c == '+') return 62;
+    if (c == '_' || c == '/') return 63;
+    return -1;
+}
+
+//Decodes (unpadded) base64url into dst, which has room for 3/4 of len.
+//Returns the decoded length, or -1 on garbage
+static int h2_b64url_decode(unsigned char *dst, char const *src, int len) {
+    int out = 0;
+    unsigned acc = 0;
+    int bits = 0;
+    int i;
+    for (i = 0; i < len && src[i] != '='; i++) {
+        int v = h2_b64url_val(src[i]);
+        if (v < 0) return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            dst[out++] = acc >> bits;
+        }
+    }
+    return out;
+}
+
+#endif
+
+////////////////////////
+// HPACK decoder state //
+////////////////////////
+
+//Assumes t is non-NULL
+void init_hpack_table(hpack_table *t)
+#ifdef MM_IMPLEMENT
+{
+    memset(t, 0, sizeof(hpack_table));
+    t->max_size = HPACK_TABLE_SIZE;
+}
+#else
+;
+#endif
+
+//Frees everything the table is holding on to (but not t itself)
+void clear_hpack_table(hpack_table *t)
+#ifdef MM_IMPLEMENT
+{
+    hpack_evict(t, 0);
+    free(t->__internal.scratch);
+    t->__internal.scratch = NULL;
+    t->__internal.scratch_cap = 0;
+}
+#else
+;
+#endif
+
+/* hpack_decode:
+
+Decodes one complete header block (i.e. everything from a HEADERS frame and
+its CONTINUATIONs), calling fn for each field, in order. Updates the
+dynamic table as it goes, so every block on a connection has to go through
+here, even the ones you don't care about.
+
+Sets *err to H2_COMPRESSION_ERROR if the block is malformed. That's fatal
+for the whole connection, since the table is now out of sync.
+*/
+void hpack_decode(hpack_table *t, char const *block, long len, hpack_hdr_fn *fn, void *arg, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!t || (len > 0 && !block) || !fn) {
+        *err = H2_NULL_ARG;
+        return;
+    }
+
+    //Huffman never makes a string more than 8/5 as long, and a name and
+    //value both come out of the same block
+    long need = len * 2 + 16;
+    if (need > t->__internal.scratch_cap) {
+        char *tmp = realloc(t->__internal.scratch, need);
+        if (!tmp) {
+            *err = H2_OOM;
+            return;
+        }
+        t->__internal.scratch = tmp;
+        t->__internal.scratch_cap = need;
+    }
+
+    unsigned char const *p = (unsigned char const *) block;
+    unsigned char const *end = p + len;
+    //Size updates are only allowed at the start of a block
+    int first = 1;
+
+    while (p < end && *err == MM_SUCCESS) {
+        unsigned char b = *p;
+        char const *name, *value;
+        int name_len, value_len;
+        int scratch_pos = 0;
+
+        if (b & 0x80) {
+            //Indexed field
+            long idx = hpack_get_int(&p, end, 7);
+            if (!hpack_lookup(t, idx, &name, &name_len, &value, &value_len)) goto bad;
+            fn(arg, name, name_len, value, value_len, err);
+        } else if ((b & 0xE0) == 0x20) {
+            //Dynamic table size update
+            long sz = hpack_get_int(&p, end, 5);
+            if (!first || sz < 0 || sz > HPACK_TABLE_SIZE) goto bad;
+            t->max_size = sz;
+            hpack_evict(t, sz);
+            continue;
+        } else {
+            //Literal, with incremental indexing (01), without indexing
+            //(0000) or never indexed (0001). The last two are the same to
+            //a decoder
+            int indexing = (b & 0xC0) == 0x40;
+            long idx = hpack_get_int(&p, end, indexing ? 6 : 4);
+            if (idx < 0) goto bad;
+            if (idx) {
+                char const *ignored;
+                int ignored_len;
+                if (!hpack_lookup(t, idx, &name, &name_len, &ignored, &ignored_len)) goto bad;
+            } else {
+                name_len = hpack_get_str(t, &p, end, &name, &scratch_pos);
+                if (name_len < 0) goto bad;
+            }
+            value_len = hpack_get_str(t, &p, end, &value, &scratch_pos);
+            if (value_len < 0) goto bad;
+
+            fn(arg, name, name_len, value, value_len, err);
+            if (indexing) hpack_add(t, name, name_len, value, value_len, err);
+        }
+        first = 0;
+    }
+    return;
+
+bad:
+    *err = H2_COMPRESSION_ERROR;
+}
+#else
+;
+#endif
+
+/////////////////////////////////////
+// Managing h2_conn structs //
+/////////////////////////////////////
+
+//Returns a new connection, with our SETTINGS already queued in out. limits
+//can be NULL to get the parser defaults. Returns NULL and sets *err on error
+h2_conn *new_h2_conn(http_limits const *limits, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    h2_conn *ret = calloc(1, sizeof(h2_conn));
+    if (!ret) {
+        *err = H2_OOM;
+        return NULL;
+    }
+
+    if (limits) ret->limits = *limits;
+    else http_default_limits(&ret->limits);
+    ret->send_window = H2_DEFAULT_WINDOW;
+    ret->recv_window = H2_RECV_WINDOW;
+    ret->peer_initial_window = H2_DEFAULT_WINDOW;
+    ret->peer_max_frame = H2_DEFAULT_FRAME_SIZE;
+    ret->__internal.preface_left = H2_PREFACE_LEN;
+    init_hpack_table(&ret->__internal.dec);
+
+    //Our SETTINGS have to be the first thing we send. The connection
+    //window can only be changed with a WINDOW_UPDATE
+    unsigned char settings[18];
+    int n = 0;
+    unsigned long vals[3][2] = {
+        {H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS},
+        {H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_RECV_WINDOW},
+        {H2_SETTINGS_MAX_HEADER_LIST_SIZE, ret->limits.max_hdr_bytes}
+    };
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (vals[i][1] == 0) continue;
+        settings[n] = vals[i][0] >> 8;
+        settings[n + 1] = vals[i][0];
+        h2_put_u32(settings + n + 2, vals[i][1]);
+        n += 6;
+    }
+    h2_put_frame(ret, H2_SETTINGS, 0, 0, settings, n, err);
+    h2_put_window_update(ret, 0, H2_RECV_WINDOW - H2_DEFAULT_WINDOW, err);
+    if (*err != MM_SUCCESS) {
+        del_h2_conn(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Gracefully ignores NULL input
+void del_h2_conn(h2_conn *h)
+#ifdef MM_IMPLEMENT
+{
+    if (!h) return;
+    while (h->__internal.streams) h2_free_stream(h, h->__internal.streams);
+    clear_hpack_table(&h->__internal.dec);
+    h2_buf_free(&h->out);
+    h2_buf_free(&h->__internal.in);
+    h2_buf_free(&h->__internal.hblock);
+    h2_buf_free(&h->__internal.enc);
+    free(h);
+}
+#else
+;
+#endif
+
+//Returns 1 if buf could be the start of an HTTP/2 connection (with prior
+//knowledge). Needs at least 3 bytes to tell it apart from PUT or POST
+int h2_is_preface(char const *buf, int len)
+#ifdef MM_IMPLEMENT
+{
+    if (len < 3) return 0;
+    if (len > H2_PREFACE_LEN) len = H2_PREFACE_LEN;
+    return !memcmp(buf, H2_PREFACE, len);
+}
+#else
+;
+#endif
+
+//Returns 1 if req is asking to upgrade to h2c (RFC 7540, 3.2)
+int is_h2c_upgrade(http_req const *req)
+#ifdef MM_IMPLEMENT
+{
+    mm_err err = MM_SUCCESS;
+    char *upgrade = get_args(req, "Upgrade", &err);
+    char *settings = get_args(req, "HTTP2-Settings", &err);
+    return err == MM_SUCCESS && h2_has_token(upgrade, "h2c") && settings != NULL;
+}
+#else
+;
+#endif
+
+//Call this after sending the 101 for an h2c upgrade. The request that asked
+//for it becomes stream 1, which is already half-closed (so answer it with
+//h2_respond, but don't expect it from h2_next_request). Also applies the
+//client's HTTP2-Settings
+void h2_upgrade(h2_conn *h, http_req const *req, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!h || !req) {
+        *err = H2_NULL_ARG;
+        return;
+    }
+
+    char *b64 = get_args(req, "HTTP2-Settings", err);
+    if (*err != MM_SUCCESS) return;
+    int b64_len = strlen(b64);
+    unsigned char *settings = malloc(b64_len + 1);
+    if (!settings) {
+        *err = H2_OOM;
+        return;
+    }
+    int len = h2_b64url_decode(settings, b64, b64_len);
+    if (len < 0 || len % 6) {
+        free(settings);
+        *err = H2_PROTOCOL_ERROR;
+        return;
+    }
+    h2_apply_settings(h, settings, len, err);
+    free(settings);
+
+    h2_stream *s = h2_new_stream(h, 1, err);
+    if (*err != MM_SUCCESS) return;
+    s->state = H2_STREAM_HALF_CLOSED;
+    s->__internal.is_head = req->req_type == HTTP_HEAD;
+}
+#else
+;
+#endif
+
+/* write_to_h2_parser:
+
+Feeds bytes from the socket into h. Frames are handled as they complete,
+and a partial one is saved for next time, so unlike the other parsers this
+always uses up all of buf. Afterwards, send whatever's in h->out and call
+h2_next_request until it runs out.
+
+Returns 0 on success. On a connection error, returns -1 and sets *err; a
+GOAWAY saying why is already in h->out, so send that and hang up.
+*/
+int write_to_h2_parser(h2_conn *h, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!h || (len > 0 && !buf)) {
+        *err = H2_NULL_ARG;
+        return -1;
+    }
+
+    //Client preface first. It can show up in pieces like anything else
+    int left = h->__internal.preface_left;
+    if (left > 0) {
+        int n = len < left ? len : left;
+        if (memcmp(buf, H2_PREFACE + (H2_PREFACE_LEN - left), n)) {
+            h2_fail(h, H2_PROTOCOL_ERR, H2_BAD_PREFACE, err);
+            return -1;
+        }
+        h->__internal.preface_left -= n;
+        buf += n;
+        len -= n;
+    }
+
+    //Frames straight out of buf, unless there was a partial one left over
+    //from last time
+    h2_buf *in = &h->__internal.in;
+    unsigned char const *p = (unsigned char const *) buf;
+    long avail = len;
+    if (in->len > 0) {
+        h2_buf_append(in, buf, len, err);
+        if (*err != MM_SUCCESS) return -1;
+        p = (unsigned char const *) in->data;
+        avail = in->len;
+    }
+
+    long off = 0;
+    while (avail - off >= H2_FRAME_HDR_LEN) {
+        long flen = ((long) p[off] << 16) | (p[off + 1] << 8) | p[off + 2];
+        //We never said we'd take anything bigger than the default
+        if (flen > H2_DEFAULT_FRAME_SIZE) {
+            h2_fail(h, H2_FRAME_SIZE_ERR, H2_FRAME_SIZE_ERROR, err);
+            return -1;
+        }
+        if (avail - off < H2_FRAME_HDR_LEN + flen) break;
+
+        h2_handle_frame(h, p + off, err);
+        if (*err != MM_SUCCESS) return -1;
+        off += H2_FRAME_HDR_LEN + flen;
+    }
+
+    if (in->len > 0) {
+        h2_buf_consume(in, off);
+    } else {
+        h2_buf_append(in, p + off, avail - off, err);
+        if (*err != MM_SUCCESS) return -1;
+    }
+
+    return 0;
+}
+#else
+;
+#endif
+
+//Returns the id of the oldest stream whose request is complete (and takes
+//it off the list), or 0 if there aren't any. Use h2_stream_req to get the
+//request
+unsigned h2_next_request(h2_conn *h)
+#ifdef MM_IMPLEMENT
+{
+    h2_stream *s = h->__internal.ready_head;
+    if (!s) return 0;
+
+    h->__internal.ready_head = s->__internal.ready_next;
+    if (!h->__internal.ready_head) h->__internal.ready_tail = NULL;
+    s->__internal.queued = 0;
+    s->__internal.ready_next = NULL;
+    return s->id;
+}
+#else
+;
+#endif
+
+//Runs stream id's request through the HTTP/1.1 parser, into req (which
+//should be fresh). Errors are the parser's, so the usual status codes apply
+//(or H2_NO_STREAM if the client reset the stream in the meantime)
+void h2_stream_req(h2_conn *h, unsigned id, http_req *req, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!h || !req) {
+        *err = H2_NULL_ARG;
+        return;
+    }
+
+    h2_stream *s = h2_find(h, id);
+    if (!s) {
+        *err = H2_NO_STREAM;
+        return;
+    }
+
+    h2_buf *head = &s->__internal.head;
+    h2_buf *body = &s->__internal.body;
+    if (body->len > 0 || !strcmp(s->__internal.method, "POST")) {
+        char cl[48];
+        int n = snprintf(cl, sizeof(cl), "Content-Length: %ld\r\n", body->len);
+        h2_buf_append(head, cl, n, err);
+    }
+    h2_buf_append(head, "\r\n", 2, err);
+    if (*err != MM_SUCCESS) return;
+
+    int rc = write_to_http_parser(req, head->data, head->len, err);
+    if (rc > 0) rc = write_to_http_parser(req, body->data, body->len, err);
+    if (rc > 0 && *err == MM_SUCCESS) *err = HTTP_IMPOSSIBLE;
+
+    //The parser has its own copy now
+    h2_buf_free(head);
+    h2_buf_free(body);
+    h2_buf_free(&s->__internal.path);
+    h2_buf_free(&s->__internal.authority);
+}
+#else
+;
+#endif
+
+/* h2_respond:
+
+Sends buf as (part of) the response on stream id. buf is HTTP/1.1, exactly
+as you'd send it on a normal connection, and can come in as many pieces as
+you like. The status line and header are turned into a HEADERS frame
+(minus the headers that only mean something to HTTP/1.1, like Connection),
+and the body goes out as DATA, as fast as flow control allows. Whatever
+can't go yet waits in the stream (see pending_bytes) until the client
+opens its window.
+
+The body ends after Content-Length bytes. Without a Content-Length, it
+ends when you call h2_end_response. Chunked responses aren't translated.
+
+Returns len, or -1 and sets *err. Bytes past the end of the response are
+ignored.
+*/
+int h2_respond(h2_conn *h, unsigned id, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!h || (len > 0 && !buf)) {
+        *err = H2_NULL_ARG;
+        return -1;
+    }
+
+    h2_stream *s = h2_find(h, id);
+    if (!s) {
+        *err = H2_NO_STREAM;
+        return -1;
+    }
+
+    int ret = len;
+    while (len > 0 && s->resp_state != H2_RESP_DONE) {
+        if (s->resp_state == H2_RESP_BODY) {
+            long n = len;
+            if (s->__internal.resp_left >= 0 && n > s->__internal.resp_left) n = s->__internal.resp_left;
+            if (s->__internal.resp_left >= 0) s->__internal.resp_left -= n;
+            int end = s->__internal.resp_left == 0;
+            h2_send_data(h, s, buf, n, end, err);
+            if (end) s->resp_state = H2_RESP_DONE;
+            buf += n;
+            len -= n;
+            continue;
+        }
+
+        //Still in the header. Collect it until we have the whole thing
+        h2_buf *hdr = &s->__internal.resp_hdr;
+        long old_len = hdr->len;
+        h2_buf_append(hdr, buf, len, err);
+        if (*err != MM_SUCCESS) return -1;
+
+        long from = old_len > 3 ? old_len - 3 : 0;
+        char *end = NULL;
+        char *scan;
+        for (scan = hdr->data + from; scan + 3 < hdr->data + hdr->len; scan++) {
+            if (!memcmp(scan, "\r\n\r\n", 4)) {
+                end = scan;
+                break;
+            }
+        }
+        if (!end) {
+            if (hdr->len > H2_MAX_RESP_HDR) {
+                *err = H2_BAD_RESPONSE;
+                return -1;
+            }
+            break;
+        }
+
+        //Whatever's after the blank line is body, which we'll go around
+        //again for
+        long used = (end + 4 - hdr->data) - old_len;
+        buf += used;
+        len -= used;
+        *end = '\0';
+
+        //Status line
+        char *line = hdr->data;
+        char *sp = strchr(line, ' ');
+        int status = sp ? atoi(sp + 1) : 0;
+        if (strncmp(line, "HTTP/1.", 7) || status < 100 || status > 999) {
+            *err = H2_BAD_RESPONSE;
+            return -1;
+        }
+
+        h2_buf *b = &h->__internal.enc;
+        b->len = 0;
+        hpack_put_status(b, status, err);
+
+        long content_length = -1;
+        line = strstr(line, "\r\n");
+        while (line) {
+            line += 2;
+            char *next = strstr(line, "\r\n");
+            char *colon = strchr(line, ':');
+            if (next) *next = '\0';
+            if (colon) {
+                char name[256];
+                int name_len = colon - line;
+                while (name_len > 0 && (line[name_len - 1] == ' ' || line[name_len - 1] == '\t')) name_len--;
+                if (name_len == 0 || name_len >= (int) sizeof(name)) {
+                    *err = H2_BAD_RESPONSE;
+                    return -1;
+                }
+                int i;
+                for (i = 0; i < name_len; i++) name[i] = (line[i] >= 'A' && line[i] <= 'Z') ? line[i] + 32 : line[i];
+
+                char *value = colon + 1;
+                while (*value == ' ' || *value == '\t') value++;
+                int value_len = strlen(value);
+                while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) value_len--;
+
+                if (h2_name_is(name, name_len, "content-length")) content_length = atol(value);
+
+                if (!h2_name_is(name, name_len, "connection")
+                    && !h2_name_is(name, name_len, "keep-alive")
+                    && !h2_name_is(name, name_len, "transfer-encoding")
+                    && !h2_name_is(name, name_len, "upgrade")
+                ) {
+                    hpack_put_hdr(b, name, name_len, value, value_len, err);
+                }
+            }
+            line = next;
+        }
+        hdr->len = 0;
+
+        if (status == 101) {
+            //Not a thing in HTTP/2. Skip it and wait for the real response
+            continue;
+        } else if (status < 200) {
+            //Informational (e.g. 100 Continue). The real one comes next
+            h2_put_headers(h, id, b, 0, err);
+            continue;
+        }
+
+        int no_body = s->__internal.is_head || status == 204 || status == 304 || content_length == 0;
+        h2_put_headers(h, id, b, no_body, err);
+        s->resp_state = no_body ? H2_RESP_DONE : H2_RESP_BODY;
+        s->__internal.resp_left = content_length;
+    }
+    if (*err != MM_SUCCESS) return -1;
+
+    h2_maybe_free(h, s);
+    return ret;
+}
+#else
+;
+#endif
+
+//Call when you're done responding on stream id. A response with no
+//Content-Length gets its END_STREAM here; one that's incomplete (or was
+//never started) gets the stream reset
+void h2_end_response(h2_conn *h, unsigned id, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!h) {
+        *err = H2_NULL_ARG;
+        return;
+    }
+
+    h2_stream *s = h2_find(h, id);
+    if (!s || s->resp_state == H2_RESP_DONE) return;
+
+    if (s->resp_state == H2_RESP_BODY && s->__internal.resp_left < 0) {
+        h2_send_data(h, s, NULL, 0, 1, err);
+        s->resp_state = H2_RESP_DONE;
+        h2_maybe_free(h, s);
+    } else {
+        h2_reset(h, s, H2_INTERNAL_ERR, err);
+    }
+}
+#else
+;
+#endif
+
+//Queues a GOAWAY (only the first call does anything). Streams the client
+//already opened still get answered, but new ones are refused
+void h2_goaway(h2_conn *h, unsigned code)
+#ifdef MM_IMPLEMENT
+{
+    if (h->goaway_sent) return;
+    h->goaway_sent = 1;
+
+    mm_err err = MM_SUCCESS;
+    unsigned char payload[8];
+    h2_put_u32(payload, h->last_stream);
+    h2_put_u32(payload + 4, code);
+    h2_put_frame(h, H2_GOAWAY, 0, 0, payload, 8, &err);
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,373 @@
+//Passing sockets from one process to another, for restarts that don't drop
+//anyone. The old process listens on a UNIX socket; the new one connects to
+//it at startup, and the old one sends over its listening socket, then its
+//connections one at a time (each with whatever state goes with it), then
+//HO_DONE. See handoff_path in server.h for how the event loop uses this.
+//
+//File descriptors go across with SCM_RIGHTS, so the kernel objects behind
+//them are shared, not copied: a connection that's been handed off keeps its
+//TCP state, and any bytes waiting in its receive buffer are still there for
+//the new process. The listening socket's accept queue goes along too, so
+//connections that arrive in the middle of all this aren't lost.
+//
+//The socket is SOCK_SEQPACKET, so messages keep their boundaries. Each one
+//is an ho_hdr (with at most one fd attached) followed by len bytes of data,
+//split into records of at most HO_MAX_RECORD bytes. Both ends are blocking,
+//with a timeout of HO_IO_TIMEOUT_MS; a message is only started once the
+//whole thing is ready, so the reader never waits long for the rest.
+//
+//Message layout is native byte order and native sizes. Both processes are
+//meant to be builds of the same program on the same machine, and
+//HO_VERSION is bumped whenever the layout of anything sent changes.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef HANDOFF_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define HANDOFF_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef HANDOFF_H
+        #define SHOULD_INCLUDE 1
+        #define HANDOFF_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "handoff.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    #define HO_MAGIC 0x4d4d484fU //"MMHO"
+    #define HO_VERSION 1
+    #define HO_MAX_RECORD 65536
+    #define HO_IO_TIMEOUT_MS 1000
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(HO_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(HO_OOM, "out of memory");
+MM_ERR(HO_SOCKET_ERROR, "handoff socket error (check errno)");
+MM_ERR(HO_NO_PEER, "nobody is listening on the handoff socket");
+MM_ERR(HO_BAD_MSG, "malformed handoff message, or from a different version");
+
+///////////////////////////
+// Handoff structs/enums //
+///////////////////////////
+#ifndef MM_IMPLEMENT
+    #define HO_MSG_TYPE_IDS \
+        X(HO_LISTENER), \
+        X(HO_CONN), \
+        X(HO_DONE)
+
+    typedef enum _ho_msg_t {
+    #define X(x) x
+        HO_MSG_TYPE_IDS
+    #undef X
+    } ho_msg_t;
+
+    extern char const *const ho_msg_type_strs[];
+
+    typedef struct _ho_hdr {
+        unsigned magic;
+        unsigned version;
+        unsigned type;
+        //Whether an fd came with this message
+        unsigned has_fd;
+        //Bytes of data after this
+        unsigned long len;
+    } ho_hdr;
+#else
+    #define X(x) #x
+    char const *const ho_msg_type_strs[] = {
+        HO_MSG_TYPE_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+//Returns -1 if path doesn't fit
+static int ho_addr(char const *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+//So that a stuck peer can't stall the event loop for long
+static void ho_set_timeouts(int fd) {
+    struct timeval tv = {HO_IO_TIMEOUT_MS / 1000, (HO_IO_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+#endif
+
+////////////////////////////
+// Setting up the sockets //
+////////////////////////////
+
+//Listens for the next process on path (replacing whatever was there). The
+//socket is non-blocking, so it can go in an epoll set. Returns -1 and sets
+//*err on error
+int ho_listen(char const *path, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!path) {
+        *err = HO_NULL_ARG;
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    if (ho_addr(path, &addr) < 0) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+
+    //Whoever had it before is either gone or done with it
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        close(fd);
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+
+    return fd;
+}
+#else
+;
+#endif
+
+//Takes the next process's connection on a socket from ho_listen. Returns
+//-1 and sets *err on error
+int ho_accept(int listen_fd, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+    ho_set_timeouts(fd);
+    return fd;
+}
+#else
+;
+#endif
+
+//Connects to the process listening on path. If there isn't one, returns -1
+//with *err set to HO_NO_PEER, which just means we're the first
+int ho_connect(char const *path, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!path) {
+        *err = HO_NULL_ARG;
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    if (ho_addr(path, &addr) < 0) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        //A socket file with no one behind it is what a crash leaves
+        *err = (errno == ENOENT || errno == ECONNREFUSED) ? HO_NO_PEER : HO_SOCKET_ERROR;
+        close(fd);
+        return -1;
+    }
+    ho_set_timeouts(fd);
+    return fd;
+}
+#else
+;
+#endif
+
+///////////////////////////
+// Sending and receiving //
+///////////////////////////
+
+//Sends one message on sock: type, fd (or -1 for none) and len bytes of
+//data. Returns 0, or -1 and sets *err on error
+int ho_send(int sock, ho_msg_t type, int fd, void const *data, unsigned long len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (len > 0 && !data) {
+        *err = HO_NULL_ARG;
+        return -1;
+    }
+
+    ho_hdr hdr = {HO_MAGIC, HO_VERSION, type, fd >= 0, len};
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hdr)) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+
+    char const *p = (char const *) data;
+    while (len > 0) {
+        unsigned long n = len < HO_MAX_RECORD ? len : HO_MAX_RECORD;
+        if (send(sock, p, n, MSG_NOSIGNAL) != (long) n) {
+            *err = HO_SOCKET_ERROR;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+#else
+;
+#endif
+
+//Receives one message from sock. *fd gets the fd that came with it (or -1),
+//and *data gets a malloc'd copy of its data (NULL if there wasn't any),
+//which is yours to free. Returns the message type, or -1 and sets *err on
+//error (including when the other end hung up). Blocks until the whole
+//message is in, so only call it once sock is readable
+int ho_recv(int sock, int *fd, char **data, unsigned long *len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!fd || !data || !len) {
+        *err = HO_NULL_ARG;
+        return -1;
+    }
+    *fd = -1;
+    *data = NULL;
+    *len = 0;
+
+    ho_hdr hdr;
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    long n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        *err = HO_SOCKET_ERROR;
+        return -1;
+    }
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(fd, CMSG_DATA(cm), sizeof(int));
+    }
+
+    if (n != sizeof(hdr) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+        || hdr.magic != HO_MAGIC || hdr.version != HO_VERSION
+        || hdr.type > HO_DONE || hdr.has_fd != (*fd >= 0)
+    ) {
+        *err = HO_BAD_MSG;
+        goto fail;
+    }
+
+    if (hdr.len > 0) {
+        *data = (char *) malloc(hdr.len);
+        if (!*data) {
+            *err = HO_OOM;
+            goto fail;
+        }
+        unsigned long got = 0;
+        while (got < hdr.len) {
+            unsigned long want = hdr.len - got < HO_MAX_RECORD ? hdr.len - got : HO_MAX_RECORD;
+            n = recv(sock, *data + got, want, 0);
+            if (n <= 0) {
+                *err = HO_SOCKET_ERROR;
+                goto fail;
+            }
+            got += n;
+        }
+    }
+
+    *len = hdr.len;
+    return hdr.type;
+
+fail:
+    if (*fd >= 0) close(*fd);
+    *fd = -1;
+    free(*data);
+    *data = NULL;
+    return -1;
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,279 @@
+//Latency histograms in the style of HdrHistogram. Values are bucketed by
+//their highest set bit, and each of those power-of-two ranges is split into
+//2^HIST_SUB_BITS linear sub-buckets. That gives a fixed relative error
+//(under 1% with the default settings) over a huge range of values, with
+//O(1) recording and no allocation after creation.
+//
+//The units are up to you. Everything in this library records nanoseconds.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef HISTOGRAM_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define HISTOGRAM_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef HISTOGRAM_H
+        #define SHOULD_INCLUDE 1
+        #define HISTOGRAM_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "histogram.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Each power of two is split into 2^HIST_SUB_BITS buckets, so the worst
+    //case relative error is 2^-HIST_SUB_BITS
+    #define HIST_SUB_BITS 7
+    #define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+    //Values up to 2^HIST_MAX_BITS - 1 can be recorded. Bigger values are
+    //clamped (with nanoseconds, that's about 18 minutes)
+    #define HIST_MAX_BITS 40
+    #define HIST_NUM_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(HIST_OOM, "out of memory");
+MM_ERR(HIST_NULL_ARG, "NULL argument where non-NULL expected");
+
+///////////////////////
+// Histogram struct  //
+///////////////////////
+#ifndef MM_IMPLEMENT
+    typedef struct _histogram {
+        unsigned long count;
+        unsigned long min;
+        unsigned long max;
+        //Used for the mean. Could overflow if you record billions of huge
+        //values, but that's not something we do
+        unsigned long sum;
+        unsigned long buckets[HIST_NUM_BUCKETS];
+    } histogram;
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+static int hist_index(unsigned long v) {
+    if (v >= (1UL << HIST_MAX_BITS)) v = (1UL << HIST_MAX_BITS) - 1;
+
+    //Small values get one bucket each
+    if (v < HIST_SUB_COUNT) return v;
+
+    int msb = 63 - __builtin_clzl(v);
+    int shift = msb - HIST_SUB_BITS;
+    //The top bit is implied by which range we're in, so take the next
+    //HIST_SUB_BITS bits as the sub-bucket
+    int sub = (v >> shift) & (HIST_SUB_COUNT - 1);
+    return (shift + 1) * HIST_SUB_COUNT + sub;
+}
+
+//Returns the highest value that lands in bucket idx
+static unsigned long hist_bucket_value(int idx) {
+    if (idx < HIST_SUB_COUNT) return idx;
+
+    int shift = idx / HIST_SUB_COUNT - 1;
+    unsigned long sub = idx % HIST_SUB_COUNT;
+    unsigned long base = (HIST_SUB_COUNT | sub) << shift;
+    return base + (1UL << shift) - 1;
+}
+
+#endif
+
+/////////////////////////////
+// Managing histograms     //
+/////////////////////////////
+
+//Clears all recorded values. Assumes h is non-NULL
+void reset_histogram(histogram *h)
+#ifdef MM_IMPLEMENT
+{
+    memset(h, 0, sizeof(histogram));
+    h->min = ~0UL;
+}
+#else
+;
+#endif
+
+//Returns a new, empty histogram. Use del_histogram to free it. Returns NULL
+//and sets *err on error
+histogram *new_histogram(mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    histogram *ret = malloc(sizeof(histogram));
+    if (!ret) {
+        *err = HIST_OOM;
+        return NULL;
+    }
+
+    reset_histogram(ret);
+    return ret;
+}
+#else
+;
+#endif
+
+//Frees a histogram. Gracefully ignores NULL input
+void del_histogram(histogram *h)
+#ifdef MM_IMPLEMENT
+{
+    free(h);
+}
+#else
+;
+#endif
+
+//Records one value. Assumes h is non-NULL
+void hist_record(histogram *h, unsigned long v)
+#ifdef MM_IMPLEMENT
+{
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+#else
+;
+#endif
+
+//Adds everything recorded in src into dst. Assumes both are non-NULL
+void hist_merge(histogram *dst, histogram const *src)
+#ifdef MM_IMPLEMENT
+{
+    int i;
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+#else
+;
+#endif
+
+//Same as hist_record, but safe for other threads to hist_merge_shared from
+//while you record. Only one thread may record into h
+void hist_record_shared(histogram *h, unsigned long v)
+#ifdef MM_IMPLEMENT
+{
+    //Only we write, so plain loads are fine. The stores just have to be
+    //atomic so readers never see a torn value
+    #define STORE(field, x) __atomic_store_n(&h->field, (x), __ATOMIC_RELAXED)
+    int idx = hist_index(v);
+    STORE(buckets[idx], h->buckets[idx] + 1);
+    STORE(count, h->count + 1);
+    STORE(sum, h->sum + v);
+    if (v < h->min) STORE(min, v);
+    if (v > h->max) STORE(max, v);
+    #undef STORE
+}
+#else
+;
+#endif
+
+//Same as hist_merge, for a src that's being recorded into with
+//hist_record_shared. The result can be very slightly out of date (e.g. the
+//count might be one ahead of the buckets), but never torn
+void hist_merge_shared(histogram *dst, histogram const *src)
+#ifdef MM_IMPLEMENT
+{
+    #define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+    int i;
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) dst->buckets[i] += LOAD(src->buckets[i]);
+    dst->count += LOAD(src->count);
+    dst->sum += LOAD(src->sum);
+    unsigned long min = LOAD(src->min);
+    unsigned long max = LOAD(src->max);
+    if (min < dst->min) dst->min = min;
+    if (max > dst->max) dst->max = max;
+    #undef LOAD
+}
+#else
+;
+#endif
+
+//Returns the value at percentile p (between 0 and 100). The answer is the
+//top of the bucket it falls into, so it errs on the high side. Returns 0
+//for an empty histogram
+unsigned long hist_percentile(histogram const *h, double p)
+#ifdef MM_IMPLEMENT
+{
+    if (h->count == 0) return 0;
+    if (p >= 100.0) return h->max;
+
+    unsigned long target = (unsigned long) (p / 100.0 * h->count + 0.5);
+    if (target < 1) target = 1;
+
+    unsigned long seen = 0;
+    int i;
+    for (i = 0; i < HIST_NUM_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            unsigned long v = hist_bucket_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+
+    return h->max;
+}
+#else
+;
+#endif
+
+//Prints a short summary of the usual percentiles to fp. Values are divided
+//by scale before printing (e.g. 1000 to print nanoseconds as microseconds),
+//and unit is printed after them
+void hist_print(histogram const *h, FILE *fp, double scale, char const *unit)
+#ifdef MM_IMPLEMENT
+{
+    if (h->count == 0) {
+        fprintf(fp, "  (no samples)\n");
+        return;
+    }
+
+    static double const pcts[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+    int i;
+
+    fprintf(fp, "  samples  %lu\n", h->count);
+    fprintf(fp, "  min      %.1f %s\n", h->min / scale, unit);
+    fprintf(fp, "  mean     %.1f %s\n", (double) h->sum / h->count / scale, unit);
+    for (i = 0; i < (int) (sizeof(pcts) / sizeof(*pcts)); i++) {
+        fprintf(fp, "  p%-7g %.1f %s\n", pcts[i], hist_percentile(h, pcts[i]) / scale, unit);
+    }
+    fprintf(fp, "  max      %.1f %s\n", h->max / scale, unit);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -34,7 +34,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "mm_err.h"
+#include "mm_alloc.h"
+#include "metrics.h"
 
 #ifdef MM_IMPLEMENT
 #warning including http_parse.h in implement mode
@@ -63,6 +74,16 @@ MM_ERR(HTTP_INVALID_ARG, "invalid argument");
 MM_ERR(HTTP_INVALID_STATE, "http parser in invalid state (must reset!)");
 MM_ERR(HTTP_NOT_FOUND, "not found");
 MM_ERR(HTTP_OOM, "out of memory");
+MM_ERR(HTTP_BAD_PATH, "malformed percent-encoding in request path");
+MM_ERR(HTTP_REQ_LINE_TOO_LONG, "HTTP request line is longer than limits.max_req_line");
+MM_ERR(HTTP_HDR_LINE_TOO_LONG, "HTTP header line is longer than limits.max_hdr_line");
+MM_ERR(HTTP_HDRS_TOO_LARGE, "HTTP header is bigger than limits.max_hdr_bytes");
+MM_ERR(HTTP_TOO_MANY_HDRS, "request has more than HTTP_MAX_HDRS header fields");
+MM_ERR(HTTP_BODY_TOO_LARGE, "HTTP Content-Length is bigger than limits.max_body");
+MM_ERR(HTTP_SPILL_FAILED, "could not write request body to its spill file");
+MM_ERR(HTTP_UNKNOWN_EXPECT, "Expect header asks for something other than 100-continue");
+MM_ERR(HTTP_BAD_STATUS, "malformed HTTP response status line");
+MM_ERR(HTTP_BAD_CHUNK, "malformed chunked body");
 MM_ERR(HTTP_IMPOSSIBLE, "HTTP parsing code reached location Marco thought was impossible");
 
 //////////////
@@ -72,6 +93,22 @@ MM_ERR(HTTP_IMPOSSIBLE, "HTTP parsing code reached location Marco thought was im
 #define HTTP_REQ_INITIAL_SIZE 257
 #define HTTP_MAX_HDRS 32
 
+//What write_to_http_parser returns when the headers just came in and the
+//body hasn't (yet). Still means "more data needed"
+#define HTTP_BODY_PENDING 2
+
+//Defaults for http_limits. These are in the same ballpark as what nginx and
+//friends do
+#define HTTP_DEFAULT_MAX_REQ_LINE 8192
+#define HTTP_DEFAULT_MAX_HDR_LINE 8192
+#define HTTP_DEFAULT_MAX_HDR_BYTES 32768
+#define HTTP_DEFAULT_MAX_BODY (1 << 20)
+//Hard ceilings, whatever http_limits says (zero included). Offsets into an
+//http_req's buffer are ints, so the header and a body kept in memory have
+//to fit in one together
+#define HTTP_MAX_HDR_BYTES (1 << 30)
+#define HTTP_MAX_BODY (INT_MAX - HTTP_MAX_HDR_BYTES)
+
 ////////////////////////////////////////////////////////
 //enums and "sub-structs" used in main http_req struct//
 ////////////////////////////////////////////////////////
@@ -84,21 +121,71 @@ MM_ERR(HTTP_IMPOSSIBLE, "HTTP parsing code reached location Marco thought was im
 #ifndef MM_IMPLEMENT
     typedef enum _http_req_t {
     #define X(x) x
-        HTTP_REQ_TYPE_IDS
+        HTTP_REQ_TYPE_IDS,
     #undef X
+        HTTP_NUM_REQ_TYPES //Not a real method; just counts them
     } http_req_t;
     
     typedef struct _http_hdr {
-        char *name; //Always converted to lower-case
-        char *args; //Can use strtok with "," as delimiter to iterate through
+        char *name; //As the client sent it, so compare ignoring case
+        //Comma-separated values. Use http_list_next to go through them. See
+        //lazy_hdrs in http_req for what's been done to them
+        char *args;
     } http_hdr;
 
+    //A piece of the request buffer. Not NUL-terminated
+    typedef struct _http_slice {
+        char *ptr;
+        int len;
+    } http_slice;
+    
+    //See http_query_next
+    typedef struct _http_query_iter {
+        char *pos;
+        char *end;
+    } http_query_iter;
+    
+    //See http_list_next
+    typedef struct _http_list_iter {
+        char *pos;
+    } http_list_iter;
+    
+    //The most a client gets to make us buffer. All in bytes, and zero means
+    //no limit (other than HTTP_MAX_HDR_BYTES and HTTP_MAX_BODY, which always
+    //apply). Going over any of them stops the parse with its own error, so
+    //the server can pick the right status code
+    typedef struct _http_limits {
+        int max_req_line; //Request line, path and all
+        int max_hdr_line; //A single header line (folded ones count separately)
+        int max_hdr_bytes; //Request line plus all header lines
+        int max_body; //Checked against Content-Length, before reading any
+    } http_limits;
+
     typedef enum req_parse_state_t {
         HTTP_STATUS_LINE,
         HTTP_HDR,
         HTTP_PAYLOAD
     } req_parse_state_t;
     
+    typedef enum http_chunk_state_t {
+        HTTP_CHUNK_SIZE,
+        HTTP_CHUNK_EXT,
+        HTTP_CHUNK_DATA,
+        HTTP_CHUNK_DATA_END,
+        HTTP_CHUNK_TRAILER,
+        HTTP_CHUNK_TRAILER_LINE,
+        HTTP_CHUNK_DONE
+    } http_chunk_state_t;
+    
+    //See http_chunks_scan
+    typedef struct _http_chunks {
+        http_chunk_state_t state;
+        //Bytes left in the current chunk (or its size so far, while we're
+        //reading it)
+        long left;
+        int digits;
+    } http_chunks;
+    
     extern char const *const http_req_strs[];
 #else
     #define X(x) #x
@@ -115,20 +202,68 @@ MM_ERR(HTTP_IMPOSSIBLE, "HTTP parsing code reached location Marco thought was im
 #ifndef MM_IMPLEMENT
     typedef struct _http_req {
         http_req_t req_type;
+        //Percent-decoded (except for %2F, which stays as-is so it can't
+        //turn into a path separator) and with "." and ".." segments
+        //resolved. Never goes above the root
         char *path;
+        int path_len;
+        //Everything after the '?', still encoded. Empty (not NULL) if there
+        //wasn't one. Use http_query_next to go through the parameters
+        char *query;
+        int query_len;
         int num_hdrs;
         http_hdr hdrs[HTTP_MAX_HDRS];
         
         int cnx_closed;
         
+        //Set if the client sent "Expect: 100-continue", meaning it's
+        //waiting to hear from us before it sends the body
+        int expect_continue;
+        
         int payload_len;
         char *payload;
         
+        //Responses only (see http_parse_resp). How the body is framed is
+        //up to you: chunked if chunked is set, else content_length bytes
+        //if that isn't -1, else everything until the connection closes.
+        //cnx_closed (above) is set if the server won't keep the connection
+        //open afterwards
+        int status;
+        int chunked;
+        long content_length;
+        
+        //If the body was spilled (see spill_min), this is the file it's in,
+        //starting at offset 0, and payload is NULL. Otherwise it's -1. It's
+        //closed when the struct is reset or deleted, so if you want to keep
+        //it, take it and set this to -1
+        int body_fd;
+        
+        //Normally, header values have the whitespace after each comma
+        //squeezed out while parsing. Most headers are never looked at, so
+        //set this to skip that: values are then left exactly as they came
+        //in (minus leading whitespace). http_list_next works either way, and
+        //http_hdr_normalize gets you the squeezed version of one header.
+        //Stays set across requests
+        int lazy_hdrs;
+        
+        //Set to the defaults by new_http_req. Also stays set across requests
+        http_limits limits;
+        
+        //Bodies of at least spill_min bytes (0 means never) go to a file
+        //instead of memory: an O_TMPFILE in spill_dir if that's set, or a
+        //memfd if not. They still count against limits.max_body. Both stay
+        //set across requests
+        int spill_min;
+        char const *spill_dir;
+        
         //Internal fields. Don't touch!
         struct {
             //Parser state
             req_parse_state_t state;
             
+            //Where base (and this struct) came from
+            mm_allocator const *alloc;
+            
             //Saved memory
             char *base;
             //Next write location in base
@@ -141,6 +276,25 @@ MM_ERR(HTTP_IMPOSSIBLE, "HTTP parsing code reached location Marco thought was im
             //current line (for example, if we need to read() more bytes to get
             //to the end)
             int line;
+            
+            //How many bytes of the request line and headers we've been fed
+            //so far (the buffer never holds more than this)
+            int hdr_bytes;
+            
+            //Set once a complete request has been returned to the user, so
+            //the next write knows to start fresh. (We can't just look at
+            //state, since a status line can be split across several writes)
+            int done;
+            
+            //How much of a spilled body is in body_fd so far
+            int body_pos;
+            
+            //Set by http_parse_hdrs: there's no request line, and the
+            //blank line after the headers is the end, body or not
+            int hdrs_only;
+            //Set by http_parse_resp. Like hdrs_only, but the first line is
+            //a status line
+            int resp;
         } __internal;
     } http_req;
 #endif
@@ -151,16 +305,30 @@ MM_ERR(HTTP_IMPOSSIBLE, "HTTP parsing code reached location Marco thought was im
 #ifdef MM_IMPLEMENT
 
 //Expand memory inside an http_req struct. Makes sure the resulting expanded
-//block is at least min_sz bytes
+//block is at least min_sz bytes. Anything past INT_MAX gives HTTP_OOM, since
+//we couldn't point into it
 //NOTE: does not check if res is non-NULL
-static void expand_req_mem_to(http_req *res, int min_sz, mm_err *err) {
+static void expand_req_mem_to(http_req *res, size_t min_sz, mm_err *err) {
     if (*err != MM_SUCCESS) return;
     
     //Quit early if no expansion needed
     if (res->__internal.cap >= min_sz) return;
+    if (min_sz > INT_MAX) {
+        *err = HTTP_OOM;
+        return;
+    }
+    
+    //Keep doubling until we're big enough. A single large write (e.g. a
+    //full socket read) can be many times bigger than the current buffer.
+    //min_sz fits in an int, so this can't wrap, but it can overshoot
+    size_t new_cap = res->__internal.cap > 0 ? res->__internal.cap : HTTP_REQ_INITIAL_SIZE;
+    while (new_cap < min_sz) new_cap *= 2;
+    if (new_cap > INT_MAX) new_cap = min_sz;
     
     //Resize the memory buffer
-    char *new_base = realloc(res->__internal.base, res->__internal.cap * 2);
+    mm_allocator const *a = res->__internal.alloc;
+    char *new_base = a->realloc(a->ctx, res->__internal.base, res->__internal.cap, new_cap);
+    METRIC_ADD(reallocs, 1);
     if (!new_base) {
         *err = HTTP_OOM;
         return;
@@ -168,7 +336,7 @@ static void expand_req_mem_to(http_req *res, int min_sz, mm_err *err) {
     
     //Update internal bookkeeping
     res->__internal.base = new_base;
-    res->__internal.cap *= 2;
+    res->__internal.cap = new_cap;
 }
 
 #define WS_CHARS " \t"
@@ -218,6 +386,238 @@ static int scrunch_args(char *line) {
     return wr_pos;
 }
 
+//Returns the index of the first byte in s[0..len) that equals a or b, or len
+//if there isn't one. Paths are mostly clean, so this is where most of the
+//time goes; with SSE2 we check 16 bytes at a time
+static int find_either(char const *s, int len, char a, char b) {
+    int i = 0;
+#ifdef __SSE2__
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *) (s + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask) return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < len; i++) {
+        if (s[i] == a || s[i] == b) return i;
+    }
+    return len;
+}
+
+static int hex_val(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//Percent-decodes src[0..len) into dst, which can be the same as src (the
+//output is never longer). In paths, %2F is left alone and '+' is just a
+//'+'. In query strings, %2F is decoded and '+' means space. Returns the
+//decoded length, or -1 on bad encoding (including %00)
+static int pct_decode(char *dst, char const *src, int len, int is_query) {
+    int rd = 0, wr = 0;
+    char other = is_query ? '+' : '%';
+    
+    while (rd < len) {
+        //Copy the clean stretch up to the next thing we need to look at
+        int next = rd + find_either(src + rd, len - rd, '%', other);
+        if (dst + wr != src + rd) memmove(dst + wr, src + rd, next - rd);
+        wr += next - rd;
+        rd = next;
+        if (rd == len) break;
+        
+        if (src[rd] == '+') {
+            dst[wr++] = ' ';
+            rd++;
+            continue;
+        }
+        
+        if (rd + 3 > len) return -1;
+        int hi = hex_val(src[rd + 1]), lo = hex_val(src[rd + 2]);
+        if (hi < 0 || lo < 0) return -1;
+        char c = hi << 4 | lo;
+        if (c == '\0') return -1;
+        
+        if (c == '/' && !is_query) {
+            //Keep it encoded
+            dst[wr++] = src[rd++];
+            dst[wr++] = src[rd++];
+            dst[wr++] = src[rd++];
+        } else {
+            dst[wr++] = c;
+            rd += 3;
+        }
+    }
+    
+    return wr;
+}
+
+//Resolves "." and ".." segments (RFC 3986, section 5.2.4) in place. s must
+//start with a '/'. Returns the new length
+static int remove_dot_segments(char *s, int len) {
+    int rd = 0, wr = 0;
+    //Set when the last segment was "." or "..", which leaves a trailing /
+    int trailing = 0;
+    
+    while (rd < len) {
+        //s[rd] is always a '/' here
+        int end = rd + 1;
+        while (end < len && s[end] != '/') end++;
+        char const *seg = s + rd + 1;
+        int seg_len = end - rd - 1;
+        
+        if (seg_len == 1 && seg[0] == '.') {
+            trailing = 1;
+        } else if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') {
+            //Back up to the start of the last segment we kept
+            while (wr > 0 && s[--wr] != '/') continue;
+            trailing = 1;
+        } else {
+            if (wr != rd) memmove(s + wr, s + rd, end - rd);
+            wr += end - rd;
+            trailing = 0;
+        }
+        rd = end;
+    }
+    
+    if (trailing || wr == 0) s[wr++] = '/';
+    return wr;
+}
+
+//Splits off the query string, decodes the path and normalizes it. path is
+//NUL-terminated and has length len. Everything happens in place. Returns
+//the new path length (and sets *query), or negative on error
+static int process_target(char *path, int len, char **query, int *query_len, mm_err *err) {
+    int q = find_either(path, len, '?', '#');
+    if (q < len && path[q] == '?') {
+        *query = path + q + 1;
+        *query_len = len - q - 1;
+        //Clients aren't supposed to send fragments, but if they do, they
+        //don't belong in the query
+        int frag = find_either(*query, *query_len, '#', '#');
+        (*query)[frag] = '\0';
+        *query_len = frag;
+    } else {
+        *query = NULL;
+        *query_len = 0;
+    }
+    path[q] = '\0';
+    len = q;
+    
+    //Only origin-form paths get cleaned up. The others ("*", or a full URL
+    //if someone is treating us as a proxy) are left alone
+    if (len == 0 || path[0] != '/') return len;
+    
+    if (find_either(path, len, '%', '%') < len) {
+        len = pct_decode(path, path, len, 0);
+        if (len < 0) {
+            *err = HTTP_BAD_PATH;
+            return -1;
+        }
+    }
+    
+    //Only bother if there's a dot right after a slash somewhere
+    int i = 0;
+    while ((i += find_either(path + i, len - i, '.', '.')) < len) {
+        if (path[i - 1] == '/') {
+            len = remove_dot_segments(path, len);
+            break;
+        }
+        i++;
+    }
+    
+    path[len] = '\0';
+    return len;
+}
+
+//Reads a Content-Length value into res->payload_len. This is where
+//limits.max_body gets checked, so that we say no before allocating anything
+//for the body. Returns negative on error
+static int parse_content_length(http_req *res, char const *s, mm_err *err) {
+    //strtoul happily takes leading spaces, signs, and "0x", none of which
+    //are allowed here
+    if (*s < '0' || *s > '9') {
+        *err = HTTP_INVALID_CONTENT_LENGTH;
+        return -1;
+    }
+    
+    char *end;
+    errno = 0;
+    unsigned long len = strtoul(s, &end, 10);
+    end += strspn(end, WS_CHARS);
+    if (*end) {
+        *err = HTTP_INVALID_CONTENT_LENGTH;
+        return -1;
+    }
+    
+    if (errno == ERANGE || len > (unsigned long) http_body_limit(&res->limits)) {
+        *err = HTTP_BODY_TOO_LARGE;
+        return -1;
+    }
+    
+    //Sending it twice is fine, as long as it's the same both times
+    if (res->payload_len >= 0 && res->payload_len != (int) len) {
+        *err = HTTP_INVALID_CONTENT_LENGTH;
+        return -1;
+    }
+    
+    res->payload_len = len;
+    return 0;
+}
+
+//Checks an Expect value. 100-continue is the only expectation there is
+static int parse_expect(http_req *res, char const *s, mm_err *err) {
+    if (strncasecmp(s, "100-continue", 12) || s[12 + strspn(s + 12, WS_CHARS)]) {
+        *err = HTTP_UNKNOWN_EXPECT;
+        return -1;
+    }
+    res->expect_continue = 1;
+    return 0;
+}
+
+//Is token one of the items in a comma-separated header value? Tokens are
+//case-insensitive, and browsers like to send "Connection: keep-alive, Upgrade"
+static int has_token(char *args, char const *token) {
+    int len = strlen(token);
+    http_list_iter it;
+    http_slice item;
+    http_list_begin(&it, args);
+    while (http_list_next(&it, &item)) {
+        if (item.len == len && !strncasecmp(item.ptr, token, len)) return 1;
+    }
+    return 0;
+}
+
+//Does a Transfer-Encoding value have chunked in it anywhere?
+static int is_chunked(char *args) {
+    return has_token(args, "chunked");
+}
+
+//parse_content_length for responses. There's no limit, since whoever
+//reads the body decides what to do with it, and it can be bigger than an
+//int
+static int parse_resp_length(http_req *res, char const *s, mm_err *err) {
+    if (*s < '0' || *s > '9') {
+        *err = HTTP_INVALID_CONTENT_LENGTH;
+        return -1;
+    }
+    
+    char *end;
+    errno = 0;
+    long len = strtol(s, &end, 10);
+    end += strspn(end, WS_CHARS);
+    if (*end || errno == ERANGE || (res->content_length >= 0 && res->content_length != len)) {
+        *err = HTTP_INVALID_CONTENT_LENGTH;
+        return -1;
+    }
+    
+    res->content_length = len;
+    return 0;
+}
+
 //Process a single line from an HTTP request. Updates the internal write
 //position for new data. If the line is empty, returns 1, otherwise 0. 
 //Returns negative on error
@@ -238,6 +638,35 @@ static int process_line(http_req *res, mm_err *err) {
     
     switch(res->__internal.state) {
     case HTTP_STATUS_LINE: {
+        if (res->__internal.resp) {
+            //"HTTP/1.x NNN Reason". The reason is for humans, so we don't
+            //keep it
+            if (strncmp("HTTP/1.", line, 7) || (line[7] != '0' && line[7] != '1') || (line[8] != ' ' && line[8] != '\t')) {
+                *err = HTTP_BAD_STATUS;
+                return -1;
+            }
+            //HTTP/1.0 servers close unless they say otherwise, and we
+            //don't bother asking
+            res->cnx_closed = line[7] == '0';
+            line += 9;
+            skip_ws(&line);
+            if (line[0] < '1' || line[0] > '5' || line[1] < '0' || line[1] > '9' || line[2] < '0' || line[2] > '9'
+                || (line[3] != '\0' && line[3] != ' ' && line[3] != '\t')
+            ) {
+                *err = HTTP_BAD_STATUS;
+                return -1;
+            }
+            res->status = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+            
+            //Same as http_parse_hdrs, path and query are an empty string
+            //(this line's NUL, as an offset)
+            res->path = res->query = (char *) ((unsigned long) res->__internal.pos - 1);
+            res->path_len = res->query_len = 0;
+            res->__internal.line = res->__internal.pos;
+            res->__internal.state = HTTP_HDR;
+            return 0;
+        }
+        
         //Start by reading the request type
         //Not efficient, but who cares?
         int reqtype_len;
@@ -267,10 +696,18 @@ static int process_line(http_req *res, mm_err *err) {
         //when we're sure there will not be any more realloc()s.
         res->path = line - (unsigned long) res->__internal.base;
         //Find the end of this word and place a NUL byte. 
-        //WARNING WARNING WARNING this code does not convert %20 into a
-        //space character
         int path_len = strcspn(line, " \t");
         line[path_len] = '\0';
+        
+        //Split off the query and clean up the path. This never makes
+        //anything longer, so it can all happen in place
+        char *query;
+        res->path_len = process_target(line, path_len, &query, &res->query_len, err);
+        if (res->path_len < 0) return -1;
+        //No query means an empty one, which might as well be the path's NUL
+        if (!query) query = line + res->path_len;
+        res->query = query - (unsigned long) res->__internal.base;
+        
         line += path_len + 1;
         
         //Finally, make sure the protocol is one that we expect
@@ -298,7 +735,11 @@ static int process_line(http_req *res, mm_err *err) {
         //If this line is empty, we move on to reading the payload. This 
         //assumes that the caller has properly processed newlines.
         if (line[0] == '\0') {
-            if (res->payload_len < 0) {
+            if (res->__internal.hdrs_only || res->__internal.resp) {
+                res->payload_len = 0;
+                res->__internal.state = HTTP_STATUS_LINE;
+                return 1;
+            } else if (res->payload_len < 0) {
                 //This happens if no Content-Length was given. This is only
                 //a problem for POST requests
                 if (res->req_type == HTTP_POST) {
@@ -328,12 +769,19 @@ static int process_line(http_req *res, mm_err *err) {
             
             //Undo NUL at end of last arg list and replace with comma
             line[-1] = ','; //Looks pretty nasty!
-            int length = scrunch_args(line);
-            res->__internal.pos = res->__internal.line + length;
+            //Starting on the comma makes scrunch_args eat the indentation too
+            int length = res->lazy_hdrs ? line_end - line : scrunch_args(line - 1) - 1;
+            //The next line goes right after this one
+            res->__internal.line += length;
+            res->__internal.pos = res->__internal.line;
             return 0;
         }
         
         //Otherwise, do our normal header processing
+        if (res->num_hdrs == HTTP_MAX_HDRS) {
+            *err = HTTP_TOO_MANY_HDRS;
+            return -1;
+        }
         int hdr_len = strcspn(line, " \t:");
         //Mark the NUL at the end of the header string
         line[hdr_len] = '\0';
@@ -347,8 +795,8 @@ static int process_line(http_req *res, mm_err *err) {
         line += num_to_skip;
         //Also hang onto this
         char *args_str = line;
-        //Process args
-        int args_len = scrunch_args(line);
+        //Process args (unless we're being lazy)
+        int args_len = res->lazy_hdrs ? 0 : scrunch_args(line);
         
         //Update entries in http_req struct
         //This uses the same ugly hack of storing offsets instead of 
@@ -356,23 +804,32 @@ static int process_line(http_req *res, mm_err *err) {
         http_hdr *hdr = res->hdrs + res->num_hdrs++;
         hdr->name = hdr_str - (unsigned long) res->__internal.base;
         hdr->args = args_str - (unsigned long) res->__internal.base;
-        //Make sure line and pos point to one after the end
-        res->__internal.line += hdr_len + args_len + 1;
+        //Make sure line and pos point to one after the end. If the args
+        //weren't touched, that's just where the line ended
+        if (res->lazy_hdrs) res->__internal.line = line_end - res->__internal.base;
+        else res->__internal.line += hdr_len + 1 + num_to_skip + args_len;
         res->__internal.pos = res->__internal.line;
         
         //As a last step, look for headers used for parsing payload
-        if (strcmp("Content-Length", hdr_str) == 0) {
-            int rc = sscanf(args_str, "%d", &res->payload_len);
-            if (rc != 1) {
-                *err = HTTP_INVALID_CONTENT_LENGTH;
-                return -1;
+        if (res->__internal.hdrs_only) {
+            //There isn't one
+        } else if (res->__internal.resp) {
+            if (strcasecmp("Content-Length", hdr_str) == 0) {
+                if (parse_resp_length(res, args_str, err) < 0) return -1;
+            } else if (strcasecmp("Transfer-Encoding", hdr_str) == 0) {
+                res->chunked = is_chunked(args_str);
+            } else if (strcasecmp("Connection", hdr_str) == 0) {
+                if (has_token(args_str, "close")) res->cnx_closed = 1;
             }
-        } else if (strcmp("Transfer-Encoding", hdr_str) == 0) {
-            //Not super robust, but probably good enough
-            if (strcmp("chunked", args_str) == 0) {
+        } else if (strcasecmp("Content-Length", hdr_str) == 0) {
+            if (parse_content_length(res, args_str, err) < 0) return -1;
+        } else if (strcasecmp("Transfer-Encoding", hdr_str) == 0) {
+            if (is_chunked(args_str)) {
                 *err = HTTP_CHUNKED_NOT_SUPPORTED;
                 return -1;
             }
+        } else if (strcasecmp("Expect", hdr_str) == 0) {
+            if (parse_expect(res, args_str, err) < 0) return -1;
         }
         
         return 0;
@@ -380,7 +837,7 @@ static int process_line(http_req *res, mm_err *err) {
     case HTTP_PAYLOAD: {
         //This function should not have been called to process payload data
         *err = HTTP_INVALID_STATE;
-        break;
+        return -1;
     }
     
     }
@@ -396,12 +853,13 @@ static int process_line(http_req *res, mm_err *err) {
 static void final_addresses(http_req *res, mm_err *err) {
     unsigned long base = (unsigned long) res->__internal.base;
     
-    if (res->num_hdrs < 0 || res->num_hdrs >= HTTP_MAX_HDRS) {
+    if (res->num_hdrs < 0 || res->num_hdrs > HTTP_MAX_HDRS) {
         *err = HTTP_INVALID_ARG;
         return;
     }
     
     res->path += base;
+    res->query += base;
     res->payload += base;
     
     int i;
@@ -418,27 +876,36 @@ static void final_addresses(http_req *res, mm_err *err) {
 //Managing http_req_structs//
 /////////////////////////////
 
-//Returns a newly allocated (and initialized) http_req struct. Use 
-//del_http_req to properly free it. Returns NULL and sets *err on error
-http_req *new_http_req(mm_err *err) 
+//Same as new_http_req, but the struct and all of its internal memory come
+//from the allocator a (see mm_alloc.h). If a is NULL, malloc is used. The
+//allocator must outlive the struct
+http_req *new_http_req_a(mm_allocator const *a, mm_err *err) 
 #ifdef MM_IMPLEMENT
 {
     if (*err != MM_SUCCESS) return NULL;
     
-    http_req *ret = malloc(sizeof(http_req));
+    if (!a) a = &mm_malloc_alloc;
+    
+    http_req *ret = a->alloc(a->ctx, sizeof(http_req));
     if (!ret) {
         *err = HTTP_OOM;
         return NULL;
     }
     
-    ret->__internal.base = malloc(HTTP_REQ_INITIAL_SIZE);
+    ret->__internal.alloc = a;
+    ret->__internal.base = a->alloc(a->ctx, HTTP_REQ_INITIAL_SIZE);
     if (!ret->__internal.base) {
         *err = HTTP_OOM;
-        free(ret);
+        a->free(a->ctx, ret, sizeof(http_req));
         return NULL;
     }
     
     ret->__internal.cap = HTTP_REQ_INITIAL_SIZE;
+    ret->lazy_hdrs = 0;
+    http_default_limits(&ret->limits);
+    ret->spill_min = 0;
+    ret->spill_dir = NULL;
+    ret->body_fd = -1;
     
     reset_http_req(ret);
     
@@ -448,16 +915,94 @@ http_req *new_http_req(mm_err *err)
 ;
 #endif
 
+//Fills l with the HTTP_DEFAULT_* limits
+void http_default_limits(http_limits *l)
+#ifdef MM_IMPLEMENT
+{
+    l->max_req_line = HTTP_DEFAULT_MAX_REQ_LINE;
+    l->max_hdr_line = HTTP_DEFAULT_MAX_HDR_LINE;
+    l->max_hdr_bytes = HTTP_DEFAULT_MAX_HDR_BYTES;
+    l->max_body = HTTP_DEFAULT_MAX_BODY;
+}
+#else
+;
+#endif
+
+//The header bytes l actually allows: limits.max_hdr_bytes, or
+//HTTP_MAX_HDR_BYTES if that's zero or bigger
+int http_hdr_limit(http_limits const *l)
+#ifdef MM_IMPLEMENT
+{
+    return l->max_hdr_bytes > 0 && l->max_hdr_bytes < HTTP_MAX_HDR_BYTES ? l->max_hdr_bytes : HTTP_MAX_HDR_BYTES;
+}
+#else
+;
+#endif
+
+//Same for the body: limits.max_body, capped at HTTP_MAX_BODY
+int http_body_limit(http_limits const *l)
+#ifdef MM_IMPLEMENT
+{
+    return l->max_body > 0 && l->max_body < HTTP_MAX_BODY ? l->max_body : HTTP_MAX_BODY;
+}
+#else
+;
+#endif
+
+//Returns a newly allocated (and initialized) http_req struct. Use 
+//del_http_req to properly free it. Returns NULL and sets *err on error
+http_req *new_http_req(mm_err *err) 
+#ifdef MM_IMPLEMENT
+{
+    return new_http_req_a(NULL, err);
+}
+#else
+;
+#endif
+
 //Resets all state in an http_req struct (but does not free any internal
 //buffers). Assumes h is non-NULL.
 void reset_http_req(http_req *h) 
 #ifdef MM_IMPLEMENT
 {
+    if (h->body_fd >= 0) close(h->body_fd);
+    h->body_fd = -1;
     h->num_hdrs = 0;
     h->payload_len = -1;
+    h->expect_continue = 0;
+    h->cnx_closed = 0;
+    h->status = 0;
+    h->chunked = 0;
+    h->content_length = -1;
     h->__internal.state = HTTP_STATUS_LINE;
     h->__internal.pos = 0;
     h->__internal.line = 0;
+    h->__internal.hdr_bytes = 0;
+    h->__internal.done = 0;
+    h->__internal.hdrs_only = 0;
+    h->__internal.resp = 0;
+}
+#else
+;
+#endif
+
+//Makes sure h's internal buffer has room for at least sz bytes, so that
+//requests up to that size never need a realloc. Useful if you know your
+//requests are bigger than HTTP_REQ_INITIAL_SIZE
+void http_req_reserve(http_req *h, int sz, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+    
+    if (!h) {
+        *err = HTTP_NULL_ARG;
+        return;
+    } else if (sz < 0) {
+        *err = HTTP_INVALID_ARG;
+        return;
+    }
+    
+    expand_req_mem_to(h, sz, err);
 }
 #else
 ;
@@ -469,8 +1014,10 @@ void del_http_req(http_req *h)
 {
     if (h == NULL) return;
     
-    free(h->__internal.base);
-    free(h);
+    if (h->body_fd >= 0) close(h->body_fd);
+    mm_allocator const *a = h->__internal.alloc;
+    a->free(a->ctx, h->__internal.base, h->__internal.cap);
+    a->free(a->ctx, h, sizeof(http_req));
 }
 #else
 ;
@@ -480,6 +1027,202 @@ void del_http_req(http_req *h)
 //Parsing HTTP requests//
 /////////////////////////
 
+#ifdef MM_IMPLEMENT
+//Copies n bytes from src to dst, leaving out carriage returns. Returns how
+//many bytes were written
+static int copy_no_cr(char *dst, char const *src, int n) {
+    int written = 0;
+    char const *cr;
+    while ((cr = memchr(src, '\r', n)) != NULL) {
+        int before = cr - src;
+        memcpy(dst + written, src, before);
+        written += before;
+        src += before + 1;
+        n -= before + 1;
+    }
+    memcpy(dst + written, src, n);
+    return written + n;
+}
+
+//Called once the whole request (body and all) is in. rd_pos is how much of
+//the user's buffer went into it. The addresses were already fixed up when
+//the headers ended
+static int finish_req(http_req *res, int rd_pos, int len, mm_err *err) {
+    res->__internal.done = 1;
+    
+    //Finally, make sure that there are no stragglers:
+    if (rd_pos < len) {
+        *err = HTTP_STRAGGLERS;
+        return -rd_pos;
+    }
+    return 0; //Done!
+}
+
+//Opens the file a big body goes in (see spill_min). Returns -1 on error
+static int open_spill_file(http_req const *res) {
+    if (res->spill_dir) return open(res->spill_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    return memfd_create("http_body", MFD_CLOEXEC);
+}
+
+//write(), but keeps going until it's all out
+static int write_all(int fd, char const *buf, int len) {
+    while (len > 0) {
+        int n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//The real guts of write_to_http_parser (which just wraps this to keep count
+//of things when MM_METRICS is on)
+static int http_parse_chunk(http_req *res, char const *buf, int len, mm_err *err) {
+    //Sanity check inputs
+    if (res == NULL || (len > 0 && buf == NULL)) {
+        *err = HTTP_NULL_ARG;
+        return -1;
+    } else if (len <= 0) {
+        *err = HTTP_INVALID_ARG;
+        return -1;
+    }
+    
+    //Reset the struct if we're starting fresh
+    if (res->__internal.done) reset_http_req(res);
+    
+    http_limits const *lim = &res->limits;
+    unsigned *wr_pos = &res->__internal.pos; //For convenience
+    int rd_pos = 0;
+    int hdrs_done = 0; //Did the headers end in this write?
+    
+    if (res->__internal.state != HTTP_PAYLOAD) {
+        //Make sure there would be enough room for the entire buffer. Every
+        //byte we read adds at most one byte to the buffer, and we stop at
+        //max_hdr_bytes, so there's no point making room for more than that
+        //(which is what stops one big write from making us allocate a lot)
+        int room = len;
+        int max_hdr = http_hdr_limit(lim);
+        if (room > max_hdr - res->__internal.hdr_bytes) room = max_hdr - res->__internal.hdr_bytes;
+        expand_req_mem_to(res, (size_t) *wr_pos + room, err);
+        if (*err != MM_SUCCESS) return -1;
+        
+        //Copy buf into the http_req struct's internal memory a line at a
+        //time, taking care to process carriage returns and line feeds
+        //properly, while also making calls to process_line when lines are
+        //scanned in. We stop reading where max_hdr_bytes says to
+        char *req_mem = res->__internal.base; //For convenience
+        int end = rd_pos + room;
+        int max_line = res->__internal.state == HTTP_STATUS_LINE ? lim->max_req_line : lim->max_hdr_line;
+        while (rd_pos < end) {
+            char const *nl = memchr(buf + rd_pos, '\n', end - rd_pos);
+            int seg_end = nl ? nl - buf : end;
+            *wr_pos += copy_no_cr(req_mem + *wr_pos, buf + rd_pos, seg_end - rd_pos);
+            res->__internal.hdr_bytes += seg_end - rd_pos;
+            rd_pos = seg_end;
+            
+            //The copy already fit (thanks to room), so it's fine to check
+            //this after the fact
+            if (max_line > 0 && (int) *wr_pos - res->__internal.line > max_line) {
+                *err = res->__internal.state == HTTP_STATUS_LINE ? HTTP_REQ_LINE_TOO_LONG : HTTP_HDR_LINE_TOO_LONG;
+                return -1;
+            }
+            if (!nl) break;
+            
+            //Terminate the line and feed to process_line
+            rd_pos++;
+            res->__internal.hdr_bytes++;
+            req_mem[(*wr_pos)++] = '\0';
+            int rc = process_line(res, err);
+            if (rc < 0) {
+                //Error occurred
+                return rc;
+            } else if (rc == 0) {
+                //The entire line has been read, but it was not empty. After
+                //the first one, they're all header lines
+                max_line = lim->max_hdr_line;
+                continue;
+            }
+            
+            //The line was empty. This means the header is finished
+            if (res->__internal.state != HTTP_PAYLOAD) {
+                //No payload, so we can just return the filled struct
+                res->payload = (char *) ((unsigned long) *wr_pos);
+                final_addresses(res, err);
+                if (*err != MM_SUCCESS) return -1;
+                return finish_req(res, rd_pos, len, err);
+            }
+            
+            //This is our tricky hack of only storing the offset until
+            //we're completely sure no more realloc()s will happen
+            res->payload = (char *) ((unsigned long) *wr_pos);
+            
+            //Big bodies don't go in memory at all
+            if (res->spill_min > 0 && res->payload_len >= res->spill_min) {
+                res->body_fd = open_spill_file(res);
+                if (res->body_fd < 0) {
+                    *err = HTTP_SPILL_FAILED;
+                    return -1;
+                }
+                res->__internal.body_pos = 0;
+            } else {
+                //Content-Length was already checked against max_body, and
+                //HTTP_MAX_BODY leaves room for the header, so this is just
+                //to be sure before we make room for the payload
+                if ((size_t) *wr_pos + res->payload_len > INT_MAX) {
+                    *err = HTTP_BODY_TOO_LARGE;
+                    return -1;
+                }
+                expand_req_mem_to(res, (size_t) *wr_pos + res->payload_len, err);
+                if (*err != MM_SUCCESS) return -1;
+            }
+            
+            //That was the last realloc, so the headers can be used now,
+            //before the body comes in (see HTTP_BODY_PENDING)
+            final_addresses(res, err);
+            if (*err != MM_SUCCESS) return -1;
+            if (res->body_fd >= 0) res->payload = NULL;
+            hdrs_done = 1;
+            break;
+        }
+        
+        //We stopped early because there's more header than we allow
+        if (res->__internal.state != HTTP_PAYLOAD && rd_pos < len) {
+            *err = HTTP_HDRS_TOO_LARGE;
+            return -1;
+        }
+        
+        //Entire buffer was read, but we haven't even seen the whole header
+        if (res->__internal.state != HTTP_PAYLOAD) return 1;
+    }
+    
+    //Copy in as much of the payload as we have. It doesn't need any
+    //processing, so this is just a memcpy (or a write, if it's spilled)
+    if (res->body_fd >= 0) {
+        int want = res->payload_len - res->__internal.body_pos;
+        int num = len - rd_pos < want ? len - rd_pos : want;
+        if (write_all(res->body_fd, buf + rd_pos, num) < 0) {
+            *err = HTTP_SPILL_FAILED;
+            return -1;
+        }
+        res->__internal.body_pos += num;
+        rd_pos += num;
+        if (num < want) return hdrs_done ? HTTP_BODY_PENDING : 1;
+    } else {
+        int have = *wr_pos - (res->payload - res->__internal.base);
+        int want = res->payload_len - have;
+        int num = len - rd_pos < want ? len - rd_pos : want;
+        memcpy(res->__internal.base + *wr_pos, buf + rd_pos, num);
+        *wr_pos += num;
+        rd_pos += num;
+        if (num < want) return hdrs_done ? HTTP_BODY_PENDING : 1;
+    }
+    
+    res->__internal.state = HTTP_STATUS_LINE;
+    return finish_req(res, rd_pos, len, err);
+}
+#endif
+
 /* write_to_http_parser:
 
 DESCRIPTION
@@ -493,7 +1236,17 @@ RETURN VALUE
 ------------
 Returns 0 if a complete request has been seen. This indicates to the user 
 that the information in *res can now be used. Returns positive if no errors 
-have occurred, but more data is needed to parse the request. Returns 
+have occurred, but more data is needed to parse the request.
+
+EARLY HEADERS
+-------------
+On the write where a request's headers end but its body doesn't, the
+return value is HTTP_BODY_PENDING instead of 1. From then on, everything
+but the payload can be used, so you can turn a request down (bad auth, no
+room for it, whatever) before the body is sent. If expect_continue is set,
+the client is waiting for a "100 Continue" (or a final status) and won't
+send the body until it gets one. An Expect header with anything else in
+it gives HTTP_UNKNOWN_EXPECT, which should be a 417. Returns 
 negative on error, and sometimes the value has a meaning. See the 
 explanation of the HTTP_STRAGGLERS error, below.
 
@@ -503,6 +1256,24 @@ This function can return one of the HTTP request syntax errors, and will
 immediately stop everything it's doing at that point. If you want to try 
 and recover, consider using reset_http_req.
 
+LIMITS
+------
+res->limits says how much a client may send. Going over one gives
+HTTP_REQ_LINE_TOO_LONG, HTTP_HDR_LINE_TOO_LONG, HTTP_HDRS_TOO_LARGE or
+HTTP_BODY_TOO_LARGE (and more than HTTP_MAX_HDRS headers gives
+HTTP_TOO_MANY_HDRS). These are checked as the bytes come in, before the
+buffer grows to hold them, so the memory a request can take is set by
+you, not the client. A too-big body is caught from Content-Length, before
+any of it is read. A limit of zero still stops at HTTP_MAX_HDR_BYTES or
+HTTP_MAX_BODY (see http_hdr_limit and http_body_limit).
+
+SPILLED BODIES
+--------------
+If res->spill_min is set, a body at least that big is written to a file
+(res->body_fd) as it comes in, instead of being kept in memory. A write
+that fails gives HTTP_SPILL_FAILED. See http_req_spill_left if you'd rather
+move the body into the file yourself.
+
 HTTP_STRAGGLERS ERROR (AND HOW TO RECOVER FROM IT)
 --------------------------------------------------
 This function also assumes the buffer passed in using buf and len does not 
@@ -570,92 +1341,233 @@ performance, but it invalidates the prior contents of res.
 Speaking of performance, this function copies buf to an internally managed 
 buffer, and the text sanitization functions (only used on the header) are 
 about as expensive as a second copy. However, the payload is only copied 
-once.
+once (and a spilled payload isn't copied into memory at all).
 */
 int write_to_http_parser(http_req *res, char const *buf, int len, mm_err *err)
 #ifdef MM_IMPLEMENT
 {
     if (*err != MM_SUCCESS) return -1;
     
-    //Sanity check inputs
-    if (res == NULL || (len > 0 && buf == NULL)) {
+    METRIC_TIME_START(t0);
+    int rc = http_parse_chunk(res, buf, len, err);
+    METRIC_PARSE_DONE(METRICS_HTTP, len, rc, *err, *err == HTTP_STRAGGLERS, t0);
+    return rc;
+}
+#else
+;
+#endif
+
+//Same as write_to_http_parser, but for a block of header lines with no
+//request line in front, like the ones at the top of each part of a
+//multipart body. The blank line after them is the end, even if there's a
+//Content-Length; whatever follows it comes back as stragglers. req_type is
+//HTTP_GET and path and query are empty, and every header (folded, limited
+//and squeezed) works the same as in a request
+int http_parse_hdrs(http_req *req, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+    
+    if (!req) {
         *err = HTTP_NULL_ARG;
         return -1;
-    } else if (len <= 0) {
-        *err = HTTP_INVALID_ARG;
+    }
+    
+    //Starting fresh? Then pretend we already saw a request line. It gets a
+    //NUL at offset 0, so path and query (which are offsets until the end)
+    //come out as ""
+    if (req->__internal.done || (req->__internal.state == HTTP_STATUS_LINE && req->__internal.pos == 0)) {
+        reset_http_req(req);
+        req->req_type = HTTP_GET;
+        req->path = req->query = NULL;
+        req->path_len = req->query_len = 0;
+        req->__internal.base[0] = '\0';
+        req->__internal.pos = req->__internal.line = 1;
+        req->__internal.state = HTTP_HDR;
+        req->__internal.hdrs_only = 1;
+    }
+    
+    return http_parse_chunk(req, buf, len, err);
+}
+#else
+;
+#endif
+
+//Same as write_to_http_parser, but for a response (say, from a server
+//you're proxying to). The status code goes in resp->status. Like
+//http_parse_hdrs, only the header is parsed: the blank line after it is
+//the end, and the body (if any) comes back as stragglers. How long the
+//body is depends on the request too (HEAD, 1xx, 204 and 304 responses
+//never have one), so it's left to you, but resp->chunked,
+//resp->content_length and resp->cnx_closed say what the header did. See
+//http_chunks_scan for finding the end of a chunked body.
+//resp->limits.max_body doesn't apply. req_type is HTTP_GET and path and
+//query are empty
+int http_parse_resp(http_req *resp, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+    
+    if (!resp) {
+        *err = HTTP_NULL_ARG;
         return -1;
     }
     
-    //Reset the struct if we're starting fresh
-    if (res->__internal.state == HTTP_STATUS_LINE) reset_http_req(res);
+    if (resp->__internal.done || (resp->__internal.state == HTTP_STATUS_LINE && resp->__internal.pos == 0)) {
+        reset_http_req(resp);
+        resp->req_type = HTTP_GET;
+        resp->__internal.resp = 1;
+    }
     
-    //Make sure there would be enough room for the entire buffer
-    expand_req_mem_to(res, res->__internal.pos + len, err);
+    return http_parse_chunk(resp, buf, len, err);
+}
+#else
+;
+#endif
+
+//Gets c ready for a new chunked body. Assumes c is non-NULL
+void http_chunks_begin(http_chunks *c)
+#ifdef MM_IMPLEMENT
+{
+    c->state = HTTP_CHUNK_SIZE;
+    c->left = 0;
+    c->digits = 0;
+}
+#else
+;
+#endif
+
+//Follows a chunked body as it goes by, without copying or decoding it, so
+//you know where it ends (this is for passing one along as-is). Give it the
+//body's bytes in order, in pieces of any size. Returns how many of the len
+//bytes at buf are part of the body: all of them, unless the body ended
+//partway through, in which case http_chunks_done says so and the rest
+//belong to whatever comes next. Returns -1 and sets *err to HTTP_BAD_CHUNK
+//if the framing is wrong
+int http_chunks_scan(http_chunks *c, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
     if (*err != MM_SUCCESS) return -1;
     
-    //Wait... sometimes we're just copying in the payload, so we shouldn't
-    //do the header processing. And also, what if the data in the buffer
-    //inludes payload data and some data for a new header?
+    if (!c || (len > 0 && !buf)) {
+        *err = HTTP_NULL_ARG;
+        return -1;
+    }
     
-    //Copy buf into the http_req struct's internal memory, taking care to
-    //process carriage returns and line feeds properly, while also making
-    //calls to process_line when lines are scanned in
-    int rd_pos = 0;
-    char *req_mem = res->__internal.base; //For convenience
-    unsigned *wr_pos = &res->__internal.pos; //For convenience
-    while (rd_pos < len) {
-        if (buf[rd_pos] == '\r') {
-            //Skip this character
-            rd_pos++;
+    int i = 0;
+    while (i < len && c->state != HTTP_CHUNK_DONE) {
+        //The only part that's more than a byte at a time
+        if (c->state == HTTP_CHUNK_DATA) {
+            long n = len - i < c->left ? len - i : c->left;
+            i += n;
+            c->left -= n;
+            if (c->left == 0) c->state = HTTP_CHUNK_DATA_END;
             continue;
-        } else if (buf[rd_pos] == '\n') {
-            //Terminate the line and feed to process_line
-            req_mem[(*wr_pos)++] = '\0'; 
-            rd_pos++;
-            
-            int rc = process_line(res, err);
-            if (rc < 0) {
-                //Error occurred
-                return rc;
-            } else if (rc == 0) {
-                //The entire line has been read, but it was not empty
-                continue;
+        }
+        
+        char ch = buf[i++];
+        switch (c->state) {
+        case HTTP_CHUNK_SIZE: {
+            int v = hex_val(ch);
+            if (v >= 0) {
+                if (c->left > (LONG_MAX >> 4)) goto bad;
+                c->left = c->left * 16 + v;
+                c->digits++;
+                break;
             }
-            //The line was empty. This means the header is finished
-            if (res->__internal.state == HTTP_PAYLOAD) {
-                //Make sure there's enough room for the payload
-                expand_req_mem_to(res, res->__internal.pos + res->payload_len, err);
-                if (*err != MM_SUCCESS) return -1;
-                
-                //This is our tricky hack of only storing the offset until
-                //we're completely sure no more realloc()s will happen
-                res->payload = (char *) ((unsigned long)res->__internal.pos);
-                
-                //TODO: finish implementing support for reading payloads
-                *err = HTTP_NOT_IMPL;
-                return -1;
+            if (c->digits == 0) goto bad;
+            if (ch == '\n') {
+                c->state = c->left > 0 ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            } else if (ch == ';' || ch == ' ' || ch == '\t' || ch == '\r') {
+                c->state = HTTP_CHUNK_EXT;
             } else {
-                //This means there is no payload and we can just return
-                //the filled struct
-                
-                //Finalize addresses
-                final_addresses(res, err);
-                if (*err != MM_SUCCESS) return -1;
-                
-                //Finally, make sure that there are no stragglers:
-                if (rd_pos < len - 1) {
-                    *err = HTTP_STRAGGLERS;
-                    return -rd_pos;
-                }
-                return 0; //Done!
+                goto bad;
             }
-        } else {
-            req_mem[(*wr_pos)++] = buf[rd_pos++];
+            break;
+        }
+        case HTTP_CHUNK_EXT:
+            //Extensions (and anything else up to the line feed) are
+            //ignored
+            if (ch == '\n') c->state = c->left > 0 ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            break;
+        case HTTP_CHUNK_DATA_END:
+            if (ch == '\n') {
+                c->state = HTTP_CHUNK_SIZE;
+                c->digits = 0;
+            } else if (ch != '\r') {
+                goto bad;
+            }
+            break;
+        case HTTP_CHUNK_TRAILER:
+            //An empty line ends the body. Anything else is a trailer field
+            if (ch == '\n') c->state = HTTP_CHUNK_DONE;
+            else if (ch != '\r') c->state = HTTP_CHUNK_TRAILER_LINE;
+            break;
+        case HTTP_CHUNK_TRAILER_LINE:
+            if (ch == '\n') c->state = HTTP_CHUNK_TRAILER;
+            break;
+        default:
+            goto bad;
         }
     }
+    return i;
     
-    //Entire buffer was read, but a complete request has not yet been seen.
-    return 1;
+bad:
+    *err = HTTP_BAD_CHUNK;
+    return -1;
+}
+#else
+;
+#endif
+
+//Says whether http_chunks_scan has seen the end of the body. Assumes c is
+//non-NULL
+int http_chunks_done(http_chunks const *c)
+#ifdef MM_IMPLEMENT
+{
+    return c->state == HTTP_CHUNK_DONE;
+}
+#else
+;
+#endif
+
+//How many more bytes of body req is waiting for that go straight to
+//body_fd. These can be put there without going through
+//write_to_http_parser (e.g. spliced in from a socket), as long as you then
+//call http_req_spliced. Returns 0 if req isn't in the middle of a spilled
+//body. Assumes req is non-NULL
+int http_req_spill_left(http_req const *req)
+#ifdef MM_IMPLEMENT
+{
+    if (req->__internal.done || req->__internal.state != HTTP_PAYLOAD || req->body_fd < 0) return 0;
+    return req->payload_len - req->__internal.body_pos;
+}
+#else
+;
+#endif
+
+//Tells req that you wrote n more bytes of its body to body_fd yourself (at
+//the fd's current offset). Returns the same as write_to_http_parser would
+//have: 0 if the request is now complete, or 1 if there's more to come
+int http_req_spliced(http_req *req, int n, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+    
+    if (!req) {
+        *err = HTTP_NULL_ARG;
+        return -1;
+    }
+    if (n < 0 || n > http_req_spill_left(req)) {
+        *err = HTTP_INVALID_ARG;
+        return -1;
+    }
+    
+    req->__internal.body_pos += n;
+    if (req->__internal.body_pos < req->payload_len) return 1;
+    
+    req->__internal.state = HTTP_STATUS_LINE;
+    return finish_req(req, 0, 0, err);
 }
 #else
 ;
@@ -676,16 +1588,16 @@ char *get_args(http_req const* req, char const *hdr_name, mm_err *err)
         *err = HTTP_NULL_ARG;
         return NULL;
     }
-    if (req->num_hdrs < 0 || req->num_hdrs >= HTTP_MAX_HDRS) {
+    if (req->num_hdrs < 0 || req->num_hdrs > HTTP_MAX_HDRS) {
         *err = HTTP_INVALID_ARG;
         return NULL;
     }
     
-    //Just do a dumb linear search
+    //Just do a dumb linear search. Header names are case-insensitive
     char *found = NULL;
     int i;
     for (i = 0; i < req->num_hdrs; i++) {
-        if (strcmp(req->hdrs[i].name, hdr_name) == 0) {
+        if (strcasecmp(req->hdrs[i].name, hdr_name) == 0) {
             found = req->hdrs[i].args;
             break;
         }
@@ -699,6 +1611,173 @@ char *get_args(http_req const* req, char const *hdr_name, mm_err *err)
 ;
 #endif
 
+/* Query strings:
+
+Parameters are only picked apart when you ask for them, and nothing is
+copied or decoded unless you say so. A typical loop:
+
+    http_query_iter it;
+    http_slice key, val;
+    http_query_begin(&it, req);
+    while (http_query_next(&it, &key, &val)) {
+        //key and val are still percent-encoded. Decode in place with
+        //http_slice_decode if you need to
+    }
+
+Empty parameters (e.g. "a=1&&b=2") are skipped. A parameter with no '='
+gets an empty value.
+*/
+
+//Starts iterating over req's query parameters. Assumes both are non-NULL
+void http_query_begin(http_query_iter *it, http_req const *req)
+#ifdef MM_IMPLEMENT
+{
+    it->pos = req->query;
+    it->end = req->query + req->query_len;
+}
+#else
+;
+#endif
+
+//Gets the next parameter. Returns 1 if there was one, and 0 at the end
+int http_query_next(http_query_iter *it, http_slice *key, http_slice *val)
+#ifdef MM_IMPLEMENT
+{
+    while (it->pos < it->end) {
+        char *start = it->pos;
+        char *amp = memchr(start, '&', it->end - start);
+        char *stop = amp ? amp : it->end;
+        it->pos = amp ? amp + 1 : it->end;
+        if (stop == start) continue;
+        
+        char *eq = memchr(start, '=', stop - start);
+        key->ptr = start;
+        key->len = (eq ? eq : stop) - start;
+        val->ptr = eq ? eq + 1 : stop;
+        val->len = stop - val->ptr;
+        return 1;
+    }
+    
+    return 0;
+}
+#else
+;
+#endif
+
+//Finds the first parameter whose (encoded) key is exactly key. Returns 1
+//and fills *val if found, otherwise 0
+int http_query_get(http_req const *req, char const *key, http_slice *val)
+#ifdef MM_IMPLEMENT
+{
+    int key_len = strlen(key);
+    http_query_iter it;
+    http_slice k;
+    http_query_begin(&it, req);
+    while (http_query_next(&it, &k, val)) {
+        if (k.len == key_len && !memcmp(k.ptr, key, key_len)) return 1;
+    }
+    return 0;
+}
+#else
+;
+#endif
+
+//Percent-decodes a query key or value in place ('+' becomes a space), and
+//updates s->len. Decoding the same slice twice is a bad idea. Returns the
+//new length, or negative (and sets *err to HTTP_BAD_PATH) on bad encoding
+int http_slice_decode(http_slice *s, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+    
+    if (!s) {
+        *err = HTTP_NULL_ARG;
+        return -1;
+    }
+    
+    int len = pct_decode(s->ptr, s->ptr, s->len, 1);
+    if (len < 0) {
+        *err = HTTP_BAD_PATH;
+        return -1;
+    }
+    
+    s->len = len;
+    return len;
+}
+#else
+;
+#endif
+
+/* Header value lists:
+
+Lots of headers are comma-separated lists. These go through one without
+changing it (unlike strtok), and work the same whether or not lazy_hdrs is
+set:
+
+    http_list_iter it;
+    http_slice item;
+    http_list_begin(&it, hdr->args);
+    while (http_list_next(&it, &item)) {
+        //item has no whitespace around it, and isn't NUL-terminated
+    }
+
+Empty items (e.g. "a, ,b") are skipped. Commas inside double quotes don't
+split items, so an ETag list like "\"a,b\", \"c\"" gives two items.
+*/
+
+//Starts iterating over the comma-separated list in args
+void http_list_begin(http_list_iter *it, char *args)
+#ifdef MM_IMPLEMENT
+{
+    it->pos = args;
+}
+#else
+;
+#endif
+
+//Gets the next item in the list. Returns 1 if there was one, or 0 at the
+//end
+int http_list_next(http_list_iter *it, http_slice *item)
+#ifdef MM_IMPLEMENT
+{
+    char *p = it->pos;
+    
+    //Skip separators (and so empty items) and leading whitespace
+    p += strspn(p, ", \t");
+    if (!*p) {
+        it->pos = p;
+        return 0;
+    }
+    
+    char *start = p;
+    char *last = p; //Last non-whitespace character
+    int quoted = 0;
+    for (; *p && (quoted || *p != ','); p++) {
+        if (*p == '"') quoted = !quoted;
+        else if (*p == '\\' && quoted && p[1]) p++;
+        if (*p != ' ' && *p != '\t') last = p;
+    }
+    
+    it->pos = p;
+    item->ptr = start;
+    item->len = last - start + 1;
+    return 1;
+}
+#else
+;
+#endif
+
+//Squeezes the whitespace after commas out of a header's value in place,
+//the same way the parser does when lazy_hdrs isn't set. Harmless if it
+//already was
+void http_hdr_normalize(http_hdr *h)
+#ifdef MM_IMPLEMENT
+{
+    scrunch_args(h->args);
+}
+#else
+;
+#endif
 
 #else
     #undef SHOULD_INCLUDE
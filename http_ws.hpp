@@ -0,0 +1,355 @@
+//C++20 layer over http_parse.h and websock.h. Header-only: include this
+//from C++ code and link against implement.c like any other user of the
+//library.
+//
+//What you get over the C API:
+//
+//  - Parse results and fields come back as std::string_view/std::span
+//    pointing into the parser's buffer (so they're only good until the next
+//    feed, same as the C pointers)
+//  - Limits are template parameters (see http_limits/ws_limits). Checks for
+//    limits you leave at their defaults compile away completely
+//  - Parsers can get their memory from a std::pmr::memory_resource, or from
+//    any mm_allocator (slab, arena, ...)
+//  - Parsers are move-only RAII objects. Nothing in here copies request data
+//
+//Errors are still mm_err values (so you can compare them against the C
+//error codes), returned in the parse_result instead of through an out-param.
+//The only thing that throws is running out of memory while constructing a
+//parser (std::bad_alloc).
+//
+//The C functions still live in implement.c, so for them to inline into
+//your C++ code you need to build with -flto (see "make cxx").
+
+#ifndef HTTP_WS_HPP
+#define HTTP_WS_HPP 1
+
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <string_view>
+#include <strings.h>
+#include <utility>
+
+extern "C" {
+#include "mm_err.h"
+#include "mm_alloc.h"
+#include "http_parse.h"
+#include "websock.h"
+}
+
+namespace mm {
+
+/////////////////
+// Error codes //
+/////////////////
+
+//Same deal as MM_ERR: compare by pointer
+inline constexpr mm_err TOO_MANY_HDRS = "request has more headers than the limits allow";
+inline constexpr mm_err METHOD_NOT_ALLOWED = "request method not enabled in the limits";
+inline constexpr mm_err INPUT_TOO_BIG = "input too big for a single feed";
+
+////////////
+// Limits //
+////////////
+
+constexpr unsigned method_bit(http_req_t m) { return 1u << m; }
+
+inline constexpr unsigned all_methods = (1u << HTTP_NUM_REQ_TYPES) - 1;
+
+//MaxHdrs can only go down from HTTP_MAX_HDRS (that's the size of the array
+//in http_req). Methods is an OR of method_bit()s
+template <int MaxHdrs = HTTP_MAX_HDRS, std::size_t InitialSize = HTTP_REQ_INITIAL_SIZE, unsigned Methods = all_methods>
+struct http_limits {
+    static_assert(MaxHdrs > 0 && MaxHdrs <= HTTP_MAX_HDRS, "MaxHdrs must be in 1..HTTP_MAX_HDRS");
+    static_assert(InitialSize > 0 && InitialSize <= INT_MAX, "bad InitialSize");
+    static_assert(Methods != 0 && (Methods & ~all_methods) == 0, "Methods must be an OR of method_bit()s");
+
+    static constexpr int max_hdrs = MaxHdrs;
+    static constexpr std::size_t initial_size = InitialSize;
+    static constexpr unsigned methods = Methods;
+};
+
+template <std::size_t InitialSize = WEBSOCK_INITIAL_SIZE>
+struct ws_limits {
+    static_assert(InitialSize > 0 && InitialSize <= INT_MAX, "bad InitialSize");
+
+    static constexpr std::size_t initial_size = InitialSize;
+};
+
+///////////////////
+// Parse results //
+///////////////////
+
+enum class parse_status {
+    need_more,
+    done,
+    error
+};
+
+struct parse_result {
+    parse_status status;
+    //How much of the input was used. Less than you gave it if the input
+    //also had the start of the next request/frame (the stragglers); feed
+    //the rest back in once you're done with this one
+    std::size_t used;
+    //MM_SUCCESS unless status is parse_status::error
+    mm_err err;
+
+    bool done() const { return status == parse_status::done; }
+    explicit operator bool() const { return status != parse_status::error; }
+};
+
+////////////////////////////
+// Allocator plumbing     //
+////////////////////////////
+
+namespace detail {
+
+//mm_allocator whose ctx is a std::pmr::memory_resource. These are called
+//from C, so exceptions get turned back into NULLs
+inline void *pmr_alloc(void *ctx, unsigned long sz) {
+    try {
+        return static_cast<std::pmr::memory_resource *>(ctx)->allocate(sz, alignof(std::max_align_t));
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+inline void pmr_free(void *ctx, void *p, unsigned long sz) {
+    if (p) static_cast<std::pmr::memory_resource *>(ctx)->deallocate(p, sz, alignof(std::max_align_t));
+}
+
+inline void *pmr_realloc(void *ctx, void *p, unsigned long old_sz, unsigned long new_sz) {
+    void *ret = pmr_alloc(ctx, new_sz);
+    if (!ret) return nullptr;
+    if (p) {
+        std::memcpy(ret, p, old_sz < new_sz ? old_sz : new_sz);
+        pmr_free(ctx, p, old_sz);
+    }
+    return ret;
+}
+
+//The C structs keep a pointer to their allocator, so it has to stay put
+//even when the wrapper moves. For pmr, we put the adapter in memory from the
+//resource itself
+struct alloc_handle {
+    mm_allocator const *a = &mm_malloc_alloc;
+    std::pmr::memory_resource *owner = nullptr;
+
+    alloc_handle() = default;
+
+    explicit alloc_handle(mm_allocator const *c_alloc) : a(c_alloc ? c_alloc : &mm_malloc_alloc) {}
+
+    explicit alloc_handle(std::pmr::memory_resource *mr) : owner(mr) {
+        void *mem = mr->allocate(sizeof(mm_allocator), alignof(mm_allocator));
+        a = new (mem) mm_allocator{pmr_alloc, pmr_realloc, pmr_free, mr};
+    }
+
+    alloc_handle(alloc_handle &&o) noexcept
+        : a(std::exchange(o.a, &mm_malloc_alloc)), owner(std::exchange(o.owner, nullptr)) {}
+
+    alloc_handle &operator=(alloc_handle &&o) noexcept {
+        std::swap(a, o.a);
+        std::swap(owner, o.owner);
+        return *this;
+    }
+
+    alloc_handle(alloc_handle const &) = delete;
+    alloc_handle &operator=(alloc_handle const &) = delete;
+
+    ~alloc_handle() {
+        if (owner) owner->deallocate(const_cast<mm_allocator *>(a), sizeof(mm_allocator), alignof(mm_allocator));
+    }
+};
+
+//Common handling of write_to_*_parser's return conventions
+inline parse_result to_result(int rc, std::size_t len, mm_err err, mm_err stragglers) {
+    if (rc < 0 && err == stragglers) return {parse_status::done, static_cast<std::size_t>(-rc), MM_SUCCESS};
+    if (rc < 0) return {parse_status::error, 0, err};
+    if (rc > 0) return {parse_status::need_more, len, MM_SUCCESS};
+    return {parse_status::done, len, MM_SUCCESS};
+}
+
+} //namespace detail
+
+//////////////////
+// HTTP request //
+//////////////////
+
+struct header {
+    std::string_view name; //As the client sent it
+    std::string_view args;
+};
+
+template <class Limits = http_limits<>>
+class http_request {
+public:
+    http_request() : http_request(detail::alloc_handle{}) {}
+    explicit http_request(mm_allocator const *a) : http_request(detail::alloc_handle{a}) {}
+    explicit http_request(std::pmr::memory_resource *mr) : http_request(detail::alloc_handle{mr}) {}
+
+    http_request(http_request &&o) noexcept : alloc_(std::move(o.alloc_)), req_(std::exchange(o.req_, nullptr)) {}
+
+    http_request &operator=(http_request &&o) noexcept {
+        //Swap, so o's destructor cleans up our old request (with the old
+        //allocator, which goes with it)
+        std::swap(alloc_, o.alloc_);
+        std::swap(req_, o.req_);
+        return *this;
+    }
+
+    http_request(http_request const &) = delete;
+    http_request &operator=(http_request const &) = delete;
+
+    ~http_request() { del_http_req(req_); }
+
+    //Same semantics as write_to_http_parser: keep feeding until the result
+    //is done (or an error). Feeding after done starts a new request
+    parse_result feed(std::string_view in) noexcept {
+        if (in.empty()) return {parse_status::need_more, 0, MM_SUCCESS};
+        if (in.size() > INT_MAX) return {parse_status::error, 0, INPUT_TOO_BIG};
+
+        mm_err err = MM_SUCCESS;
+        int rc = write_to_http_parser(req_, in.data(), static_cast<int>(in.size()), &err);
+        parse_result ret = detail::to_result(rc, in.size(), err, HTTP_STRAGGLERS);
+        if (!ret.done()) return ret;
+
+        if constexpr (Limits::methods != all_methods) {
+            if (!(Limits::methods & method_bit(req_->req_type))) return {parse_status::error, 0, METHOD_NOT_ALLOWED};
+        }
+        if constexpr (Limits::max_hdrs < HTTP_MAX_HDRS) {
+            if (req_->num_hdrs > Limits::max_hdrs) return {parse_status::error, 0, TOO_MANY_HDRS};
+        }
+
+        return ret;
+    }
+
+    parse_result feed(std::span<char const> in) noexcept {
+        return feed(std::string_view{in.data(), in.size()});
+    }
+
+    //Everything below is only meaningful once feed() has said done
+
+    http_req_t method() const { return req_->req_type; }
+    std::string_view method_name() const { return http_req_strs[req_->req_type]; }
+    //Decoded and normalized (see http_req)
+    std::string_view path() const { return {req_->path, static_cast<std::size_t>(req_->path_len)}; }
+    //Still encoded. Use http_query_next on raw() to pick it apart
+    std::string_view query() const { return {req_->query, static_cast<std::size_t>(req_->query_len)}; }
+    bool cnx_closed() const { return req_->cnx_closed; }
+
+    auto headers() const {
+        return std::span<http_hdr const>{req_->hdrs, static_cast<std::size_t>(req_->num_hdrs)}
+             | std::views::transform([](http_hdr const &h) { return header{h.name, h.args}; });
+    }
+
+    //Looks up a header by name (case-insensitive)
+    std::optional<std::string_view> header_args(std::string_view name) const {
+        for (int i = 0; i < req_->num_hdrs; i++) {
+            char const *h = req_->hdrs[i].name;
+            if (std::strlen(h) == name.size() && !strncasecmp(h, name.data(), name.size())) {
+                return std::string_view{req_->hdrs[i].args};
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::span<char const> payload() const {
+        if (req_->payload_len <= 0) return {};
+        return {req_->payload, static_cast<std::size_t>(req_->payload_len)};
+    }
+
+    //For passing to the rest of the C API
+    http_req *raw() { return req_; }
+    http_req const *raw() const { return req_; }
+
+private:
+    explicit http_request(detail::alloc_handle &&h) : alloc_(std::move(h)) {
+        mm_err err = MM_SUCCESS;
+        req_ = new_http_req_a(alloc_.a, &err);
+        if constexpr (Limits::initial_size > HTTP_REQ_INITIAL_SIZE) {
+            http_req_reserve(req_, static_cast<int>(Limits::initial_size), &err);
+        }
+        if (err != MM_SUCCESS) {
+            del_http_req(req_);
+            throw std::bad_alloc{};
+        }
+    }
+
+    detail::alloc_handle alloc_;
+    http_req *req_ = nullptr;
+};
+
+/////////////////////
+// Websocket frame //
+/////////////////////
+
+template <class Limits = ws_limits<>>
+class websock_frame {
+public:
+    websock_frame() : websock_frame(detail::alloc_handle{}) {}
+    explicit websock_frame(mm_allocator const *a) : websock_frame(detail::alloc_handle{a}) {}
+    explicit websock_frame(std::pmr::memory_resource *mr) : websock_frame(detail::alloc_handle{mr}) {}
+
+    websock_frame(websock_frame &&o) noexcept : alloc_(std::move(o.alloc_)), pkt_(std::exchange(o.pkt_, nullptr)) {}
+
+    websock_frame &operator=(websock_frame &&o) noexcept {
+        std::swap(alloc_, o.alloc_);
+        std::swap(pkt_, o.pkt_);
+        return *this;
+    }
+
+    websock_frame(websock_frame const &) = delete;
+    websock_frame &operator=(websock_frame const &) = delete;
+
+    ~websock_frame() { del_websock_pkt(pkt_); }
+
+    //Same semantics as http_request::feed
+    parse_result feed(std::span<char const> in) noexcept {
+        if (in.empty()) return {parse_status::need_more, 0, MM_SUCCESS};
+        if (in.size() > INT_MAX) return {parse_status::error, 0, INPUT_TOO_BIG};
+
+        mm_err err = MM_SUCCESS;
+        int rc = write_to_websock_parser(pkt_, in.data(), static_cast<int>(in.size()), &err);
+        return detail::to_result(rc, in.size(), err, WEBSOCK_STRAGGLERS);
+    }
+
+    parse_result feed(std::string_view in) noexcept {
+        return feed(std::span<char const>{in.data(), in.size()});
+    }
+
+    websock_pkt_type_t type() const { return pkt_->type; }
+    bool fin() const { return pkt_->fin; }
+    std::span<char const> payload() const { return {pkt_->payload, pkt_->payload_len}; }
+    //Same bytes as payload(), for text frames
+    std::string_view text() const { return {pkt_->payload, pkt_->payload_len}; }
+
+    websock_pkt *raw() { return pkt_; }
+    websock_pkt const *raw() const { return pkt_; }
+
+private:
+    explicit websock_frame(detail::alloc_handle &&h) : alloc_(std::move(h)) {
+        mm_err err = MM_SUCCESS;
+        pkt_ = new_websock_pkt_a(alloc_.a, &err);
+        if constexpr (Limits::initial_size > WEBSOCK_INITIAL_SIZE) {
+            websock_pkt_reserve(pkt_, static_cast<int>(Limits::initial_size), &err);
+        }
+        if (err != MM_SUCCESS) {
+            del_websock_pkt(pkt_);
+            throw std::bad_alloc{};
+        }
+    }
+
+    detail::alloc_handle alloc_;
+    websock_pkt *pkt_ = nullptr;
+};
+
+} //namespace mm
+
+#endif
@@ -1,4 +1,21 @@
 #define MM_IMPLEMENT
 #include "mm_err.h"
+#include "mm_alloc.h"
+#include "metrics.h"
 #include "http_parse.h"
+#include "h2.h"
 #include "websock.h"
+#include "multipart.h"
+#include "router.h"
+#include "encoding.h"
+#include "cache.h"
+#include "histogram.h"
+#include "trace.h"
+#include "timer_wheel.h"
+#include "write_queue.h"
+#include "tls.h"
+#include "capture.h"
+#include "ratelimit.h"
+#include "handoff.h"
+#include "mpsc.h"
+#include "server.h"
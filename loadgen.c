@@ -0,0 +1,528 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "mm_err.h"
+#include "websock.h"
+#include "histogram.h"
+
+//Open-loop load generator. Opens a bunch of connections to a server (over
+//loopback, normally) and fires HTTP requests or websocket messages at a
+//fixed overall rate, whether or not the earlier ones have been answered.
+//Latency is measured from when each request was *supposed* to go out, so a
+//server that stalls can't hide the stall by also stalling the load
+//generator (a.k.a. coordinated omission).
+//
+//Usage:
+//  loadgen [-h host] [-p port] [-m http|ws] [-c conns] [-r rate] [-d secs]
+//          [-s ws_payload_size] [-f request_file]...
+//
+//In http mode, each -f file is sent as-is as one request (round-robin over
+//the files); the default is tests/getroot.txt. In ws mode, every connection
+//does a websocket handshake first, then sends masked binary frames, and the
+//server is expected to echo them back.
+//
+//The last line of output is a single RESULT line that is easy to grep out
+//when using this as a regression benchmark.
+
+#define MAX_FILES 16
+#define READ_SIZE 65536
+#define DRAIN_NS 2000000000UL
+
+#define WS_HANDSHAKE \
+    "GET /loadgen HTTP/1.1\r\n"\
+    "Host: localhost\r\n"\
+    "Upgrade: websocket\r\n"\
+    "Connection: Upgrade\r\n"\
+    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"\
+    "Sec-WebSocket-Version: 13\r\n"\
+    "\r\n"
+
+typedef enum {
+    LG_HANDSHAKE,
+    LG_READY,
+    LG_DEAD
+} lg_state_t;
+
+typedef struct _lg_buf {
+    char *data;
+    int len;
+    int cap;
+} lg_buf;
+
+typedef struct _lg_conn {
+    int fd;
+    lg_state_t state;
+
+    //Intended send times of requests that haven't been answered yet. The
+    //server answers in order, so this is just a FIFO
+    unsigned long *pending;
+    int head;
+    int num;
+    int cap;
+
+    lg_buf in;
+    lg_buf out;
+    int want_out;
+} lg_conn;
+
+static struct {
+    char const *host;
+    char const *port;
+    int ws;
+    int conns;
+    double rate;
+    double secs;
+    int ws_size;
+    char *files[MAX_FILES];
+    int file_lens[MAX_FILES];
+    int num_files;
+} cfg = {
+    .host = "127.0.0.1",
+    .port = "2345",
+    .ws = 0,
+    .conns = 16,
+    .rate = 10000,
+    .secs = 5,
+    .ws_size = 32
+};
+
+static struct {
+    unsigned long sent;
+    unsigned long completed;
+    unsigned long errors;
+} stats;
+
+static histogram *hist;
+static int epfd;
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void buf_append(lg_buf *b, char const *data, int len) {
+    if (b->len + len > b->cap) {
+        int new_cap = b->cap ? b->cap : 4096;
+        while (new_cap < b->len + len) new_cap *= 2;
+        b->data = realloc(b->data, new_cap);
+        if (!b->data) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        b->cap = new_cap;
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void buf_consume(lg_buf *b, int len) {
+    memmove(b->data, b->data + len, b->len - len);
+    b->len -= len;
+}
+
+static char *read_file(char const *path, int *len) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    long sz = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *ret = malloc(sz);
+    if (ret && fread(ret, 1, sz, fp) != (size_t) sz) {
+        free(ret);
+        ret = NULL;
+    }
+    fclose(fp);
+
+    *len = sz;
+    return ret;
+}
+
+static void set_events(lg_conn *c) {
+    int want = c->out.len > 0;
+    if (want == c->want_out) return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->want_out = want;
+}
+
+static void kill_conn(lg_conn *c) {
+    if (c->state == LG_DEAD) return;
+    c->state = LG_DEAD;
+    stats.errors++;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+}
+
+static void flush_out(lg_conn *c) {
+    while (c->out.len > 0) {
+        int rc = send(c->fd, c->out.data, c->out.len, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) kill_conn(c);
+            break;
+        }
+        buf_consume(&c->out, rc);
+    }
+    if (c->state != LG_DEAD) set_events(c);
+}
+
+static void push_pending(lg_conn *c, unsigned long t) {
+    if (c->num == c->cap) {
+        int new_cap = c->cap ? c->cap * 2 : 64;
+        unsigned long *p = malloc(new_cap * sizeof(unsigned long));
+        int i;
+        for (i = 0; i < c->num; i++) p[i] = c->pending[(c->head + i) % c->cap];
+        free(c->pending);
+        c->pending = p;
+        c->head = 0;
+        c->cap = new_cap;
+    }
+    c->pending[(c->head + c->num++) % c->cap] = t;
+}
+
+static void complete_one(lg_conn *c) {
+    if (c->num == 0) {
+        //Answer to something we never asked
+        stats.errors++;
+        return;
+    }
+    unsigned long intended = c->pending[c->head];
+    c->head = (c->head + 1) % c->cap;
+    c->num--;
+
+    hist_record(hist, now_ns() - intended);
+    stats.completed++;
+}
+
+static void send_one(lg_conn *c, unsigned long intended, unsigned long k) {
+    if (c->state != LG_READY) return;
+
+    if (cfg.ws) {
+        mm_err err = MM_SUCCESS;
+        char hdr[WEBSOCK_MAX_HDR_SIZE];
+        char mask[4];
+        unsigned r = rand();
+        memcpy(mask, &r, 4);
+
+        int hdr_len = construct_websock_client_hdr(hdr, WEBSOCK_BIN, 1, cfg.ws_size, mask, &err);
+        buf_append(&c->out, hdr, hdr_len);
+
+        //Payload is just a counter pattern; the server doesn't care
+        int start = c->out.len;
+        int i;
+        for (i = 0; i < cfg.ws_size; i++) {
+            char ch = 'a' + (k + i) % 26;
+            buf_append(&c->out, &ch, 1);
+        }
+        websock_mask(c->out.data + start, c->out.data + start, cfg.ws_size, mask, 0);
+    } else {
+        int f = k % cfg.num_files;
+        buf_append(&c->out, cfg.files[f], cfg.file_lens[f]);
+    }
+
+    push_pending(c, intended);
+    stats.sent++;
+    flush_out(c);
+}
+
+//Picks complete responses out of the input buffer. Returns nonzero if the
+//connection should be killed
+static int parse_http_responses(lg_conn *c) {
+    while (c->in.len > 0) {
+        char *end = memmem(c->in.data, c->in.len, "\r\n\r\n", 4);
+        if (!end) return 0;
+        int hdr_len = end + 4 - c->in.data;
+
+        if (strncmp(c->in.data, "HTTP/1.", 7)) return 1;
+
+        //Find Content-Length (case-insensitively, since servers differ)
+        long body_len = 0;
+        char *p = c->in.data;
+        while (p < end) {
+            char *eol = memmem(p, end + 2 - p, "\r\n", 2);
+            if (!eol) break;
+            if (eol - p > 15 && strncasecmp(p, "Content-Length:", 15) == 0) {
+                body_len = strtol(p + 15, NULL, 10);
+            }
+            p = eol + 2;
+        }
+
+        if (c->in.len < hdr_len + body_len) return 0;
+
+        buf_consume(&c->in, hdr_len + body_len);
+        complete_one(c);
+    }
+    return 0;
+}
+
+static int parse_ws_frames(lg_conn *c) {
+    if (c->state == LG_HANDSHAKE) {
+        char *end = memmem(c->in.data, c->in.len, "\r\n\r\n", 4);
+        if (!end) return 0;
+        if (strncmp(c->in.data, "HTTP/1.1 101", 12)) return 1;
+        buf_consume(&c->in, end + 4 - c->in.data);
+        c->state = LG_READY;
+    }
+
+    while (c->in.len >= 2) {
+        unsigned char const *p = (unsigned char const *) c->in.data;
+        int opcode = p[0] & 0xF;
+        unsigned long len = p[1] & 0x7F;
+        int hdr_len = 2;
+
+        if (len == 126) {
+            if (c->in.len < 4) return 0;
+            len = (p[2] << 8) | p[3];
+            hdr_len = 4;
+        } else if (len == 127) {
+            if (c->in.len < 10) return 0;
+            len = 0;
+            int i;
+            for (i = 0; i < 8; i++) len = (len << 8) | p[2 + i];
+            hdr_len = 10;
+        }
+
+        if (c->in.len < hdr_len + len) return 0;
+
+        if (opcode == WEBSOCK_CLOSE) return 1;
+        if (opcode == WEBSOCK_PING) {
+            //Keep the server happy. Pongs have to be masked like anything
+            //else we send
+            mm_err err = MM_SUCCESS;
+            char hdr[WEBSOCK_MAX_HDR_SIZE];
+            char mask[4] = {0, 0, 0, 0};
+            int n = construct_websock_client_hdr(hdr, WEBSOCK_PONG, 1, len, mask, &err);
+            buf_append(&c->out, hdr, n);
+            buf_append(&c->out, c->in.data + hdr_len, len);
+            flush_out(c);
+        } else if (opcode != WEBSOCK_PONG) {
+            complete_one(c);
+        }
+
+        buf_consume(&c->in, hdr_len + len);
+    }
+    return 0;
+}
+
+static void handle_readable(lg_conn *c) {
+    char buf[READ_SIZE];
+
+    while (c->state != LG_DEAD) {
+        int rc = read(c->fd, buf, sizeof(buf));
+        if (rc == 0) {
+            kill_conn(c);
+            return;
+        } else if (rc < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) kill_conn(c);
+            return;
+        }
+
+        buf_append(&c->in, buf, rc);
+        int bad = cfg.ws ? parse_ws_frames(c) : parse_http_responses(c);
+        if (bad) {
+            kill_conn(c);
+            return;
+        }
+    }
+}
+
+static int open_conn(lg_conn *c) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res;
+    if (getaddrinfo(cfg.host, cfg.port, &hints, &res) != 0) return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    memset(c, 0, sizeof(lg_conn));
+    c->fd = fd;
+    c->state = cfg.ws ? LG_HANDSHAKE : LG_READY;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+
+    if (cfg.ws) {
+        buf_append(&c->out, WS_HANDSHAKE, sizeof(WS_HANDSHAKE) - 1);
+        flush_out(c);
+    }
+
+    return 0;
+}
+
+//Waits for socket events, but no later than deadline
+static void poll_until(unsigned long deadline) {
+    struct epoll_event evs[64];
+    unsigned long now = now_ns();
+    unsigned long wait = deadline > now ? deadline - now : 0;
+    struct timespec ts = {wait / 1000000000UL, wait % 1000000000UL};
+
+    int n = epoll_pwait2(epfd, evs, 64, &ts, NULL);
+    int i;
+    for (i = 0; i < n; i++) {
+        lg_conn *c = evs[i].data.ptr;
+        if (evs[i].events & EPOLLOUT) flush_out(c);
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) handle_readable(c);
+    }
+}
+
+static void usage(char const *prog) {
+    fprintf(stderr,
+        "Usage: %s [-h host] [-p port] [-m http|ws] [-c conns] [-r rate]\n"
+        "       [-d secs] [-s ws_payload_size] [-f request_file]...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:m:c:r:d:s:f:")) != -1) {
+        switch (opt) {
+        case 'h': cfg.host = optarg; break;
+        case 'p': cfg.port = optarg; break;
+        case 'm':
+            if (!strcmp(optarg, "ws")) cfg.ws = 1;
+            else if (!strcmp(optarg, "http")) cfg.ws = 0;
+            else usage(argv[0]);
+            break;
+        case 'c': cfg.conns = atoi(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 'd': cfg.secs = atof(optarg); break;
+        case 's': cfg.ws_size = atoi(optarg); break;
+        case 'f':
+            if (cfg.num_files == MAX_FILES) usage(argv[0]);
+            cfg.files[cfg.num_files] = read_file(optarg, &cfg.file_lens[cfg.num_files]);
+            if (!cfg.files[cfg.num_files]) {
+                fprintf(stderr, "Could not read %s\n", optarg);
+                return 1;
+            }
+            cfg.num_files++;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (cfg.conns <= 0 || cfg.rate <= 0 || cfg.secs <= 0 || cfg.ws_size < 0) usage(argv[0]);
+
+    if (!cfg.ws && cfg.num_files == 0) {
+        cfg.files[0] = read_file("tests/getroot.txt", &cfg.file_lens[0]);
+        if (!cfg.files[0]) {
+            fprintf(stderr, "Could not read tests/getroot.txt (use -f)\n");
+            return 1;
+        }
+        cfg.num_files = 1;
+    }
+
+    mm_err err = MM_SUCCESS;
+    hist = new_histogram(&err);
+    epfd = epoll_create1(0);
+    if (err != MM_SUCCESS || epfd < 0) {
+        fprintf(stderr, "Setup failed\n");
+        return 1;
+    }
+
+    lg_conn *conns = calloc(cfg.conns, sizeof(lg_conn));
+    int i;
+    for (i = 0; i < cfg.conns; i++) {
+        if (open_conn(conns + i) < 0) {
+            fprintf(stderr, "Could not connect to %s:%s\n", cfg.host, cfg.port);
+            return 1;
+        }
+    }
+
+    //Let websocket handshakes finish before the clock starts
+    if (cfg.ws) {
+        unsigned long give_up = now_ns() + DRAIN_NS;
+        int ready = 0;
+        while (ready < cfg.conns && now_ns() < give_up) {
+            poll_until(now_ns() + 1000000);
+            ready = 0;
+            for (i = 0; i < cfg.conns; i++) ready += conns[i].state == LG_READY;
+        }
+    }
+
+    //The k-th request overall is due at start + k*gap, and goes out on
+    //connection k % conns. If we fall behind, we catch up by sending
+    //everything that's overdue (with its original intended time)
+    double gap = 1e9 / cfg.rate;
+    unsigned long total = (unsigned long) (cfg.rate * cfg.secs);
+    unsigned long start = now_ns();
+    unsigned long k = 0;
+
+    while (k < total) {
+        unsigned long now = now_ns();
+        while (k < total && start + (unsigned long) (k * gap) <= now) {
+            send_one(conns + (k % cfg.conns), start + (unsigned long) (k * gap), k);
+            k++;
+        }
+        if (k < total) poll_until(start + (unsigned long) (k * gap));
+    }
+    unsigned long send_end = now_ns();
+
+    //Give stragglers a chance to come back
+    unsigned long give_up = now_ns() + DRAIN_NS;
+    while (stats.completed + stats.errors < stats.sent && now_ns() < give_up) {
+        poll_until(now_ns() + 1000000);
+        unsigned long outstanding = 0;
+        for (i = 0; i < cfg.conns; i++) if (conns[i].state != LG_DEAD) outstanding += conns[i].num;
+        if (outstanding == 0) break;
+    }
+
+    unsigned long lost = stats.sent - stats.completed;
+    double elapsed = (send_end - start) / 1e9;
+
+    printf("%s, %d connections, target %.0f/s for %.1f s\n",
+        cfg.ws ? "websocket" : "http", cfg.conns, cfg.rate, cfg.secs);
+    printf("sent %lu, completed %lu, lost %lu, connection errors %lu\n",
+        stats.sent, stats.completed, lost, stats.errors);
+    printf("throughput %.1f/s\n", stats.completed / elapsed);
+    printf("latency (from intended send time):\n");
+    hist_print(hist, stdout, 1000.0, "us");
+    printf("RESULT mode=%s conns=%d rate=%.0f throughput=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f max_us=%.1f lost=%lu errors=%lu\n",
+        cfg.ws ? "ws" : "http", cfg.conns, cfg.rate, stats.completed / elapsed,
+        hist_percentile(hist, 50) / 1000.0, hist_percentile(hist, 99) / 1000.0,
+        hist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0, lost, stats.errors);
+
+    for (i = 0; i < cfg.conns; i++) {
+        if (conns[i].state != LG_DEAD) close(conns[i].fd);
+        free(conns[i].pending);
+        free(conns[i].in.data);
+        free(conns[i].out.data);
+    }
+    free(conns);
+    del_histogram(hist);
+    for (i = 0; i < cfg.num_files; i++) free(cfg.files[i]);
+
+    return (lost > 0 || stats.errors > 0) ? 2 : 0;
+}
@@ -1,23 +1,187 @@
 #include <stdio.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "http_parse.h"
 #include "websock.h"
+#include "multipart.h"
 #include "mm_err.h"
 
 //I'm just using this as driver code to feed test files into the library.
+//"make test" runs it over everything in tests/.
+//
+//Usage: main [-r] [-l max_req_line:max_hdr_line:max_hdr_bytes:max_body] [-m bytes] < file
+//
+//-l sets the parser's limits (zero means no limit, like in http_limits).
+//-m is how many bytes at a time a multipart/form-data body is fed to the
+//multipart parser. It's small by default so the boundaries get split
+//across writes.
+//-r reads responses instead of requests (see parse_responses).
 
-int main() {    
+//Prints the parts of a multipart body as they come out of the parser. The
+//first bit of each part's data is kept so you can see it came out right
+static char part_data[64];
+
+static void on_part(mp_parser *p, mp_part *part, void *arg) {
+    part_data[0] = 0;
+    fprintf(stderr, "\tPart [%.*s]", (int) part->name.len, part->name.ptr);
+    if (part->filename.ptr) fprintf(stderr, " filename = [%.*s]", (int) part->filename.len, part->filename.ptr);
+    if (part->content_type) fprintf(stderr, " type = [%s]", part->content_type);
+    fprintf(stderr, "\n");
+}
+
+static void on_data(mp_parser *p, mp_part *part, char const *data, int len, void *arg) {
+    unsigned long have = part->len - len; //part->len already counts this piece
+    if (have >= sizeof(part_data) - 1) return;
+    int n = sizeof(part_data) - 1 - have;
+    if (n > len) n = len;
+    memcpy(part_data + have, data, n);
+    part_data[have + n] = 0;
+}
+
+static void on_part_end(mp_parser *p, mp_part *part, void *arg) {
+    fprintf(stderr, "\t\tdata = [%s]\n", part_data);
+    fprintf(stderr, "\t\tlength = %lu\n", part->len);
+}
+
+static void parse_multipart(char const *type, char const *body, int len, int step, mm_err *err) {
+    mp_callbacks cb = {on_part, on_data, on_part_end};
+    mp_parser *p = new_mp_parser(type, &cb, NULL, err);
+    int rc = 1;
+    int pos;
+    for (pos = 0; pos < len && rc > 0; pos += step) {
+        int n = (len - pos < step) ? len - pos : step;
+        rc = write_to_mp_parser(p, body + pos, n, err);
+    }
+    if (rc == 0) fprintf(stderr, "Parsed a multipart body! %d parts\n", p->num_parts);
+    else if (rc > 0) fprintf(stderr, "Multipart body was cut short\n");
+    del_mp_parser(p);
+}
+
+//Says whether a response's body has all gone by. Chunked bodies are
+//followed with http_chunks_scan
+static int body_done(http_req const *resp, http_chunks const *c, long len) {
+    if (resp->chunked) return http_chunks_done(c);
+    return resp->content_length >= 0 && len == resp->content_length;
+}
+
+//Feeds the input to http_parse_resp, and follows each response's body the
+//way the proxy does, without keeping it. A body with no length ends with
+//the input
+static void parse_responses(http_req *resp, mm_err *err) {
+    char buf[80];
+    int num;
+    
+    int in_body = 0;
+    long body_len = 0;
+    http_chunks chunks;
+    
+    while ((num = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+        char const *p = buf;
+        while (num > 0) {
+            int used;
+            if (!in_body) {
+                int rc = http_parse_resp(resp, p, num, err);
+                used = num;
+                if (rc < 0 && *err == HTTP_STRAGGLERS) {
+                    //The body (or the next response) starts in this write
+                    *err = MM_SUCCESS;
+                    used = -rc;
+                    rc = 0;
+                } else if (rc < 0) {
+                    return;
+                }
+                p += used;
+                num -= used;
+                if (rc > 0) break;
+                
+                fprintf(stderr, "Parsed a response!\n");
+                fprintf(stderr, "\tStatus = %d\n", resp->status);
+                int i;
+                for (i = 0; i < resp->num_hdrs; i++) {
+                    fprintf(stderr, "\t\t[%s] = [%s]\n", resp->hdrs[i].name, resp->hdrs[i].args);
+                }
+                fprintf(stderr, "\tChunked = %d\n", resp->chunked);
+                fprintf(stderr, "\tContent-Length = %ld\n", resp->content_length);
+                fprintf(stderr, "\tClosed = %d\n", resp->cnx_closed);
+                
+                //Informational responses don't have bodies
+                if (resp->status < 200) continue;
+                in_body = 1;
+                body_len = 0;
+                if (resp->chunked) http_chunks_begin(&chunks);
+            } else {
+                if (resp->chunked) {
+                    used = http_chunks_scan(&chunks, p, num, err);
+                    if (used < 0) return;
+                } else if (resp->content_length >= 0 && resp->content_length - body_len < num) {
+                    used = resp->content_length - body_len;
+                } else {
+                    used = num;
+                }
+                p += used;
+                num -= used;
+                body_len += used;
+            }
+            
+            if (body_done(resp, &chunks, body_len)) {
+                fprintf(stderr, "\tBody length = %ld%s\n", body_len, resp->chunked ? " (with chunk framing)" : "");
+                in_body = 0;
+            }
+        }
+    }
+    
+    if (in_body && (resp->chunked || resp->content_length >= 0)) {
+        fprintf(stderr, "Response body was cut short after %ld bytes\n", body_len);
+    } else if (in_body) {
+        fprintf(stderr, "\tBody length = %ld (up to the end of the input)\n", body_len);
+    }
+}
+
+int main(int argc, char **argv) {    
     mm_err err = MM_SUCCESS;
     http_req *res = new_http_req(&err);
     websock_pkt *pkt = new_websock_pkt(&err);
     
+    int mp_step = 7;
+    int resp = 0;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "rl:m:")) != -1) {
+        switch (opt) {
+        case 'l': {
+            http_limits *l = &res->limits;
+            if (sscanf(optarg, "%d:%d:%d:%d", &l->max_req_line, &l->max_hdr_line, &l->max_hdr_bytes, &l->max_body) != 4) {
+                fprintf(stderr, "Bad limits [%s]\n", optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'm':
+            mp_step = atoi(optarg);
+            if (mp_step < 1) {
+                fprintf(stderr, "Bad multipart step [%s]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            resp = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r] [-l max_req_line:max_hdr_line:max_hdr_bytes:max_body] [-m bytes] < file\n", argv[0]);
+            return 1;
+        }
+    }
+    
     char buf[80];
     int num;
     
     int http = 1;
     
-    while ((num = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+    if (resp) parse_responses(res, &err);
+    
+    while (!resp && (num = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
         int rc;
         if (http) rc = write_to_http_parser(res, buf, num, &err);
         else rc = write_to_websock_parser(pkt, buf, num, &err);
@@ -25,7 +189,8 @@ int main() {
         if (rc == 0) {
             if(http) {
                 fprintf(stderr, "Parsed a request!\n");
-                if (is_websock_request(res, &err)) {
+                mm_err tmp = MM_SUCCESS; //A missing header isn't an error here
+                if (is_websock_request(res, &tmp)) {
                     fprintf(stderr, "It's actually a websocket request!\n");
                     char * resp = websock_handshake_response(res, NULL, &err);
                     //printf("Response:\n%s\n", resp);
@@ -42,6 +207,13 @@ int main() {
                 }
                 
                 fprintf(stderr, "\tPayload length = %d\n", res->payload_len);
+                
+                tmp = MM_SUCCESS;
+                char *type = get_args(res, "Content-Type", &tmp);
+                if (type && !strncasecmp(type, "multipart/form-data", 19)) {
+                    parse_multipart(type, res->payload, res->payload_len, mp_step, &err);
+                    if (err != MM_SUCCESS) break;
+                }
             } else {
                 fprintf(stderr, "Parsed a websockets message!\n");
                 fprintf(stderr, "Opcode = [%s]\n", websock_pkt_type_strs[pkt->type]);
@@ -69,6 +241,15 @@ int main() {
                     }
                 }
             }
+        } else if (http && rc == HTTP_BODY_PENDING) {
+            //Headers are in, the body isn't. This is where a server decides
+            //whether it wants the body at all
+            fprintf(stderr, "Headers are in, waiting on a %d byte body\n", res->payload_len);
+            if (res->expect_continue) {
+                printf("HTTP/1.1 100 Continue\r\n\r\n");
+                fflush(stdout);
+                fprintf(stderr, "Sent 100 Continue\n");
+            }
         } else if (rc < 0) {
             //Error
             break;
@@ -0,0 +1,61 @@
+#include <cstdio>
+#include <memory_resource>
+#include <unistd.h>
+#include "http_ws.hpp"
+
+//Same idea as main.c, but through the C++ wrapper. Mostly here to make sure
+//http_ws.hpp keeps compiling (and to show how it's used).
+
+//Only GET requests, and at most 16 headers
+using limits = mm::http_limits<16, 1024, mm::method_bit(HTTP_GET)>;
+
+int main() {
+    //Everything comes out of a buffer on the stack until that runs out
+    char backing[16384];
+    std::pmr::monotonic_buffer_resource pool{backing, sizeof(backing)};
+
+    mm::http_request<limits> req{&pool};
+    mm::websock_frame<> frame{&pool};
+    bool http = true;
+
+    char buf[80];
+    ssize_t num;
+    while ((num = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+        std::string_view in{buf, static_cast<std::size_t>(num)};
+
+        while (!in.empty()) {
+            mm::parse_result res = http ? req.feed(in) : frame.feed(in);
+            if (!res) {
+                std::fprintf(stderr, "Error: %s\n", res.err);
+                return 1;
+            }
+            in.remove_prefix(res.used);
+            if (!res.done()) continue;
+
+            if (http) {
+                std::fprintf(stderr, "Parsed a request!\n");
+                std::fprintf(stderr, "\tMethod = %.*s\n", (int) req.method_name().size(), req.method_name().data());
+                std::fprintf(stderr, "\tPath = [%.*s]\n", (int) req.path().size(), req.path().data());
+                for (mm::header h : req.headers()) {
+                    std::fprintf(stderr, "\t\t[%.*s] = [%.*s]\n", (int) h.name.size(), h.name.data(), (int) h.args.size(), h.args.data());
+                }
+
+                mm_err err = MM_SUCCESS;
+                if (is_websock_request(req.raw(), &err)) {
+                    std::fprintf(stderr, "It's actually a websocket request!\n");
+                    std::printf("%s", websock_handshake_response(req.raw(), nullptr, &err));
+                    std::fflush(stdout);
+                    http = false;
+                }
+            } else {
+                std::fprintf(stderr, "Parsed a websockets message!\n");
+                std::fprintf(stderr, "Opcode = [%s]\n", websock_pkt_type_strs[frame.type()]);
+                std::fprintf(stderr, "Payload = [%.*s]\n", (int) frame.text().size(), frame.text().data());
+                if (frame.type() == WEBSOCK_CLOSE) return 0;
+            }
+        }
+    }
+
+    std::fprintf(stderr, "\nDone\n");
+    return 0;
+}
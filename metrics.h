@@ -0,0 +1,404 @@
+//Hot-path counters for the parsers. Build with -DMM_METRICS (or "make
+//METRICS=1") to turn them on. Without it, every METRIC_* macro expands to
+//nothing at all, so there is zero cost; the snapshot functions still exist
+//but just report zeros.
+//
+//Each thread counts into its own block of counters, so the hot path never
+//does anything fancier than a load and a store to memory only it writes. The
+//blocks are linked into a global list the first time a thread counts
+//anything, and metrics_snapshot walks that list without taking any locks.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef METRICS_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define METRICS_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef METRICS_H
+        #define SHOULD_INCLUDE 1
+        #define METRICS_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "metrics.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Parse times are bucketed by powers of two (in clock ticks)
+    #define METRICS_TIME_BUCKETS 32
+    //Max number of distinct error codes we keep separate counts for
+    #define METRICS_MAX_ERRS 64
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(METRICS_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(METRICS_BUF_TOO_SMALL, "buffer too small for metrics output");
+
+///////////////////////////
+// Counters and snapshots //
+///////////////////////////
+#ifndef MM_IMPLEMENT
+    #define METRICS_KIND_IDS \
+        X(METRICS_HTTP), \
+        X(METRICS_WEBSOCK)
+
+    typedef enum _metrics_kind_t {
+    #define X(x) x
+        METRICS_KIND_IDS
+    #undef X
+    } metrics_kind_t;
+
+    typedef struct _metrics_err_count {
+        mm_err code; //NULL for unused slots
+        unsigned long count;
+    } metrics_err_count;
+
+    //One of these per thread (while counting), and also the format of a
+    //snapshot
+    typedef struct _metrics_counters {
+        unsigned long http_bytes;
+        unsigned long http_requests;
+        unsigned long ws_bytes;
+        unsigned long ws_frames;
+        //Number of times a parser had to grow its buffer
+        unsigned long reallocs;
+        unsigned long stragglers;
+        unsigned long errors;
+        metrics_err_count errs[METRICS_MAX_ERRS];
+
+        //Time spent in write_to_*_parser, in clock ticks (see
+        //metrics_ticks_per_sec)
+        unsigned long parse_ticks[METRICS_TIME_BUCKETS];
+        unsigned long parse_ticks_sum;
+        unsigned long parse_calls;
+
+        //Internal fields. Don't touch!
+        struct {
+            struct _metrics_counters *next;
+        } __internal;
+    } metrics_counters;
+#endif
+
+#ifndef MM_IMPLEMENT
+    //Current time in clock ticks. Uses the TSC on x86, which is a lot
+    //cheaper than clock_gettime
+    static inline unsigned long metrics_now() {
+    #if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+    #else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+    #endif
+    }
+
+    extern __thread struct _metrics_counters *metrics_tls;
+#endif
+
+#ifdef MM_METRICS
+
+    //Gets this thread's counters, registering them if this is the first time
+    #define METRICS_LOCAL() \
+        (__builtin_expect(metrics_tls != NULL, 1) ? metrics_tls : metrics_register())
+
+    //Only this thread ever writes its counters, so we don't need an atomic
+    //add; we just need the store to be atomic so snapshots never see a torn
+    //value
+    #define METRIC_BUMP(p, n) \
+        __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+
+    #define METRIC_ADD(field, n) METRIC_BUMP(&METRICS_LOCAL()->field, (n))
+
+    #define METRIC_TIME_START(var) unsigned long var = metrics_now()
+
+    //Call after a write_to_*_parser body has run. Sorts out which counters
+    //to bump based on the return code and error
+    #define METRIC_PARSE_DONE(kind, len, rc, err, straggled, t0) \
+        metrics_parse_done((kind), (len), (rc), (err), (straggled), metrics_now() - (t0))
+#else
+    #define METRIC_ADD(field, n) ((void) 0)
+    #define METRIC_TIME_START(var) ((void) 0)
+    #define METRIC_PARSE_DONE(kind, len, rc, err, straggled, t0) ((void) 0)
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+__thread metrics_counters *metrics_tls = NULL;
+
+//Head of the list of every thread's counters. Only ever pushed onto
+static metrics_counters *metrics_all = NULL;
+
+static void metrics_add_counters(metrics_counters *dst, metrics_counters const *src) {
+    #define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+    dst->http_bytes += LOAD(src->http_bytes);
+    dst->http_requests += LOAD(src->http_requests);
+    dst->ws_bytes += LOAD(src->ws_bytes);
+    dst->ws_frames += LOAD(src->ws_frames);
+    dst->reallocs += LOAD(src->reallocs);
+    dst->stragglers += LOAD(src->stragglers);
+    dst->errors += LOAD(src->errors);
+    dst->parse_ticks_sum += LOAD(src->parse_ticks_sum);
+    dst->parse_calls += LOAD(src->parse_calls);
+
+    int i, j;
+    for (i = 0; i < METRICS_TIME_BUCKETS; i++) dst->parse_ticks[i] += LOAD(src->parse_ticks[i]);
+
+    for (i = 0; i < METRICS_MAX_ERRS; i++) {
+        mm_err code = __atomic_load_n(&src->errs[i].code, __ATOMIC_ACQUIRE);
+        if (!code) continue;
+        for (j = 0; j < METRICS_MAX_ERRS; j++) {
+            if (!dst->errs[j].code) dst->errs[j].code = code;
+            if (dst->errs[j].code == code) {
+                dst->errs[j].count += LOAD(src->errs[i].count);
+                break;
+            }
+        }
+    }
+    #undef LOAD
+}
+
+//Prometheus label values need quotes and backslashes escaped
+static int metrics_escape(char *dst, int cap, char const *s) {
+    int n = 0;
+    for (; *s && n < cap - 2; s++) {
+        if (*s == '"' || *s == '\\') dst[n++] = '\\';
+        dst[n++] = *s;
+    }
+    dst[n] = '\0';
+    return n;
+}
+
+#endif
+
+//////////////
+// Hot path //
+//////////////
+
+//Allocates and registers this thread's counters. Called automatically the
+//first time a thread counts something. Returns NULL if out of memory (in
+//which case you'll crash; we don't try to count without memory)
+metrics_counters *metrics_register()
+#ifdef MM_IMPLEMENT
+{
+    metrics_counters *c = calloc(1, sizeof(metrics_counters));
+    if (!c) return NULL;
+
+    //Lock-free push onto the global list
+    metrics_counters *head = __atomic_load_n(&metrics_all, __ATOMIC_RELAXED);
+    do {
+        c->__internal.next = head;
+    } while (!__atomic_compare_exchange_n(&metrics_all, &head, c, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    metrics_tls = c;
+    return c;
+}
+#else
+;
+#endif
+
+//Records the results of one write_to_*_parser call. You shouldn't need to
+//call this yourself; use METRIC_PARSE_DONE
+void metrics_parse_done(metrics_kind_t kind, int len, int rc, mm_err err, int straggled, unsigned long ticks)
+#ifdef MM_IMPLEMENT
+{
+    metrics_counters *c = metrics_tls ? metrics_tls : metrics_register();
+    #define BUMP(field, n) __atomic_store_n(&c->field, c->field + (n), __ATOMIC_RELAXED)
+
+    if (kind == METRICS_HTTP) BUMP(http_bytes, len);
+    else BUMP(ws_bytes, len);
+
+    int bucket = 63 - __builtin_clzl(ticks | 1);
+    if (bucket >= METRICS_TIME_BUCKETS) bucket = METRICS_TIME_BUCKETS - 1;
+    BUMP(parse_ticks[bucket], 1);
+    BUMP(parse_ticks_sum, ticks);
+    BUMP(parse_calls, 1);
+
+    //Stragglers still mean a complete request/frame was parsed
+    if (rc == 0 || straggled) {
+        if (kind == METRICS_HTTP) BUMP(http_requests, 1);
+        else BUMP(ws_frames, 1);
+        if (straggled) BUMP(stragglers, 1);
+        return;
+    }
+
+    if (rc < 0 && err) {
+        BUMP(errors, 1);
+
+        //Error codes are pointers to unique strings, so we can just hash the
+        //pointer
+        unsigned long h = ((unsigned long) err >> 3) % METRICS_MAX_ERRS;
+        int i;
+        for (i = 0; i < METRICS_MAX_ERRS; i++) {
+            metrics_err_count *e = c->errs + (h + i) % METRICS_MAX_ERRS;
+            if (e->code == err) {
+                BUMP(errs[e - c->errs].count, 1);
+                break;
+            } else if (e->code == NULL) {
+                //Count must be visible before the code is
+                e->count = 1;
+                __atomic_store_n(&e->code, err, __ATOMIC_RELEASE);
+                break;
+            }
+        }
+    }
+    #undef BUMP
+}
+#else
+;
+#endif
+
+/////////////////////////
+// Reading the metrics //
+/////////////////////////
+
+//Adds up every thread's counters into *out. Never blocks the threads doing
+//the counting. Counts can be very slightly out of date, but never torn.
+//Without MM_METRICS, this just zeroes *out
+void metrics_snapshot(metrics_counters *out, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!out) {
+        *err = METRICS_NULL_ARG;
+        return;
+    }
+
+    memset(out, 0, sizeof(metrics_counters));
+
+    metrics_counters *c = __atomic_load_n(&metrics_all, __ATOMIC_ACQUIRE);
+    for (; c; c = c->__internal.next) metrics_add_counters(out, c);
+    out->__internal.next = NULL;
+}
+#else
+;
+#endif
+
+//Returns how many clock ticks (as used for parse times) happen per second.
+//Measured the first time you call it, which takes a few milliseconds
+double metrics_ticks_per_sec()
+#ifdef MM_IMPLEMENT
+{
+    static double tps = 0;
+    if (tps != 0) return tps;
+
+#if defined(__x86_64__) || defined(__i386__)
+    struct timespec ts0, ts1;
+    clock_gettime(CLOCK_MONOTONIC, &ts0);
+    unsigned long t0 = metrics_now();
+    struct timespec nap = {0, 5000000};
+    nanosleep(&nap, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts1);
+    unsigned long t1 = metrics_now();
+    double secs = (ts1.tv_sec - ts0.tv_sec) + (ts1.tv_nsec - ts0.tv_nsec) / 1e9;
+    tps = (t1 - t0) / secs;
+#else
+    tps = 1e9;
+#endif
+
+    return tps;
+}
+#else
+;
+#endif
+
+/* metrics_prometheus:
+
+Writes a snapshot of all the metrics to buf in the Prometheus text
+exposition format. Returns the number of bytes written (not counting the
+NUL), or negative on error; if buf is too small, *err is set to
+METRICS_BUF_TOO_SMALL. 8 KiB is plenty for the built-in metrics.
+*/
+int metrics_prometheus(char *buf, int cap, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!buf) {
+        *err = METRICS_NULL_ARG;
+        return -1;
+    }
+
+    metrics_counters s;
+    metrics_snapshot(&s, err);
+    if (*err != MM_SUCCESS) return -1;
+
+    int pos = 0;
+    #define EMIT(...) do { \
+        int n_ = snprintf(buf + pos, cap - pos, __VA_ARGS__); \
+        if (n_ < 0 || n_ >= cap - pos) { *err = METRICS_BUF_TOO_SMALL; return -1; } \
+        pos += n_; \
+    } while (0)
+    #define COUNTER(name, help, val) \
+        EMIT("# HELP " name " " help "\n# TYPE " name " counter\n" name " %lu\n", (val))
+
+    COUNTER("mm_http_bytes_total", "Bytes fed to the HTTP parser", s.http_bytes);
+    COUNTER("mm_http_requests_total", "Complete HTTP requests parsed", s.http_requests);
+    COUNTER("mm_ws_bytes_total", "Bytes fed to the websocket parser", s.ws_bytes);
+    COUNTER("mm_ws_frames_total", "Complete websocket frames parsed", s.ws_frames);
+    COUNTER("mm_parser_reallocs_total", "Times a parser grew its buffer", s.reallocs);
+    COUNTER("mm_parser_stragglers_total", "Parser calls that left straggling bytes", s.stragglers);
+
+    EMIT("# HELP mm_parser_errors_total Parse errors by error code\n# TYPE mm_parser_errors_total counter\n");
+    int i;
+    for (i = 0; i < METRICS_MAX_ERRS; i++) {
+        if (!s.errs[i].code) continue;
+        char esc[256];
+        metrics_escape(esc, sizeof(esc), s.errs[i].code);
+        EMIT("mm_parser_errors_total{error=\"%s\"} %lu\n", esc, s.errs[i].count);
+    }
+
+    double tps = metrics_ticks_per_sec();
+    EMIT("# HELP mm_parse_duration_seconds Time spent per parser call\n# TYPE mm_parse_duration_seconds histogram\n");
+    unsigned long cumulative = 0;
+    for (i = 0; i < METRICS_TIME_BUCKETS - 1; i++) {
+        cumulative += s.parse_ticks[i];
+        //Bucket i holds values below 2^(i+1) ticks
+        EMIT("mm_parse_duration_seconds_bucket{le=\"%.3g\"} %lu\n", (double) (2UL << i) / tps, cumulative);
+    }
+    EMIT("mm_parse_duration_seconds_bucket{le=\"+Inf\"} %lu\n", s.parse_calls);
+    EMIT("mm_parse_duration_seconds_sum %.9f\n", s.parse_ticks_sum / tps);
+    EMIT("mm_parse_duration_seconds_count %lu\n", s.parse_calls);
+
+    #undef COUNTER
+    #undef EMIT
+
+    return pos;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
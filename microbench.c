@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "mm_err.h"
+#include "http_parse.h"
+#include "websock.h"
+#include "multipart.h"
+#include "router.h"
+#include "histogram.h"
+
+//Parser microbenchmarks. No sockets involved: this just feeds the same
+//input to a parser over and over and reports how long each parse took. It's
+//meant for comparing builds against each other (e.g. "make bench-parse"
+//runs it with and without MM_METRICS), so all it prints is a few numbers.
+//
+//Usage:
+//  microbench [-m http|ws|router|multipart] [-n iters] [-r runs] [-b chunk] [-s size]
+//             [-l] [-f request_file]...
+//
+//Each run parses every input n times and reports ns/parse. The best run is
+//what goes in the RESULT line, since the slower ones are mostly noise from
+//whatever else the machine was doing. -b splits the input into chunks of
+//that many bytes, like a slow network would. -l turns on lazy_hdrs, so the
+//parser leaves header values alone.
+//
+//In ws mode, -s is the payload size. In router mode there's no parsing:
+//each "parse" is one router_lookup against a table shaped like a big REST
+//API (a few hand-written routes plus ROUTES_PER_SVC for each of -s made-up
+//services), and -f is ignored.
+//
+//In multipart mode, the input is a form upload like a browser would send:
+//a couple of small fields and two files that add up to -s bytes (4MB if
+//not given). -n defaults to 50 instead, since each parse is that much work. The files are random bytes with the odd "\r\n--" thrown in,
+//so the boundary search gets some near misses. -f is ignored here too.
+
+#define MAX_FILES 16
+#define ROUTES_PER_SVC 5
+#define MP_BOUNDARY "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+#define MP_CONTENT_TYPE "multipart/form-data; boundary=" MP_BOUNDARY
+
+typedef struct _mb_input {
+    char *data;
+    int len;
+} mb_input;
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int read_file(char const *path, mb_input *in) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return -1;
+
+    fseek(fp, 0, SEEK_END);
+    in->len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    in->data = malloc(in->len);
+    if (!in->data || fread(in->data, 1, in->len, fp) != (size_t) in->len) {
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+//Makes a masked binary frame like a client would send
+static void make_ws_frame(mb_input *in, int size) {
+    static char const mask[4] = {0x12, 0x34, 0x56, 0x78};
+    mm_err err = MM_SUCCESS;
+
+    in->data = malloc(WEBSOCK_MAX_HDR_SIZE + size);
+    int hdr_len = construct_websock_client_hdr(in->data, WEBSOCK_BIN, 1, size, mask, &err);
+    char *payload = malloc(size);
+    int i;
+    for (i = 0; i < size; i++) payload[i] = 'a' + i % 26;
+    websock_mask(in->data + hdr_len, payload, size, mask, 0);
+    free(payload);
+    in->len = hdr_len + size;
+}
+
+static int append(char *dst, int pos, char const *src, int len) {
+    memcpy(dst + pos, src, len);
+    return pos + len;
+}
+
+//Makes a form upload with size bytes of files in it. Sets *data_len to how
+//much of that is part data, for checking the parser found all of it
+static void make_multipart(mb_input *in, int size, unsigned long *data_len) {
+    static char const *const fields[][2] = {
+        {"title", "Holiday pictures"},
+        {"description", "Nothing much, just\r\nsome photos"},
+    };
+    char hdr[256];
+
+    in->data = malloc(size + 4096);
+    int pos = 0;
+    *data_len = 0;
+
+    int i;
+    for (i = 0; i < 2; i++) {
+        int n = snprintf(hdr, sizeof(hdr), "--%s\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n", MP_BOUNDARY, fields[i][0]);
+        pos = append(in->data, pos, hdr, n);
+        pos = append(in->data, pos, fields[i][1], strlen(fields[i][1]));
+        pos = append(in->data, pos, "\r\n", 2);
+        *data_len += strlen(fields[i][1]);
+    }
+
+    srand(1234);
+    for (i = 0; i < 2; i++) {
+        int n = snprintf(hdr, sizeof(hdr),
+            "--%s\r\nContent-Disposition: form-data; name=\"file%d\"; filename=\"IMG_%d.jpg\"\r\n"
+            "Content-Type: image/jpeg\r\n\r\n", MP_BOUNDARY, i, 1000 + i);
+        pos = append(in->data, pos, hdr, n);
+        int file_len = i == 0 ? size / 4 : size - size / 4;
+        int j;
+        for (j = 0; j < file_len; j++) in->data[pos + j] = rand();
+        for (j = 0; j + 64 < file_len; j += 4096) memcpy(in->data + pos + j, "\r\n--", 4);
+        pos += file_len;
+        pos = append(in->data, pos, "\r\n", 2);
+        *data_len += file_len;
+    }
+
+    pos = append(in->data, pos, "--" MP_BOUNDARY "--\r\n", strlen(MP_BOUNDARY) + 6);
+    in->len = pos;
+}
+
+static void count_part(mp_parser *p, mp_part *part, void *arg) {
+    *(unsigned long *) arg += part->len;
+}
+
+static router_route const api_routes[] = {
+    {ROUTER_GET, "/", NULL},
+    {ROUTER_GET, "/users/:user", NULL},
+    {ROUTER_GET, "/users/:user/repos", NULL},
+    {ROUTER_GET, "/repos/:owner/:repo", NULL},
+    {ROUTER_GET | ROUTER_POST, "/repos/:owner/:repo/issues", NULL},
+    {ROUTER_GET, "/repos/:owner/:repo/issues/:number", NULL},
+    {ROUTER_GET, "/repos/:owner/:repo/issues/:number/comments", NULL},
+    {ROUTER_GET, "/repos/:owner/:repo/contents/*path", NULL},
+    {ROUTER_GET, "/repos/:owner/:repo/git/refs/heads/:branch", NULL},
+    {ROUTER_GET, "/search/code", NULL},
+    {ROUTER_GET, "/static/*file", NULL},
+};
+#define NUM_API_ROUTES ((int) (sizeof(api_routes) / sizeof(*api_routes)))
+
+//Paths we look up, in order. The last one doesn't match anything
+static char const *const router_paths[] = {
+    "/",
+    "/users/octocat",
+    "/repos/octocat/hello-world/issues/1347",
+    "/repos/octocat/hello-world/contents/src/lib/main.c",
+    "/svc7/items/12345",
+    "/svc123/items/987/parts/wheel",
+    "/svc42/static/css/site.css",
+    "/svc99/list",
+    "/nope/not/here",
+};
+#define NUM_ROUTER_PATHS ((int) (sizeof(router_paths) / sizeof(*router_paths)))
+
+//Makes the route table for router mode. Pattern strings are leaked on
+//purpose; they have to outlive the router anyway
+static router_route *make_routes(int svcs, int *num) {
+    static char const *const fmts[ROUTES_PER_SVC] = {
+        "/svc%d/list", "/svc%d/items/:id", "/svc%d/items/:id/parts/:part",
+        "/svc%d/items/:id/history", "/svc%d/static/*file"
+    };
+
+    *num = NUM_API_ROUTES + svcs * ROUTES_PER_SVC;
+    router_route *ret = malloc(*num * sizeof(router_route));
+    memcpy(ret, api_routes, sizeof(api_routes));
+
+    int i, j;
+    for (i = 0; i < svcs; i++) {
+        for (j = 0; j < ROUTES_PER_SVC; j++) {
+            char *pat = malloc(64);
+            snprintf(pat, 64, fmts[j], i);
+            router_route *rt = ret + NUM_API_ROUTES + i * ROUTES_PER_SVC + j;
+            rt->methods = ROUTER_GET;
+            rt->pattern = pat;
+            rt->handler = NULL;
+        }
+    }
+
+    return ret;
+}
+
+//Parses in once (in chunks of at most chunk bytes). Returns 0 on success
+static int parse_http(http_req *req, mb_input const *in, int chunk) {
+    mm_err err = MM_SUCCESS;
+    int pos = 0;
+    while (pos < in->len) {
+        int n = in->len - pos < chunk ? in->len - pos : chunk;
+        int rc = write_to_http_parser(req, in->data + pos, n, &err);
+        if (rc < 0) return -1;
+        pos += n;
+        if (rc == 0) return pos == in->len ? 0 : -1;
+    }
+    return -1;
+}
+
+//Parses in once, and checks every byte of part data came out
+static int parse_multipart(mb_input const *in, int chunk, unsigned long data_len) {
+    mm_err err = MM_SUCCESS;
+    unsigned long seen = 0;
+    mp_callbacks cb = {.on_part_end = count_part};
+    mp_parser *p = new_mp_parser(MP_CONTENT_TYPE, &cb, &seen, &err);
+    int rc = 1;
+    int pos = 0;
+    while (pos < in->len && rc == 1) {
+        int n = in->len - pos < chunk ? in->len - pos : chunk;
+        rc = write_to_mp_parser(p, in->data + pos, n, &err);
+        pos += n;
+    }
+    int parts = p ? p->num_parts : 0;
+    del_mp_parser(p);
+    return rc == 0 && parts == 4 && seen == data_len ? 0 : -1;
+}
+
+static int parse_ws(websock_pkt *pkt, mb_input const *in, int chunk) {
+    mm_err err = MM_SUCCESS;
+    int pos = 0;
+    while (pos < in->len) {
+        int n = in->len - pos < chunk ? in->len - pos : chunk;
+        int rc = write_to_websock_parser(pkt, in->data + pos, n, &err);
+        if (rc < 0) return -1;
+        pos += n;
+        if (rc == 0) return pos == in->len ? 0 : -1;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    char const *mode = "http";
+    int iters = -1;
+    int runs = 5;
+    int chunk = 1 << 30;
+    int size = -1;
+    int lazy = 0;
+    char const *files[MAX_FILES];
+    int num_files = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:n:r:b:s:lf:")) != -1) {
+        switch (opt) {
+        case 'm': mode = optarg; break;
+        case 'n': iters = atoi(optarg); break;
+        case 'r': runs = atoi(optarg); break;
+        case 'b': chunk = atoi(optarg); break;
+        case 's': size = atoi(optarg); break;
+        case 'l': lazy = 1; break;
+        case 'f':
+            if (num_files == MAX_FILES) {
+                fprintf(stderr, "Too many -f options (max %d)\n", MAX_FILES);
+                return 1;
+            }
+            files[num_files++] = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-m http|ws|router|multipart] [-n iters] [-r runs] [-b chunk] [-s size] [-l] [-f request_file]...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    int is_ws = !strcmp(mode, "ws");
+    int is_router = !strcmp(mode, "router");
+    int is_mp = !strcmp(mode, "multipart");
+    if (!is_ws && !is_router && !is_mp && strcmp(mode, "http")) {
+        fprintf(stderr, "Unknown mode [%s]\n", mode);
+        return 1;
+    }
+    if (size < 0) size = is_router ? 1000 : is_mp ? (4 << 20) : 64;
+    if (iters < 0) iters = is_mp ? 50 : 200000;
+    if (iters <= 0 || runs <= 0 || chunk <= 0) {
+        fprintf(stderr, "Bad arguments\n");
+        return 1;
+    }
+
+    mb_input inputs[MAX_FILES];
+    int num_inputs = 0;
+    unsigned long mp_data_len = 0;
+    if (is_router) {
+        num_inputs = NUM_ROUTER_PATHS;
+        int i;
+        for (i = 0; i < num_inputs; i++) {
+            inputs[i].data = strdup(router_paths[i]);
+            inputs[i].len = strlen(router_paths[i]);
+        }
+    } else if (is_ws) {
+        make_ws_frame(&inputs[num_inputs++], size);
+    } else if (is_mp) {
+        make_multipart(&inputs[num_inputs++], size, &mp_data_len);
+    } else {
+        if (num_files == 0) files[num_files++] = "tests/getroot.txt";
+        int i;
+        for (i = 0; i < num_files; i++) {
+            if (read_file(files[i], &inputs[num_inputs++]) < 0) {
+                fprintf(stderr, "Could not read [%s]\n", files[i]);
+                return 1;
+            }
+        }
+    }
+
+    mm_err err = MM_SUCCESS;
+    http_req *req = (is_ws || is_router || is_mp) ? NULL : new_http_req(&err);
+    websock_pkt *pkt = is_ws ? new_websock_pkt(&err) : NULL;
+    int num_routes = 0;
+    router_route *routes = is_router ? make_routes(size, &num_routes) : NULL;
+    router *rtr = is_router ? new_router(routes, num_routes, &err) : NULL;
+    if (err != MM_SUCCESS) {
+        fprintf(stderr, "Error: %s\n", err);
+        return 1;
+    }
+    if (req) req->lazy_hdrs = lazy;
+
+    unsigned long total_bytes = 0;
+    int i;
+    for (i = 0; i < num_inputs; i++) total_bytes += inputs[i].len;
+
+    double best = 0;
+    int r;
+    for (r = 0; r < runs; r++) {
+        unsigned long start = now_ns();
+        int n;
+        for (n = 0; n < iters; n++) {
+            for (i = 0; i < num_inputs; i++) {
+                int rc;
+                if (is_router) {
+                    router_match m;
+                    rc = router_lookup(rtr, HTTP_GET, inputs[i].data, inputs[i].len, &m);
+                    //Only the last path is supposed to miss
+                    rc = (rc >= 0) == (i < num_inputs - 1) ? 0 : -1;
+                } else if (is_mp) {
+                    rc = parse_multipart(&inputs[i], chunk, mp_data_len);
+                } else {
+                    rc = is_ws ? parse_ws(pkt, &inputs[i], chunk) : parse_http(req, &inputs[i], chunk);
+                }
+                if (rc < 0) {
+                    fprintf(stderr, "Parse failed on input %d\n", i);
+                    return 2;
+                }
+            }
+        }
+        unsigned long elapsed = now_ns() - start;
+
+        double ns_per = (double) elapsed / ((double) iters * num_inputs);
+        double mb_s = (double) total_bytes * iters / (elapsed / 1e9) / 1e6;
+        printf("run %d: %.1f ns/parse, %.1f MB/s\n", r + 1, ns_per, mb_s);
+        if (r == 0 || ns_per < best) best = ns_per;
+    }
+
+    if (is_router) printf("RESULT mode=%s routes=%d best_ns=%.1f\n", mode, num_routes, best);
+    else if (is_mp) printf("RESULT mode=%s size=%d chunk=%d best_ns=%.1f best_mb_s=%.1f\n", mode, size, chunk < (1 << 30) ? chunk : 0, best, total_bytes / best * 1e3);
+    else printf("RESULT mode=%s chunk=%d lazy=%d best_ns=%.1f\n", mode, chunk < (1 << 30) ? chunk : 0, lazy, best);
+
+    del_router(rtr);
+    del_http_req(req);
+    del_websock_pkt(pkt);
+    for (i = 0; i < num_inputs; i++) free(inputs[i].data);
+
+    return 0;
+}
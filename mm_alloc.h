@@ -0,0 +1,448 @@
+//Pluggable allocators. Anything that needs memory on the per-request path
+//(http_req, websock_pkt, the server's connections) takes one of these
+//instead of calling malloc directly, so you can decide where the memory
+//comes from.
+//
+//Built-in allocators:
+//
+//  - mm_malloc_alloc: plain old malloc/realloc/free. This is the default.
+//  - mm_slab_alloc: per-thread free lists for a handful of size classes.
+//    Good for lots of small same-sized objects (like the parser structs)
+//    that get created and destroyed constantly. Memory goes back on the
+//    free list, never back to the OS.
+//  - mm_arena: a bump allocator you reset all at once, e.g. after each
+//    request. Growing the most recent allocation happens in place.
+//  - mm_huge_alloc: every allocation is its own (transparent) hugepage-backed
+//    mapping. Only worth it for big, long-lived regions. You can also ask
+//    the slab allocator to carve its objects out of hugepages.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef MM_ALLOC_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define MM_ALLOC_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef MM_ALLOC_H
+        #define SHOULD_INCLUDE 1
+        #define MM_ALLOC_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "mm_alloc.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Slab size classes are powers of two from 2^MM_SLAB_MIN_SHIFT up to
+    //2^MM_SLAB_MAX_SHIFT. Anything bigger just goes to malloc
+    #define MM_SLAB_MIN_SHIFT 4
+    #define MM_SLAB_MAX_SHIFT 14
+    #define MM_SLAB_NUM_CLASSES (MM_SLAB_MAX_SHIFT - MM_SLAB_MIN_SHIFT + 1)
+    //How much memory the slab grabs at a time when a free list runs dry
+    #define MM_SLAB_CHUNK_SIZE (64 * 1024)
+
+    #define MM_ARENA_ALIGN 16
+    #define MM_ARENA_DEFAULT_CHUNK 8192
+
+    #define MM_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(MM_ALLOC_OOM, "out of memory");
+MM_ERR(MM_ALLOC_NULL_ARG, "NULL argument where non-NULL expected");
+
+/////////////////////////
+// Allocator interface //
+/////////////////////////
+#ifndef MM_IMPLEMENT
+    //All three functions get the allocator's ctx pointer. Frees and
+    //reallocs are told the old size, which is what lets the slab get away
+    //without any per-object headers. The caller always knows the size
+    //anyway (it's the cap field everywhere in this library)
+    typedef struct _mm_allocator {
+        void *(*alloc)(void *ctx, unsigned long sz);
+        void *(*realloc)(void *ctx, void *p, unsigned long old_sz, unsigned long new_sz);
+        void (*free)(void *ctx, void *p, unsigned long sz);
+        void *ctx;
+    } mm_allocator;
+
+    extern mm_allocator const mm_malloc_alloc;
+    extern mm_allocator const mm_slab_alloc;
+    extern mm_allocator const mm_huge_alloc;
+
+    typedef struct _mm_arena_chunk {
+        struct _mm_arena_chunk *next;
+        unsigned long cap;
+        unsigned long pos;
+        //Offset of the most recent allocation. Only that one can be grown
+        //(or given back) in place
+        unsigned long last;
+        char mem[] __attribute__((aligned(MM_ARENA_ALIGN)));
+    } mm_arena_chunk;
+
+    typedef struct _mm_arena {
+        //Pass &arena->alloc anywhere that wants an mm_allocator
+        mm_allocator alloc;
+
+        //Internal fields. Don't touch!
+        struct {
+            mm_allocator const *parent;
+            unsigned long chunk_sz;
+            //Newest chunk first. The very first chunk is kept around by
+            //mm_arena_reset
+            mm_arena_chunk *chunks;
+        } __internal;
+    } mm_arena;
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+static void *mm_malloc_fn(void *ctx, unsigned long sz) {
+    return malloc(sz);
+}
+
+static void *mm_realloc_fn(void *ctx, void *p, unsigned long old_sz, unsigned long new_sz) {
+    return realloc(p, new_sz);
+}
+
+static void mm_free_fn(void *ctx, void *p, unsigned long sz) {
+    free(p);
+}
+
+mm_allocator const mm_malloc_alloc = {mm_malloc_fn, mm_realloc_fn, mm_free_fn, NULL};
+
+//Hugepages
+//---------
+
+static void *mm_huge_fn(void *ctx, unsigned long sz) {
+    mm_err err = MM_SUCCESS;
+    return mm_huge_map(sz, &err);
+}
+
+static void *mm_huge_realloc_fn(void *ctx, void *p, unsigned long old_sz, unsigned long new_sz) {
+    unsigned long old_map = (old_sz + MM_HUGEPAGE_SIZE - 1) & ~(MM_HUGEPAGE_SIZE - 1);
+    if (p && new_sz <= old_map) return p;
+
+    void *ret = mm_huge_fn(ctx, new_sz);
+    if (!ret) return NULL;
+    if (p) {
+        memcpy(ret, p, old_sz < new_sz ? old_sz : new_sz);
+        mm_huge_unmap(p, old_sz);
+    }
+    return ret;
+}
+
+static void mm_huge_free_fn(void *ctx, void *p, unsigned long sz) {
+    mm_huge_unmap(p, sz);
+}
+
+mm_allocator const mm_huge_alloc = {mm_huge_fn, mm_huge_realloc_fn, mm_huge_free_fn, NULL};
+
+//Slab
+//----
+
+//Each thread has its own free lists, so there's no locking at all. An
+//object freed on a different thread than the one that allocated it simply
+//joins the freeing thread's list
+static __thread void *mm_slab_free_lists[MM_SLAB_NUM_CLASSES];
+static int mm_slab_hugepages = 0;
+
+//Returns the size class for sz, or -1 if it's too big for the slab
+static int mm_slab_class(unsigned long sz) {
+    if (sz > (1UL << MM_SLAB_MAX_SHIFT)) return -1;
+
+    int cls = 0;
+    while ((1UL << (cls + MM_SLAB_MIN_SHIFT)) < sz) cls++;
+    return cls;
+}
+
+//Grabs a fresh chunk of memory and chops it up into objects of the given
+//class. These chunks are never given back
+static int mm_slab_refill(int cls) {
+    unsigned long chunk_sz = mm_slab_hugepages ? MM_HUGEPAGE_SIZE : MM_SLAB_CHUNK_SIZE;
+    char *chunk;
+    if (mm_slab_hugepages) chunk = mm_huge_fn(NULL, chunk_sz);
+    else chunk = malloc(chunk_sz);
+    if (!chunk) return -1;
+
+    unsigned long obj_sz = 1UL << (cls + MM_SLAB_MIN_SHIFT);
+    unsigned long i;
+    for (i = 0; i + obj_sz <= chunk_sz; i += obj_sz) {
+        *(void **) (chunk + i) = mm_slab_free_lists[cls];
+        mm_slab_free_lists[cls] = chunk + i;
+    }
+
+    return 0;
+}
+
+static void *mm_slab_fn(void *ctx, unsigned long sz) {
+    int cls = mm_slab_class(sz);
+    if (cls < 0) return malloc(sz);
+
+    if (!mm_slab_free_lists[cls] && mm_slab_refill(cls) < 0) return NULL;
+
+    void *ret = mm_slab_free_lists[cls];
+    mm_slab_free_lists[cls] = *(void **) ret;
+    return ret;
+}
+
+static void mm_slab_free_fn(void *ctx, void *p, unsigned long sz) {
+    if (!p) return;
+
+    int cls = mm_slab_class(sz);
+    if (cls < 0) {
+        free(p);
+        return;
+    }
+
+    *(void **) p = mm_slab_free_lists[cls];
+    mm_slab_free_lists[cls] = p;
+}
+
+static void *mm_slab_realloc_fn(void *ctx, void *p, unsigned long old_sz, unsigned long new_sz) {
+    if (!p) return mm_slab_fn(ctx, new_sz);
+
+    int old_cls = mm_slab_class(old_sz);
+    int new_cls = mm_slab_class(new_sz);
+
+    //Still fits in the same object
+    if (old_cls >= 0 && old_cls == new_cls) return p;
+    //Both are too big for the slab
+    if (old_cls < 0 && new_cls < 0) return realloc(p, new_sz);
+
+    void *ret = mm_slab_fn(ctx, new_sz);
+    if (!ret) return NULL;
+    memcpy(ret, p, old_sz < new_sz ? old_sz : new_sz);
+    mm_slab_free_fn(ctx, p, old_sz);
+    return ret;
+}
+
+mm_allocator const mm_slab_alloc = {mm_slab_fn, mm_slab_realloc_fn, mm_slab_free_fn, NULL};
+
+//Arena
+//-----
+
+static unsigned long mm_arena_round(unsigned long sz) {
+    return (sz + MM_ARENA_ALIGN - 1) & ~(unsigned long) (MM_ARENA_ALIGN - 1);
+}
+
+static mm_arena_chunk *mm_arena_new_chunk(mm_arena *a, unsigned long min_sz) {
+    unsigned long cap = a->__internal.chunk_sz - sizeof(mm_arena_chunk);
+    if (cap < min_sz) cap = min_sz;
+
+    mm_allocator const *parent = a->__internal.parent;
+    mm_arena_chunk *ret = parent->alloc(parent->ctx, sizeof(mm_arena_chunk) + cap);
+    if (!ret) return NULL;
+
+    ret->cap = cap;
+    ret->pos = 0;
+    ret->last = 0;
+    ret->next = a->__internal.chunks;
+    a->__internal.chunks = ret;
+    return ret;
+}
+
+static void *mm_arena_fn(void *ctx, unsigned long sz) {
+    mm_arena *a = ctx;
+    sz = mm_arena_round(sz);
+
+    mm_arena_chunk *c = a->__internal.chunks;
+    if (!c || c->cap - c->pos < sz) {
+        c = mm_arena_new_chunk(a, sz);
+        if (!c) return NULL;
+    }
+
+    c->last = c->pos;
+    c->pos += sz;
+    return c->mem + c->last;
+}
+
+//Is p the most recent allocation in the current chunk?
+static int mm_arena_is_last(mm_arena *a, void *p) {
+    mm_arena_chunk *c = a->__internal.chunks;
+    return c && p == c->mem + c->last;
+}
+
+static void *mm_arena_realloc_fn(void *ctx, void *p, unsigned long old_sz, unsigned long new_sz) {
+    mm_arena *a = ctx;
+    if (!p) return mm_arena_fn(ctx, new_sz);
+
+    //Grow (or shrink) in place if we can
+    if (mm_arena_is_last(a, p)) {
+        mm_arena_chunk *c = a->__internal.chunks;
+        unsigned long rounded = mm_arena_round(new_sz);
+        if (c->last + rounded <= c->cap) {
+            c->pos = c->last + rounded;
+            return p;
+        }
+    }
+
+    void *ret = mm_arena_fn(ctx, new_sz);
+    if (!ret) return NULL;
+    memcpy(ret, p, old_sz < new_sz ? old_sz : new_sz);
+    return ret;
+}
+
+//Individual frees do nothing, except that the most recent allocation can be
+//given back. Everything else waits for mm_arena_reset
+static void mm_arena_free_fn(void *ctx, void *p, unsigned long sz) {
+    mm_arena *a = ctx;
+    if (p && mm_arena_is_last(a, p)) {
+        a->__internal.chunks->pos = a->__internal.chunks->last;
+    }
+}
+
+#endif
+
+//////////////////
+// Hugepages    //
+//////////////////
+
+//Maps at least sz bytes (rounded up to a whole hugepage) of zeroed memory.
+//Tries explicit hugepages first (these need to be reserved through
+///proc/sys/vm/nr_hugepages) and falls back to asking for transparent
+//hugepages. Returns NULL and sets *err on error
+void *mm_huge_map(unsigned long sz, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    sz = (sz + MM_HUGEPAGE_SIZE - 1) & ~(MM_HUGEPAGE_SIZE - 1);
+
+    void *ret = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ret != MAP_FAILED) return ret;
+
+    ret = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED) {
+        *err = MM_ALLOC_OOM;
+        return NULL;
+    }
+    madvise(ret, sz, MADV_HUGEPAGE);
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Unmaps memory from mm_huge_map. sz must be the size you asked for.
+//Gracefully ignores NULL input
+void mm_huge_unmap(void *p, unsigned long sz)
+#ifdef MM_IMPLEMENT
+{
+    if (!p) return;
+    sz = (sz + MM_HUGEPAGE_SIZE - 1) & ~(MM_HUGEPAGE_SIZE - 1);
+    munmap(p, sz);
+}
+#else
+;
+#endif
+
+//Makes the slab allocator carve objects out of hugepages from now on
+//(nonzero) or out of regular malloc'd chunks (zero). Only affects chunks
+//grabbed after the call
+void mm_slab_use_hugepages(int on)
+#ifdef MM_IMPLEMENT
+{
+    mm_slab_hugepages = on;
+}
+#else
+;
+#endif
+
+//////////////////
+// Arenas       //
+//////////////////
+
+//Initializes an (embedded) arena whose chunks come from parent (or malloc if
+//parent is NULL). chunk_sz is how much to ask the parent for at a time
+//(including a small header, so a power of two lines up nicely with the slab
+//size classes). 0 means MM_ARENA_DEFAULT_CHUNK. Allocations that don't fit
+//in a chunk get a chunk of their own. Nothing is allocated until the first
+//allocation. Assumes a is non-NULL
+void init_mm_arena(mm_arena *a, mm_allocator const *parent, unsigned long chunk_sz)
+#ifdef MM_IMPLEMENT
+{
+    a->alloc.alloc = mm_arena_fn;
+    a->alloc.realloc = mm_arena_realloc_fn;
+    a->alloc.free = mm_arena_free_fn;
+    a->alloc.ctx = a;
+
+    a->__internal.parent = parent ? parent : &mm_malloc_alloc;
+    if (chunk_sz <= sizeof(mm_arena_chunk)) chunk_sz = MM_ARENA_DEFAULT_CHUNK;
+    a->__internal.chunk_sz = chunk_sz;
+    a->__internal.chunks = NULL;
+}
+#else
+;
+#endif
+
+//Frees everything allocated from the arena at once. The oldest chunk is
+//kept (so in the steady state, resetting and reusing an arena never touches
+//the parent allocator). Extra chunks go back to the parent. Assumes a is
+//non-NULL
+void mm_arena_reset(mm_arena *a)
+#ifdef MM_IMPLEMENT
+{
+    mm_allocator const *parent = a->__internal.parent;
+    mm_arena_chunk *c = a->__internal.chunks;
+    if (!c) return;
+
+    while (c->next) {
+        mm_arena_chunk *next = c->next;
+        parent->free(parent->ctx, c, sizeof(mm_arena_chunk) + c->cap);
+        c = next;
+    }
+
+    c->pos = 0;
+    c->last = 0;
+    a->__internal.chunks = c;
+}
+#else
+;
+#endif
+
+//Gives all of the arena's memory back to its parent. The arena can still be
+//used afterwards. Assumes a is non-NULL
+void clear_mm_arena(mm_arena *a)
+#ifdef MM_IMPLEMENT
+{
+    mm_arena_reset(a);
+
+    mm_allocator const *parent = a->__internal.parent;
+    mm_arena_chunk *c = a->__internal.chunks;
+    if (c) parent->free(parent->ctx, c, sizeof(mm_arena_chunk) + c->cap);
+    a->__internal.chunks = NULL;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
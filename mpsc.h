@@ -0,0 +1,276 @@
+//Bounded multi-producer, single-consumer queue, for getting work from any
+//thread to the one thread that owns an event loop. It's Dmitry Vyukov's
+//bounded ring: every cell has a sequence number that says whose turn it is,
+//so producers only fight over the tail index (one compare-and-swap) and the
+//consumer never touches anything shared but the cells themselves. No locks
+//anywhere. When the ring is full, mpsc_push fails right away instead of
+//waiting.
+//
+//Optionally, the queue has an eventfd that goes readable when there's
+//something to pop, so it can sit in an epoll set. Wakeups are coalesced:
+//only the first push after the consumer has cleared the wakeup writes to
+//the eventfd. Everything pushed before the consumer gets around to
+//draining rides along for free, so a busy producer doesn't make a syscall
+//per item.
+//
+//Each item is a few words. What they mean is up to you (see mpsc_item).
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef MPSC_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define MPSC_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef MPSC_H
+        #define SHOULD_INCLUDE 1
+        #define MPSC_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "mpsc.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Producers and the consumer each get their own cache line, so they
+    //don't slow each other down just by being next to each other
+    #define MPSC_CACHE_LINE 64
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(MPSC_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(MPSC_INVALID_ARG, "invalid argument");
+MM_ERR(MPSC_OOM, "out of memory");
+MM_ERR(MPSC_EVENTFD_ERROR, "could not make eventfd (check errno)");
+MM_ERR(MPSC_FULL, "queue is full");
+
+//////////////////////
+// Queue structures //
+//////////////////////
+#ifndef MM_IMPLEMENT
+    typedef struct _mpsc_item {
+        unsigned long id;
+        void *data;
+        unsigned tag;
+    } mpsc_item;
+
+    typedef struct _mpsc_cell {
+        //pos means it's free for the push at pos, pos + 1 means the item
+        //pushed at pos is ready to pop
+        unsigned long seq;
+        mpsc_item item;
+    } mpsc_cell;
+
+    typedef struct _mpsc_queue {
+        //Number of cells (a power of two)
+        unsigned long cap;
+        //-1 if you didn't ask for one
+        int efd;
+
+        //Internal fields. Don't touch!
+        struct {
+            mpsc_cell *cells;
+            char pad0[MPSC_CACHE_LINE];
+            //Where the next push goes. Shared by all producers
+            unsigned long tail;
+            //Set by the push that wrote to efd, until mpsc_clear_wakeup
+            int signaled;
+            char pad1[MPSC_CACHE_LINE];
+            //Where the next pop comes from. Only the consumer uses this
+            unsigned long head;
+        } __internal;
+    } mpsc_queue;
+#endif
+
+/////////////////////////////////
+// Managing mpsc_queue structs //
+/////////////////////////////////
+
+//Returns a new queue with room for at least cap items. If want_eventfd is
+//nonzero, q->efd is an eventfd that's readable whenever there's something
+//to pop (see mpsc_clear_wakeup). Returns NULL and sets *err on error
+mpsc_queue *new_mpsc_queue(unsigned long cap, int want_eventfd, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (cap == 0 || cap > (1UL << 31)) {
+        *err = MPSC_INVALID_ARG;
+        return NULL;
+    }
+
+    unsigned long n = 1;
+    while (n < cap) n *= 2;
+
+    mpsc_queue *ret = malloc(sizeof(mpsc_queue));
+    if (!ret) {
+        *err = MPSC_OOM;
+        return NULL;
+    }
+    ret->__internal.cells = malloc(n * sizeof(mpsc_cell));
+    if (!ret->__internal.cells) {
+        free(ret);
+        *err = MPSC_OOM;
+        return NULL;
+    }
+
+    ret->cap = n;
+    unsigned long i;
+    for (i = 0; i < n; i++) ret->__internal.cells[i].seq = i;
+    ret->__internal.tail = 0;
+    ret->__internal.head = 0;
+    ret->__internal.signaled = 0;
+
+    ret->efd = -1;
+    if (want_eventfd) {
+        ret->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (ret->efd < 0) {
+            free(ret->__internal.cells);
+            free(ret);
+            *err = MPSC_EVENTFD_ERROR;
+            return NULL;
+        }
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Frees q. Whatever is still in it is just forgotten, so pop it all first if
+//that matters. Gracefully ignores NULL input
+void del_mpsc_queue(mpsc_queue *q)
+#ifdef MM_IMPLEMENT
+{
+    if (!q) return;
+    if (q->efd >= 0) close(q->efd);
+    free(q->__internal.cells);
+    free(q);
+}
+#else
+;
+#endif
+
+/////////////////////////
+// Pushing and popping //
+/////////////////////////
+
+//Adds an item to q. Safe to call from any thread, at the same time as
+//other pushes and a pop. Returns 0, or -1 with *err set to MPSC_FULL if
+//there's no room (in which case nothing happened). Doesn't make a syscall
+//unless the consumer needs waking up
+int mpsc_push(mpsc_queue *q, unsigned long id, void *data, unsigned tag, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!q) {
+        *err = MPSC_NULL_ARG;
+        return -1;
+    }
+
+    unsigned long mask = q->cap - 1;
+    unsigned long pos = __atomic_load_n(&q->__internal.tail, __ATOMIC_RELAXED);
+    mpsc_cell *cell;
+    while (1) {
+        cell = q->__internal.cells + (pos & mask);
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) (seq - pos);
+        if (diff == 0) {
+            //Our turn, if nobody beats us to it. (On failure, pos gets the
+            //new tail)
+            if (__atomic_compare_exchange_n(&q->__internal.tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if (diff < 0) {
+            //The consumer hasn't gotten to the item a lap ago
+            *err = MPSC_FULL;
+            return -1;
+        } else {
+            //Someone else pushed here already
+            pos = __atomic_load_n(&q->__internal.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->item.id = id;
+    cell->item.data = data;
+    cell->item.tag = tag;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (q->efd < 0) return 0;
+
+    //Pairs with the fence in mpsc_clear_wakeup: either the consumer sees our
+    //item when it drains, or we see that it's no longer signaled
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->__internal.signaled, __ATOMIC_RELAXED)) return 0;
+    if (__atomic_exchange_n(&q->__internal.signaled, 1, __ATOMIC_ACQ_REL)) return 0;
+    eventfd_write(q->efd, 1);
+    return 0;
+}
+#else
+;
+#endif
+
+//Takes the oldest item off q and puts it in *out. Returns 1 if there was
+//one, and 0 if q is empty. Only one thread (the consumer) can call this.
+//Assumes its arguments are non-NULL
+int mpsc_pop(mpsc_queue *q, mpsc_item *out)
+#ifdef MM_IMPLEMENT
+{
+    unsigned long pos = q->__internal.head;
+    mpsc_cell *cell = q->__internal.cells + (pos & (q->cap - 1));
+    unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    //A producer might have claimed this cell but not finished writing it.
+    //Whatever comes after it waits too, so items come out in order
+    if (seq != pos + 1) return 0;
+
+    *out = cell->item;
+    //Free for the push one lap from now
+    __atomic_store_n(&cell->seq, pos + q->cap, __ATOMIC_RELEASE);
+    q->__internal.head = pos + 1;
+    return 1;
+}
+#else
+;
+#endif
+
+//The consumer calls this when q->efd goes readable, before popping
+//everything. The next push after this wakes it up again. Assumes q is
+//non-NULL
+void mpsc_clear_wakeup(mpsc_queue *q)
+#ifdef MM_IMPLEMENT
+{
+    eventfd_t junk;
+    eventfd_read(q->efd, &junk);
+    __atomic_store_n(&q->__internal.signaled, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,446 @@
+//Token bucket rate limits, per connection and per IP prefix (e.g. every
+//client in the same /24 shares one set of buckets). There are limits on
+//bytes, HTTP requests and websocket frames per second, each with its own
+//burst size.
+//
+//A bucket is 8 bytes: a token count and the time (in milliseconds) it was
+//last topped up. Nothing runs in the background; a bucket is only refilled
+//when someone looks at it, by however much time has passed since. So an
+//idle connection costs nothing but its 8 bytes per bucket.
+//
+//server.h uses this when you set params.ratelimit. A connection that runs
+//out of tokens stops being read from until it has some again, so the
+//kernel's socket buffer (and then TCP) does the pushing back, not us.
+//
+//Not thread-safe; one table per event loop.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef RATELIMIT_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define RATELIMIT_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef RATELIMIT_H
+        #define SHOULD_INCLUDE 1
+        #define RATELIMIT_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "ratelimit.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //How far we look for an IP prefix's slot in the table. If every slot
+    //in the way is in use, that connection just doesn't get a per-IP limit
+    #define RL_MAX_PROBE 16
+    #define RL_DEFAULT_IP_SLOTS 65536
+    #define RL_DEFAULT_IP4_PREFIX 24
+    #define RL_DEFAULT_IP6_PREFIX 64
+    //What rl_avail says when nothing is limited
+    #define RL_UNLIMITED 0x7fffffffL
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(RL_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(RL_INVALID_ARG, "invalid argument");
+MM_ERR(RL_OOM, "out of memory");
+
+//////////////////////////////
+// Rate limit structs/enums //
+//////////////////////////////
+#ifndef MM_IMPLEMENT
+    #define RL_KIND_IDS \
+        X(RL_BYTES), \
+        X(RL_REQUESTS), \
+        X(RL_FRAMES)
+
+    typedef enum _rl_kind_t {
+    #define X(x) x
+        RL_KIND_IDS
+    #undef X
+    } rl_kind_t;
+
+    #define RL_NUM_KINDS (RL_FRAMES + 1)
+
+    extern char const *const rl_kind_strs[];
+
+    //rate is per second, and 0 means no limit. burst is how many tokens a
+    //bucket holds (0 means the same as rate)
+    typedef struct _rl_limit {
+        unsigned rate;
+        unsigned burst;
+    } rl_limit;
+
+    typedef struct _rl_bucket {
+        unsigned tokens;
+        unsigned last_ms;
+    } rl_bucket;
+
+    typedef struct _rl_params {
+        //Indexed by rl_kind_t
+        rl_limit conn[RL_NUM_KINDS];
+        rl_limit ip[RL_NUM_KINDS];
+        //How many leading bits of the address make up the "IP" for the ip
+        //limits
+        int ip4_prefix;
+        int ip6_prefix;
+        //Size of the table of IP prefixes. Rounded up to a power of two
+        int ip_slots;
+    } rl_params;
+
+    //Keep one of these per connection
+    typedef struct _rl_state {
+        rl_bucket b[RL_NUM_KINDS];
+        //-1 if the connection has no per-IP limit
+        int ip_slot;
+    } rl_state;
+
+    typedef struct _rl_ip {
+        //IPv4 addresses are stored IPv4-mapped. Everything past the prefix
+        //is zeroed
+        unsigned char key[16];
+        //Connections using this slot. Slots nobody uses are taken over by
+        //other prefixes, but only once their buckets are full again, so
+        //reconnecting doesn't get you a fresh set
+        int refs;
+        rl_bucket b[RL_NUM_KINDS];
+    } rl_ip;
+
+    typedef struct _rl_table {
+        rl_params params;
+
+        //Counters
+        unsigned long throttled;    //Times a connection ran out of tokens
+        unsigned long ip_overflows; //Connections that got no slot
+
+        //Internal fields. Don't touch!
+        struct {
+            rl_ip *slots;
+            unsigned mask;
+        } __internal;
+    } rl_table;
+#else
+    #define X(x) #x
+    char const *const rl_kind_strs[] = {
+        RL_KIND_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+static void rl_fill(rl_bucket *b, rl_limit const *lim, unsigned now) {
+    b->tokens = lim->burst;
+    b->last_ms = now;
+}
+
+//Tops up b for the time that passed since last_ms
+static void rl_refill(rl_bucket *b, rl_limit const *lim, unsigned now) {
+    if (lim->rate == 0) return;
+
+    unsigned long elapsed = (unsigned) (now - b->last_ms);
+    if (elapsed > (1UL << 31)) elapsed = 1UL << 31;
+    unsigned long add = elapsed * lim->rate / 1000;
+    if (add == 0) return;
+
+    if (b->tokens + add >= lim->burst) {
+        b->tokens = lim->burst;
+        b->last_ms = now;
+    } else {
+        b->tokens += add;
+        //Only move forward by the time we actually paid out for, so the
+        //leftover fraction of a token isn't lost. (Rounded up, or at more
+        //than 1000/s we'd never move at all)
+        b->last_ms += (add * 1000 + lim->rate - 1) / lim->rate;
+    }
+}
+
+static unsigned long rl_hash(unsigned char const *key) {
+    unsigned long a, b;
+    memcpy(&a, key, 8);
+    memcpy(&b, key + 8, 8);
+    unsigned long h = a * 0x9E3779B97F4A7C15UL ^ b;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9UL;
+    return h ^ (h >> 32);
+}
+
+//Fills key with the address's prefix. Returns -1 if it's not an IP address
+static int rl_key(rl_table const *t, struct sockaddr const *addr, unsigned char *key) {
+    memset(key, 0, 16);
+    int bits;
+    if (addr->sa_family == AF_INET) {
+        key[10] = key[11] = 0xFF;
+        memcpy(key + 12, &((struct sockaddr_in const *) addr)->sin_addr, 4);
+        bits = 96 + t->params.ip4_prefix;
+    } else if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((struct sockaddr_in6 const *) addr)->sin6_addr, 16);
+        bits = t->params.ip6_prefix;
+    } else {
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < 16; i++) {
+        if (bits >= 8) bits -= 8;
+        else {
+            key[i] &= (unsigned char) (0xFF00 >> bits);
+            bits = 0;
+        }
+    }
+    return 0;
+}
+
+//Whether nobody uses slot s and its buckets have all filled back up
+static int rl_ip_idle(rl_table *t, rl_ip *s, unsigned now) {
+    if (s->refs > 0) return 0;
+    int k;
+    for (k = 0; k < RL_NUM_KINDS; k++) {
+        rl_limit const *lim = t->params.ip + k;
+        rl_refill(s->b + k, lim, now);
+        if (lim->rate && s->b[k].tokens < lim->burst) return 0;
+    }
+    return 1;
+}
+
+#endif
+
+//////////////////////////////////
+// Setting up and tearing down //
+//////////////////////////////////
+
+//Everything unlimited, default prefixes and table size. Assumes p is
+//non-NULL
+void rl_default_params(rl_params *p)
+#ifdef MM_IMPLEMENT
+{
+    memset(p, 0, sizeof(rl_params));
+    p->ip4_prefix = RL_DEFAULT_IP4_PREFIX;
+    p->ip6_prefix = RL_DEFAULT_IP6_PREFIX;
+    p->ip_slots = RL_DEFAULT_IP_SLOTS;
+}
+#else
+;
+#endif
+
+//Returns a new table with the given limits. Returns NULL and sets *err on
+//error
+rl_table *new_rl_table(rl_params const *params, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!params) {
+        *err = RL_NULL_ARG;
+        return NULL;
+    }
+    if (params->ip4_prefix < 0 || params->ip4_prefix > 32
+        || params->ip6_prefix < 0 || params->ip6_prefix > 128
+        || params->ip_slots <= 0
+    ) {
+        *err = RL_INVALID_ARG;
+        return NULL;
+    }
+
+    rl_table *ret = calloc(1, sizeof(rl_table));
+    if (!ret) {
+        *err = RL_OOM;
+        return NULL;
+    }
+    ret->params = *params;
+
+    int k;
+    for (k = 0; k < RL_NUM_KINDS; k++) {
+        if (ret->params.conn[k].burst == 0) ret->params.conn[k].burst = ret->params.conn[k].rate;
+        if (ret->params.ip[k].burst == 0) ret->params.ip[k].burst = ret->params.ip[k].rate;
+    }
+
+    //Only bother with the table if there's an IP limit at all
+    int any_ip = 0;
+    for (k = 0; k < RL_NUM_KINDS; k++) any_ip |= ret->params.ip[k].rate != 0;
+    if (any_ip) {
+        unsigned cap = 1;
+        while (cap < (unsigned) params->ip_slots) cap <<= 1;
+        ret->__internal.slots = calloc(cap, sizeof(rl_ip));
+        if (!ret->__internal.slots) {
+            free(ret);
+            *err = RL_OOM;
+            return NULL;
+        }
+        ret->__internal.mask = cap - 1;
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Gracefully ignores NULL input. Connections using t must be gone first
+void del_rl_table(rl_table *t)
+#ifdef MM_IMPLEMENT
+{
+    if (!t) return;
+    free(t->__internal.slots);
+    free(t);
+}
+#else
+;
+#endif
+
+//Current time in the milliseconds the buckets use
+unsigned rl_now_ms()
+#ifdef MM_IMPLEMENT
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+#else
+;
+#endif
+
+///////////////////////////
+// Limiting a connection //
+///////////////////////////
+
+//Sets up st for a new connection from addr (which can be NULL, or not an IP
+//address, in which case only the per-connection limits apply)
+void rl_open(rl_table *t, rl_state *st, struct sockaddr const *addr)
+#ifdef MM_IMPLEMENT
+{
+    unsigned now = rl_now_ms();
+    int k;
+    for (k = 0; k < RL_NUM_KINDS; k++) rl_fill(st->b + k, t->params.conn + k, now);
+    st->ip_slot = -1;
+
+    unsigned char key[16];
+    if (!t->__internal.slots || !addr || rl_key(t, addr, key) < 0) return;
+
+    unsigned long h = rl_hash(key);
+    int free_slot = -1;
+    int i;
+    for (i = 0; i < RL_MAX_PROBE; i++) {
+        int idx = (h + i) & t->__internal.mask;
+        rl_ip *s = t->__internal.slots + idx;
+        if (!memcmp(s->key, key, 16) && (s->refs > 0 || s->b[0].last_ms)) {
+            s->refs++;
+            st->ip_slot = idx;
+            return;
+        }
+        if (free_slot < 0 && rl_ip_idle(t, s, now)) free_slot = idx;
+    }
+
+    if (free_slot < 0) {
+        t->ip_overflows++;
+        return;
+    }
+
+    rl_ip *s = t->__internal.slots + free_slot;
+    memcpy(s->key, key, 16);
+    s->refs = 1;
+    for (k = 0; k < RL_NUM_KINDS; k++) rl_fill(s->b + k, t->params.ip + k, now);
+    //last_ms doubles as "this slot was ever used", so never let it be 0
+    if (!s->b[0].last_ms) s->b[0].last_ms = 1;
+    st->ip_slot = free_slot;
+}
+#else
+;
+#endif
+
+//Call when the connection goes away
+void rl_close(rl_table *t, rl_state *st)
+#ifdef MM_IMPLEMENT
+{
+    if (st->ip_slot >= 0) t->__internal.slots[st->ip_slot].refs--;
+    st->ip_slot = -1;
+}
+#else
+;
+#endif
+
+//Returns how many tokens of the given kind the connection may use right
+//now (the smaller of its own and its IP's), or RL_UNLIMITED. If it's 0,
+//*wait_ms says how long until there's at least one again
+long rl_avail(rl_table *t, rl_state *st, rl_kind_t kind, unsigned *wait_ms)
+#ifdef MM_IMPLEMENT
+{
+    rl_limit const *lims[2] = {t->params.conn + kind, t->params.ip + kind};
+    rl_bucket *bs[2] = {st->b + kind, st->ip_slot >= 0 ? t->__internal.slots[st->ip_slot].b + kind : NULL};
+    if (lims[0]->rate == 0 && (!bs[1] || lims[1]->rate == 0)) return RL_UNLIMITED;
+
+    unsigned now = rl_now_ms();
+    long ret = RL_UNLIMITED;
+    unsigned wait = 0;
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (!bs[i] || lims[i]->rate == 0) continue;
+        rl_refill(bs[i], lims[i], now);
+        if (bs[i]->tokens < ret) ret = bs[i]->tokens;
+        if (bs[i]->tokens == 0) {
+            //Time until the next whole token
+            unsigned w = (1000 + lims[i]->rate - 1) / lims[i]->rate;
+            unsigned spent = now - bs[i]->last_ms;
+            w = spent < w ? w - spent : 1;
+            if (w > wait) wait = w;
+        }
+    }
+
+    if (ret == 0) {
+        t->throttled++;
+        if (wait_ms) *wait_ms = wait;
+    }
+    return ret;
+}
+#else
+;
+#endif
+
+//Uses up n tokens of the given kind (or as many as there are). Call
+//rl_avail first; this doesn't refill anything
+void rl_take(rl_table *t, rl_state *st, rl_kind_t kind, unsigned n)
+#ifdef MM_IMPLEMENT
+{
+    rl_bucket *b = st->b + kind;
+    if (t->params.conn[kind].rate) b->tokens = b->tokens > n ? b->tokens - n : 0;
+
+    if (st->ip_slot >= 0 && t->params.ip[kind].rate) {
+        b = t->__internal.slots[st->ip_slot].b + kind;
+        b->tokens = b->tokens > n ? b->tokens - n : 0;
+    }
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,509 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "mm_err.h"
+#include "http_parse.h"
+#include "websock.h"
+#include "h2.h"
+#include "capture.h"
+
+//Plays back a capture log (see capture.h) made by the server, e.g. with
+//"MM_CAPTURE=traffic.cap ./server". Every connection gets exactly the chunks
+//it got the first time around, so whatever was odd about the real traffic
+//(tiny segments, pipelined requests, a burst of frames in one read) comes
+//back too.
+//
+//Usage:
+//  replay [-m parse|server] [-h host] [-p port] [-t] [-s speed] [-r runs]
+//         capture_file
+//
+//In parse mode (the default), there are no sockets: each connection's
+//chunks go straight into its own parsers, the way the server would feed
+//them. HTTP/1.1 connections switch to the websocket parser after a
+//websocket upgrade, and to the HTTP/2 parser on the h2 preface (or an h2c
+//upgrade). Each run reports ns/chunk; the best one goes in the RESULT line.
+//
+//In server mode, every captured connection becomes a real connection to
+//host:port, and gets the same chunks sent down it. Responses are read and
+//thrown away. A capture from a TLS server holds plaintext, so replay it
+//against a plain one.
+//
+//Normally the chunks go out as fast as possible. -t waits between them like
+//the original traffic did (-s 2 for twice as fast). In parse mode, the
+//waiting isn't counted.
+
+#define READ_SIZE 65536
+#define DRAIN_NS 2000000000UL
+
+typedef enum {
+    RP_HTTP,
+    RP_WEBSOCK,
+    RP_H2,
+    RP_DEAD
+} rp_mode_t;
+
+//One captured connection
+typedef struct _rp_conn {
+    //Parse mode
+    rp_mode_t mode;
+    http_req *req;
+    websock_pkt *pkt;
+    h2_conn *h2;
+    //Nothing's been fed to req since it was last reset
+    int at_start;
+
+    //Server mode
+    int fd;
+    int open;
+} rp_conn;
+
+static struct {
+    char const *host;
+    char const *port;
+    int server;
+    int timed;
+    double speed;
+    int runs;
+} cfg = {"127.0.0.1", "2345", 0, 0, 1.0, 5};
+
+static struct {
+    unsigned long reqs;
+    unsigned long msgs;
+    unsigned long errors;
+    unsigned long sent;
+    unsigned long recvd;
+} stats;
+
+//Every record in the file, and which rp_conn each belongs to
+static cap_rec *recs;
+static int *rec_conns;
+static int num_recs;
+static rp_conn *conns;
+static int num_conns;
+
+static int epfd = -1;
+
+static unsigned long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void sleep_until(unsigned long deadline) {
+    struct timespec ts = {deadline / 1000000000UL, deadline % 1000000000UL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+//When record i should go out, given the run started at start
+static unsigned long rec_deadline(unsigned long start, int i) {
+    return start + (unsigned long) ((recs[i].ts_ns - recs[0].ts_ns) / cfg.speed);
+}
+
+static int cmp_ids(void const *a, void const *b) {
+    unsigned long x = *(unsigned long const *) a;
+    unsigned long y = *(unsigned long const *) b;
+    return (x > y) - (x < y);
+}
+
+//Reads the whole log, and numbers the connections 0 to num_conns-1
+static int load(char const *path) {
+    mm_err err = MM_SUCCESS;
+    cap_reader *r = new_cap_reader(path, &err);
+    if (err != MM_SUCCESS) {
+        fprintf(stderr, "Could not read %s: %s\n", path, err);
+        return -1;
+    }
+    if (r->dropped) fprintf(stderr, "Warning: %lu records were dropped while capturing\n", r->dropped);
+
+    recs = malloc((r->num_recs + 1) * sizeof(cap_rec));
+    rec_conns = malloc((r->num_recs + 1) * sizeof(int));
+    unsigned long *ids = malloc((r->num_recs + 1) * sizeof(unsigned long));
+    cap_rec rec;
+    while (num_recs < (int) r->num_recs && cap_next(r, &rec, &err) > 0) {
+        //The data stays mapped, since we never delete the reader
+        ids[num_recs] = rec.conn;
+        recs[num_recs++] = rec;
+    }
+    if (err != MM_SUCCESS) {
+        fprintf(stderr, "Could not read %s: %s\n", path, err);
+        return -1;
+    }
+
+    qsort(ids, num_recs, sizeof(unsigned long), cmp_ids);
+    int i;
+    for (i = 0; i < num_recs; i++) {
+        if (i == 0 || ids[i] != ids[num_conns - 1]) ids[num_conns++] = ids[i];
+    }
+    for (i = 0; i < num_recs; i++) {
+        unsigned long *id = bsearch(&recs[i].conn, ids, num_conns, sizeof(unsigned long), cmp_ids);
+        rec_conns[i] = id - ids;
+    }
+    free(ids);
+
+    conns = calloc(num_conns + 1, sizeof(rp_conn));
+    return 0;
+}
+
+////////////////
+// Parse mode //
+////////////////
+
+static void start_h2(rp_conn *c, http_req const *upgrade) {
+    mm_err err = MM_SUCCESS;
+    http_limits limits;
+    http_default_limits(&limits);
+    c->h2 = new_h2_conn(&limits, &err);
+    if (upgrade) {
+        //The upgrade request itself is stream 1, and already counted
+        h2_upgrade(c->h2, upgrade, &err);
+        h2_end_response(c->h2, 1, &err);
+    }
+    c->mode = err == MM_SUCCESS ? RP_H2 : RP_DEAD;
+    if (err != MM_SUCCESS) stats.errors++;
+}
+
+static void feed_h2(rp_conn *c, char const *buf, int len) {
+    mm_err err = MM_SUCCESS;
+    if (write_to_h2_parser(c->h2, buf, len, &err) < 0) {
+        stats.errors++;
+        c->mode = RP_DEAD;
+        return;
+    }
+
+    unsigned id;
+    while ((id = h2_next_request(c->h2))) {
+        reset_http_req(c->req);
+        h2_stream_req(c->h2, id, c->req, &err);
+        if (err == MM_SUCCESS) stats.reqs++;
+        else if (err != H2_NO_STREAM) stats.errors++;
+        //Nobody answers, so this resets the stream. Either way it's gone
+        err = MM_SUCCESS;
+        h2_end_response(c->h2, id, &err);
+    }
+    //Whatever the server would have sent (SETTINGS acks, WINDOW_UPDATEs,
+    //resets) goes nowhere
+    c->h2->out.len = 0;
+}
+
+//Same idea as srv_feed in server.h, minus the sockets
+static void feed(rp_conn *c, char const *buf, int len) {
+    while (len > 0 && c->mode != RP_DEAD) {
+        mm_err err = MM_SUCCESS;
+        int rc;
+
+        if (c->mode == RP_H2) {
+            feed_h2(c, buf, len);
+            return;
+        }
+
+        if (c->mode == RP_HTTP) {
+            if (c->at_start && h2_is_preface(buf, len)) {
+                start_h2(c, NULL);
+                continue;
+            }
+            c->at_start = 0;
+            rc = write_to_http_parser(c->req, buf, len, &err);
+        } else {
+            rc = write_to_websock_parser(c->pkt, buf, len, &err);
+        }
+
+        int used = len;
+        if (rc < 0 && (err == HTTP_STRAGGLERS || err == WEBSOCK_STRAGGLERS)) {
+            used = -rc;
+            rc = 0;
+        } else if (rc < 0) {
+            stats.errors++;
+            c->mode = RP_DEAD;
+            return;
+        }
+
+        buf += used;
+        len -= used;
+        if (rc > 0) continue;
+
+        if (c->mode == RP_HTTP) {
+            stats.reqs++;
+            err = MM_SUCCESS;
+            if (is_websock_request(c->req, &err)) c->mode = RP_WEBSOCK;
+            else if (is_h2c_upgrade(c->req)) start_h2(c, c->req);
+            reset_http_req(c->req);
+            c->at_start = 1;
+        } else {
+            stats.msgs++;
+            reset_websock_pkt(c->pkt);
+        }
+    }
+}
+
+static void open_parsers(rp_conn *c) {
+    mm_err err = MM_SUCCESS;
+    c->req = new_http_req(&err);
+    c->pkt = new_websock_pkt(&err);
+    c->mode = err == MM_SUCCESS ? RP_HTTP : RP_DEAD;
+    c->at_start = 1;
+    c->open = 1;
+}
+
+static void close_parsers(rp_conn *c) {
+    del_http_req(c->req);
+    del_websock_pkt(c->pkt);
+    del_h2_conn(c->h2);
+    memset(c, 0, sizeof(rp_conn));
+}
+
+//Returns the time spent parsing
+static unsigned long run_parse() {
+    unsigned long parse_ns = 0;
+    unsigned long start = now_ns();
+
+    int i;
+    for (i = 0; i < num_recs; i++) {
+        if (cfg.timed) sleep_until(rec_deadline(start, i));
+        unsigned long t = cfg.timed ? now_ns() : 0;
+
+        rp_conn *c = conns + rec_conns[i];
+        switch (recs[i].type) {
+        case CAP_OPEN:
+            if (c->open) close_parsers(c);
+            open_parsers(c);
+            break;
+        case CAP_DATA:
+            //Started before the capture did; nothing we can do with it
+            if (c->open) feed(c, recs[i].data, recs[i].len);
+            break;
+        case CAP_CLOSE:
+            if (c->open) close_parsers(c);
+            break;
+        }
+
+        if (cfg.timed) parse_ns += now_ns() - t;
+    }
+
+    if (!cfg.timed) parse_ns = now_ns() - start;
+    for (i = 0; i < num_conns; i++) {
+        if (conns[i].open) close_parsers(conns + i);
+    }
+    return parse_ns;
+}
+
+/////////////////
+// Server mode //
+/////////////////
+
+static int connect_to_server() {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res;
+    if (getaddrinfo(cfg.host, cfg.port, &hints, &res) != 0) return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+        if (fd >= 0) close(fd);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+static void hang_up(rp_conn *c) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->open = 0;
+}
+
+//Reads and throws away whatever the server sent
+static void drain(rp_conn *c) {
+    static char buf[READ_SIZE];
+    while (c->open) {
+        int n = read(c->fd, buf, sizeof(buf));
+        if (n > 0) {
+            stats.recvd += n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            hang_up(c);
+        } else {
+            return;
+        }
+    }
+}
+
+//Sends all of buf. If the socket fills up, keep reading responses while we
+//wait, or a server that blocks on us reading could deadlock us both
+static void send_all(rp_conn *c, char const *buf, int len) {
+    while (len > 0 && c->open) {
+        int n = send(c->fd, buf, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            stats.sent += n;
+            buf += n;
+            len -= n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            struct pollfd p = {c->fd, POLLIN | POLLOUT, 0};
+            poll(&p, 1, 1000);
+            if (p.revents & (POLLIN | POLLHUP | POLLERR)) drain(c);
+        } else {
+            //The server hung up on us, which it didn't do the first time
+            //(or we'd have a CLOSE record before this data)
+            stats.errors++;
+            hang_up(c);
+        }
+    }
+}
+
+//Reads responses until deadline (or just what's there, if that's now)
+static void poll_until(unsigned long deadline) {
+    struct epoll_event evs[64];
+    do {
+        unsigned long now = now_ns();
+        int wait_ms = deadline > now ? (deadline - now) / 1000000 : 0;
+        int n = epoll_wait(epfd, evs, 64, wait_ms);
+        int i;
+        for (i = 0; i < n; i++) drain(evs[i].data.ptr);
+    } while (now_ns() < deadline);
+}
+
+static int num_open() {
+    int ret = 0;
+    int i;
+    for (i = 0; i < num_conns; i++) ret += conns[i].open;
+    return ret;
+}
+
+//Returns the time it took to send everything
+static unsigned long run_server() {
+    unsigned long start = now_ns();
+
+    int i;
+    for (i = 0; i < num_recs; i++) {
+        if (cfg.timed) poll_until(rec_deadline(start, i));
+        else poll_until(0);
+
+        rp_conn *c = conns + rec_conns[i];
+        switch (recs[i].type) {
+        case CAP_OPEN:
+            if (c->open) hang_up(c);
+            c->fd = connect_to_server();
+            if (c->fd < 0) {
+                fprintf(stderr, "Could not connect to %s:%s\n", cfg.host, cfg.port);
+                exit(1);
+            }
+            c->open = 1;
+            struct epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+            break;
+        case CAP_DATA:
+            if (c->open) send_all(c, recs[i].data, recs[i].len);
+            break;
+        case CAP_CLOSE:
+            //Let the server finish answering; it hangs up after that
+            if (c->open) shutdown(c->fd, SHUT_WR);
+            break;
+        }
+    }
+    unsigned long elapsed = now_ns() - start;
+
+    //Give the stragglers a chance to finish
+    unsigned long give_up = now_ns() + DRAIN_NS;
+    while (num_open() > 0 && now_ns() < give_up) poll_until(now_ns() + 10000000);
+    for (i = 0; i < num_conns; i++) {
+        if (conns[i].open) hang_up(conns + i);
+    }
+
+    return elapsed;
+}
+
+static void usage(char const *prog) {
+    fprintf(stderr,
+        "Usage: %s [-m parse|server] [-h host] [-p port] [-t] [-s speed] [-r runs]\n"
+        "       capture_file\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:h:p:ts:r:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!strcmp(optarg, "server")) cfg.server = 1;
+            else if (!strcmp(optarg, "parse")) cfg.server = 0;
+            else usage(argv[0]);
+            break;
+        case 'h': cfg.host = optarg; break;
+        case 'p': cfg.port = optarg; break;
+        case 't': cfg.timed = 1; break;
+        case 's': cfg.speed = atof(optarg); break;
+        case 'r': cfg.runs = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || cfg.speed <= 0 || cfg.runs <= 0) usage(argv[0]);
+
+    if (load(argv[optind]) < 0) return 1;
+    if (num_recs == 0) {
+        fprintf(stderr, "Nothing to replay\n");
+        return 1;
+    }
+
+    unsigned long total_bytes = 0;
+    int num_chunks = 0;
+    int i;
+    for (i = 0; i < num_recs; i++) {
+        if (recs[i].type != CAP_DATA) continue;
+        total_bytes += recs[i].len;
+        num_chunks++;
+    }
+    printf("%d connections, %d chunks, %lu bytes, %.3f s of traffic\n",
+        num_conns, num_chunks, total_bytes, (recs[num_recs - 1].ts_ns - recs[0].ts_ns) / 1e9);
+
+    if (cfg.server) {
+        epfd = epoll_create1(0);
+        if (epfd < 0) {
+            fprintf(stderr, "Setup failed\n");
+            return 1;
+        }
+
+        unsigned long elapsed = run_server();
+        printf("sent %lu bytes in %.3f s, got %lu bytes back, %lu errors\n",
+            stats.sent, elapsed / 1e9, stats.recvd, stats.errors);
+        printf("RESULT mode=server conns=%d chunks=%d timed=%d secs=%.3f sent=%lu recvd=%lu errors=%lu\n",
+            num_conns, num_chunks, cfg.timed, elapsed / 1e9, stats.sent, stats.recvd, stats.errors);
+        close(epfd);
+        return stats.errors ? 2 : 0;
+    }
+
+    double best = 0;
+    int r;
+    for (r = 0; r < cfg.runs; r++) {
+        memset(&stats, 0, sizeof(stats));
+        unsigned long elapsed = run_parse();
+
+        double ns_per = (double) elapsed / num_chunks;
+        double mb_s = (double) total_bytes / (elapsed / 1e9) / 1e6;
+        printf("run %d: %.1f ns/chunk, %.1f MB/s, %lu requests, %lu messages, %lu errors\n",
+            r + 1, ns_per, mb_s, stats.reqs, stats.msgs, stats.errors);
+        if (r == 0 || ns_per < best) best = ns_per;
+    }
+
+    printf("RESULT mode=parse chunks=%d timed=%d best_ns=%.1f\n", num_chunks, cfg.timed, best);
+    return 0;
+}
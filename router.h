@@ -0,0 +1,582 @@
+//Request router. You declare a table of routes, and new_router compiles it
+//into a compressed radix tree laid out in a few flat arrays. Matching a path
+//walks that tree without allocating anything; path parameters come back as
+//pointers into the path you passed in.
+//
+//Patterns:
+//
+//  /users              exact match
+//  /users/:id          :id matches one (non-empty) path segment
+//  /files/*path        *path matches everything after /files/ (even
+//                      nothing). Only allowed at the very end
+//
+//When more than one pattern could match, static text wins over :params,
+//which win over *wildcards, no matter what order they're declared in.
+//Routes that don't take the request's method are skipped, and if that
+//leaves nothing, router_lookup says so (so you can send a 405).
+//
+//Example:
+//
+//    static router_route const routes[] = {
+//        {ROUTER_GET,                "/",              index_page},
+//        {ROUTER_GET | ROUTER_POST,  "/users/:id",     user_page},
+//        {ROUTER_ANY,                "/static/*file",  static_file},
+//    };
+//    router *r = new_router(routes, 3, &err);
+//    ...
+//    router_match m;
+//    int idx = router_lookup_req(r, req, &m);
+//    if (idx >= 0) call routes[idx].handler with m.params
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef ROUTER_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define ROUTER_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef ROUTER_H
+        #define SHOULD_INCLUDE 1
+        #define ROUTER_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "router.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include "mm_err.h"
+#include "http_parse.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Most params a single route can have
+    #define ROUTER_MAX_PARAMS 8
+
+    //Method masks for router_route. ROUTER_ANY matches every method
+    #define ROUTER_ANY 0u
+    #define ROUTER_METHOD(m) (1u << (m))
+    #define ROUTER_GET ROUTER_METHOD(HTTP_GET)
+    #define ROUTER_POST ROUTER_METHOD(HTTP_POST)
+    #define ROUTER_HEAD ROUTER_METHOD(HTTP_HEAD)
+
+    //What router_lookup returns when it doesn't find a route
+    #define ROUTER_NO_MATCH (-1)
+    #define ROUTER_WRONG_METHOD (-2)
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(ROUTER_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(ROUTER_OOM, "out of memory");
+MM_ERR(ROUTER_BAD_PATTERN, "bad route pattern (must start with '/', params need names, wildcards must be last)");
+MM_ERR(ROUTER_CONFLICT, "two routes with the same pattern and method, or differently named params in the same place");
+MM_ERR(ROUTER_TOO_MANY_PARAMS, "route has more than ROUTER_MAX_PARAMS params");
+
+/////////////////////////
+// Routes and matching //
+/////////////////////////
+#ifndef MM_IMPLEMENT
+    typedef struct _router_route {
+        unsigned methods;    //OR of ROUTER_METHOD()s, or ROUTER_ANY
+        char const *pattern;
+        void *handler;       //Whatever you want; the router doesn't look
+    } router_route;
+
+    typedef struct _router_param {
+        char const *name;    //From the pattern, without the ':' or '*'
+        char const *val;     //Points into the matched path
+        int len;
+    } router_param;
+
+    typedef struct _router_match {
+        int num_params;
+        router_param params[ROUTER_MAX_PARAMS];
+    } router_match;
+
+    //One node of the compiled tree. Static children are stored next to
+    //each other, and their first characters are in a separate array so
+    //picking one is a short scan over bytes
+    typedef struct _router_node {
+        int prefix;          //Offset into the router's chars
+        int prefix_len;
+        int first_kid;       //Index of first static child
+        int num_kids;
+        int param;           //Index of the :param child, or -1
+        int wild;            //Index of the *wildcard child, or -1
+        char const *name;    //Name, for :param and *wildcard nodes
+        //Index into the route table for each method, or -1
+        int routes[HTTP_NUM_REQ_TYPES];
+    } router_node;
+
+    typedef struct _router {
+        router_route const *routes;
+        int num_routes;
+
+        //Internal fields. Don't touch!
+        struct {
+            router_node *nodes;
+            int num_nodes;
+            //First character of each node's prefix, indexed like nodes
+            char *firsts;
+            char *chars;
+        } __internal;
+    } router;
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+//While building, the tree is a bunch of separately allocated nodes. Once
+//everything is in, it gets flattened into a router
+typedef struct _rt_build {
+    char *prefix;
+    int prefix_len;
+    struct _rt_build **kids;
+    int num_kids;
+    struct _rt_build *param;
+    struct _rt_build *wild;
+    char const *name;
+    int name_len;
+    int routes[HTTP_NUM_REQ_TYPES];
+} rt_build;
+
+static rt_build *rt_new_node(char const *prefix, int len, mm_err *err) {
+    if (*err != MM_SUCCESS) return NULL;
+
+    rt_build *n = calloc(1, sizeof(rt_build));
+    char *copy = malloc(len + 1);
+    if (!n || !copy) {
+        free(n);
+        free(copy);
+        *err = ROUTER_OOM;
+        return NULL;
+    }
+    memcpy(copy, prefix, len);
+    copy[len] = '\0';
+
+    n->prefix = copy;
+    n->prefix_len = len;
+    int i;
+    for (i = 0; i < HTTP_NUM_REQ_TYPES; i++) n->routes[i] = -1;
+    return n;
+}
+
+static void rt_free(rt_build *n) {
+    if (!n) return;
+    int i;
+    for (i = 0; i < n->num_kids; i++) rt_free(n->kids[i]);
+    rt_free(n->param);
+    rt_free(n->wild);
+    free(n->kids);
+    free(n->prefix);
+    free(n);
+}
+
+static void rt_add_kid(rt_build *n, rt_build *kid, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    rt_build **kids = realloc(n->kids, (n->num_kids + 1) * sizeof(rt_build *));
+    if (!kids) {
+        *err = ROUTER_OOM;
+        return;
+    }
+    n->kids = kids;
+    n->kids[n->num_kids++] = kid;
+}
+
+//Inserts the static text s[0..len) below n, splitting edges as needed.
+//Returns the node where the text ends
+static rt_build *rt_insert_static(rt_build *n, char const *s, int len, mm_err *err) {
+    while (len > 0 && *err == MM_SUCCESS) {
+        rt_build *kid = NULL;
+        int i;
+        for (i = 0; i < n->num_kids; i++) {
+            if (n->kids[i]->prefix[0] == s[0]) {
+                kid = n->kids[i];
+                break;
+            }
+        }
+
+        if (!kid) {
+            kid = rt_new_node(s, len, err);
+            rt_add_kid(n, kid, err);
+            if (*err != MM_SUCCESS) {
+                rt_free(kid);
+                return NULL;
+            }
+            return kid;
+        }
+
+        //How much of the kid's prefix do we share?
+        int common = 0;
+        while (common < kid->prefix_len && common < len && kid->prefix[common] == s[common]) common++;
+
+        if (common < kid->prefix_len) {
+            //Split the kid: a new node takes over its tail and everything
+            //below it
+            rt_build *tail = rt_new_node(kid->prefix + common, kid->prefix_len - common, err);
+            if (*err != MM_SUCCESS) return NULL;
+            tail->kids = kid->kids;
+            tail->num_kids = kid->num_kids;
+            tail->param = kid->param;
+            tail->wild = kid->wild;
+            memcpy(tail->routes, kid->routes, sizeof(tail->routes));
+
+            kid->kids = NULL;
+            kid->num_kids = 0;
+            kid->param = NULL;
+            kid->wild = NULL;
+            for (i = 0; i < HTTP_NUM_REQ_TYPES; i++) kid->routes[i] = -1;
+            kid->prefix_len = common;
+            kid->prefix[common] = '\0';
+            rt_add_kid(kid, tail, err);
+            if (*err != MM_SUCCESS) {
+                rt_free(tail);
+                return NULL;
+            }
+        }
+
+        n = kid;
+        s += common;
+        len -= common;
+    }
+
+    return n;
+}
+
+//Gets (or makes) the :param or *wildcard child of n
+static rt_build *rt_insert_var(rt_build *n, int wild, char const *name, int name_len, mm_err *err) {
+    if (*err != MM_SUCCESS) return NULL;
+
+    rt_build **slot = wild ? &n->wild : &n->param;
+    if (*slot) {
+        if ((*slot)->name_len != name_len || memcmp((*slot)->name, name, name_len)) {
+            *err = ROUTER_CONFLICT;
+            return NULL;
+        }
+        return *slot;
+    }
+
+    *slot = rt_new_node("", 0, err);
+    if (*err != MM_SUCCESS) return NULL;
+    (*slot)->name = name;
+    (*slot)->name_len = name_len;
+    return *slot;
+}
+
+static void rt_insert(rt_build *root, router_route const *rt, int idx, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    char const *p = rt->pattern;
+    if (!p) {
+        *err = ROUTER_NULL_ARG;
+        return;
+    }
+    if (p[0] != '/') {
+        *err = ROUTER_BAD_PATTERN;
+        return;
+    }
+
+    rt_build *n = root;
+    int num_params = 0;
+    while (*p) {
+        if (*p == ':' || *p == '*') {
+            int wild = (*p == '*');
+            char const *name = ++p;
+            int name_len = strcspn(p, "/");
+            p += name_len;
+            //Params have to take up a whole segment, and wildcards have to
+            //be at the end
+            if (name_len == 0 || (name[-2] != '/') || (wild && *p)) {
+                *err = ROUTER_BAD_PATTERN;
+                return;
+            }
+            if (++num_params > ROUTER_MAX_PARAMS) {
+                *err = ROUTER_TOO_MANY_PARAMS;
+                return;
+            }
+            n = rt_insert_var(n, wild, name, name_len, err);
+        } else {
+            int len = strcspn(p, ":*");
+            n = rt_insert_static(n, p, len, err);
+            p += len;
+        }
+        if (*err != MM_SUCCESS) return;
+    }
+
+    int i;
+    for (i = 0; i < HTTP_NUM_REQ_TYPES; i++) {
+        if (rt->methods != ROUTER_ANY && !(rt->methods & ROUTER_METHOD(i))) continue;
+        if (n->routes[i] >= 0) {
+            *err = ROUTER_CONFLICT;
+            return;
+        }
+        n->routes[i] = idx;
+    }
+}
+
+//Counts nodes and prefix characters, so we know how much to allocate
+static void rt_count(rt_build const *n, int *nodes, int *chars) {
+    (*nodes)++;
+    *chars += n->prefix_len + 1 + (n->name ? n->name_len + 1 : 0);
+    int i;
+    for (i = 0; i < n->num_kids; i++) rt_count(n->kids[i], nodes, chars);
+    if (n->param) rt_count(n->param, nodes, chars);
+    if (n->wild) rt_count(n->wild, nodes, chars);
+}
+
+//Copies n (already given index idx) into r, then does the same for its
+//children. Each node's static kids get consecutive slots
+static void rt_flatten(router *r, rt_build const *n, int idx, int *next_node, int *next_char) {
+    router_node *out = r->__internal.nodes + idx;
+    char *chars = r->__internal.chars;
+
+    out->prefix = *next_char;
+    out->prefix_len = n->prefix_len;
+    memcpy(chars + *next_char, n->prefix, n->prefix_len + 1);
+    *next_char += n->prefix_len + 1;
+    r->__internal.firsts[idx] = n->prefix[0];
+
+    out->name = NULL;
+    if (n->name) {
+        memcpy(chars + *next_char, n->name, n->name_len);
+        chars[*next_char + n->name_len] = '\0';
+        out->name = chars + *next_char;
+        *next_char += n->name_len + 1;
+    }
+    memcpy(out->routes, n->routes, sizeof(out->routes));
+
+    out->num_kids = n->num_kids;
+    out->first_kid = *next_node;
+    *next_node += n->num_kids;
+    out->param = n->param ? (*next_node)++ : -1;
+    out->wild = n->wild ? (*next_node)++ : -1;
+
+    //out might move around if we keep a pointer, so use indices from here
+    int first_kid = out->first_kid, param = out->param, wild = out->wild;
+    int i;
+    for (i = 0; i < n->num_kids; i++) rt_flatten(r, n->kids[i], first_kid + i, next_node, next_char);
+    if (n->param) rt_flatten(r, n->param, param, next_node, next_char);
+    if (n->wild) rt_flatten(r, n->wild, wild, next_node, next_char);
+}
+
+//Tries to match path[0..len) for method, starting at node idx. Fills m and
+//returns the index of the node where the path ended up, or -1. If the path
+//matched somewhere but not for this method, sets *wrong_method
+static int rt_match(router const *r, int idx, http_req_t method, char const *path, int len, router_match *m, int *wrong_method) {
+    router_node const *n = r->__internal.nodes + idx;
+
+    if (n->prefix_len) {
+        if (len < n->prefix_len || memcmp(path, r->__internal.chars + n->prefix, n->prefix_len)) return -1;
+        path += n->prefix_len;
+        len -= n->prefix_len;
+    }
+
+    if (len == 0) {
+        if (n->routes[method] >= 0) return idx;
+        int i;
+        for (i = 0; i < HTTP_NUM_REQ_TYPES; i++) {
+            if (n->routes[i] >= 0) *wrong_method = 1;
+        }
+    }
+
+    //Static text first. At most one kid can start with this character
+    if (len > 0) {
+        char const *firsts = r->__internal.firsts + n->first_kid;
+        int i;
+        for (i = 0; i < n->num_kids; i++) {
+            if (firsts[i] == path[0]) {
+                int found = rt_match(r, n->first_kid + i, method, path, len, m, wrong_method);
+                if (found >= 0) return found;
+                break;
+            }
+        }
+    }
+
+    //Then a :param, which eats up to the next '/'
+    if (n->param >= 0 && len > 0 && m->num_params < ROUTER_MAX_PARAMS) {
+        char const *slash = memchr(path, '/', len);
+        int seg = slash ? slash - path : len;
+        if (seg > 0) {
+            router_param *p = m->params + m->num_params++;
+            p->name = r->__internal.nodes[n->param].name;
+            p->val = path;
+            p->len = seg;
+            int found = rt_match(r, n->param, method, path + seg, len - seg, m, wrong_method);
+            if (found >= 0) return found;
+            m->num_params--;
+        }
+    }
+
+    //Finally a *wildcard, which eats everything
+    int wild = n->wild;
+    if (wild >= 0 && m->num_params < ROUTER_MAX_PARAMS) {
+        if (r->__internal.nodes[wild].routes[method] < 0) {
+            *wrong_method = 1;
+            return -1;
+        }
+        router_param *p = m->params + m->num_params++;
+        p->name = r->__internal.nodes[wild].name;
+        p->val = path;
+        p->len = len;
+        return wild;
+    }
+
+    return -1;
+}
+
+#endif
+
+/////////////////////////////
+// Managing router structs //
+/////////////////////////////
+
+//Compiles a route table into a router. The table (including the pattern
+//strings) must outlive the router, since router_lookup gives you back
+//indices into it. Use del_router to free it. Returns NULL and sets *err on
+//error
+router *new_router(router_route const *routes, int num_routes, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!routes && num_routes > 0) {
+        *err = ROUTER_NULL_ARG;
+        return NULL;
+    }
+
+    rt_build *root = rt_new_node("", 0, err);
+    int i;
+    for (i = 0; i < num_routes; i++) rt_insert(root, routes + i, i, err);
+    if (*err != MM_SUCCESS) {
+        rt_free(root);
+        return NULL;
+    }
+
+    int num_nodes = 0, num_chars = 0;
+    rt_count(root, &num_nodes, &num_chars);
+
+    router *ret = malloc(sizeof(router));
+    router_node *nodes = malloc(num_nodes * sizeof(router_node));
+    char *firsts = malloc(num_nodes);
+    char *chars = malloc(num_chars);
+    if (!ret || !nodes || !firsts || !chars) {
+        free(ret);
+        free(nodes);
+        free(firsts);
+        free(chars);
+        rt_free(root);
+        *err = ROUTER_OOM;
+        return NULL;
+    }
+
+    ret->routes = routes;
+    ret->num_routes = num_routes;
+    ret->__internal.nodes = nodes;
+    ret->__internal.num_nodes = num_nodes;
+    ret->__internal.firsts = firsts;
+    ret->__internal.chars = chars;
+
+    int next_node = 1, next_char = 0;
+    rt_flatten(ret, root, 0, &next_node, &next_char);
+    rt_free(root);
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Frees a router. Gracefully ignores NULL input
+void del_router(router *r)
+#ifdef MM_IMPLEMENT
+{
+    if (!r) return;
+    free(r->__internal.nodes);
+    free(r->__internal.firsts);
+    free(r->__internal.chars);
+    free(r);
+}
+#else
+;
+#endif
+
+/* router_lookup:
+
+Looks up path[0..len) for the given method. Returns the index of the
+matching route in the table, ROUTER_WRONG_METHOD if the path matched but
+not for this method, or ROUTER_NO_MATCH. Captured params go in *m, in the
+order they appear in the pattern; they point into path, so they're only
+good as long as it is.
+
+Assumes r, path, and m are non-NULL. Never allocates.
+*/
+int router_lookup(router const *r, http_req_t method, char const *path, int len, router_match *m)
+#ifdef MM_IMPLEMENT
+{
+    m->num_params = 0;
+    if ((unsigned) method >= HTTP_NUM_REQ_TYPES) return ROUTER_NO_MATCH;
+
+    int wrong_method = 0;
+    int idx = rt_match(r, 0, method, path, len, m, &wrong_method);
+    if (idx < 0) {
+        m->num_params = 0;
+        return wrong_method ? ROUTER_WRONG_METHOD : ROUTER_NO_MATCH;
+    }
+
+    return r->__internal.nodes[idx].routes[method];
+}
+#else
+;
+#endif
+
+//Shorthand for matching a parsed request's method and path
+int router_lookup_req(router const *r, http_req const *req, router_match *m)
+#ifdef MM_IMPLEMENT
+{
+    return router_lookup(r, req->req_type, req->path, req->path_len, m);
+}
+#else
+;
+#endif
+
+//Returns the value of the param called name (which must be NUL-terminated),
+//or NULL if there isn't one. Its length goes in *len
+char const *router_param_get(router_match const *m, char const *name, int *len)
+#ifdef MM_IMPLEMENT
+{
+    int i;
+    for (i = 0; i < m->num_params; i++) {
+        if (!strcmp(m->params[i].name, name)) {
+            *len = m->params[i].len;
+            return m->params[i].val;
+        }
+    }
+    return NULL;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
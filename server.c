@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "http_parse.h"
+#include "websock.h"
+#include "server.h"
+#include "cache.h"
+#include "encoding.h"
+#include "tls.h"
+#include "capture.h"
+#include "ratelimit.h"
+#include "multipart.h"
+#include "mm_err.h"
+
+//Small demo server, mostly so there's something real to point a browser
+//(or a load generator) at. Answers every HTTP request with a tiny page, and
+//echoes back any websocket messages (big ones as they stream in). Counters
+//are served on /metrics (build with METRICS=1 to get the parser ones).
+//Pages go in the response cache, so after the first request for a path, the
+//loop answers it on its own.
+//
+//If you give it a directory, files in there are served under /static/. A
+//foo.css.br or foo.css.gz next to foo.css is sent instead to clients that
+//accept it. Otherwise, text files get gzipped on a worker thread and the
+//compressed version goes in the cache for next time.
+//
+//Uploads (POSTs) of SPILL_SIZE or more go to a memfd instead of memory, and
+//just get told how big they were. Form uploads (multipart/form-data) get a
+//list of their parts instead. Set MM_UPLOAD_TOKEN to only take uploads
+//with "Authorization: Bearer <token>"; the others are turned away before
+//their bodies are sent (try curl -T with a big file).
+//
+//Plain connections can also speak HTTP/2 (h2c), with prior knowledge or
+//through an Upgrade. Try curl --http2-prior-knowledge.
+//
+//Give it a certificate and key (make cert.pem) and it speaks HTTPS/WSS
+//instead, using kernel TLS if the kernel has it.
+//
+//Set MM_CAPTURE to a file name to record all incoming traffic there, for
+//replaying later with ./replay (see capture.h).
+//
+//Set MM_TRACE to time every request by stage (see trace.h). The numbers go
+//on /metrics, and /trace has one in every MM_TRACE requests as a Chrome
+//trace.
+//
+//Set MM_RATELIMIT to N to let each /24 (or IPv6 /64) make N requests and
+//send N websocket frames a second, with each connection also held to
+//CONN_BYTES_PER_SEC (see ratelimit.h).
+//
+//Set MM_HANDOFF to a socket path to restart without dropping anyone: start
+//a second server with the same path, and it takes over the port and the
+//websockets while this one finishes up and exits (see handoff.h).
+//
+//Set MM_TICK to N to have a separate thread send "tick" to every websocket
+//every N milliseconds, through the loop's post queue (see srv_post).
+//
+//Set MM_PROXY to host:port to pass every request on to another server
+//instead (see srv_proxy), websockets included. /metrics is still ours.
+//
+//Usage: server [port] [static_dir] [cert key]
+
+#define HELLO_RESPONSE \
+    "HTTP/1.1 200 OK\r\n"\
+    "Content-Type: text/plain\r\n"\
+    "Content-Length: 6\r\n"\
+    "\r\n"\
+    "Hello\n"
+
+//How long pages stay in the cache
+#define HELLO_TTL_MS 60000
+#define STATIC_TTL_MS 10000
+#define STATIC_PREFIX "/static/"
+//We read static files into memory, so don't go overboard
+#define MAX_STATIC_SIZE (16 << 20)
+//Bodies this big or bigger are spilled, up to MAX_UPLOAD_SIZE
+#define SPILL_SIZE (64 << 10)
+#define MAX_UPLOAD_SIZE (256 << 20)
+//Where MM_CAPTURE stops recording
+#define MAX_CAPTURE_SIZE (1L << 30)
+//What MM_RATELIMIT lets each connection read
+#define CONN_BYTES_PER_SEC (1 << 20)
+//Websockets past this many don't get MM_TICK's ticks
+#define MAX_TICKERS 1024
+
+static srv_loop *loop = NULL;
+static cache *pages = NULL;
+static enc_pool *workers = NULL;
+static char const *static_dir = NULL;
+static tls_ctx *tls = NULL;
+static cap_log *capture = NULL;
+static rl_table *limits = NULL;
+static char const *upload_token = NULL;
+static srv_upstream *upstream = NULL;
+
+//Ids of the websockets that get ticks. The tick thread only holds the lock
+//long enough to post to each of them, which never blocks
+static pthread_mutex_t tickers_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long tickers[MAX_TICKERS];
+static int num_tickers = 0;
+static int tick_ms = 0;
+static volatile int ticking = 0;
+
+//What a compression job needs to put its result in the cache
+typedef struct _compress_job {
+    char type[64];
+    int key_len;
+    char key[CACHE_MAX_KEY];
+} compress_job;
+
+static void on_sigint(int sig) {
+    if (loop) srv_stop(loop);
+}
+
+//Header names aren't lower-cased by the parser, so look for them ignoring
+//case
+static char const *find_hdr(http_req const *req, char const *name) {
+    int i;
+    for (i = 0; i < req->num_hdrs; i++) {
+        if (!strcasecmp(req->hdrs[i].name, name)) return req->hdrs[i].args;
+    }
+    return NULL;
+}
+
+static char const *content_type(char const *path) {
+    static char const *const types[][2] = {
+        {".html", "text/html"},
+        {".css", "text/css"},
+        {".js", "text/javascript"},
+        {".json", "application/json"},
+        {".svg", "image/svg+xml"},
+        {".txt", "text/plain"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+    };
+    
+    char const *dot = strrchr(path, '.');
+    if (dot) {
+        int i;
+        for (i = 0; i < (int) (sizeof(types) / sizeof(*types)); i++) {
+            if (!strcmp(dot, types[i][0])) return types[i][1];
+        }
+    }
+    return "application/octet-stream";
+}
+
+//Runs on a worker thread
+static void on_compressed(wq_buf *out, mm_err err, void *arg) {
+    compress_job *job = arg;
+    
+    if (err == MM_SUCCESS) {
+        char hdr[256];
+        int hdr_len = snprintf(hdr, sizeof(hdr),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Encoding: gzip\r\n"
+            "Vary: Accept-Encoding\r\n"
+            "Content-Length: %d\r\n"
+            "\r\n",
+            job->type, out->len
+        );
+        char *resp = malloc(hdr_len + out->len);
+        if (resp) {
+            memcpy(resp, hdr, hdr_len);
+            memcpy(resp + hdr_len, out->data, out->len);
+            mm_err cache_err = MM_SUCCESS;
+            cache_put_key(pages, job->key, job->key_len, resp, hdr_len + out->len, STATIC_TTL_MS, &cache_err);
+            free(resp);
+        }
+        wq_buf_unref(out);
+    }
+    
+    free(job);
+}
+
+static void serve_static(srv_conn *c, http_req *req) {
+    mm_err err = MM_SUCCESS;
+    
+    //The parser already got rid of any "..", so this can't leave static_dir
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", static_dir, req->path + strlen(STATIC_PREFIX));
+    
+    char const *accept = find_hdr(req, "Accept-Encoding");
+    enc_t enc;
+    int fd = enc_open_precompressed(path, accept, &enc, &err);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > MAX_STATIC_SIZE) {
+        if (fd >= 0) close(fd);
+        static char const not_found[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+        err = MM_SUCCESS;
+        srv_send(c, not_found, sizeof(not_found) - 1, &err);
+        return;
+    }
+    
+    char const *type = content_type(path);
+    char hdr[256];
+    int hdr_len = snprintf(hdr, sizeof(hdr),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: %s\r\n"
+        "%s%s%s"
+        "Vary: Accept-Encoding\r\n"
+        "Content-Length: %ld\r\n"
+        "\r\n",
+        type,
+        enc == ENC_IDENTITY ? "" : "Content-Encoding: ",
+        enc == ENC_IDENTITY ? "" : enc_names[enc],
+        enc == ENC_IDENTITY ? "" : "\r\n",
+        (long) st.st_size
+    );
+    
+    char *resp = malloc(hdr_len + st.st_size);
+    if (!resp || read(fd, resp + hdr_len, st.st_size) != st.st_size) {
+        close(fd);
+        free(resp);
+        srv_send(c, SRV_INTERNAL_ERROR_RESPONSE, strlen(SRV_INTERNAL_ERROR_RESPONSE), &err);
+        return;
+    }
+    close(fd);
+    memcpy(resp, hdr, hdr_len);
+    int len = hdr_len + st.st_size;
+    
+    srv_send(c, resp, len, &err);
+    
+    mm_err cache_err = MM_SUCCESS;
+    cache_put(pages, req, resp, len, STATIC_TTL_MS, &cache_err);
+    
+    //Nothing precompressed, but the client would take gzip. Make it in the
+    //background; whoever asks next gets it from the cache
+    int is_text = !strncmp(type, "text/", 5) || !strcmp(type, "application/json") || !strcmp(type, "image/svg+xml");
+    if (enc == ENC_IDENTITY && is_text && st.st_size >= ENC_MIN_SIZE && enc_choose(accept, ENC_BIT(ENC_GZIP)) == ENC_GZIP) {
+        compress_job *job = malloc(sizeof(compress_job));
+        if (job) {
+            snprintf(job->type, sizeof(job->type), "%s", type);
+            job->key_len = cache_key(pages, req, job->key);
+            //Once it's submitted, job belongs to the worker
+            cache_err = job->key_len < 0 ? CACHE_KEY_TOO_LONG : MM_SUCCESS;
+            enc_submit(workers, ENC_GZIP, resp + hdr_len, st.st_size, -1, on_compressed, job, &cache_err);
+            if (cache_err != MM_SUCCESS) free(job);
+        }
+    }
+    
+    free(resp);
+}
+
+//One line per part of a form upload, for the response
+typedef struct _upload_summary {
+    char text[4096];
+    int len;
+} upload_summary;
+
+static void on_part_end(mp_parser *p, mp_part *part, void *arg) {
+    upload_summary *sum = arg;
+    int room = sizeof(sum->text) - sum->len;
+    int n = snprintf(sum->text + sum->len, room, "%.*s: %lu bytes%s%.*s\n",
+        part->name.len, part->name.ptr, part->len,
+        part->filename.ptr ? " from " : "", part->filename.len, part->filename.ptr ? part->filename.ptr : ""
+    );
+    sum->len += n < room ? n : room - 1;
+}
+
+//Runs a multipart/form-data body through the parser, wherever it ended up
+static void serve_upload(srv_conn *c, http_req *req, char const *type) {
+    mm_err err = MM_SUCCESS;
+    upload_summary sum = {.len = 0};
+    mp_callbacks cb = {.on_part_end = on_part_end};
+    mp_parser *p = new_mp_parser(type, &cb, &sum, &err);
+    int rc = req->body_fd >= 0
+        ? mp_parse_fd(p, req->body_fd, req->payload_len, &err)
+        : write_to_mp_parser(p, req->payload, req->payload_len, &err);
+    del_mp_parser(p);
+    
+    if (rc != 0) {
+        if (err == MM_SUCCESS) err = MP_BAD_BODY; //Cut short
+        sum.len = snprintf(sum.text, sizeof(sum.text), "Bad upload: %s\n", err);
+    }
+    
+    err = MM_SUCCESS;
+    char hdr[128];
+    int hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n", rc == 0 ? "200 OK" : "400 Bad Request", sum.len);
+    srv_send(c, hdr, hdr_len, &err);
+    srv_send(c, sum.text, sum.len, &err);
+}
+
+//Decides whether we want a request's body, before it's sent
+static int on_headers(srv_conn *c, http_req *req, void *user) {
+    if (!upload_token) return 0;
+    
+    mm_err err = MM_SUCCESS;
+    char const *auth = get_args(req, "Authorization", &err);
+    if (!auth || strncmp(auth, "Bearer ", 7) || strcmp(auth + 7, upload_token)) return 401;
+    return 0;
+}
+
+static void add_ticker(srv_conn *c) {
+    if (!tick_ms) return;
+    pthread_mutex_lock(&tickers_lock);
+    if (num_tickers < MAX_TICKERS) tickers[num_tickers++] = c->id;
+    pthread_mutex_unlock(&tickers_lock);
+}
+
+static void *tick_thread(void *arg) {
+    unsigned long n = 0;
+    while (ticking) {
+        usleep(tick_ms * 1000);
+        char msg[32];
+        int len = snprintf(msg, sizeof(msg), "tick %lu", ++n);
+        mm_err err = MM_SUCCESS;
+        wq_buf *b = new_websock_wq_buf(WEBSOCK_TEXT, msg, len, &err);
+        if (err != MM_SUCCESS) continue;
+        
+        //Every post gets its own reference. If the queue is full, that
+        //connection just misses this one
+        pthread_mutex_lock(&tickers_lock);
+        int i;
+        for (i = 0; i < num_tickers; i++) {
+            err = MM_SUCCESS;
+            wq_buf_ref(b);
+            if (srv_post(loop, tickers[i], b, 0, &err) < 0) wq_buf_unref(b);
+        }
+        pthread_mutex_unlock(&tickers_lock);
+        wq_buf_unref(b);
+    }
+    return NULL;
+}
+
+static void on_request(srv_conn *c, http_req *req, void *user) {
+    mm_err err = MM_SUCCESS;
+    
+    if (upstream) {
+        srv_proxy(c, req, upstream, &err);
+        if (err != MM_SUCCESS) {
+            //e.g. it came in over HTTP/2, which we don't proxy
+            mm_err send_err = MM_SUCCESS;
+            srv_send(c, SRV_BAD_GATEWAY_RESPONSE, sizeof(SRV_BAD_GATEWAY_RESPONSE) - 1, &send_err);
+            if (c->mode != SRV_CONN_H2) srv_close(c);
+        }
+        return;
+    }
+    
+    if (is_websock_request(req, &err)) {
+        srv_accept_websock(c, req, NULL, &err);
+        if (err != MM_SUCCESS) {
+            fprintf(stderr, "Could not accept websocket: %s\n", err);
+            srv_close(c);
+        } else {
+            add_ticker(c);
+        }
+        return;
+    }
+    
+    err = MM_SUCCESS;
+    char const *type = req->req_type == HTTP_POST ? get_args(req, "Content-Type", &err) : NULL;
+    if (type && !strncasecmp(type, "multipart/form-data", 19)) {
+        serve_upload(c, req, type);
+        return;
+    }
+    
+    if (req->body_fd >= 0) {
+        err = MM_SUCCESS;
+        char resp[128];
+        int body_len = snprintf(resp, sizeof(resp), "Got %d bytes\n", req->payload_len);
+        char hdr[128];
+        int hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n", body_len);
+        srv_send(c, hdr, hdr_len, &err);
+        srv_send(c, resp, body_len, &err);
+        return;
+    }
+    
+    if (static_dir && !strncmp(req->path, STATIC_PREFIX, strlen(STATIC_PREFIX))) {
+        serve_static(c, req);
+        return;
+    }
+    
+    //is_websock_request complains if it can't find the headers it wants
+    err = MM_SUCCESS;
+    srv_send(c, HELLO_RESPONSE, sizeof(HELLO_RESPONSE) - 1, &err);
+    
+    //Not being able to cache it isn't a problem; we'll just end up here
+    //again next time
+    mm_err cache_err = MM_SUCCESS;
+    cache_put(pages, req, HELLO_RESPONSE, sizeof(HELLO_RESPONSE) - 1, HELLO_TTL_MS, &cache_err);
+}
+
+static void on_message(srv_conn *c, websock_pkt *pkt, void *user) {
+    //Big frames were already echoed as they came in
+    if (pkt->streamed) return;
+    mm_err err = MM_SUCCESS;
+    srv_send_websock(c, pkt->type, pkt->payload, pkt->payload_len, &err);
+}
+
+//Echoes big frames a piece at a time, so we never hold a whole one
+static void on_message_data(srv_conn *c, websock_pkt *pkt, char const *data, int len, unsigned long off, void *user) {
+    mm_err err = MM_SUCCESS;
+    if (off == 0) {
+        char hdr[WEBSOCK_MAX_HDR_SIZE];
+        int hdr_len = construct_websock_hdr(hdr, pkt->type, pkt->fin, pkt->payload_len, &err);
+        srv_send(c, hdr, hdr_len, &err);
+    }
+    srv_send(c, data, len, &err);
+}
+
+//Websockets handed over by the server we replaced (see MM_HANDOFF) show up
+//here already upgraded
+static void on_open(srv_conn *c, void *user) {
+    if (c->mode == SRV_CONN_WEBSOCK) add_ticker(c);
+}
+
+static void on_close(srv_conn *c, void *user) {
+    if (!tick_ms) return;
+    pthread_mutex_lock(&tickers_lock);
+    int i;
+    for (i = 0; i < num_tickers; i++) {
+        if (tickers[i] == c->id) {
+            tickers[i] = tickers[--num_tickers];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tickers_lock);
+}
+
+static void on_send_blocked(srv_conn *c, void *user) {
+    fprintf(stderr, "Connection %d is reading too slowly\n", c->fd);
+}
+
+static void on_send_resumed(srv_conn *c, void *user) {
+    fprintf(stderr, "Connection %d caught up\n", c->fd);
+}
+
+int main(int argc, char **argv) {
+    char const *port = "2345";
+    if (argc > 1) port = argv[1];
+    if (argc > 2 && argv[2][0]) static_dir = argv[2];
+    
+    srv_callbacks cb = {
+        .on_request = on_request,
+        .on_message = on_message,
+        .on_close = on_close,
+        .on_send_blocked = on_send_blocked,
+        .on_send_resumed = on_send_resumed,
+        .on_message_data = on_message_data,
+        .on_headers = on_headers,
+        .on_open = on_open
+    };
+    
+    srv_params params;
+    srv_default_params(&params);
+    params.metrics_path = "/metrics";
+    //Nothing in here minds a bit of whitespace in header values
+    params.lazy_hdrs = 1;
+    params.h2 = 1;
+    params.body_spill_min = SPILL_SIZE;
+    params.http_limits.max_body = MAX_UPLOAD_SIZE;
+    
+    static char const *const vary[] = {"Accept-Encoding"};
+    mm_err err = MM_SUCCESS;
+    pages = new_cache(16 << 20, 4096, vary, 1, &err);
+    workers = new_enc_pool(2, 256, &err);
+    params.cache = pages;
+    if (argc > 4) {
+        tls = new_tls_ctx(argv[3], argv[4], 1, &err);
+        params.tls = tls;
+    }
+    if (getenv("MM_TRACE")) {
+        params.trace = 1;
+        params.trace_sampling = atoi(getenv("MM_TRACE"));
+        params.trace_path = "/trace";
+    }
+    if (getenv("MM_CAPTURE")) {
+        capture = new_cap_log(getenv("MM_CAPTURE"), MAX_CAPTURE_SIZE, &err);
+        params.capture = capture;
+    }
+    upload_token = getenv("MM_UPLOAD_TOKEN");
+    params.handoff_path = getenv("MM_HANDOFF");
+    if (getenv("MM_TICK")) {
+        tick_ms = atoi(getenv("MM_TICK"));
+        params.post_queue_size = 4096;
+    }
+    if (getenv("MM_RATELIMIT")) {
+        rl_params rp;
+        rl_default_params(&rp);
+        unsigned n = atoi(getenv("MM_RATELIMIT"));
+        rp.ip[RL_REQUESTS].rate = n;
+        rp.ip[RL_FRAMES].rate = n;
+        rp.conn[RL_BYTES].rate = CONN_BYTES_PER_SEC;
+        limits = new_rl_table(&rp, &err);
+        params.ratelimit = limits;
+    }
+    loop = new_srv_loop(port, &params, &cb, NULL, &err);
+    if (err != MM_SUCCESS) {
+        fprintf(stderr, "Error: %s\n", err);
+        del_enc_pool(workers);
+        del_cache(pages);
+        del_tls_ctx(tls);
+        del_cap_log(capture);
+        del_rl_table(limits);
+        return 1;
+    }
+    
+    if (getenv("MM_PROXY")) {
+        //Split at the last ':', so IPv6 addresses work
+        char host[256];
+        snprintf(host, sizeof(host), "%s", getenv("MM_PROXY"));
+        char *colon = strrchr(host, ':');
+        if (colon) *colon = '\0';
+        upstream = new_srv_upstream(loop, host, colon ? colon + 1 : "80", &err);
+        if (err != MM_SUCCESS) {
+            fprintf(stderr, "Error: %s\n", err);
+            del_srv_loop(loop);
+            del_enc_pool(workers);
+            del_cache(pages);
+            del_tls_ctx(tls);
+            del_cap_log(capture);
+            del_rl_table(limits);
+            return 1;
+        }
+    }
+    
+    //No SA_RESTART, so that epoll_wait gets interrupted
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    
+    pthread_t ticker;
+    if (tick_ms > 0) {
+        ticking = 1;
+        if (pthread_create(&ticker, NULL, tick_thread, NULL) != 0) ticking = 0;
+    }
+    
+    fprintf(stderr, "Listening on port %s%s\n", port, tls ? " (TLS)" : "");
+    if (upstream) fprintf(stderr, "Proxying to %s\n", getenv("MM_PROXY"));
+    srv_run(loop, &err);
+    //It posts to the loop, so it has to be gone before the loop is
+    if (ticking) {
+        ticking = 0;
+        pthread_join(ticker, NULL);
+    }
+    if (srv_draining(loop)) fprintf(stderr, "Handed off to the new server, exiting\n");
+    
+    del_srv_loop(loop);
+    del_srv_upstream(upstream);
+    //Workers might still be putting things in the cache
+    del_enc_pool(workers);
+    del_cache(pages);
+    del_tls_ctx(tls);
+    if (capture && capture->full) fprintf(stderr, "Capture hit %ld bytes, the rest was dropped\n", MAX_CAPTURE_SIZE);
+    del_cap_log(capture);
+    del_rl_table(limits);
+    
+    if (err != MM_SUCCESS) {
+        fprintf(stderr, "Error: %s\n", err);
+        return 1;
+    }
+    
+    fprintf(stderr, "\nDone\n");
+    
+    return 0;
+}
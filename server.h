@@ -0,0 +1,3736 @@
+//A small epoll-based event loop that ties the HTTP and websocket parsers to
+//real sockets. You give it a port and some callbacks; it deals with
+//accepting connections, feeding bytes to the right parser, the websocket
+//handshake and control frames, queueing output for clients that read
+//slowly, and timing out connections that sit around doing nothing (or that
+//trickle in a header one byte at a time).
+//
+//It can also be a reverse proxy: srv_proxy hands a request to another
+//server over a pooled keep-alive connection, and passes the response back.
+//
+//Linux only (epoll). Everything runs on the thread that calls srv_run.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef SERVER_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define SERVER_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef SERVER_H
+        #define SHOULD_INCLUDE 1
+        #define SERVER_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "server.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include "mm_err.h"
+#include "mm_alloc.h"
+#include "metrics.h"
+#include "http_parse.h"
+#include "h2.h"
+#include "websock.h"
+#include "timer_wheel.h"
+#include "write_queue.h"
+#include "cache.h"
+#include "tls.h"
+#include "capture.h"
+#include "trace.h"
+#include "ratelimit.h"
+#include "handoff.h"
+#include "mpsc.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    #define SRV_READ_SIZE 4096
+    //How much of a spilled body we try to splice at once (see
+    //body_spill_min). Also the size we ask for for the loop's pipe
+    #define SRV_SPLICE_SIZE (256 << 10)
+    #define SRV_MAX_EVENTS 64
+    #define SRV_LISTEN_BACKLOG 512
+    //Each connection has an arena that holds its parser struct (and the
+    //parser's buffer). It's reset after every request/message, so in the
+    //steady state nothing on the request path calls malloc
+    #define SRV_ARENA_CHUNK 8192
+    //Websocket frames at least this big get streamed, if you ask for it
+    #define SRV_DEFAULT_WS_STREAM_MIN (64 << 10)
+    //Resolution of all the connection timeouts
+    #define SRV_TICK_MS 10
+    //How long we stop accepting for when we run out of file descriptors
+    //(see srv_accept_all)
+    #define SRV_ACCEPT_RETRY_MS 100
+
+    //Timeouts, in milliseconds. Zero disables that timeout
+    #define SRV_DEFAULT_HDR_TIMEOUT 10000
+    #define SRV_DEFAULT_KEEPALIVE_TIMEOUT 60000
+    #define SRV_DEFAULT_BODY_TIMEOUT 10000
+    #define SRV_DEFAULT_WS_PING_INTERVAL 30000
+    #define SRV_DEFAULT_WS_PONG_TIMEOUT 10000
+    #define SRV_DEFAULT_DRAIN_TIMEOUT 10000
+    #define SRV_DEFAULT_LINGER_TIMEOUT 2000
+    #define SRV_DEFAULT_UPSTREAM_TIMEOUT 30000
+
+    //Idle connections each upstream keeps for reuse (see srv_proxy)
+    #define SRV_DEFAULT_UPSTREAM_IDLE 64
+    //How much of a proxied response we read at once when it can't be
+    //spliced
+    #define SRV_PROXY_READ_SIZE (16 << 10)
+
+    //Most posted messages (see srv_post) we send in one loop iteration.
+    //Anything past that waits for the next one, so a flood of posts can't
+    //starve the sockets
+    #define SRV_POST_BATCH 256
+
+    //Default cap on output queued across all connections (0 = no cap)
+    #define SRV_DEFAULT_MAX_OUT_BYTES (256L * 1024 * 1024)
+
+    #define SRV_BAD_REQUEST_RESPONSE \
+        "HTTP/1.1 400 Bad Request\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    //For when the client goes over one of the parser limits
+    #define SRV_URI_TOO_LONG_RESPONSE \
+        "HTTP/1.1 414 URI Too Long\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    #define SRV_HDRS_TOO_LARGE_RESPONSE \
+        "HTTP/1.1 431 Request Header Fields Too Large\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    #define SRV_BODY_TOO_LARGE_RESPONSE \
+        "HTTP/1.1 413 Content Too Large\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    #define SRV_TIMEOUT_RESPONSE \
+        "HTTP/1.1 408 Request Timeout\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    #define SRV_EXPECTATION_FAILED_RESPONSE \
+        "HTTP/1.1 417 Expectation Failed\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    #define SRV_CONTINUE_RESPONSE "HTTP/1.1 100 Continue\r\n\r\n"
+
+    #define SRV_INTERNAL_ERROR_RESPONSE \
+        "HTTP/1.1 500 Internal Server Error\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    //For when a proxied request's upstream server fails us
+    #define SRV_BAD_GATEWAY_RESPONSE \
+        "HTTP/1.1 502 Bad Gateway\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+
+    #define SRV_GATEWAY_TIMEOUT_RESPONSE \
+        "HTTP/1.1 504 Gateway Timeout\r\n"\
+        "Connection: close\r\n"\
+        "Content-Length: 0\r\n"\
+        "\r\n"
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(SRV_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(SRV_INVALID_ARG, "invalid argument");
+MM_ERR(SRV_OOM, "out of memory");
+MM_ERR(SRV_SOCKET_ERROR, "could not set up listening socket (check errno)");
+MM_ERR(SRV_EPOLL_ERROR, "epoll error (check errno)");
+MM_ERR(SRV_SEND_ERROR, "could not send on connection (check errno)");
+MM_ERR(SRV_CLOSED, "connection is closed");
+MM_ERR(SRV_NOT_HTTP, "connection is not in HTTP mode");
+MM_ERR(SRV_NOT_WEBSOCK, "connection is not in websocket mode");
+MM_ERR(SRV_NO_POSTS, "loop has no post queue (see params.post_queue_size)");
+MM_ERR(SRV_BAD_UPSTREAM, "could not look up upstream server's address");
+MM_ERR(SRV_UPSTREAM_ERROR, "could not connect to upstream server (check errno)");
+MM_ERR(SRV_PROXYING, "connection is already waiting on an upstream server");
+
+/////////////////////////////////////////////
+// enums and structs used by the event loop //
+/////////////////////////////////////////////
+#ifndef MM_IMPLEMENT
+    typedef enum _srv_conn_mode_t {
+        SRV_CONN_HTTP,
+        SRV_CONN_WEBSOCK,
+        SRV_CONN_H2,
+        //Upgraded by a proxied server (see srv_proxy). From then on, bytes
+        //just go back and forth between the client and that server
+        SRV_CONN_TUNNEL
+    } srv_conn_mode_t;
+
+    //Which deadline a connection's timer is currently enforcing. Each
+    //connection is only ever in one of these phases at a time, so one timer
+    //per connection is enough
+    #define SRV_TIMEOUT_IDS \
+        X(SRV_TIMEOUT_NONE), \
+        X(SRV_TIMEOUT_HDR), \
+        X(SRV_TIMEOUT_KEEPALIVE), \
+        X(SRV_TIMEOUT_BODY), \
+        X(SRV_TIMEOUT_PING), \
+        X(SRV_TIMEOUT_PONG), \
+        X(SRV_TIMEOUT_DRAIN), \
+        X(SRV_TIMEOUT_LINGER), \
+        X(SRV_TIMEOUT_UPSTREAM)
+
+    typedef enum _srv_timeout_t {
+    #define X(x) x
+        SRV_TIMEOUT_IDS
+    #undef X
+    } srv_timeout_t;
+
+    extern char const *const srv_timeout_strs[];
+
+    typedef struct _srv_params {
+        //All in milliseconds. Zero disables that timeout.
+
+        //Time from the first byte of a request to the end of its header.
+        //This is a hard deadline (trickling bytes doesn't extend it), which
+        //is what stops slowloris-style attacks
+        unsigned hdr_timeout;
+        //How long a connection may sit idle between requests
+        unsigned keepalive_timeout;
+        //Max time between reads while receiving a request payload
+        unsigned body_timeout;
+        //How long a websocket can be quiet before we ping it
+        unsigned ws_ping_interval;
+        //How long the client gets to answer our ping
+        unsigned ws_pong_timeout;
+        //How long srv_close waits for queued output to go out before giving
+        //up and closing anyway
+        unsigned drain_timeout;
+        //How long we keep reading (and throwing away) what a client is
+        //still sending after an error response, before we close. Closing
+        //with unread input makes the kernel send a reset, which can get to
+        //the client before the response does. Zero closes right away
+        unsigned linger_timeout;
+        //Max time between bytes from a proxied request's upstream server
+        //(see srv_proxy). A client that hasn't seen any of the response yet
+        //gets a 504; otherwise it's hung up on
+        unsigned upstream_timeout;
+
+        //Per-connection output queue limits (see write_queue.h). Note that
+        //dropping or coalescing only makes sense for websocket messages; a
+        //dropped HTTP response leaves the client hopelessly confused, which
+        //is why the default policy is to disconnect
+        long wq_high_wm;
+        long wq_low_wm;
+        long wq_max_bytes;
+        wq_policy_t wq_policy;
+        //Cap on output queued across every connection in the process
+        long max_out_bytes;
+
+        //If non-NULL, GET requests for this path are answered by the loop
+        //itself with Prometheus-style metrics (see metrics.h), and never
+        //reach on_request. NULL (the default) turns this off
+        char const *metrics_path;
+
+        //If non-NULL, GET and HEAD requests are looked up here first, and
+        //hits (including 304s) are answered without calling on_request.
+        //Filling it is up to you (see cache_put). Not freed by del_srv_loop
+        cache *cache;
+
+        //Sets lazy_hdrs on every request (see http_parse.h). Only turn this
+        //on if your handlers are fine with unsqueezed header values
+        int lazy_hdrs;
+
+        //How much a client can make us buffer (see http_parse.h and
+        //websock.h). Going over gets a 414, 431 or 413, or for websockets,
+        //a close with status 1009. Defaults are the parsers' defaults
+        http_limits http_limits;
+        websock_limits ws_limits;
+
+        //HTTP/1.1 bodies of at least this many bytes go to a file instead of
+        //memory (see spill_min in http_parse.h), and handlers find them in
+        //req->body_fd. On plain connections, the body is spliced from the
+        //socket into the file, so it never passes through user space.
+        //body_spill_dir is passed on as spill_dir. 0 (the default) turns
+        //this off. Remember these still count against http_limits.max_body,
+        //and HTTP/2 bodies are always buffered
+        int body_spill_min;
+        char const *body_spill_dir;
+
+        //If you set on_message_data, websocket data frames with at least
+        //this much payload are streamed to it instead of being buffered
+        //(see websock.h), so ws_limits don't apply to them
+        unsigned long ws_stream_min;
+
+        //If non-NULL, every connection speaks TLS (see tls.h), with kTLS if
+        //the context asks for it and the kernel has it. Not freed by
+        //del_srv_loop
+        tls_ctx *tls;
+
+        //Accept cleartext HTTP/2 (see h2.h), both with prior knowledge and
+        //through "Upgrade: h2c". Requests still show up in on_request one at
+        //a time, and whatever you srv_send is translated into frames for
+        //the right stream, so handlers don't need to know
+        int h2;
+
+        //If non-NULL, everything read from every connection is recorded
+        //here, plus when connections open and close (see capture.h). Not
+        //freed by del_srv_loop
+        cap_log *capture;
+
+        //Time every request and websocket message through parsing, the
+        //handler and writing the response (see trace.h). The histograms
+        //show up on metrics_path, and 1 in trace_sampling requests is kept
+        //for GET requests to trace_path (if non-NULL), which gets you a
+        //Chrome trace
+        int trace;
+        unsigned trace_sampling;
+        char const *trace_path;
+
+        //If non-NULL, connections are held to these limits (see
+        //ratelimit.h). One that runs out isn't read from until its buckets
+        //fill back up; requests and frames are counted as they start. Not
+        //freed by del_srv_loop
+        rl_table *ratelimit;
+
+        //Restarts without dropping anyone (see handoff.h). If non-NULL, the
+        //loop listens on this UNIX socket path for its replacement. When a
+        //new loop starts with the same path, it takes over the listening
+        //socket (port is ignored then) and this one stops accepting and
+        //starts draining: idle HTTP connections are closed, busy ones are
+        //closed once they're idle, and websockets are handed over, parse
+        //state and all, as soon as they're between callbacks with nothing
+        //queued. Once every connection is gone (or drain_timeout runs out)
+        //srv_run returns. The new loop calls on_open for each websocket it
+        //gets, already in websocket mode; c->user and rate limit buckets
+        //don't come along. TLS connections can't be handed over, so they
+        //get a close (1001) instead, same as every websocket if
+        //handoff_websocks is 0. NULL by default
+        char const *handoff_path;
+        int handoff_websocks;
+
+        //Room in the loop's post queue, which is how other threads send
+        //things to its connections (see srv_post). 0 (the default) means
+        //there isn't one
+        unsigned long post_queue_size;
+    } srv_params;
+
+    struct _srv_conn;
+    struct _srv_loop;
+    struct _srv_upconn;
+
+    typedef struct _srv_callbacks {
+        //Called when a complete HTTP request has been parsed. req is only
+        //valid until the callback returns
+        void (*on_request)(struct _srv_conn *c, http_req *req, void *user);
+        //Called for each websocket data frame (text, binary, or
+        //continuation). Pings, pongs and closes are handled for you. pkt is
+        //only valid until the callback returns
+        void (*on_message)(struct _srv_conn *c, websock_pkt *pkt, void *user);
+        //Called once a connection has been closed, just before its memory is
+        //freed
+        void (*on_close)(struct _srv_conn *c, void *user);
+        //Backpressure: called when a connection's output queue crosses its
+        //high watermark (stop producing for it) and when it drains back
+        //below the low watermark (go ahead again). Any of these can be NULL
+        void (*on_send_blocked)(struct _srv_conn *c, void *user);
+        void (*on_send_resumed)(struct _srv_conn *c, void *user);
+        //Called for each new connection, before anything has been read
+        //from it
+        void (*on_open)(struct _srv_conn *c, void *user);
+        //Called for each piece of a streamed websocket frame's payload (see
+        //params.ws_stream_min) as it comes in. off is where data goes in the
+        //frame, and pkt already has the frame's type, fin and payload_len.
+        //on_message is still called once the frame is done, with payload
+        //set to NULL. You can send and srv_close from in here, but don't
+        //srv_hold
+        void (*on_message_data)(struct _srv_conn *c, websock_pkt *pkt, char const *data, int len, unsigned long off, void *user);
+        //Called when an HTTP/1.1 request's headers are in but its body
+        //isn't. Everything in req but the payload can be used. Return 0 to
+        //take the body (a client that sent Expect: 100-continue gets its
+        //100 Continue then), or a 4xx/5xx status to turn the request down
+        //without reading the body: the client gets that status and the
+        //connection is closed. If this is NULL, every body is taken
+        int (*on_headers)(struct _srv_conn *c, http_req *req, void *user);
+    } srv_callbacks;
+
+    typedef struct _srv_conn {
+        int fd;
+        srv_conn_mode_t mode;
+        //Unique for the life of the loop (unlike fd, which gets reused)
+        unsigned long id;
+        //Yours to do whatever you want with
+        void *user;
+
+        //Internal fields. Don't touch!
+        struct {
+            struct _srv_loop *loop;
+            //Where req/pkt live. Reset after every request/message
+            mm_arena arena;
+            //Only one of these exists at a time, depending on mode
+            http_req *req;
+            websock_pkt *pkt;
+            //NULL unless params.tls is set
+            tls_conn *tls;
+            //NULL unless params.trace is set
+            trace_conn *trace;
+            //Where the request we're waiting on went (see srv_proxy). NULL
+            //unless we're proxying or tunneling
+            struct _srv_upconn *proxy;
+            //Only in SRV_CONN_H2 mode. h2_stream is the stream whose request
+            //is currently out with the user (0 if none)
+            h2_conn *h2;
+            unsigned h2_stream;
+            tw_timer timer;
+            srv_timeout_t timeout;
+            write_queue wq;
+            //The epoll events we're currently registered for
+            unsigned events;
+            //Set by srv_close while we wait for the queue to drain
+            int closing;
+            //Set by srv_send_canned: once the queue has drained, we shut
+            //down our side and wait for the client to hang up (see
+            //srv_linger). lingering means we're doing that now
+            int linger;
+            int lingering;
+            int closed;
+            //See srv_hold. parked means a request/message was kept past its
+            //callback, and whatever else we had read is sitting in stash
+            int held;
+            int parked;
+            //Out of rate limit tokens (see params.ratelimit). rl_timer goes
+            //off once there should be some again. Whatever we had read past
+            //the limit is in stash, like when held
+            int throttled;
+            rl_state rl;
+            tw_timer rl_timer;
+            char *stash;
+            int stash_len;
+            //Released connections waiting for the loop to pick them back up
+            int queued;
+            struct _srv_conn *ready_next;
+            //All connections are in a list owned by the loop. Closed ones
+            //are moved to a graveyard and freed at the end of the current
+            //loop iteration
+            struct _srv_conn *next;
+            struct _srv_conn *prev;
+        } __internal;
+    } srv_conn;
+
+    typedef struct _srv_loop {
+        srv_params params;
+        int num_conns;
+
+        //Internal fields. Don't touch!
+        struct {
+            int epfd;
+            int listen_fd;
+            //Armed while listen_fd is out of the epoll set because accept
+            //ran out of fds. Puts it back when it goes off
+            tw_timer accept_timer;
+            srv_callbacks cb;
+            void *user;
+            tw_wheel *wheel;
+            volatile int stop;
+            srv_conn *conns;
+            srv_conn *graveyard;
+            srv_conn *ready;
+            unsigned long next_id;
+            //For splicing spilled bodies. Always empty between calls. -1 if
+            //we're not doing that
+            int pipe[2];
+            //See params.handoff_path. handoff_fd is where we listen for our
+            //replacement, and handoff_peer is the one socket to the process
+            //on the other side of a handoff (whichever side we're on).
+            //Their addresses are their epoll tags
+            int handoff_fd;
+            int handoff_peer;
+            int draining;
+            unsigned long drain_deadline;
+            //NULL unless params.post_queue_size is set. Its address is its
+            //epoll tag. posts_pending means we stopped at SRV_POST_BATCH
+            mpsc_queue *posts;
+            int posts_pending;
+            //Live connections by id, for srv_post (only kept if there's a
+            //post queue). Open addressing, ids_cap is a power of two
+            srv_conn **ids;
+            unsigned long ids_cap;
+            unsigned long ids_len;
+            //Closed upstream connections, freed along with the graveyard
+            struct _srv_upconn *dead_ups;
+        } __internal;
+    } srv_loop;
+
+    //Where an upstream connection is in a proxied exchange
+    typedef enum _srv_up_state_t {
+        SRV_UP_IDLE, //In the pool
+        SRV_UP_CONNECTING,
+        SRV_UP_SENDING, //Writing out the request
+        SRV_UP_HEAD, //Waiting for the response header
+        SRV_UP_BODY,
+        SRV_UP_DONE, //Read it all, but some is still in the pipe
+        SRV_UP_TUNNEL, //After a 101
+        SRV_UP_CLOSED
+    } srv_up_state_t;
+
+    //How we'll know the response body is over
+    typedef enum _srv_up_body_t {
+        SRV_UP_LENGTH, //Content-Length, or no body at all
+        SRV_UP_CHUNKED,
+        SRV_UP_UNTIL_CLOSE
+    } srv_up_body_t;
+
+    //One connection to an upstream server. All internal, so don't touch!
+    typedef struct _srv_upconn {
+        int fd;
+        struct _srv_upstream *up;
+        srv_loop *loop;
+        //Who we're answering. NULL while idle
+        srv_conn *client;
+        srv_up_state_t state;
+        //The epoll events we're currently registered for
+        unsigned events;
+        //reused means it came out of the pool, so the server might have
+        //closed it just before our request got there. Until got_resp, that
+        //gets the request retried on a new connection
+        int reused;
+        int got_resp;
+        //Once the client has seen part of the response, all we can do
+        //about a failure is hang up on it
+        int head_sent;
+        int is_head;
+        int upgrade;
+        int close_client;
+
+        //The request: the header (and the body, unless it was spilled, in
+        //which case it's sent from body_fd). Tunnels use out for whatever
+        //the client sent right after asking to upgrade
+        char *out;
+        int out_len;
+        int out_cap;
+        int out_pos;
+        int body_fd;
+        long body_len;
+        off_t body_off;
+
+        //The response
+        http_req *resp;
+        srv_up_body_t body;
+        long left;
+        http_chunks chunks;
+        //Can go back in the pool once the response is over
+        int keep;
+
+        //Response bytes on their way to the client, and in a tunnel, the
+        //client's bytes on their way here. -1 until we need them
+        int pipe[2];
+        long piped;
+        int rpipe[2];
+        long rpiped;
+        //The server hung up on a tunnel
+        int eof;
+
+        //In the pool, or in the loop's dead_ups
+        struct _srv_upconn *next;
+    } srv_upconn;
+
+    //A server to proxy requests to (see srv_proxy), and the keep-alive
+    //connections we have open to it
+    typedef struct _srv_upstream {
+        //Most idle connections to keep. Defaults to
+        //SRV_DEFAULT_UPSTREAM_IDLE
+        int max_idle;
+        int num_idle;
+
+        //Internal fields. Don't touch!
+        struct {
+            srv_loop *loop;
+            struct sockaddr_storage addr;
+            socklen_t addr_len;
+            srv_upconn *idle;
+        } __internal;
+    } srv_upstream;
+#else
+    #define X(x) #x
+    char const *const srv_timeout_strs[] = {
+        SRV_TIMEOUT_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+//Current time in timer wheel ticks
+static unsigned long srv_now_ticks() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long ms = ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+    return ms / SRV_TICK_MS;
+}
+
+static void srv_close_conn(srv_conn *c);
+static void srv_up_close(srv_upconn *u);
+static void srv_up_fail(srv_upconn *u, char const *resp);
+static void srv_up_resume(srv_upconn *u);
+static void srv_tunnel_read(srv_loop *l, srv_conn *c);
+
+//Points the connection's (only) timer at a new deadline. Passing
+//SRV_TIMEOUT_NONE, or a timeout that is configured to zero, just disarms it
+static void srv_set_timeout(srv_conn *c, srv_timeout_t which) {
+    srv_loop *l = c->__internal.loop;
+    unsigned ms = 0;
+
+    switch (which) {
+    case SRV_TIMEOUT_HDR:       ms = l->params.hdr_timeout; break;
+    case SRV_TIMEOUT_KEEPALIVE: ms = l->params.keepalive_timeout; break;
+    case SRV_TIMEOUT_BODY:      ms = l->params.body_timeout; break;
+    case SRV_TIMEOUT_PING:      ms = l->params.ws_ping_interval; break;
+    case SRV_TIMEOUT_PONG:      ms = l->params.ws_pong_timeout; break;
+    case SRV_TIMEOUT_DRAIN:     ms = l->params.drain_timeout; break;
+    case SRV_TIMEOUT_LINGER:    ms = l->params.linger_timeout; break;
+    case SRV_TIMEOUT_UPSTREAM:  ms = l->params.upstream_timeout; break;
+    case SRV_TIMEOUT_NONE:      break;
+    }
+
+    c->__internal.timeout = which;
+    if (ms == 0) {
+        tw_cancel(l->__internal.wheel, &c->__internal.timer);
+        return;
+    }
+
+    tw_arm(l->__internal.wheel, &c->__internal.timer, (ms + SRV_TICK_MS - 1) / SRV_TICK_MS);
+}
+
+//Re-registers c with epoll if the set of events we care about changed. We
+//only ask for EPOLLOUT while there is something queued, and stop reading
+//once the connection is closing
+static void srv_update_events(srv_conn *c) {
+    unsigned want = 0;
+    //A tunnel only reads as fast as the server on the other end takes it
+    srv_upconn *u = c->__internal.proxy;
+    int blocked = c->mode == SRV_CONN_TUNNEL && (!u || u->rpiped > 0 || u->out_pos < u->out_len);
+    if (!c->__internal.closing && !c->__internal.held && !c->__internal.throttled && !blocked) want |= EPOLLIN | EPOLLRDHUP;
+    if (c->__internal.lingering) want |= EPOLLIN | EPOLLRDHUP;
+    if (!wq_empty(&c->__internal.wq)) want |= EPOLLOUT;
+    if (u && u->piped > 0) want |= EPOLLOUT;
+    if (c->__internal.tls && c->__internal.tls->want_write) want |= EPOLLOUT;
+
+    if (want == c->__internal.events) return;
+
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.ptr = c;
+    epoll_ctl(c->__internal.loop->__internal.epfd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->__internal.events = want;
+}
+
+//Sends an error response and hangs up once it has gone out. On HTTP/2,
+//only the stream is finished, not the whole connection. The client may
+//still be sending (e.g. a body we just turned down), so we linger instead
+//of closing outright
+static void srv_send_canned(srv_conn *c, char const *msg) {
+    mm_err err = MM_SUCCESS;
+    srv_send(c, msg, strlen(msg), &err);
+    if (c->mode == SRV_CONN_H2) return;
+    c->__internal.linger = 1;
+    srv_close(c);
+}
+
+//Called once everything queued on a closing connection is out. Instead of
+//closing, we shut down our side, so the client sees the end of the
+//response, and drop whatever it sends until it hangs up or linger_timeout
+//runs out. (This is what a "lingering close" is)
+static void srv_linger(srv_conn *c) {
+    srv_loop *l = c->__internal.loop;
+    if (l->params.linger_timeout == 0 || shutdown(c->fd, SHUT_WR) < 0) {
+        srv_close_conn(c);
+        return;
+    }
+
+    c->__internal.lingering = 1;
+    //Nothing we read now counts for anything
+    c->__internal.throttled = 0;
+    tw_cancel(l->__internal.wheel, &c->__internal.rl_timer);
+    srv_set_timeout(c, SRV_TIMEOUT_LINGER);
+    srv_update_events(c);
+}
+
+//The queue of a closing connection has drained
+static void srv_closed_drained(srv_conn *c) {
+    if (c->__internal.linger && !c->__internal.lingering) srv_linger(c);
+    else srv_close_conn(c);
+}
+
+//Reads and drops what a lingering connection sent. A bit at a time, so a
+//client that keeps sending can't hog the loop; the timeout is a hard
+//deadline either way
+static void srv_linger_read(srv_conn *c) {
+    char buf[SRV_READ_SIZE];
+    int num = read(c->fd, buf, sizeof(buf));
+    if (num == 0 || (num < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) srv_close_conn(c);
+}
+
+//Answers a request for params.metrics_path
+static void srv_send_metrics(srv_conn *c) {
+    srv_loop *l = c->__internal.loop;
+    mm_err err = MM_SUCCESS;
+    char body[16384];
+    
+    int len = metrics_prometheus(body, sizeof(body), &err);
+    if (err != MM_SUCCESS) {
+        srv_send_canned(c, SRV_INTERNAL_ERROR_RESPONSE);
+        return;
+    }
+    
+    //The loop's own gauges don't need MM_METRICS, since we keep track of
+    //them anyway
+    len += snprintf(body + len, sizeof(body) - len,
+        "# HELP mm_srv_connections Open connections\n"
+        "# TYPE mm_srv_connections gauge\n"
+        "mm_srv_connections %d\n"
+        "# HELP mm_srv_queued_bytes Output bytes waiting to be sent\n"
+        "# TYPE mm_srv_queued_bytes gauge\n"
+        "mm_srv_queued_bytes %ld\n",
+        l->num_conns, wq_global_bytes()
+    );
+    cache *rc = l->params.cache;
+    if (rc && len < (int) sizeof(body)) {
+        len += snprintf(body + len, sizeof(body) - len,
+            "# HELP mm_cache_lookups_total Response cache lookups by result\n"
+            "# TYPE mm_cache_lookups_total counter\n"
+            "mm_cache_lookups_total{result=\"hit\"} %lu\n"
+            "mm_cache_lookups_total{result=\"not_modified\"} %lu\n"
+            "mm_cache_lookups_total{result=\"miss\"} %lu\n"
+            "# HELP mm_cache_evictions_total Responses evicted from the cache\n"
+            "# TYPE mm_cache_evictions_total counter\n"
+            "mm_cache_evictions_total %lu\n",
+            rc->hits, rc->not_modified, rc->misses, rc->evictions
+        );
+    }
+    rl_table *rt = l->params.ratelimit;
+    if (rt && len < (int) sizeof(body)) {
+        len += snprintf(body + len, sizeof(body) - len,
+            "# HELP mm_ratelimit_throttled_total Times a connection ran out of rate limit tokens\n"
+            "# TYPE mm_ratelimit_throttled_total counter\n"
+            "mm_ratelimit_throttled_total %lu\n",
+            rt->throttled
+        );
+    }
+    tls_ctx *tc = l->params.tls;
+    if (tc && len < (int) sizeof(body)) {
+        len += snprintf(body + len, sizeof(body) - len,
+            "# HELP mm_tls_handshakes_total TLS handshakes by result\n"
+            "# TYPE mm_tls_handshakes_total counter\n"
+            "mm_tls_handshakes_total{result=\"ok\"} %lu\n"
+            "mm_tls_handshakes_total{result=\"failed\"} %lu\n"
+            "# HELP mm_tls_ktls_total Connections handed to kernel TLS, by direction\n"
+            "# TYPE mm_tls_ktls_total counter\n"
+            "mm_tls_ktls_total{dir=\"tx\"} %lu\n"
+            "mm_tls_ktls_total{dir=\"rx\"} %lu\n",
+            tc->handshakes, tc->failed, tc->ktls_tx, tc->ktls_rx
+        );
+    }
+    if (l->params.trace && len < (int) sizeof(body)) {
+        int n = trace_prometheus(body + len, sizeof(body) - len, &err);
+        len = err == MM_SUCCESS ? len + n : (int) sizeof(body);
+    }
+    if (len >= (int) sizeof(body)) {
+        srv_send_canned(c, SRV_INTERNAL_ERROR_RESPONSE);
+        return;
+    }
+    
+    char hdr[128];
+    int hdr_len = snprintf(hdr, sizeof(hdr),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\n"
+        "\r\n",
+        len
+    );
+    srv_send(c, hdr, hdr_len, &err);
+    srv_send(c, body, len, &err);
+}
+
+//Answers a GET for trace_path with the sampled requests as a Chrome trace
+static void srv_send_trace(srv_conn *c) {
+    mm_err err = MM_SUCCESS;
+    char *body = NULL;
+    size_t len = 0;
+    FILE *fp = open_memstream(&body, &len);
+    if (fp) trace_write_chrome(fp, &err);
+    if (!fp || fclose(fp) != 0 || err != MM_SUCCESS) {
+        free(body);
+        srv_send_canned(c, SRV_INTERNAL_ERROR_RESPONSE);
+        return;
+    }
+
+    char hdr[128];
+    int hdr_len = snprintf(hdr, sizeof(hdr),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %ld\r\n"
+        "\r\n",
+        (long) len
+    );
+    srv_send(c, hdr, hdr_len, &err);
+    srv_send(c, body, len, &err);
+    free(body);
+}
+
+static void srv_wq_stop(write_queue *q, void *arg) {
+    srv_conn *c = arg;
+    srv_loop *l = c->__internal.loop;
+    if (l->__internal.cb.on_send_blocked) l->__internal.cb.on_send_blocked(c, l->__internal.user);
+}
+
+static void srv_wq_resume(write_queue *q, void *arg) {
+    srv_conn *c = arg;
+    srv_loop *l = c->__internal.loop;
+    if (l->__internal.cb.on_send_resumed) l->__internal.cb.on_send_resumed(c, l->__internal.user);
+}
+
+//Where c's bytes go: straight to the socket, or through TLS
+static wq_send_fn *srv_sender(srv_conn *c, void **arg) {
+    if (c->__internal.tls) {
+        *arg = c->__internal.tls;
+        return tls_writev;
+    }
+    *arg = (void *) (long) c->fd;
+    return wq_send_socket;
+}
+
+//Moves the TLS handshake along. Returns 1 once it's done (and it's time to
+//read), 0 if we have to wait, or -1 if c got closed
+static int srv_handshake(srv_conn *c) {
+    mm_err err = MM_SUCCESS;
+    int rc = tls_handshake(c->__internal.tls, &err);
+    if (rc < 0) {
+        srv_close_conn(c);
+        return -1;
+    }
+    srv_update_events(c);
+    return rc;
+}
+
+static void srv_handle_readable(srv_loop *l, srv_conn *c);
+
+//Tries to write out c's queue, and closes c if that fails or if this was
+//the last thing srv_close was waiting for
+static void srv_handle_writable(srv_conn *c) {
+    if (c->__internal.tls && !c->__internal.tls->established) {
+        //The handshake was waiting to write. If it's done now, the client
+        //may well have sent its request already
+        if (srv_handshake(c) == 1) srv_handle_readable(c->__internal.loop, c);
+        return;
+    }
+
+    mm_err err = MM_SUCCESS;
+    void *arg;
+    wq_send_fn *send = srv_sender(c, &arg);
+    long left = wq_flush_to(&c->__internal.wq, send, arg, &err);
+    if (c->__internal.trace && err == MM_SUCCESS) trace_flushed(c->__internal.trace, c->__internal.wq.sent, left);
+    if (err != MM_SUCCESS) {
+        srv_close_conn(c);
+        return;
+    }
+    if (left == 0 && c->__internal.closing) {
+        srv_closed_drained(c);
+        return;
+    }
+    //A proxied response only comes in as fast as the client takes it
+    if (left == 0 && c->__internal.proxy) {
+        srv_up_resume(c->__internal.proxy);
+        if (c->__internal.closed) return;
+    }
+    srv_update_events(c);
+}
+
+//Queues whatever part of b (starting at off) didn't make it out directly.
+//Deals with the slow-consumer policy
+static void srv_queue_buf(srv_conn *c, wq_buf *b, int off, unsigned key, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    wq_push(&c->__internal.wq, b, off, key, err);
+    if (*err == WQ_SLOW_CONSUMER) {
+        srv_close_conn(c);
+        return;
+    }
+    srv_update_events(c);
+}
+
+//Writes as much of iov as the socket will take right now. Returns number of
+//bytes written, or negative (and closes c) on a real error
+static long srv_send_direct(srv_conn *c, struct iovec *iov, int n, mm_err *err) {
+    void *arg;
+    wq_send_fn *send = srv_sender(c, &arg);
+    long rc = send(arg, iov, n);
+    if (rc >= 0) return rc;
+
+    *err = SRV_SEND_ERROR;
+    srv_close_conn(c);
+    return -1;
+}
+
+//srv_send, minus the checks and HTTP/2 translation
+static int srv_send_bytes(srv_conn *c, char const *buf, int len, mm_err *err) {
+    long sent = 0;
+    if (wq_empty(&c->__internal.wq)) {
+        struct iovec iov = {(void *) buf, len};
+        sent = srv_send_direct(c, &iov, 1, err);
+        if (sent < 0) return -1;
+        if (sent == len) return len;
+    }
+
+    wq_buf *b = new_wq_buf_from(buf + sent, len - sent, err);
+    srv_queue_buf(c, b, 0, 0, err);
+    wq_buf_unref(b);
+    if (*err != MM_SUCCESS) return -1;
+
+    return len;
+}
+
+//Sends whatever frames the HTTP/2 code has piled up
+static void srv_h2_flush(srv_conn *c) {
+    h2_buf *out = &c->__internal.h2->out;
+    if (out->len == 0 || c->__internal.closed) return;
+
+    mm_err err = MM_SUCCESS;
+    srv_send_bytes(c, out->data, out->len, &err);
+    out->len = 0;
+}
+
+//Sends (part of) an HTTP/1.1 response on the current stream
+static int srv_send_h2(srv_conn *c, char const *buf, int len, mm_err *err) {
+    h2_conn *h = c->__internal.h2;
+    int rc = h2_respond(h, c->__internal.h2_stream, buf, len, err);
+    srv_h2_flush(c);
+
+    //A client that doesn't open its window is just a slow reader, so it
+    //gets held to the same limit
+    long max = c->__internal.wq.max_bytes;
+    if (max && h->pending_bytes > max) {
+        if (*err == MM_SUCCESS) *err = WQ_SLOW_CONSUMER;
+        srv_close_conn(c);
+        return -1;
+    }
+    return rc;
+}
+
+//Timer wheel callback. The connection's timer expired, so do whatever that
+//phase calls for
+static void srv_conn_timeout(tw_timer *t, void *arg) {
+    srv_conn *c = arg;
+    if (c->__internal.closed) return;
+
+    switch (c->__internal.timeout) {
+    case SRV_TIMEOUT_PING: {
+        //Websocket has been quiet for a while. Ping it and give it a
+        //deadline to answer
+        mm_err err = MM_SUCCESS;
+        srv_send_websock(c, WEBSOCK_PING, NULL, 0, &err);
+        if (err == MM_SUCCESS) srv_set_timeout(c, SRV_TIMEOUT_PONG);
+        else srv_close_conn(c);
+        return;
+    }
+    case SRV_TIMEOUT_HDR:
+    case SRV_TIMEOUT_BODY:
+        srv_send_canned(c, SRV_TIMEOUT_RESPONSE);
+        return;
+    case SRV_TIMEOUT_UPSTREAM:
+        if (c->__internal.proxy) srv_up_fail(c->__internal.proxy, SRV_GATEWAY_TIMEOUT_RESPONSE);
+        else srv_close_conn(c);
+        return;
+    default:
+        //Keep-alive, pong, drain and linger timeouts just hang up
+        srv_close_conn(c);
+        return;
+    }
+}
+
+//The table srv_post looks connections up in. Ids are handed out in order,
+//so they hash to their own low bits and mostly land in their own slot.
+//Returns -1 if we couldn't make room
+static int srv_ids_put(srv_loop *l, srv_conn *c) {
+    if ((l->__internal.ids_len + 1) * 2 > l->__internal.ids_cap) {
+        unsigned long cap = l->__internal.ids_cap ? l->__internal.ids_cap * 2 : 64;
+        srv_conn **ids = calloc(cap, sizeof(srv_conn *));
+        if (!ids) return -1;
+        unsigned long i;
+        for (i = 0; i < l->__internal.ids_cap; i++) {
+            srv_conn *old = l->__internal.ids[i];
+            if (!old) continue;
+            unsigned long j = old->id & (cap - 1);
+            while (ids[j]) j = (j + 1) & (cap - 1);
+            ids[j] = old;
+        }
+        free(l->__internal.ids);
+        l->__internal.ids = ids;
+        l->__internal.ids_cap = cap;
+    }
+
+    unsigned long mask = l->__internal.ids_cap - 1;
+    unsigned long i = c->id & mask;
+    while (l->__internal.ids[i]) i = (i + 1) & mask;
+    l->__internal.ids[i] = c;
+    l->__internal.ids_len++;
+    return 0;
+}
+
+static srv_conn *srv_ids_get(srv_loop *l, unsigned long id) {
+    if (l->__internal.ids_cap == 0) return NULL;
+    unsigned long mask = l->__internal.ids_cap - 1;
+    unsigned long i = id & mask;
+    while (l->__internal.ids[i]) {
+        if (l->__internal.ids[i]->id == id) return l->__internal.ids[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+static void srv_ids_del(srv_loop *l, unsigned long id) {
+    if (l->__internal.ids_cap == 0) return;
+    srv_conn **ids = l->__internal.ids;
+    unsigned long mask = l->__internal.ids_cap - 1;
+    unsigned long i = id & mask;
+    while (ids[i] && ids[i]->id != id) i = (i + 1) & mask;
+    if (!ids[i]) return;
+
+    //Shift back anything after it that would no longer be findable with a
+    //hole here, i.e. anything whose home slot isn't between the hole and
+    //where it sits now
+    unsigned long j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!ids[j]) break;
+        unsigned long home = ids[j]->id & mask;
+        int stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays) continue;
+        ids[i] = ids[j];
+        i = j;
+    }
+    ids[i] = NULL;
+    l->__internal.ids_len--;
+}
+
+//Takes a connection out of the loop and hands it to the graveyard. Safe to
+//call more than once, and safe to call from inside callbacks
+static void srv_close_conn(srv_conn *c) {
+    if (c->__internal.closed) return;
+    c->__internal.closed = 1;
+
+    srv_loop *l = c->__internal.loop;
+    tw_cancel(l->__internal.wheel, &c->__internal.timer);
+    tw_cancel(l->__internal.wheel, &c->__internal.rl_timer);
+    if (l->params.ratelimit) rl_close(l->params.ratelimit, &c->__internal.rl);
+    if (l->__internal.posts) srv_ids_del(l, c->id);
+    if (c->__internal.proxy) {
+        //The response isn't over, so the upstream connection can't be
+        //reused
+        c->__internal.proxy->client = NULL;
+        srv_up_close(c->__internal.proxy);
+        c->__internal.proxy = NULL;
+    }
+    clear_write_queue(&c->__internal.wq);
+    epoll_ctl(l->__internal.epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    del_tls_conn(c->__internal.tls);
+    c->__internal.tls = NULL;
+    close(c->fd);
+    cap_record(l->params.capture, CAP_CLOSE, c->id, NULL, 0);
+
+    if (l->__internal.cb.on_close) l->__internal.cb.on_close(c, l->__internal.user);
+
+    //Unlink from live list
+    if (c->__internal.prev) c->__internal.prev->__internal.next = c->__internal.next;
+    else l->__internal.conns = c->__internal.next;
+    if (c->__internal.next) c->__internal.next->__internal.prev = c->__internal.prev;
+
+    //Add to graveyard
+    c->__internal.prev = NULL;
+    c->__internal.next = l->__internal.graveyard;
+    l->__internal.graveyard = c;
+
+    l->num_conns--;
+}
+
+static void srv_free_conn(srv_conn *c) {
+    //req/pkt live in the arena, so there's no need to delete them. (But a
+    //spilled body's file still has to be closed)
+    if (c->__internal.req) reset_http_req(c->__internal.req);
+    clear_mm_arena(&c->__internal.arena);
+    del_h2_conn(c->__internal.h2);
+    if (c->__internal.trace) mm_slab_alloc.free(NULL, c->__internal.trace, sizeof(trace_conn));
+    free(c->__internal.stash);
+    mm_slab_alloc.free(NULL, c, sizeof(srv_conn));
+}
+
+//websock_pkt's on_data, for streamed frames
+static void srv_ws_data(websock_pkt *pkt, char const *data, int len, unsigned long off, void *arg) {
+    srv_conn *c = arg;
+    srv_loop *l = c->__internal.loop;
+    if (!c->__internal.closed) l->__internal.cb.on_message_data(c, pkt, data, len, off, l->__internal.user);
+}
+
+//Called after each complete request or message. Throws away everything in
+//the connection's arena and starts a fresh parser struct (for whichever
+//mode the connection is now in) in its place
+static void srv_recycle(srv_conn *c, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    //Whatever we were working on is done. The response might still be
+    //queued, in which case srv_handle_writable finishes the timing
+    if (c->__internal.trace) {
+        write_queue const *q = &c->__internal.wq;
+        trace_done(c->__internal.trace, c->id, q->sent, q->bytes);
+    }
+
+    //The next frame might be part of the same message, so the size so far
+    //has to outlive the old packet
+    unsigned long msg_len = c->__internal.pkt ? c->__internal.pkt->__internal.msg_len : 0;
+
+    //Closes the last request's spill file, if it had one
+    if (c->__internal.req) reset_http_req(c->__internal.req);
+    mm_arena_reset(&c->__internal.arena);
+    c->__internal.req = NULL;
+    c->__internal.pkt = NULL;
+
+    //Tunnels don't parse anything
+    if (c->mode == SRV_CONN_TUNNEL) return;
+
+    //HTTP/2 requests get their http_req when they're handed out (see
+    //srv_h2_dispatch). All we do here is finish the last one's response
+    if (c->mode == SRV_CONN_H2) {
+        if (c->__internal.h2_stream) {
+            mm_err h2_err = MM_SUCCESS;
+            h2_end_response(c->__internal.h2, c->__internal.h2_stream, &h2_err);
+            c->__internal.h2_stream = 0;
+            srv_h2_flush(c);
+        }
+        return;
+    }
+
+    srv_params const *p = &c->__internal.loop->params;
+    mm_allocator const *a = &c->__internal.arena.alloc;
+    if (c->mode == SRV_CONN_HTTP) {
+        c->__internal.req = new_http_req_a(a, err);
+        if (*err != MM_SUCCESS) return;
+        c->__internal.req->lazy_hdrs = p->lazy_hdrs;
+        c->__internal.req->limits = p->http_limits;
+        c->__internal.req->spill_min = p->body_spill_min;
+        c->__internal.req->spill_dir = p->body_spill_dir;
+    } else {
+        c->__internal.pkt = new_websock_pkt_a(a, err);
+        if (*err != MM_SUCCESS) return;
+        c->__internal.pkt->limits = p->ws_limits;
+        if (c->__internal.loop->__internal.cb.on_message_data) {
+            c->__internal.pkt->on_data = srv_ws_data;
+            c->__internal.pkt->on_data_arg = c;
+            c->__internal.pkt->stream_min = p->ws_stream_min;
+        }
+        c->__internal.pkt->__internal.msg_len = msg_len;
+    }
+}
+
+static void srv_bury_dead(srv_loop *l) {
+    while (l->__internal.graveyard) {
+        srv_conn *c = l->__internal.graveyard;
+        l->__internal.graveyard = c->__internal.next;
+        srv_free_conn(c);
+    }
+    while (l->__internal.dead_ups) {
+        srv_upconn *u = l->__internal.dead_ups;
+        l->__internal.dead_ups = u->next;
+        del_http_req(u->resp);
+        free(u->out);
+        free(u);
+    }
+}
+
+static void srv_unthrottle(tw_timer *t, void *arg);
+
+//Sets up a connection for fd, in the given mode, and puts it in the loop.
+//Returns NULL (having closed fd) if it can't
+static srv_conn *srv_new_conn(srv_loop *l, int fd, srv_conn_mode_t mode, int tls) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    mm_err err = MM_SUCCESS;
+    srv_conn *c = mm_slab_alloc.alloc(NULL, sizeof(srv_conn));
+    if (!c) {
+        close(fd);
+        return NULL;
+    }
+    c->fd = fd;
+    c->mode = mode;
+    c->id = ++l->__internal.next_id;
+    c->user = NULL;
+    c->__internal.loop = l;
+    init_mm_arena(&c->__internal.arena, &mm_slab_alloc, SRV_ARENA_CHUNK);
+    c->__internal.req = NULL;
+    c->__internal.pkt = NULL;
+    c->__internal.h2 = NULL;
+    c->__internal.h2_stream = 0;
+    c->__internal.tls = tls ? new_tls_conn(l->params.tls, fd, &err) : NULL;
+    c->__internal.trace = NULL;
+    c->__internal.proxy = NULL;
+    srv_recycle(c, &err);
+    c->__internal.timeout = SRV_TIMEOUT_NONE;
+    c->__internal.events = EPOLLIN | EPOLLRDHUP;
+    c->__internal.closing = 0;
+    c->__internal.linger = 0;
+    c->__internal.lingering = 0;
+    c->__internal.closed = 0;
+    c->__internal.held = 0;
+    c->__internal.parked = 0;
+    c->__internal.throttled = 0;
+    c->__internal.stash = NULL;
+    c->__internal.stash_len = 0;
+    c->__internal.queued = 0;
+    c->__internal.ready_next = NULL;
+    init_tw_timer(&c->__internal.timer, srv_conn_timeout, c);
+    init_tw_timer(&c->__internal.rl_timer, srv_unthrottle, c);
+    init_write_queue(&c->__internal.wq);
+    c->__internal.wq.high_wm = l->params.wq_high_wm;
+    c->__internal.wq.low_wm = l->params.wq_low_wm;
+    c->__internal.wq.max_bytes = l->params.wq_max_bytes;
+    c->__internal.wq.policy = l->params.wq_policy;
+    c->__internal.wq.on_stop = srv_wq_stop;
+    c->__internal.wq.on_resume = srv_wq_resume;
+    c->__internal.wq.arg = c;
+    if (l->params.trace && err == MM_SUCCESS) {
+        c->__internal.trace = mm_slab_alloc.alloc(NULL, sizeof(trace_conn));
+        if (c->__internal.trace) init_trace_conn(c->__internal.trace);
+        else err = SRV_OOM;
+    }
+    if (err != MM_SUCCESS) {
+        del_tls_conn(c->__internal.tls);
+        close(fd);
+        srv_free_conn(c);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    ev.events = c->__internal.events;
+    ev.data.ptr = c;
+    if (epoll_ctl(l->__internal.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        del_tls_conn(c->__internal.tls);
+        close(fd);
+        srv_free_conn(c);
+        return NULL;
+    }
+    if (l->__internal.posts && srv_ids_put(l, c) < 0) {
+        epoll_ctl(l->__internal.epfd, EPOLL_CTL_DEL, fd, NULL);
+        del_tls_conn(c->__internal.tls);
+        close(fd);
+        srv_free_conn(c);
+        return NULL;
+    }
+
+    c->__internal.prev = NULL;
+    c->__internal.next = l->__internal.conns;
+    if (l->__internal.conns) l->__internal.conns->__internal.prev = c;
+    l->__internal.conns = c;
+    l->num_conns++;
+    return c;
+}
+
+//accept_timer went off, so listen for connections again. If we're still
+//out of fds, srv_accept_all just takes us back out
+static void srv_resume_accept(tw_timer *t, void *arg) {
+    srv_loop *l = arg;
+    if (l->__internal.listen_fd < 0) return; //Handed off in the meantime
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(l->__internal.epfd, EPOLL_CTL_MOD, l->__internal.listen_fd, &ev);
+}
+
+//Accepts as many pending connections as we can
+static void srv_accept_all(srv_loop *l) {
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        int fd = accept4(l->__internal.listen_fd, (struct sockaddr *) &addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            //The client gave up while it was in the queue
+            if (errno == ECONNABORTED || errno == EINTR) continue;
+
+            //Out of fds (or socket memory). The listening socket is
+            //level-triggered, so leaving it in the epoll set would wake us
+            //straight back up for the same connections, and we'd spin.
+            //Instead, stop listening for SRV_ACCEPT_RETRY_MS. The backlog
+            //holds the new connections until then
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                struct epoll_event ev;
+                ev.events = 0;
+                ev.data.ptr = NULL;
+                epoll_ctl(l->__internal.epfd, EPOLL_CTL_MOD, l->__internal.listen_fd, &ev);
+                tw_arm(l->__internal.wheel, &l->__internal.accept_timer, (SRV_ACCEPT_RETRY_MS + SRV_TICK_MS - 1) / SRV_TICK_MS);
+            }
+
+            //Otherwise it's EAGAIN, and we're done
+            return;
+        }
+
+        srv_conn *c = srv_new_conn(l, fd, SRV_CONN_HTTP, l->params.tls != NULL);
+        if (!c) continue;
+        if (l->params.ratelimit) rl_open(l->params.ratelimit, &c->__internal.rl, (struct sockaddr *) &addr);
+        cap_record(l->params.capture, CAP_OPEN, c->id, NULL, 0);
+
+        //A brand new connection gets the same grace period as an idle
+        //keep-alive connection
+        srv_set_timeout(c, SRV_TIMEOUT_KEEPALIVE);
+
+        if (l->__internal.cb.on_open) l->__internal.cb.on_open(c, l->__internal.user);
+    }
+}
+
+//Deals with pings, pongs, and closes so the user doesn't have to. Returns 1
+//if the frame was a control frame (and so should not be passed on)
+static int srv_handle_control(srv_conn *c, websock_pkt *pkt) {
+    mm_err err = MM_SUCCESS;
+
+    switch (pkt->type) {
+    case WEBSOCK_PING:
+        srv_send_websock(c, WEBSOCK_PONG, pkt->payload, pkt->payload_len, &err);
+        return 1;
+    case WEBSOCK_PONG:
+        //Any traffic already re-armed the ping timer, so there's nothing
+        //else to do
+        return 1;
+    case WEBSOCK_CLOSE:
+        //Echo the close and hang up
+        srv_send_websock(c, WEBSOCK_CLOSE, pkt->payload, pkt->payload_len, &err);
+        srv_close(c);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+//Saves the bytes we couldn't feed because c is held. buf may point into the
+//old stash
+static void srv_stash(srv_conn *c, char const *buf, int len) {
+    char *old = c->__internal.stash;
+    c->__internal.stash = NULL;
+    c->__internal.stash_len = 0;
+
+    if (len > 0) {
+        c->__internal.stash = malloc(len);
+        if (!c->__internal.stash) {
+            free(old);
+            srv_close_conn(c);
+            return;
+        }
+        memcpy(c->__internal.stash, buf, len);
+        c->__internal.stash_len = len;
+    }
+
+    free(old);
+}
+
+//Stops reading from c until its rate limit buckets have had wait_ms to
+//fill up
+static void srv_throttle(srv_conn *c, unsigned wait_ms) {
+    srv_loop *l = c->__internal.loop;
+    c->__internal.throttled = 1;
+    srv_update_events(c);
+    tw_arm(l->__internal.wheel, &c->__internal.rl_timer, (wait_ms + SRV_TICK_MS - 1) / SRV_TICK_MS);
+}
+
+//Takes one request/frame token if there's a limit on them. If there's none
+//left, throttles c and returns 0. buf (if non-NULL) is what we were about
+//to parse, and gets stashed for when the tokens come back
+static int srv_take_token(srv_conn *c, rl_kind_t kind, char const *buf, int len) {
+    rl_table *t = c->__internal.loop->params.ratelimit;
+    if (!t) return 1;
+
+    unsigned wait_ms;
+    if (rl_avail(t, &c->__internal.rl, kind, &wait_ms) == 0) {
+        if (buf) srv_stash(c, buf, len);
+        if (!c->__internal.closed) srv_throttle(c, wait_ms);
+        return 0;
+    }
+    rl_take(t, &c->__internal.rl, kind, 1);
+    return 1;
+}
+
+//Answers req from params.cache if it's in there. Returns 1 if it was
+static int srv_send_cached(srv_conn *c, http_req const *req) {
+    wq_buf *b;
+    if (cache_lookup(c->__internal.loop->params.cache, req, &b) == CACHE_MISS) return 0;
+
+    mm_err err = MM_SUCCESS;
+    srv_send_buf(c, b, 0, &err);
+    wq_buf_unref(b);
+    return 1;
+}
+
+//Tells the client why we're hanging up on it, as best we can
+static void srv_reject(srv_conn *c, mm_err parse_err) {
+    if (c->mode != SRV_CONN_WEBSOCK) {
+        if (parse_err == HTTP_REQ_LINE_TOO_LONG) srv_send_canned(c, SRV_URI_TOO_LONG_RESPONSE);
+        else if (parse_err == HTTP_HDR_LINE_TOO_LONG || parse_err == HTTP_HDRS_TOO_LARGE || parse_err == HTTP_TOO_MANY_HDRS) srv_send_canned(c, SRV_HDRS_TOO_LARGE_RESPONSE);
+        else if (parse_err == HTTP_BODY_TOO_LARGE) srv_send_canned(c, SRV_BODY_TOO_LARGE_RESPONSE);
+        else if (parse_err == HTTP_SPILL_FAILED) srv_send_canned(c, SRV_INTERNAL_ERROR_RESPONSE);
+        else if (parse_err == HTTP_UNKNOWN_EXPECT) srv_send_canned(c, SRV_EXPECTATION_FAILED_RESPONSE);
+        else srv_send_canned(c, SRV_BAD_REQUEST_RESPONSE);
+    } else if (parse_err == WEBSOCK_FRAME_TOO_BIG || parse_err == WEBSOCK_MSG_TOO_BIG) {
+        //1009 is "Message Too Big"
+        static char const too_big[2] = {1009 >> 8, 1009 & 0xFF};
+        mm_err err = MM_SUCCESS;
+        srv_send_websock(c, WEBSOCK_CLOSE, too_big, 2, &err);
+        srv_close(c);
+    } else {
+        srv_close_conn(c);
+    }
+}
+
+//Reason phrases for the statuses on_headers is likely to give back, and the
+//usual ones from servers we proxy to (see srv_up_head). Nobody reads these,
+//so anything else just gets a generic one
+static char const *srv_reason(int status) {
+    switch (status) {
+    case 101: return "Switching Protocols";
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 411: return "Length Required";
+    case 413: return "Content Too Large";
+    case 415: return "Unsupported Media Type";
+    case 417: return "Expectation Failed";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default:
+        if (status < 300) return "OK";
+        if (status < 400) return "Redirect";
+        return status < 500 ? "Client Error" : "Server Error";
+    }
+}
+
+//A request's headers are in, and its body is on the way (or waiting on a
+//100 Continue). Lets on_headers decide whether we want it. Returns 0 if
+//the request was turned down
+static int srv_body_pending(srv_loop *l, srv_conn *c) {
+    http_req *req = c->__internal.req;
+    int status = l->__internal.cb.on_headers ? l->__internal.cb.on_headers(c, req, l->__internal.user) : 0;
+    if (c->__internal.closed || c->__internal.closing) return 0;
+
+    if (status != 0) {
+        char resp[128];
+        if (status < 400 || status > 599) status = 500;
+        snprintf(resp, sizeof(resp), "HTTP/1.1 %d %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", status, srv_reason(status));
+        srv_send_canned(c, resp);
+        return 0;
+    }
+
+    if (req->expect_continue) {
+        mm_err err = MM_SUCCESS;
+        srv_send(c, SRV_CONTINUE_RESPONSE, sizeof(SRV_CONTINUE_RESPONSE) - 1, &err);
+    }
+    return 1;
+}
+
+//Answers a complete HTTP request: metrics, then the cache, then the user
+static void srv_dispatch(srv_loop *l, srv_conn *c, http_req *req) {
+    //Go back to waiting for the next request. (The user may upgrade to
+    //websockets in the callback, which changes the timeout again)
+    srv_set_timeout(c, SRV_TIMEOUT_KEEPALIVE);
+    if (c->__internal.trace) trace_mark(c->__internal.trace, TRACE_HANDLER_START);
+    if (l->params.metrics_path && req->req_type == HTTP_GET && !strcmp(req->path, l->params.metrics_path)) {
+        srv_send_metrics(c);
+    } else if (l->params.trace_path && req->req_type == HTTP_GET && !strcmp(req->path, l->params.trace_path)) {
+        srv_send_trace(c);
+    } else if (l->params.cache && srv_send_cached(c, req)) {
+        //Nothing else to do
+    } else if (l->__internal.cb.on_request) {
+        l->__internal.cb.on_request(c, req, l->__internal.user);
+    }
+    //If it's held, srv_release says when the handler is done
+    if (c->__internal.trace && !c->__internal.held) trace_mark(c->__internal.trace, TRACE_HANDLER_END);
+}
+
+//Switches c to HTTP/2. Our SETTINGS go out right away
+static void srv_start_h2(srv_conn *c, mm_err *err) {
+    c->__internal.h2 = new_h2_conn(&c->__internal.loop->params.http_limits, err);
+    if (*err != MM_SUCCESS) return;
+    c->mode = SRV_CONN_H2;
+}
+
+//Answers an "Upgrade: h2c" request with a 101, and makes req stream 1. If
+//the upgrade is no good (e.g. bad HTTP2-Settings), we just stay on HTTP/1.1
+static void srv_upgrade_h2(srv_conn *c, http_req const *req) {
+    static char const resp[] =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n"
+        "\r\n";
+
+    mm_err err = MM_SUCCESS;
+    h2_conn *h = new_h2_conn(&c->__internal.loop->params.http_limits, &err);
+    h2_upgrade(h, req, &err);
+    if (err != MM_SUCCESS) {
+        del_h2_conn(h);
+        return;
+    }
+
+    srv_send_bytes(c, resp, sizeof(resp) - 1, &err);
+    c->__internal.h2 = h;
+    c->__internal.h2_stream = 1;
+    c->mode = SRV_CONN_H2;
+    srv_h2_flush(c);
+}
+
+//Hands out every complete request on an HTTP/2 connection, one at a time,
+//the same way pipelined HTTP/1.1 requests are. srv_hold works the same too
+static void srv_h2_dispatch(srv_loop *l, srv_conn *c) {
+    h2_conn *h = c->__internal.h2;
+    while (!c->__internal.closed && !c->__internal.closing && !c->__internal.held) {
+        //Streams keep being parsed while we're throttled; they just wait
+        //here until there are tokens for them
+        if (!h->__internal.ready_head || !srv_take_token(c, RL_REQUESTS, NULL, 0)) break;
+        unsigned id = h2_next_request(h);
+
+        mm_err err = MM_SUCCESS;
+        c->__internal.h2_stream = id;
+        http_req *req = new_http_req_a(&c->__internal.arena.alloc, &err);
+        if (err == MM_SUCCESS) {
+            req->lazy_hdrs = l->params.lazy_hdrs;
+            req->limits = l->params.http_limits;
+        }
+        h2_stream_req(h, id, req, &err);
+        if (c->__internal.trace) trace_parsed(c->__internal.trace, TRACE_H2);
+        if (err == H2_NO_STREAM) {
+            //Reset while it was waiting
+        } else if (err != MM_SUCCESS) {
+            srv_reject(c, err);
+        } else {
+            c->__internal.req = req;
+            srv_dispatch(l, c, req);
+        }
+        if (c->__internal.closed) return;
+
+        if (c->__internal.held) {
+            c->__internal.parked = 1;
+            break;
+        }
+
+        srv_recycle(c, &err);
+    }
+    srv_h2_flush(c);
+}
+
+static void srv_feed_h2(srv_loop *l, srv_conn *c, char const *buf, int len) {
+    //Streams come and go, so any traffic counts as the connection being in
+    //use
+    srv_set_timeout(c, SRV_TIMEOUT_KEEPALIVE);
+
+    mm_err err = MM_SUCCESS;
+    write_to_h2_parser(c->__internal.h2, buf, len, &err);
+    srv_h2_flush(c);
+    if (err != MM_SUCCESS) {
+        //The GOAWAY is already on its way
+        srv_close(c);
+        return;
+    }
+
+    srv_h2_dispatch(l, c);
+}
+
+//Hands a complete HTTP/1.1 request or websocket message to the user, then
+//gets ready for the next one. buf is whatever we read past the end of it.
+//Returns 0 if the caller should stop there (i.e. c is closed or held)
+static int srv_finish_msg(srv_loop *l, srv_conn *c, char const *buf, int len) {
+    if (c->__internal.trace) trace_parsed(c->__internal.trace, c->mode == SRV_CONN_HTTP ? TRACE_HTTP : TRACE_WEBSOCK);
+
+    if (c->mode == SRV_CONN_HTTP) {
+        //An h2c upgrade switches protocols right here, and the request
+        //that asked for it is answered as stream 1
+        http_req *req = c->__internal.req;
+        if (l->params.h2 && is_h2c_upgrade(req)) srv_upgrade_h2(c, req);
+        if (!c->__internal.closed) srv_dispatch(l, c, req);
+    } else {
+        websock_pkt *pkt = c->__internal.pkt;
+        if (!srv_handle_control(c, pkt) && l->__internal.cb.on_message) {
+            if (c->__internal.trace) trace_mark(c->__internal.trace, TRACE_HANDLER_START);
+            l->__internal.cb.on_message(c, pkt, l->__internal.user);
+            if (c->__internal.trace && !c->__internal.held) trace_mark(c->__internal.trace, TRACE_HANDLER_END);
+        }
+    }
+    
+    if (c->__internal.closed) return 0;
+    
+    //The user wants to hang on to this request/message for now. Leave
+    //it alone, and keep everything after it for srv_release
+    if (c->__internal.held) {
+        c->__internal.parked = 1;
+        srv_stash(c, buf, len);
+        return 0;
+    }
+    
+    //The user is done with the request/message, so the arena can be
+    //reused. (This is also where a websocket upgrade gets its parser)
+    mm_err err = MM_SUCCESS;
+    srv_recycle(c, &err);
+    if (err != MM_SUCCESS) {
+        srv_close_conn(c);
+        return 0;
+    }
+    return 1;
+}
+
+//Feeds bytes from the socket into whichever parser the connection is
+//currently using. Handles stragglers, which happen whenever the client
+//pipelines requests or sends several frames in one go
+static void srv_feed(srv_loop *l, srv_conn *c, char const *buf, int len) {
+    while (len > 0 && !c->__internal.closed && !c->__internal.closing) {
+        mm_err err = MM_SUCCESS;
+        int rc;
+
+        //HTTP/2 frames can't be split up like this, so they all go in at
+        //once
+        if (c->mode == SRV_CONN_H2) {
+            srv_feed_h2(l, c, buf, len);
+            return;
+        }
+
+        if (c->mode == SRV_CONN_HTTP) {
+            //First bytes of a new request. The header deadline starts now
+            if (c->__internal.timeout == SRV_TIMEOUT_KEEPALIVE) {
+                //Unless it's the HTTP/2 preface (which HTTP/1.1 would think
+                //is a bad request)
+                if (l->params.h2 && h2_is_preface(buf, len)) {
+                    srv_start_h2(c, &err);
+                    if (err != MM_SUCCESS) {
+                        srv_close_conn(c);
+                        return;
+                    }
+                    continue;
+                }
+                if (!srv_take_token(c, RL_REQUESTS, buf, len)) return;
+                srv_set_timeout(c, SRV_TIMEOUT_HDR);
+            }
+            rc = write_to_http_parser(c->__internal.req, buf, len, &err);
+        } else {
+            //Any traffic at all means the other end is still alive
+            srv_set_timeout(c, SRV_TIMEOUT_PING);
+            websock_pkt *pkt = c->__internal.pkt;
+            int fresh = pkt->__internal.state == WEBSOCK_HDR_FIRST_TWO_BYTES && pkt->__internal.pos == 0;
+            if (fresh && !srv_take_token(c, RL_FRAMES, buf, len)) return;
+            rc = write_to_websock_parser(pkt, buf, len, &err);
+        }
+
+        int used = len;
+        if (rc < 0 && (err == HTTP_STRAGGLERS || err == WEBSOCK_STRAGGLERS)) {
+            used = -rc;
+            rc = 0;
+            err = MM_SUCCESS;
+        } else if (rc < 0) {
+            srv_reject(c, err);
+            return;
+        }
+
+        buf += used;
+        len -= used;
+
+        if (rc == HTTP_BODY_PENDING && c->mode == SRV_CONN_HTTP && !srv_body_pending(l, c)) return;
+        if (rc > 0) {
+            //Need more data. If we're in the middle of a payload, the client
+            //gets a fresh deadline every time it makes progress
+            if (c->mode == SRV_CONN_HTTP && c->__internal.req->__internal.state == HTTP_PAYLOAD) {
+                srv_set_timeout(c, SRV_TIMEOUT_BODY);
+            }
+            continue;
+        }
+
+        if (!srv_finish_msg(l, c, buf, len)) return;
+    }
+}
+
+//How much we're allowed to read from c right now, up to want. If it's
+//nothing, c is throttled
+static int srv_read_budget(srv_conn *c, int want) {
+    rl_table *t = c->__internal.loop->params.ratelimit;
+    if (!t) return want;
+
+    unsigned wait_ms;
+    long n = rl_avail(t, &c->__internal.rl, RL_BYTES, &wait_ms);
+    if (n == 0) srv_throttle(c, wait_ms);
+    return n < want ? n : want;
+}
+
+//Reads what's there from a TLS connection. OpenSSL can have decrypted more
+//than we asked for, and epoll won't tell us about that, so keep going until
+//it's all out (or we're not supposed to be reading)
+static void srv_read_tls(srv_loop *l, srv_conn *c) {
+    tls_conn *t = c->__internal.tls;
+    if (!t->established && srv_handshake(c) != 1) return;
+
+    char buf[SRV_READ_SIZE];
+    do {
+        int want = srv_read_budget(c, sizeof(buf));
+        if (want == 0) return;
+
+        mm_err err = MM_SUCCESS;
+        int num = tls_read(t, buf, want, &err);
+        if (num == 0 || err != MM_SUCCESS) {
+            srv_close_conn(c);
+            return;
+        } else if (num < 0) {
+            return;
+        }
+
+        if (l->params.ratelimit) rl_take(l->params.ratelimit, &c->__internal.rl, RL_BYTES, num);
+        cap_record(l->params.capture, CAP_DATA, c->id, buf, num);
+        if (c->__internal.trace) trace_read(c->__internal.trace);
+        srv_feed(l, c, buf, num);
+    } while (!c->__internal.closed && !c->__internal.held && !c->__internal.throttled && tls_pending(t) > 0);
+}
+
+//Moves up to left bytes of a spilled body straight from the socket to the
+//body's file, by way of the loop's pipe
+static void srv_splice_body(srv_loop *l, srv_conn *c, int left) {
+    http_req *req = c->__internal.req;
+    int want = srv_read_budget(c, left < SRV_SPLICE_SIZE ? left : SRV_SPLICE_SIZE);
+    if (want == 0) return;
+
+    long num = splice(c->fd, NULL, l->__internal.pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (num == 0) {
+        srv_close_conn(c);
+        return;
+    } else if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) srv_close_conn(c);
+        return;
+    }
+
+    //The pipe is shared, so all of it has to come back out before we go
+    long moved = 0;
+    while (moved < num) {
+        long n = splice(l->__internal.pipe[0], NULL, req->body_fd, NULL, num - moved, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        moved += n;
+    }
+    if (moved < num) {
+        char junk[SRV_READ_SIZE];
+        while (read(l->__internal.pipe[0], junk, sizeof(junk)) > 0) {}
+        srv_send_canned(c, SRV_INTERNAL_ERROR_RESPONSE);
+        return;
+    }
+
+    if (l->params.ratelimit) rl_take(l->params.ratelimit, &c->__internal.rl, RL_BYTES, num);
+    if (c->__internal.trace) trace_read(c->__internal.trace);
+    srv_set_timeout(c, SRV_TIMEOUT_BODY);
+
+    mm_err err = MM_SUCCESS;
+    if (http_req_spliced(req, num, &err) == 0) srv_finish_msg(l, c, NULL, 0);
+}
+
+static void srv_handle_readable(srv_loop *l, srv_conn *c) {
+    if (c->__internal.lingering) {
+        srv_linger_read(c);
+        return;
+    }
+
+    //We don't ask for EPOLLIN while throttled, so this is a hangup or an
+    //error. Either way there's no one left to read from
+    if (c->__internal.throttled) {
+        srv_close_conn(c);
+        return;
+    }
+
+    if (c->mode == SRV_CONN_TUNNEL) {
+        srv_tunnel_read(l, c);
+        return;
+    }
+
+    if (c->__internal.tls) {
+        srv_read_tls(l, c);
+        return;
+    }
+
+    //The rest of a spilled body doesn't need to come through here. (Unless
+    //we're capturing, which has to see it)
+    if (c->mode == SRV_CONN_HTTP && c->__internal.req && l->__internal.pipe[0] >= 0 && !l->params.capture) {
+        int left = http_req_spill_left(c->__internal.req);
+        if (left > 0) {
+            srv_splice_body(l, c, left);
+            return;
+        }
+    }
+
+    char buf[SRV_READ_SIZE];
+    int want = srv_read_budget(c, sizeof(buf));
+    if (want == 0) return;
+
+    int num = read(c->fd, buf, want);
+    if (num == 0) {
+        srv_close_conn(c);
+        return;
+    } else if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) srv_close_conn(c);
+        return;
+    }
+
+    if (l->params.ratelimit) rl_take(l->params.ratelimit, &c->__internal.rl, RL_BYTES, num);
+    cap_record(l->params.capture, CAP_DATA, c->id, buf, num);
+    if (c->__internal.trace) trace_read(c->__internal.trace);
+    srv_feed(l, c, buf, num);
+}
+
+//Timer wheel callback for a throttled connection. Its buckets should have
+//something in them by now, so pick up where srv_throttle left off. (If
+//they don't, we just end up throttled again)
+static void srv_unthrottle(tw_timer *t, void *arg) {
+    srv_conn *c = arg;
+    if (c->__internal.closed) return;
+    c->__internal.throttled = 0;
+    srv_loop *l = c->__internal.loop;
+
+    //If it's held, the stash is srv_release's business
+    if (!c->__internal.held && !c->__internal.parked) {
+        char *stash = c->__internal.stash;
+        int stash_len = c->__internal.stash_len;
+        c->__internal.stash = NULL;
+        c->__internal.stash_len = 0;
+        srv_feed(l, c, stash, stash_len);
+        free(stash);
+
+        if (c->mode == SRV_CONN_H2 && !c->__internal.closed && !c->__internal.throttled) srv_h2_dispatch(l, c);
+
+        if (!c->__internal.closed && !c->__internal.held && !c->__internal.throttled && c->__internal.tls && tls_pending(c->__internal.tls) > 0) {
+            srv_read_tls(l, c);
+        }
+    }
+
+    if (!c->__internal.closed) srv_update_events(c);
+}
+
+//Picks up every connection srv_release put on the ready list, i.e. recycles
+//the request/message it was holding and feeds it whatever was stashed
+static void srv_handle_ready(srv_loop *l) {
+    while (l->__internal.ready) {
+        srv_conn *c = l->__internal.ready;
+        l->__internal.ready = c->__internal.ready_next;
+        c->__internal.ready_next = NULL;
+        c->__internal.queued = 0;
+        //Held again before we got to it
+        if (c->__internal.closed || c->__internal.held) continue;
+        c->__internal.parked = 0;
+
+        mm_err err = MM_SUCCESS;
+        srv_recycle(c, &err);
+        if (err != MM_SUCCESS) {
+            srv_close_conn(c);
+            continue;
+        }
+
+        char *stash = c->__internal.stash;
+        int stash_len = c->__internal.stash_len;
+        c->__internal.stash = NULL;
+        c->__internal.stash_len = 0;
+        srv_feed(l, c, stash, stash_len);
+        free(stash);
+
+        //HTTP/2 streams that finished while we were held are already
+        //parsed, so there may be nothing stashed
+        if (c->mode == SRV_CONN_H2) srv_h2_dispatch(l, c);
+
+        //There may be more sitting inside OpenSSL that epoll doesn't know
+        //about
+        if (!c->__internal.closed && !c->__internal.held && !c->__internal.throttled && c->__internal.tls && tls_pending(c->__internal.tls) > 0) {
+            srv_read_tls(l, c);
+        }
+
+        if (!c->__internal.closed) srv_update_events(c);
+    }
+}
+
+//Sends what other threads posted (see srv_post), up to SRV_POST_BATCH of
+//them. Posts for connections that have gone away are just dropped
+static void srv_take_posts(srv_loop *l) {
+    mpsc_queue *q = l->__internal.posts;
+    mpsc_clear_wakeup(q);
+
+    mpsc_item it;
+    int n = 0;
+    while (n < SRV_POST_BATCH && mpsc_pop(q, &it)) {
+        n++;
+        srv_conn *c = srv_ids_get(l, it.id);
+        if (c && !c->__internal.closing) {
+            mm_err err = MM_SUCCESS;
+            srv_send_buf(c, (wq_buf *) it.data, it.tag, &err);
+        }
+        wq_buf_unref((wq_buf *) it.data);
+    }
+    l->__internal.posts_pending = (n == SRV_POST_BATCH);
+}
+
+//Upstream connections share the epoll set with client connections, and
+//both show up as a plain pointer. malloc never hands out odd addresses, so
+//upstream ones get their lowest bit set. Yes, it's a hack
+static void *srv_up_tag(srv_upconn *u) {
+    return (void *) ((unsigned long) u | 1);
+}
+
+//srv_update_events for upstream connections. We only read a response while
+//the client is keeping up with it, so a slow client slows the server down
+//instead of making us buffer
+static void srv_up_events(srv_upconn *u) {
+    srv_conn *c = u->client;
+    int client_ready = c && wq_empty(&c->__internal.wq) && u->piped == 0;
+    unsigned want = 0;
+
+    switch (u->state) {
+    case SRV_UP_IDLE:
+    case SRV_UP_HEAD:
+        want = EPOLLIN | EPOLLRDHUP;
+        break;
+    case SRV_UP_CONNECTING:
+    case SRV_UP_SENDING:
+        want = EPOLLOUT;
+        break;
+    case SRV_UP_BODY:
+        if (client_ready) want = EPOLLIN | EPOLLRDHUP;
+        break;
+    case SRV_UP_TUNNEL:
+        if (client_ready && !u->eof) want = EPOLLIN | EPOLLRDHUP;
+        if (u->rpiped > 0 || u->out_pos < u->out_len) want |= EPOLLOUT;
+        break;
+    case SRV_UP_DONE:
+    case SRV_UP_CLOSED:
+        break;
+    }
+
+    if (want == u->events || u->fd < 0) return;
+
+    struct epoll_event ev;
+    ev.events = want;
+    ev.data.ptr = srv_up_tag(u);
+    epoll_ctl(u->loop->__internal.epfd, EPOLL_CTL_MOD, u->fd, &ev);
+    u->events = want;
+}
+
+//Closes u for good. Like connections, its memory lasts until the end of the
+//loop iteration, since there might still be an event for it
+static void srv_up_close(srv_upconn *u) {
+    if (u->state == SRV_UP_CLOSED) return;
+    u->state = SRV_UP_CLOSED;
+
+    srv_loop *l = u->loop;
+    if (u->fd >= 0) {
+        epoll_ctl(l->__internal.epfd, EPOLL_CTL_DEL, u->fd, NULL);
+        close(u->fd);
+        u->fd = -1;
+    }
+    if (u->pipe[0] >= 0) {
+        close(u->pipe[0]);
+        close(u->pipe[1]);
+    }
+    if (u->rpipe[0] >= 0) {
+        close(u->rpipe[0]);
+        close(u->rpipe[1]);
+    }
+
+    u->next = l->__internal.dead_ups;
+    l->__internal.dead_ups = u;
+}
+
+//Opens a new connection to up. It's probably still connecting when we
+//return. Returns NULL (with errno set) if that didn't work
+static srv_upconn *srv_up_new(srv_upstream *up) {
+    srv_loop *l = up->__internal.loop;
+    srv_upconn *u = malloc(sizeof(srv_upconn));
+    if (!u) return NULL;
+
+    mm_err err = MM_SUCCESS;
+    u->resp = new_http_req(&err);
+    if (err != MM_SUCCESS) {
+        free(u);
+        errno = ENOMEM;
+        return NULL;
+    }
+    //Nobody looks at the response's headers but us, and we don't mind
+    //whitespace
+    u->resp->lazy_hdrs = 1;
+    u->resp->limits = l->params.http_limits;
+
+    u->up = up;
+    u->loop = l;
+    u->client = NULL;
+    u->events = EPOLLOUT;
+    u->reused = 0;
+    u->out = NULL;
+    u->out_len = u->out_cap = u->out_pos = 0;
+    u->body_fd = -1;
+    u->pipe[0] = u->pipe[1] = -1;
+    u->piped = 0;
+    u->rpipe[0] = u->rpipe[1] = -1;
+    u->rpiped = 0;
+    u->next = NULL;
+
+    u->fd = socket(up->__internal.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (u->fd < 0) {
+        del_http_req(u->resp);
+        free(u);
+        return NULL;
+    }
+    int one = 1;
+    setsockopt(u->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    u->state = SRV_UP_SENDING;
+    if (connect(u->fd, (struct sockaddr *) &up->__internal.addr, up->__internal.addr_len) < 0) {
+        if (errno != EINPROGRESS) goto fail;
+        u->state = SRV_UP_CONNECTING;
+    }
+
+    struct epoll_event ev;
+    ev.events = u->events;
+    ev.data.ptr = srv_up_tag(u);
+    if (epoll_ctl(l->__internal.epfd, EPOLL_CTL_ADD, u->fd, &ev) < 0) goto fail;
+    return u;
+
+fail:;
+    int saved = errno;
+    close(u->fd);
+    del_http_req(u->resp);
+    free(u);
+    errno = saved;
+    return NULL;
+}
+
+//Takes u out of its upstream's pool
+static void srv_up_unidle(srv_upconn *u) {
+    srv_upconn **pp = &u->up->__internal.idle;
+    while (*pp && *pp != u) pp = &(*pp)->next;
+    if (!*pp) return;
+    *pp = u->next;
+    u->next = NULL;
+    u->up->num_idle--;
+}
+
+//Gets a connection to up: the most recently used idle one, or failing
+//that, a new one
+static srv_upconn *srv_up_get(srv_upstream *up) {
+    srv_upconn *u = up->__internal.idle;
+    if (!u) return srv_up_new(up);
+
+    srv_up_unidle(u);
+    u->reused = 1;
+    u->state = SRV_UP_SENDING;
+    return u;
+}
+
+//Adds len bytes to the end of u->out. Returns -1 if there wasn't room
+static int srv_up_put(srv_upconn *u, char const *buf, int len) {
+    if (u->out_len + len > u->out_cap) {
+        int cap = u->out_cap ? u->out_cap : SRV_READ_SIZE;
+        while (cap < u->out_len + len) cap *= 2;
+        char *out = realloc(u->out, cap);
+        if (!out) return -1;
+        u->out = out;
+        u->out_cap = cap;
+    }
+    memcpy(u->out + u->out_len, buf, len);
+    u->out_len += len;
+    return 0;
+}
+
+static int srv_up_puts(srv_upconn *u, char const *str) {
+    return srv_up_put(u, str, strlen(str));
+}
+
+//Copies r's headers into u->out, minus the ones that are only meant for
+//one hop: the usual suspects, and whatever the Connection header names.
+//Transfer-Encoding is left alone, since bodies go through exactly as they
+//came. Upgrade stays if keep_upgrade is set
+static int srv_up_put_hdrs(srv_upconn *u, http_req const *r, int keep_upgrade) {
+    static char const *const hop[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Expect", "Upgrade"};
+
+    mm_err err = MM_SUCCESS;
+    char *conn = get_args(r, "Connection", &err);
+    int rc = 0;
+    int i;
+    for (i = 0; i < r->num_hdrs; i++) {
+        http_hdr const *h = r->hdrs + i;
+        int skip = conn && has_token(conn, h->name);
+        int j;
+        for (j = 0; !skip && j < (int) (sizeof(hop) / sizeof(*hop)); j++) skip = !strcasecmp(h->name, hop[j]);
+        if (keep_upgrade && !strcasecmp(h->name, "Upgrade")) skip = 0;
+        if (skip) continue;
+
+        rc |= srv_up_puts(u, h->name);
+        rc |= srv_up_put(u, ": ", 2);
+        rc |= srv_up_puts(u, h->args);
+        rc |= srv_up_put(u, "\r\n", 2);
+    }
+    return rc;
+}
+
+//req->path has been decoded, so it has to be encoded again before it goes
+//anywhere. The one '%' that stays a '%' is the start of a %2F, which the
+//parser never decodes
+static int srv_up_put_path(srv_upconn *u, char const *path, int len) {
+    static char const hex[] = "0123456789ABCDEF";
+    int rc = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        unsigned char ch = path[i];
+        int plain = (ch > ' ' && ch < 0x7F && !strchr("\"#%<>?\\^`{|}", ch))
+            || (ch == '%' && i + 2 < len && path[i + 1] == '2' && (path[i + 2] == 'F' || path[i + 2] == 'f'));
+        if (plain) {
+            rc |= srv_up_put(u, (char const *) &ch, 1);
+        } else {
+            char esc[3] = {'%', hex[ch >> 4], hex[ch & 0xF]};
+            rc |= srv_up_put(u, esc, 3);
+        }
+    }
+    return rc;
+}
+
+//Moves everything in pipe p to the socket `to`, or as much as it'll take
+//right now. Returns -1 on error
+static int srv_pump_out(int to, int p[2], long *piped) {
+    while (*piped > 0) {
+        long n = splice(p[0], NULL, to, NULL, *piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        *piped -= n;
+    }
+    return 0;
+}
+
+//Moves up to limit bytes from one socket to another through pipe p (made
+//here if it's -1), so they never come into user space. Whatever `to` won't
+//take yet stays in the pipe (*piped says how much), and nothing more is
+//read until it's gone. Returns how many bytes were read, or -1 on an error
+//at either end. Sets *eof if `from` hung up
+static long srv_pump(int from, int to, int p[2], long *piped, long limit, int *eof) {
+    if (p[0] < 0) {
+        if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) return -1;
+        fcntl(p[1], F_SETPIPE_SZ, SRV_SPLICE_SIZE);
+    }
+
+    if (srv_pump_out(to, p, piped) < 0) return -1;
+    if (*piped > 0 || limit == 0) return 0;
+
+    long n = splice(from, NULL, p[1], NULL, limit < SRV_SPLICE_SIZE ? limit : SRV_SPLICE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == 0) {
+        *eof = 1;
+        return 0;
+    } else if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+
+    *piped += n;
+    if (srv_pump_out(to, p, piped) < 0) return -1;
+    return n;
+}
+
+//Puts u back in the pool, if there's room, now that it's done with its
+//response
+static void srv_up_idle(srv_upconn *u) {
+    srv_upstream *up = u->up;
+    if (up->num_idle >= up->max_idle) {
+        srv_up_close(u);
+        return;
+    }
+
+    u->state = SRV_UP_IDLE;
+    u->client = NULL;
+    u->next = up->__internal.idle;
+    up->__internal.idle = u;
+    up->num_idle++;
+    srv_up_events(u);
+}
+
+//The response is all out (or in the client's write queue). The client
+//can go on to its next request
+static void srv_up_finish(srv_upconn *u) {
+    srv_conn *c = u->client;
+    int close_client = u->close_client;
+    c->__internal.proxy = NULL;
+    u->client = NULL;
+    if (u->keep) srv_up_idle(u);
+    else srv_up_close(u);
+
+    if (close_client) {
+        srv_close(c);
+        return;
+    }
+    srv_set_timeout(c, SRV_TIMEOUT_KEEPALIVE);
+    srv_release(c);
+}
+
+//We've read the whole response. Some of it might still be in the pipe
+static void srv_up_done(srv_upconn *u) {
+    u->state = SRV_UP_DONE;
+    if (u->piped == 0) srv_up_finish(u);
+    else srv_up_events(u);
+}
+
+static void srv_up_go(srv_upconn *u);
+
+//Something went wrong on the upstream side. If the client hasn't seen any
+//of the response yet, it gets resp (a canned response). Otherwise all we
+//can do is hang up
+static void srv_up_fail(srv_upconn *u, char const *resp) {
+    srv_conn *c = u->client;
+    c->__internal.proxy = NULL;
+    u->client = NULL;
+
+    //The server closed a pooled connection just as we picked it up, which
+    //isn't really a failure. Try again on a new one. (This doesn't happen
+    //twice, since the new one isn't reused)
+    srv_upconn *fresh = NULL;
+    if (u->reused && !u->got_resp && resp && !strcmp(resp, SRV_BAD_GATEWAY_RESPONSE)) fresh = srv_up_new(u->up);
+    if (fresh) {
+        fresh->client = c;
+        c->__internal.proxy = fresh;
+        fresh->is_head = u->is_head;
+        fresh->upgrade = u->upgrade;
+        fresh->body_fd = u->body_fd;
+        fresh->body_len = u->body_len;
+        //The request is the same, so just hand over the buffer
+        fresh->out = u->out;
+        fresh->out_len = u->out_len;
+        fresh->out_cap = u->out_cap;
+        u->out = NULL;
+        srv_up_close(u);
+        srv_up_go(fresh);
+        return;
+    }
+
+    srv_up_close(u);
+    if (u->head_sent || !resp) srv_close(c);
+    else srv_send_canned(c, resp);
+}
+
+//Writes out as much of the request as the server takes. Once it's all
+//gone, we wait for the response
+static void srv_up_send(srv_upconn *u) {
+    while (u->out_pos < u->out_len) {
+        long n = send(u->fd, u->out + u->out_pos, u->out_len - u->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            srv_up_events(u);
+            return;
+        }
+        if (n < 0) {
+            srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+            return;
+        }
+        u->out_pos += n;
+    }
+
+    //Spilled bodies go straight from their file
+    while (u->body_fd >= 0 && u->body_off < u->body_len) {
+        long n = sendfile(u->fd, u->body_fd, &u->body_off, u->body_len - u->body_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            srv_up_events(u);
+            return;
+        }
+        if (n <= 0) {
+            srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+            return;
+        }
+    }
+
+    u->state = SRV_UP_HEAD;
+    srv_set_timeout(u->client, SRV_TIMEOUT_UPSTREAM);
+    srv_up_events(u);
+}
+
+//Starts sending u's request (from the top) once it's connected
+static void srv_up_go(srv_upconn *u) {
+    u->out_pos = 0;
+    u->body_off = 0;
+    u->got_resp = 0;
+    u->head_sent = 0;
+    u->close_client = 0;
+    u->eof = 0;
+    if (u->state == SRV_UP_CONNECTING) srv_up_events(u);
+    else srv_up_send(u);
+}
+
+//Our connection to the server went through (or didn't)
+static void srv_up_connected(srv_upconn *u) {
+    int so_err = 0;
+    socklen_t len = sizeof(so_err);
+    if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &so_err, &len) < 0 || so_err != 0) {
+        srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+        return;
+    }
+    u->state = SRV_UP_SENDING;
+    srv_up_send(u);
+}
+
+//Sends body bytes we've already read on to the client, and works out
+//whether that was the end of the body
+static void srv_up_body_bytes(srv_upconn *u, char const *buf, int len) {
+    srv_conn *c = u->client;
+    int n = len;
+    if (u->body == SRV_UP_LENGTH) {
+        if (n > u->left) n = u->left;
+        u->left -= n;
+    } else if (u->body == SRV_UP_CHUNKED) {
+        mm_err err = MM_SUCCESS;
+        n = http_chunks_scan(&u->chunks, buf, len, &err);
+        if (n < 0) {
+            srv_up_fail(u, NULL);
+            return;
+        }
+    }
+    //Anything past the end means the server's confused, so it doesn't get
+    //another request from us
+    if (n < len) u->keep = 0;
+
+    if (n > 0) {
+        mm_err err = MM_SUCCESS;
+        srv_send_bytes(c, buf, n, &err);
+        if (c->__internal.closed) return;
+    }
+
+    if ((u->body == SRV_UP_LENGTH && u->left == 0) || (u->body == SRV_UP_CHUNKED && http_chunks_done(&u->chunks))) {
+        srv_up_done(u);
+        return;
+    }
+    srv_up_events(u);
+}
+
+//Reads some of the response body and sends it on. Chunked bodies have to
+//come through here, so we can tell where they end, and so does anything
+//going out over TLS
+static void srv_up_copy_body(srv_upconn *u) {
+    char buf[SRV_PROXY_READ_SIZE];
+    long want = sizeof(buf);
+    if (u->body == SRV_UP_LENGTH && u->left < want) want = u->left;
+
+    int num = read(u->fd, buf, want);
+    if (num == 0) {
+        u->keep = 0;
+        if (u->body == SRV_UP_UNTIL_CLOSE) srv_up_done(u);
+        else srv_up_fail(u, NULL);
+        return;
+    } else if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) srv_up_fail(u, NULL);
+        return;
+    }
+
+    srv_set_timeout(u->client, SRV_TIMEOUT_UPSTREAM);
+    srv_up_body_bytes(u, buf, num);
+}
+
+//Moves some of the response body from the server to the client without
+//reading it ourselves
+static void srv_up_splice_body(srv_upconn *u) {
+    srv_conn *c = u->client;
+    long limit = u->body == SRV_UP_LENGTH ? u->left : SRV_SPLICE_SIZE;
+    int eof = 0;
+    long n = srv_pump(u->fd, c->fd, u->pipe, &u->piped, limit, &eof);
+    if (n < 0) {
+        srv_up_fail(u, NULL);
+        return;
+    }
+    //Whatever's left in the pipe goes once the client can take it
+    srv_update_events(c);
+
+    if (eof) {
+        u->keep = 0;
+        if (u->body == SRV_UP_UNTIL_CLOSE) srv_up_done(u);
+        else srv_up_fail(u, NULL);
+        return;
+    }
+
+    if (n > 0) srv_set_timeout(c, SRV_TIMEOUT_UPSTREAM);
+    if (u->body == SRV_UP_LENGTH) u->left -= n;
+    if (u->body == SRV_UP_LENGTH && u->left == 0) srv_up_done(u);
+    else srv_up_events(u);
+}
+
+//Passes a 101 on to the client, after which the two of them are on their
+//own. Whatever the client sent after its request is the start of the new
+//protocol, so it goes first
+static void srv_up_tunnel(srv_upconn *u) {
+    srv_conn *c = u->client;
+    c->mode = SRV_CONN_TUNNEL;
+    u->state = SRV_UP_TUNNEL;
+    u->keep = 0;
+    srv_set_timeout(c, SRV_TIMEOUT_NONE);
+
+    u->out_len = u->out_pos = 0;
+    if (c->__internal.stash_len > 0 && srv_up_put(u, c->__internal.stash, c->__internal.stash_len) < 0) {
+        srv_close_conn(c);
+        return;
+    }
+    free(c->__internal.stash);
+    c->__internal.stash = NULL;
+    c->__internal.stash_len = 0;
+
+    //Let go of the request without srv_release, which would start parsing
+    //again
+    c->__internal.held = 0;
+    c->__internal.parked = 0;
+    if (c->__internal.trace) trace_mark(c->__internal.trace, TRACE_HANDLER_END);
+    mm_err err = MM_SUCCESS;
+    srv_recycle(c, &err);
+    srv_update_events(c);
+    srv_up_events(u);
+}
+
+//Rebuilds the response header for the client and sends it, then works out
+//how the body will go
+static void srv_up_head(srv_upconn *u) {
+    srv_conn *c = u->client;
+    http_req const *r = u->resp;
+
+    u->keep = !r->cnx_closed;
+    if (r->status == 101) {
+        //We only pass one on if we asked for it
+        if (!u->upgrade) {
+            srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+            return;
+        }
+    } else if (u->is_head || r->status == 204 || r->status == 304) {
+        u->body = SRV_UP_LENGTH;
+        u->left = 0;
+    } else if (r->chunked) {
+        u->body = SRV_UP_CHUNKED;
+        http_chunks_begin(&u->chunks);
+    } else if (r->content_length >= 0) {
+        u->body = SRV_UP_LENGTH;
+        u->left = r->content_length;
+    } else {
+        //The body ends when the server hangs up, and the only way to tell
+        //the client the same thing is to hang up on it too
+        u->body = SRV_UP_UNTIL_CLOSE;
+        u->keep = 0;
+        u->close_client = 1;
+    }
+
+    //The request has gone through, so out is free again
+    char status[64];
+    snprintf(status, sizeof(status), "HTTP/1.1 %d %s\r\n", r->status, srv_reason(r->status));
+    u->out_len = u->out_pos = 0;
+    int rc = srv_up_puts(u, status);
+    rc |= srv_up_put_hdrs(u, r, r->status == 101);
+    if (r->status == 101) rc |= srv_up_puts(u, "Connection: Upgrade\r\n");
+    if (u->close_client) rc |= srv_up_puts(u, "Connection: close\r\n");
+    rc |= srv_up_put(u, "\r\n", 2);
+    if (rc < 0) {
+        srv_up_fail(u, SRV_INTERNAL_ERROR_RESPONSE);
+        return;
+    }
+
+    mm_err err = MM_SUCCESS;
+    srv_send_bytes(c, u->out, u->out_len, &err);
+    u->out_len = 0;
+    u->head_sent = 1;
+    if (c->__internal.closed) return;
+
+    if (r->status == 101) {
+        srv_up_tunnel(u);
+    } else if (u->body == SRV_UP_LENGTH && u->left == 0) {
+        srv_up_done(u);
+    } else {
+        u->state = SRV_UP_BODY;
+        srv_up_events(u);
+    }
+}
+
+//Reads (some of) the response header. Whatever comes after it is the start
+//of the body
+static void srv_up_read_head(srv_upconn *u) {
+    char buf[SRV_READ_SIZE];
+    int num = read(u->fd, buf, sizeof(buf));
+    if (num == 0) {
+        srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+        return;
+    } else if (num < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+        return;
+    }
+    u->got_resp = 1;
+    srv_set_timeout(u->client, SRV_TIMEOUT_UPSTREAM);
+
+    char const *p = buf;
+    while (num > 0) {
+        mm_err err = MM_SUCCESS;
+        int rc = http_parse_resp(u->resp, p, num, &err);
+        int used = num;
+        if (rc < 0 && err == HTTP_STRAGGLERS) {
+            used = -rc;
+            rc = 0;
+        } else if (rc < 0) {
+            srv_up_fail(u, SRV_BAD_GATEWAY_RESPONSE);
+            return;
+        }
+        p += used;
+        num -= used;
+        if (rc > 0) return;
+
+        //Informational responses (other than 101) are just for us. Strip
+        //Expect so we shouldn't get 100s, but there's also 103
+        int status = u->resp->status;
+        if (status < 200 && status != 101) continue;
+
+        srv_up_head(u);
+        if (num == 0) return;
+        if (u->state == SRV_UP_TUNNEL) {
+            //The server's first bytes in the new protocol
+            mm_err send_err = MM_SUCCESS;
+            srv_send_bytes(u->client, p, num, &send_err);
+        } else if (u->state == SRV_UP_BODY) {
+            srv_up_body_bytes(u, p, num);
+        } else if (u->state == SRV_UP_IDLE) {
+            //There was no body, but the server sent more anyway
+            srv_up_unidle(u);
+            srv_up_close(u);
+        }
+        return;
+    }
+    srv_up_events(u);
+}
+
+//Sends what the client has sent on to the server
+static void srv_up_tunnel_write(srv_upconn *u) {
+    srv_conn *c = u->client;
+    while (u->out_pos < u->out_len) {
+        long n = send(u->fd, u->out + u->out_pos, u->out_len - u->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n < 0) {
+            srv_close_conn(c);
+            return;
+        }
+        u->out_pos += n;
+    }
+    if (u->out_pos == u->out_len && srv_pump_out(u->fd, u->rpipe, &u->rpiped) < 0) {
+        srv_close_conn(c);
+        return;
+    }
+    srv_update_events(c);
+    srv_up_events(u);
+}
+
+//Sends what the server has sent on to the client
+static void srv_up_tunnel_read(srv_upconn *u) {
+    srv_conn *c = u->client;
+    int eof = 0;
+    long n = srv_pump(u->fd, c->fd, u->pipe, &u->piped, SRV_SPLICE_SIZE, &eof);
+    if (n < 0) {
+        srv_close_conn(c);
+        return;
+    }
+    if (eof) {
+        //Let the client have the rest first
+        u->eof = 1;
+        if (u->piped == 0) {
+            srv_close(c);
+            return;
+        }
+    }
+    srv_update_events(c);
+    srv_up_events(u);
+}
+
+//A tunneled client has sent something
+static void srv_tunnel_read(srv_loop *l, srv_conn *c) {
+    srv_upconn *u = c->__internal.proxy;
+    //We weren't reading (see srv_update_events), so this is a hangup or
+    //an error
+    if (u->rpiped > 0 || u->out_pos < u->out_len) {
+        srv_close_conn(c);
+        return;
+    }
+
+    int want = srv_read_budget(c, SRV_SPLICE_SIZE);
+    if (want == 0) return;
+
+    int eof = 0;
+    long n = srv_pump(c->fd, u->fd, u->rpipe, &u->rpiped, want, &eof);
+    if (n < 0 || eof) {
+        srv_close_conn(c);
+        return;
+    }
+
+    if (l->params.ratelimit) rl_take(l->params.ratelimit, &c->__internal.rl, RL_BYTES, n);
+    srv_update_events(c);
+    srv_up_events(u);
+}
+
+//The client has made room for more of the response
+static void srv_up_resume(srv_upconn *u) {
+    srv_conn *c = u->client;
+    if (u->piped > 0 && srv_pump_out(c->fd, u->pipe, &u->piped) < 0) {
+        srv_close_conn(c);
+        return;
+    }
+
+    if (u->piped == 0 && u->state == SRV_UP_DONE) {
+        srv_up_finish(u);
+        return;
+    }
+    if (u->piped == 0 && u->state == SRV_UP_TUNNEL && u->eof) {
+        srv_close(c);
+        return;
+    }
+    srv_up_events(u);
+}
+
+//Does whatever an event on an upstream connection calls for
+static void srv_up_handle(srv_upconn *u, unsigned events) {
+    switch (u->state) {
+    case SRV_UP_CLOSED:
+        return;
+    case SRV_UP_IDLE:
+        //The server hung up, or said something out of turn. Either way,
+        //it's no good to us now
+        srv_up_unidle(u);
+        srv_up_close(u);
+        return;
+    case SRV_UP_CONNECTING:
+        srv_up_connected(u);
+        return;
+    case SRV_UP_SENDING:
+        srv_up_send(u);
+        return;
+    case SRV_UP_HEAD:
+        srv_up_read_head(u);
+        return;
+    case SRV_UP_BODY:
+        //Hangups and errors get reported even when we aren't reading. If
+        //the server went away mid-body, there's nothing to wait for
+        if (!(u->events & EPOLLIN)) srv_up_fail(u, NULL);
+        else if (u->body != SRV_UP_CHUNKED && !u->client->__internal.tls) srv_up_splice_body(u);
+        else srv_up_copy_body(u);
+        return;
+    case SRV_UP_DONE:
+        //Same here, except we already have everything. We just can't reuse
+        //the connection
+        epoll_ctl(u->loop->__internal.epfd, EPOLL_CTL_DEL, u->fd, NULL);
+        close(u->fd);
+        u->fd = -1;
+        u->keep = 0;
+        return;
+    case SRV_UP_TUNNEL:
+        if (events & EPOLLOUT) srv_up_tunnel_write(u);
+        if (u->state != SRV_UP_TUNNEL || !(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) return;
+        if (u->events & EPOLLIN) srv_up_tunnel_read(u);
+        else if (events & (EPOLLHUP | EPOLLERR)) srv_close_conn(u->client);
+        return;
+    }
+}
+
+//Sends websocket c to the process replacing us, parse state and all, and
+//lets go of it. Returns 0 if it's theirs now
+static int srv_handoff_conn(srv_loop *l, srv_conn *c) {
+    websock_pkt_state st;
+    char const *data;
+    unsigned long len = websock_pkt_save(c->__internal.pkt, &st, &data);
+
+    char *msg = malloc(sizeof(st) + len);
+    if (!msg) return -1;
+    memcpy(msg, &st, sizeof(st));
+    if (len > 0) memcpy(msg + sizeof(st), data, len);
+
+    mm_err err = MM_SUCCESS;
+    ho_send(l->__internal.handoff_peer, HO_CONN, c->fd, msg, sizeof(st) + len, &err);
+    free(msg);
+    if (err != MM_SUCCESS) {
+        //They're gone (or stuck), so nobody else gets handed off either
+        close(l->__internal.handoff_peer);
+        l->__internal.handoff_peer = -1;
+        return -1;
+    }
+
+    //The socket lives on in the other process. All we're closing is our fd
+    srv_close_conn(c);
+    return 0;
+}
+
+//Does whatever draining calls for with c, if it can be done yet
+static void srv_drain_conn(srv_loop *l, srv_conn *c) {
+    if (c->__internal.closing || c->__internal.held) return;
+
+    switch (c->mode) {
+    case SRV_CONN_HTTP:
+        //Between requests, with nothing on its way in
+        if (c->__internal.timeout == SRV_TIMEOUT_KEEPALIVE && !c->__internal.throttled) srv_close(c);
+        return;
+    case SRV_CONN_H2:
+        //srv_close sends a GOAWAY, which tells the client which requests
+        //to try again elsewhere
+        if (!c->__internal.h2_stream) srv_close(c);
+        return;
+    case SRV_CONN_TUNNEL:
+        //We don't know what's in there, so it can't be handed over
+        srv_close(c);
+        return;
+    case SRV_CONN_WEBSOCK:
+        break;
+    }
+
+    //Whatever we've read that the parser hasn't seen yet would be lost
+    if (c->__internal.parked || c->__internal.throttled || c->__internal.queued || c->__internal.stash) return;
+
+    if (c->__internal.tls || !l->params.handoff_websocks || l->__internal.handoff_peer < 0) {
+        //1001 is "going away"
+        mm_err err = MM_SUCCESS;
+        srv_send_websock(c, WEBSOCK_CLOSE, "\x03\xe9", 2, &err);
+        srv_close(c);
+        return;
+    }
+
+    //Anything still queued has to go out from here first. (If the handoff
+    //doesn't work, the next pass closes it like above)
+    if (wq_empty(&c->__internal.wq)) srv_handoff_conn(l, c);
+}
+
+//Called every loop iteration while we're draining. Once there's nothing
+//left, tells our replacement we're done and stops the loop
+static void srv_drain(srv_loop *l) {
+    if (l->params.drain_timeout > 0 && srv_now_ticks() >= l->__internal.drain_deadline) {
+        while (l->__internal.conns) srv_close_conn(l->__internal.conns);
+    }
+
+    srv_conn *c = l->__internal.conns;
+    while (c) {
+        srv_conn *next = c->__internal.next;
+        srv_drain_conn(l, c);
+        //on_close might have closed next too, in which case its links
+        //point into the graveyard. Starting over is fine, since c is gone
+        if (next && next->__internal.closed) next = c->__internal.closed ? l->__internal.conns : c->__internal.next;
+        c = next;
+    }
+
+    if (l->num_conns > 0) return;
+
+    if (l->__internal.handoff_peer >= 0) {
+        mm_err err = MM_SUCCESS;
+        ho_send(l->__internal.handoff_peer, HO_DONE, -1, NULL, 0, &err);
+        close(l->__internal.handoff_peer);
+        l->__internal.handoff_peer = -1;
+    }
+    l->__internal.stop = 1;
+}
+
+//Our replacement showed up on handoff_fd. It gets our listening socket, and
+//we start draining
+static void srv_handoff_accept(srv_loop *l) {
+    mm_err err = MM_SUCCESS;
+    int fd = ho_accept(l->__internal.handoff_fd, &err);
+    if (fd < 0) return;
+
+    ho_send(fd, HO_LISTENER, l->__internal.listen_fd, NULL, 0, &err);
+    if (err != MM_SUCCESS) {
+        //Carry on as if it never happened
+        close(fd);
+        return;
+    }
+
+    //The socket (and its accept queue) is theirs now. We don't unlink
+    //handoff_path, since it's about to be theirs too
+    tw_cancel(l->__internal.wheel, &l->__internal.accept_timer);
+    epoll_ctl(l->__internal.epfd, EPOLL_CTL_DEL, l->__internal.listen_fd, NULL);
+    close(l->__internal.listen_fd);
+    l->__internal.listen_fd = -1;
+    epoll_ctl(l->__internal.epfd, EPOLL_CTL_DEL, l->__internal.handoff_fd, NULL);
+    close(l->__internal.handoff_fd);
+    l->__internal.handoff_fd = -1;
+
+    l->__internal.handoff_peer = fd;
+    l->__internal.draining = 1;
+    l->__internal.drain_deadline = srv_now_ticks() + (l->params.drain_timeout + SRV_TICK_MS - 1) / SRV_TICK_MS;
+}
+
+//Takes the next thing the process we're replacing sent us: a websocket,
+//or word that it's done
+static void srv_adopt(srv_loop *l) {
+    mm_err err = MM_SUCCESS;
+    int fd;
+    char *data;
+    unsigned long len;
+    int type = ho_recv(l->__internal.handoff_peer, &fd, &data, &len, &err);
+
+    websock_pkt_state st;
+    if (type != HO_CONN || fd < 0 || len < sizeof(st)) {
+        free(data);
+        if (fd >= 0) close(fd);
+        //HO_DONE, or it went away. Either way, we're on our own now
+        if (type != HO_CONN) {
+            epoll_ctl(l->__internal.epfd, EPOLL_CTL_DEL, l->__internal.handoff_peer, NULL);
+            close(l->__internal.handoff_peer);
+            l->__internal.handoff_peer = -1;
+        }
+        return;
+    }
+    memcpy(&st, data, sizeof(st));
+
+    srv_conn *c = srv_new_conn(l, fd, SRV_CONN_WEBSOCK, 0);
+    if (c) websock_pkt_restore(c->__internal.pkt, &st, data + sizeof(st), len - sizeof(st), &err);
+    free(data);
+    if (!c) return;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *) &addr, &addr_len) < 0) addr.ss_family = AF_UNSPEC;
+    if (l->params.ratelimit) rl_open(l->params.ratelimit, &c->__internal.rl, (struct sockaddr *) &addr);
+    cap_record(l->params.capture, CAP_OPEN, c->id, NULL, 0);
+    srv_set_timeout(c, SRV_TIMEOUT_PING);
+
+    if (l->__internal.cb.on_open) l->__internal.cb.on_open(c, l->__internal.user);
+
+    //Their parser state doesn't fit ours (e.g. our limits are smaller), so
+    //we can't pick up where they left off. 1011 is "internal error"
+    if (err != MM_SUCCESS && !c->__internal.closed) {
+        mm_err close_err = MM_SUCCESS;
+        srv_send_websock(c, WEBSOCK_CLOSE, "\x03\xf3", 2, &close_err);
+        srv_close(c);
+    }
+}
+
+static int srv_listen(char const *port, mm_err *err) {
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    struct addrinfo *res;
+    if (getaddrinfo(NULL, port, &hints, &res) != 0) {
+        *err = SRV_SOCKET_ERROR;
+        return -1;
+    }
+
+    int fd = -1;
+    struct addrinfo *p;
+    for (p = res; p; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
+        if (fd < 0) continue;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, SRV_LISTEN_BACKLOG) == 0) break;
+
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) *err = SRV_SOCKET_ERROR;
+    return fd;
+}
+
+
+//Gets the listening socket from the loop we're replacing, if there is one,
+//and otherwise sets up our own
+static int srv_take_over(srv_loop *l, char const *port, mm_err *err) {
+    if (!l->params.handoff_path) return srv_listen(port, err);
+
+    int peer = ho_connect(l->params.handoff_path, err);
+    if (*err == HO_NO_PEER) {
+        //We're the first
+        *err = MM_SUCCESS;
+        return srv_listen(port, err);
+    }
+    if (*err != MM_SUCCESS) return -1;
+
+    int fd;
+    char *data;
+    unsigned long len;
+    int type = ho_recv(peer, &fd, &data, &len, err);
+    free(data);
+    if (*err == MM_SUCCESS && (type != HO_LISTENER || fd < 0)) *err = HO_BAD_MSG;
+    if (*err != MM_SUCCESS) {
+        if (fd >= 0) close(fd);
+        close(peer);
+        return -1;
+    }
+
+    l->__internal.handoff_peer = peer;
+    return fd;
+}
+
+#endif
+
+/////////////////////////////
+// Managing srv_loop structs //
+/////////////////////////////
+
+//Fills p with the default timeouts. Assumes p is non-NULL
+void srv_default_params(srv_params *p)
+#ifdef MM_IMPLEMENT
+{
+    p->hdr_timeout = SRV_DEFAULT_HDR_TIMEOUT;
+    p->keepalive_timeout = SRV_DEFAULT_KEEPALIVE_TIMEOUT;
+    p->body_timeout = SRV_DEFAULT_BODY_TIMEOUT;
+    p->ws_ping_interval = SRV_DEFAULT_WS_PING_INTERVAL;
+    p->ws_pong_timeout = SRV_DEFAULT_WS_PONG_TIMEOUT;
+    p->drain_timeout = SRV_DEFAULT_DRAIN_TIMEOUT;
+    p->linger_timeout = SRV_DEFAULT_LINGER_TIMEOUT;
+    p->upstream_timeout = SRV_DEFAULT_UPSTREAM_TIMEOUT;
+    p->wq_high_wm = WQ_DEFAULT_HIGH_WM;
+    p->wq_low_wm = WQ_DEFAULT_LOW_WM;
+    p->wq_max_bytes = WQ_DEFAULT_MAX_BYTES;
+    p->wq_policy = WQ_POLICY_DISCONNECT;
+    p->max_out_bytes = SRV_DEFAULT_MAX_OUT_BYTES;
+    p->metrics_path = NULL;
+    p->cache = NULL;
+    p->lazy_hdrs = 0;
+    http_default_limits(&p->http_limits);
+    websock_default_limits(&p->ws_limits);
+    p->ws_stream_min = SRV_DEFAULT_WS_STREAM_MIN;
+    p->body_spill_min = 0;
+    p->body_spill_dir = NULL;
+    p->tls = NULL;
+    p->h2 = 0;
+    p->capture = NULL;
+    p->trace = 0;
+    p->trace_sampling = TRACE_DEFAULT_SAMPLING;
+    p->trace_path = NULL;
+    p->ratelimit = NULL;
+    p->handoff_path = NULL;
+    p->handoff_websocks = 1;
+    p->post_queue_size = 0;
+}
+#else
+;
+#endif
+
+//Returns a newly allocated event loop listening on the given port (a
+//string, since it goes straight to getaddrinfo). params can be NULL to get
+//the defaults. user is passed to all the callbacks. Use del_srv_loop to
+//free it. If params.handoff_path is set and another loop is listening
+//there, we take over its listening socket instead. Returns NULL and sets
+//*err on error
+srv_loop *new_srv_loop(char const *port, srv_params const *params, srv_callbacks const *cb, void *user, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!port || !cb) {
+        *err = SRV_NULL_ARG;
+        return NULL;
+    }
+
+    srv_loop *ret = malloc(sizeof(srv_loop));
+    if (!ret) {
+        *err = SRV_OOM;
+        return NULL;
+    }
+
+    if (params) ret->params = *params;
+    else srv_default_params(&ret->params);
+    wq_set_global_cap(ret->params.max_out_bytes);
+    if (ret->params.trace) {
+        trace_set_sampling(ret->params.trace_sampling);
+        //The first call takes a few milliseconds, so get it out of the way
+        //before there are any requests to slow down
+        metrics_ticks_per_sec();
+    }
+    ret->num_conns = 0;
+    ret->__internal.cb = *cb;
+    ret->__internal.user = user;
+    ret->__internal.stop = 0;
+    ret->__internal.conns = NULL;
+    ret->__internal.graveyard = NULL;
+    ret->__internal.ready = NULL;
+    ret->__internal.next_id = 0;
+    ret->__internal.epfd = -1;
+    ret->__internal.pipe[0] = ret->__internal.pipe[1] = -1;
+    ret->__internal.handoff_fd = ret->__internal.handoff_peer = -1;
+    ret->__internal.draining = 0;
+    ret->__internal.drain_deadline = 0;
+    ret->__internal.posts = NULL;
+    ret->__internal.posts_pending = 0;
+    ret->__internal.ids = NULL;
+    ret->__internal.ids_cap = ret->__internal.ids_len = 0;
+    ret->__internal.dead_ups = NULL;
+
+    ret->__internal.wheel = new_tw_wheel(srv_now_ticks(), err);
+    if (*err != MM_SUCCESS) {
+        free(ret);
+        return NULL;
+    }
+    init_tw_timer(&ret->__internal.accept_timer, srv_resume_accept, ret);
+
+    ret->__internal.listen_fd = srv_take_over(ret, port, err);
+    if (*err != MM_SUCCESS) {
+        del_tw_wheel(ret->__internal.wheel);
+        free(ret);
+        return NULL;
+    }
+
+    ret->__internal.epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; //NULL means the listening socket
+    if (ret->__internal.epfd < 0 || epoll_ctl(ret->__internal.epfd, EPOLL_CTL_ADD, ret->__internal.listen_fd, &ev) < 0) {
+        *err = SRV_EPOLL_ERROR;
+        if (ret->__internal.epfd >= 0) close(ret->__internal.epfd);
+        close(ret->__internal.listen_fd);
+        if (ret->__internal.handoff_peer >= 0) close(ret->__internal.handoff_peer);
+        del_tw_wheel(ret->__internal.wheel);
+        free(ret);
+        return NULL;
+    }
+
+    //If we can't get a pipe, spilled bodies just get written the slow way
+    if (ret->params.body_spill_min > 0 && pipe2(ret->__internal.pipe, O_NONBLOCK | O_CLOEXEC) == 0) {
+        fcntl(ret->__internal.pipe[1], F_SETPIPE_SZ, SRV_SPLICE_SIZE);
+    }
+
+    if (ret->params.post_queue_size > 0) {
+        ret->__internal.posts = new_mpsc_queue(ret->params.post_queue_size, 1, err);
+        ev.events = EPOLLIN;
+        ev.data.ptr = ret->__internal.posts;
+        if (*err == MM_SUCCESS && epoll_ctl(ret->__internal.epfd, EPOLL_CTL_ADD, ret->__internal.posts->efd, &ev) < 0) {
+            *err = SRV_EPOLL_ERROR;
+        }
+        if (*err != MM_SUCCESS) {
+            del_srv_loop(ret);
+            return NULL;
+        }
+    }
+
+    //Whoever we took over from sends its websockets on handoff_peer, and
+    //whoever takes over from us shows up on handoff_fd
+    if (ret->params.handoff_path) {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &ret->__internal.handoff_peer;
+        if (ret->__internal.handoff_peer >= 0 && epoll_ctl(ret->__internal.epfd, EPOLL_CTL_ADD, ret->__internal.handoff_peer, &ev) < 0) {
+            *err = SRV_EPOLL_ERROR;
+            del_srv_loop(ret);
+            return NULL;
+        }
+
+        ret->__internal.handoff_fd = ho_listen(ret->params.handoff_path, err);
+        ev.data.ptr = &ret->__internal.handoff_fd;
+        if (*err == MM_SUCCESS && epoll_ctl(ret->__internal.epfd, EPOLL_CTL_ADD, ret->__internal.handoff_fd, &ev) < 0) {
+            *err = SRV_EPOLL_ERROR;
+        }
+        if (*err != MM_SUCCESS) {
+            del_srv_loop(ret);
+            return NULL;
+        }
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Closes all connections and frees the loop. Gracefully ignores NULL input.
+//Don't call this from inside a callback; use srv_stop instead
+void del_srv_loop(srv_loop *l)
+#ifdef MM_IMPLEMENT
+{
+    if (!l) return;
+
+    while (l->__internal.conns) srv_close_conn(l->__internal.conns);
+    srv_bury_dead(l);
+
+    //Nobody's going to send these now
+    if (l->__internal.posts) {
+        mpsc_item it;
+        while (mpsc_pop(l->__internal.posts, &it)) wq_buf_unref((wq_buf *) it.data);
+        del_mpsc_queue(l->__internal.posts);
+    }
+    free(l->__internal.ids);
+
+    if (l->__internal.listen_fd >= 0) close(l->__internal.listen_fd);
+    if (l->__internal.handoff_fd >= 0) {
+        close(l->__internal.handoff_fd);
+        //Nobody took over, so the path is still ours
+        unlink(l->params.handoff_path);
+    }
+    if (l->__internal.handoff_peer >= 0) close(l->__internal.handoff_peer);
+    close(l->__internal.epfd);
+    if (l->__internal.pipe[0] >= 0) {
+        close(l->__internal.pipe[0]);
+        close(l->__internal.pipe[1]);
+    }
+    del_tw_wheel(l->__internal.wheel);
+    free(l);
+}
+#else
+;
+#endif
+
+//Returns 1 if another loop has taken over from l (see
+//params.handoff_path), in which case srv_run returns once l's connections
+//are gone. Assumes l is non-NULL
+int srv_draining(srv_loop const *l)
+#ifdef MM_IMPLEMENT
+{
+    return l->__internal.draining;
+}
+#else
+;
+#endif
+
+//Asks srv_run to return at the end of its current iteration. Safe to call
+//from callbacks and from signal handlers. Assumes l is non-NULL
+void srv_stop(srv_loop *l)
+#ifdef MM_IMPLEMENT
+{
+    l->__internal.stop = 1;
+}
+#else
+;
+#endif
+
+/* srv_run:
+
+Runs the event loop until srv_stop is called, another loop has taken over
+and we're done draining (see params.handoff_path), or a fatal error
+happens. Returns 0 after a normal stop, and negative (with *err set) on
+error.
+
+Each iteration waits on epoll, services every ready socket, picks up any
+connections that srv_release let go of, then advances the timer wheel so
+that all the timeouts that came due are handled as one batch. If no timers
+are armed, the loop sleeps until there's socket activity.
+*/
+int srv_run(srv_loop *l, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!l) {
+        *err = SRV_NULL_ARG;
+        return -1;
+    }
+
+    struct epoll_event evs[SRV_MAX_EVENTS];
+
+    while (!l->__internal.stop) {
+        int timeout = l->__internal.wheel->num_armed || l->__internal.draining ? SRV_TICK_MS : -1;
+        if (l->__internal.ready || l->__internal.posts_pending) timeout = 0;
+        int n = epoll_wait(l->__internal.epfd, evs, SRV_MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            *err = SRV_EPOLL_ERROR;
+            return -1;
+        }
+
+        int i;
+        for (i = 0; i < n; i++) {
+            srv_conn *c = evs[i].data.ptr;
+            if (c == NULL) {
+                srv_accept_all(l);
+                continue;
+            }
+            if ((void *) c == &l->__internal.handoff_fd) {
+                srv_handoff_accept(l);
+                continue;
+            }
+            if ((void *) c == &l->__internal.handoff_peer) {
+                srv_adopt(l);
+                continue;
+            }
+            if ((void *) c == l->__internal.posts) {
+                srv_take_posts(l);
+                continue;
+            }
+            if ((unsigned long) c & 1) {
+                srv_up_handle((srv_upconn *) ((unsigned long) c & ~1UL), evs[i].events);
+                continue;
+            }
+
+            if (c->__internal.closed) continue;
+            if (evs[i].events & EPOLLOUT) {
+                srv_handle_writable(c);
+            }
+            if (c->__internal.closed) continue;
+            if (evs[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                srv_handle_readable(l, c);
+            }
+        }
+
+        srv_handle_ready(l);
+        if (l->__internal.posts_pending) srv_take_posts(l);
+        tw_advance(l->__internal.wheel, srv_now_ticks());
+        if (l->__internal.draining) srv_drain(l);
+        srv_bury_dead(l);
+    }
+
+    return 0;
+}
+#else
+;
+#endif
+
+////////////////////////////////
+// Sending data on connections //
+////////////////////////////////
+
+/* Sending functions:
+
+All of these try to write straight to the socket first, so in the common
+case nothing is copied or allocated. Whatever the kernel doesn't take right
+away goes on the connection's write queue and is sent when the socket
+becomes writable.
+
+If the queue is over its limits, the slow-consumer policy applies (see
+wq_push): with WQ_POLICY_DROP or WQ_POLICY_COALESCE the message is dropped
+and *err is set to WQ_DROPPED, but the connection is fine. With
+WQ_POLICY_DISCONNECT the connection is closed and *err is set to
+WQ_SLOW_CONSUMER.
+
+They all return the number of bytes accepted (sent or queued), or negative
+on error.
+*/
+
+//Sends len bytes from buf on connection c
+int srv_send(srv_conn *c, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!c || (len > 0 && !buf)) {
+        *err = SRV_NULL_ARG;
+        return -1;
+    }
+    if (c->__internal.closed) {
+        *err = SRV_CLOSED;
+        return -1;
+    }
+
+    if (c->mode == SRV_CONN_H2) return srv_send_h2(c, buf, len, err);
+    return srv_send_bytes(c, buf, len, err);
+}
+#else
+;
+#endif
+
+//Sends a reference-counted buffer. This is the way to send the same data to
+//lots of connections without copying it. Messages queued with the same
+//nonzero key can be coalesced under WQ_POLICY_COALESCE. You still own your
+//reference to b
+int srv_send_buf(srv_conn *c, wq_buf *b, unsigned key, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!c || !b) {
+        *err = SRV_NULL_ARG;
+        return -1;
+    }
+    if (c->__internal.closed) {
+        *err = SRV_CLOSED;
+        return -1;
+    }
+    if (c->mode == SRV_CONN_H2) return srv_send_h2(c, b->data, b->len, err) < 0 ? -1 : b->len;
+
+    long sent = 0;
+    if (wq_empty(&c->__internal.wq)) {
+        struct iovec iov = {b->data, b->len};
+        sent = srv_send_direct(c, &iov, 1, err);
+        if (sent < 0) return -1;
+        if (sent == b->len) return b->len;
+    }
+
+    srv_queue_buf(c, b, sent, key, err);
+    if (*err != MM_SUCCESS) return -1;
+
+    return b->len;
+}
+#else
+;
+#endif
+
+//Builds a complete (unfragmented) websocket frame in a new reference-counted
+//buffer, ready for srv_send_buf. Server frames aren't masked, so the same
+//buffer works for every connection. Returns NULL and sets *err on error
+wq_buf *new_websock_wq_buf(websock_pkt_type_t type, char const *payload, unsigned long len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (len > 0 && !payload) {
+        *err = SRV_NULL_ARG;
+        return NULL;
+    }
+
+    char hdr[WEBSOCK_MAX_HDR_SIZE];
+    int hdr_len = construct_websock_hdr(hdr, type, 1, len, err);
+    wq_buf *ret = new_wq_buf(hdr_len + len, err);
+    if (*err != MM_SUCCESS) return NULL;
+
+    memcpy(ret->data, hdr, hdr_len);
+    memcpy(ret->data + hdr_len, payload, len);
+    return ret;
+}
+#else
+;
+#endif
+
+//Sends one (unfragmented) websocket frame on c. Returns number of payload
+//bytes accepted, or negative on error
+int srv_send_websock(srv_conn *c, websock_pkt_type_t type, char const *payload, unsigned long len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!c || (len > 0 && !payload)) {
+        *err = SRV_NULL_ARG;
+        return -1;
+    }
+    if (c->__internal.closed) {
+        *err = SRV_CLOSED;
+        return -1;
+    }
+    if (c->mode != SRV_CONN_WEBSOCK) {
+        *err = SRV_NOT_WEBSOCK;
+        return -1;
+    }
+
+    char hdr[WEBSOCK_MAX_HDR_SIZE];
+    int hdr_len = construct_websock_hdr(hdr, type, 1, len, err);
+    if (*err != MM_SUCCESS) return -1;
+
+    long sent = 0;
+    if (wq_empty(&c->__internal.wq)) {
+        struct iovec iov[2] = {{hdr, hdr_len}, {(void *) payload, len}};
+        sent = srv_send_direct(c, iov, 2, err);
+        if (sent < 0) return -1;
+        if (sent == hdr_len + len) return len;
+    }
+
+    //Only the leftover part of the frame goes on the queue, but it all has
+    //to be in one buffer so it gets dropped/coalesced as a unit
+    wq_buf *b = new_wq_buf(hdr_len + len - sent, err);
+    if (*err != MM_SUCCESS) return -1;
+
+    char *dst = b->data;
+    if (sent < hdr_len) {
+        memcpy(dst, hdr + sent, hdr_len - sent);
+        dst += hdr_len - sent;
+        memcpy(dst, payload, len);
+    } else {
+        memcpy(dst, payload + (sent - hdr_len), len - (sent - hdr_len));
+    }
+
+    srv_queue_buf(c, b, 0, 0, err);
+    wq_buf_unref(b);
+    if (*err != MM_SUCCESS) return -1;
+
+    return len;
+}
+#else
+;
+#endif
+
+//Sends the websocket handshake response for req (see the comments for
+//websock_handshake_response about prot) and switches c to websocket mode.
+//Meant to be called from your on_request callback
+void srv_accept_websock(srv_conn *c, http_req const *req, char const *prot, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!c || !req) {
+        *err = SRV_NULL_ARG;
+        return;
+    }
+    if (c->mode != SRV_CONN_HTTP) {
+        *err = SRV_NOT_HTTP;
+        return;
+    }
+
+    char *resp = websock_handshake_response(req, prot, err);
+    if (*err != MM_SUCCESS) return;
+
+    srv_send(c, resp, strlen(resp), err);
+    if (*err != MM_SUCCESS) return;
+
+    c->mode = SRV_CONN_WEBSOCK;
+    srv_set_timeout(c, SRV_TIMEOUT_PING);
+}
+#else
+;
+#endif
+
+//Closes c once everything queued on it has been sent (or drain_timeout
+//runs out). We stop reading from c right away. Its memory stays valid until
+//the current loop iteration ends, so it's safe to call this from inside
+//callbacks
+void srv_close(srv_conn *c)
+#ifdef MM_IMPLEMENT
+{
+    if (!c || c->__internal.closed || c->__internal.closing) return;
+
+    if (c->mode == SRV_CONN_H2) {
+        h2_goaway(c->__internal.h2, H2_NO_ERROR);
+        srv_h2_flush(c);
+        if (c->__internal.closed) return;
+    }
+
+    c->__internal.closing = 1;
+    if (wq_empty(&c->__internal.wq)) {
+        srv_closed_drained(c);
+        return;
+    }
+
+    srv_set_timeout(c, SRV_TIMEOUT_DRAIN);
+    srv_update_events(c);
+}
+#else
+;
+#endif
+
+/* srv_hold and srv_release:
+
+Normally a request (or websocket message) only lives until its callback
+returns. If you call srv_hold from inside on_request/on_message, the server
+leaves the current one alone after the callback, and stops reading from c
+(anything already read is saved) until you call srv_release. This is how
+you finish a request later, e.g. after waiting for a slow backend.
+
+srv_hold outside a callback just stops reading from c. Neither function
+does anything to a closed connection. Assumes c is non-NULL.
+*/
+void srv_hold(srv_conn *c)
+#ifdef MM_IMPLEMENT
+{
+    if (c->__internal.closed || c->__internal.held) return;
+    c->__internal.held = 1;
+    srv_update_events(c);
+}
+#else
+;
+#endif
+
+//Lets the server carry on with c. If a request/message was being held, the
+//loop picks c back up at the end of its current iteration (never from
+//inside this call), so it's safe to call from anywhere
+void srv_release(srv_conn *c)
+#ifdef MM_IMPLEMENT
+{
+    if (c->__internal.closed || !c->__internal.held) return;
+    c->__internal.held = 0;
+    if (c->__internal.trace) trace_mark(c->__internal.trace, TRACE_HANDLER_END);
+
+    if (!c->__internal.parked) {
+        srv_update_events(c);
+        return;
+    }
+
+    //Might already be on the list if it was held and released again
+    if (!c->__internal.queued) {
+        srv_loop *l = c->__internal.loop;
+        c->__internal.queued = 1;
+        c->__internal.ready_next = l->__internal.ready;
+        l->__internal.ready = c;
+    }
+}
+#else
+;
+#endif
+
+//Returns the number of bytes queued on c waiting for the client to read
+//them. Assumes c is non-NULL
+long srv_queued_bytes(srv_conn const *c)
+#ifdef MM_IMPLEMENT
+{
+    return c->__internal.wq.bytes;
+}
+#else
+;
+#endif
+
+/* srv_post:
+
+The one function here that's safe to call from any thread. It asks l's
+thread to send b on the connection with the given id (see srv_conn.id),
+the same way srv_send_buf would, with key for coalescing. For websockets,
+make b with new_websock_wq_buf. Nothing is sent from the calling thread:
+the post goes on a lock-free queue (see mpsc.h) and the loop sends it,
+along with whatever else has piled up, the next time it wakes up. If the
+connection is gone by then, the post is dropped.
+
+On success, the loop takes over your reference to b. Returns 0, or -1 and
+sets *err on error, in which case b is still yours. MPSC_FULL means the
+queue (params.post_queue_size) is full right now; it's up to you whether
+to wait and try again or drop the message.
+*/
+int srv_post(srv_loop *l, unsigned long id, wq_buf *b, unsigned key, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!l || !b) {
+        *err = SRV_NULL_ARG;
+        return -1;
+    }
+    if (!l->__internal.posts) {
+        *err = SRV_NO_POSTS;
+        return -1;
+    }
+
+    return mpsc_push(l->__internal.posts, id, b, key, err);
+}
+#else
+;
+#endif
+
+//////////////
+// Proxying //
+//////////////
+
+//Returns a new upstream server for srv_proxy to send requests to, at host
+//and port (strings, since they go straight to getaddrinfo; the first
+//address wins). Connections to it are made as they're needed, and kept
+//open between requests. Since splice and sendfile have no MSG_NOSIGNAL,
+//this also ignores SIGPIPE, unless you've set up your own handler for it.
+//Returns NULL and sets *err on error
+srv_upstream *new_srv_upstream(srv_loop *l, char const *host, char const *port, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!l || !host || !port) {
+        *err = SRV_NULL_ARG;
+        return NULL;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        *err = SRV_BAD_UPSTREAM;
+        return NULL;
+    }
+
+    srv_upstream *ret = malloc(sizeof(srv_upstream));
+    if (!ret) {
+        freeaddrinfo(res);
+        *err = SRV_OOM;
+        return NULL;
+    }
+    memcpy(&ret->__internal.addr, res->ai_addr, res->ai_addrlen);
+    ret->__internal.addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    ret->max_idle = SRV_DEFAULT_UPSTREAM_IDLE;
+    ret->num_idle = 0;
+    ret->__internal.loop = l;
+    ret->__internal.idle = NULL;
+
+    struct sigaction sa;
+    if (sigaction(SIGPIPE, NULL, &sa) == 0 && sa.sa_handler == SIG_DFL) signal(SIGPIPE, SIG_IGN);
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Closes up's idle connections and frees it. Connections that are busy with
+//a request belong to the loop until then, so call this after del_srv_loop.
+//Gracefully ignores NULL input
+void del_srv_upstream(srv_upstream *up)
+#ifdef MM_IMPLEMENT
+{
+    if (!up) return;
+
+    //The loop might be gone, but closing the fds takes them out of its
+    //epoll set anyway
+    while (up->__internal.idle) {
+        srv_upconn *u = up->__internal.idle;
+        up->__internal.idle = u->next;
+        close(u->fd);
+        if (u->pipe[0] >= 0) {
+            close(u->pipe[0]);
+            close(u->pipe[1]);
+        }
+        if (u->rpipe[0] >= 0) {
+            close(u->rpipe[0]);
+            close(u->rpipe[1]);
+        }
+        del_http_req(u->resp);
+        free(u->out);
+        free(u);
+    }
+    free(up);
+}
+#else
+;
+#endif
+
+/* srv_proxy:
+
+Sends req to up, and whatever up sends back to c, as if it came from us.
+Call it from on_request instead of answering the request yourself. It
+srv_holds c until the response is over, so pipelined requests wait their
+turn, and then lets go of it (including any hold of your own).
+
+The request goes out on one of up's idle connections if there is one, and
+on a new one otherwise. Hop-by-hop headers (Connection, Keep-Alive and
+anything Connection names, TE, Expect, Upgrade) are left out, and the path
+is re-encoded, so it's the normalized one (see http_parse.h). Spilled
+bodies are sent from their file with sendfile.
+
+Response bodies go to the client with splice, so they never come into user
+space, except for chunked ones (which we have to look at to see where they
+end) and any going out over TLS, which are copied through a small buffer.
+Either way, we only read from up as fast as the client reads from us. A
+body that ends when the server hangs up ends with us hanging up on the
+client too. Once it's over, the connection goes back in the pool, unless
+the server said it was closing.
+
+If the client asked to upgrade (e.g. to websockets) and up says 101, c
+becomes a tunnel (SRV_CONN_TUNNEL): from then on, bytes are spliced back
+and forth untouched until one side hangs up, and none of the callbacks
+but on_close hear from c again. TLS clients can't be tunneled, so their
+requests go through without the Upgrade.
+
+If up can't be reached, or sends back something that isn't HTTP, the
+client gets a 502. If it takes longer than params.upstream_timeout between
+bytes, the client gets a 504. (Either way, if the client has already seen
+part of the response, it's just hung up on.) A pooled connection the
+server closed just before we used it isn't a failure; the request is
+tried again on a new connection.
+
+Only works on HTTP/1.1 connections (SRV_NOT_HTTP otherwise). Sets *err to
+SRV_UPSTREAM_ERROR if we couldn't even start connecting, in which case c is
+left alone for you to answer.
+*/
+void srv_proxy(srv_conn *c, http_req const *req, srv_upstream *up, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+
+    if (!c || !req || !up) {
+        *err = SRV_NULL_ARG;
+        return;
+    }
+    if (c->__internal.closed) {
+        *err = SRV_CLOSED;
+        return;
+    }
+    if (c->mode != SRV_CONN_HTTP) {
+        *err = SRV_NOT_HTTP;
+        return;
+    }
+    if (c->__internal.proxy) {
+        *err = SRV_PROXYING;
+        return;
+    }
+
+    srv_upconn *u = srv_up_get(up);
+    if (!u) {
+        *err = errno == ENOMEM ? SRV_OOM : SRV_UPSTREAM_ERROR;
+        return;
+    }
+
+    //Only pass the upgrade along if we'd be able to tunnel it
+    mm_err hdr_err = MM_SUCCESS;
+    char *conn = get_args(req, "Connection", &hdr_err);
+    u->upgrade = !c->__internal.tls && conn && has_token(conn, "upgrade") && get_args(req, "Upgrade", &hdr_err);
+
+    //http_req_strs has "HTTP_GET" and so on
+    u->out_len = 0;
+    int rc = srv_up_puts(u, http_req_strs[req->req_type] + 5);
+    rc |= srv_up_put(u, " ", 1);
+    rc |= srv_up_put_path(u, req->path, req->path_len);
+    if (req->query_len > 0) {
+        rc |= srv_up_put(u, "?", 1);
+        rc |= srv_up_put(u, req->query, req->query_len);
+    }
+    rc |= srv_up_puts(u, " HTTP/1.1\r\n");
+    rc |= srv_up_put_hdrs(u, req, u->upgrade);
+    if (u->upgrade) rc |= srv_up_puts(u, "Connection: Upgrade\r\n");
+    rc |= srv_up_put(u, "\r\n", 2);
+    u->body_fd = req->body_fd;
+    u->body_len = req->body_fd >= 0 ? req->payload_len : 0;
+    if (req->body_fd < 0 && req->payload_len > 0) rc |= srv_up_put(u, req->payload, req->payload_len);
+    if (rc < 0) {
+        //Nothing was sent, so it's still good for next time
+        if (u->reused) srv_up_idle(u);
+        else srv_up_close(u);
+        *err = SRV_OOM;
+        return;
+    }
+
+    u->client = c;
+    u->is_head = req->req_type == HTTP_HEAD;
+    c->__internal.proxy = u;
+    srv_hold(c);
+    srv_set_timeout(c, SRV_TIMEOUT_UPSTREAM);
+    srv_up_go(u);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,76 @@
+#include <cstdio>
+#include <cstring>
+#include <signal.h>
+#include "co_server.hpp"
+
+//Same as server.c, but written with the coroutine API (co_server.hpp).
+//"make bench-co" runs the load generator against both so they can be
+//compared.
+
+#define HELLO_RESPONSE \
+    "HTTP/1.1 200 OK\r\n"\
+    "Content-Type: text/plain\r\n"\
+    "Content-Length: 6\r\n"\
+    "\r\n"\
+    "Hello\n"
+
+static mm::co_server *srv = nullptr;
+
+static void on_sigint(int sig) {
+    if (srv) srv->stop();
+}
+
+static mm::conn_task handle(mm::connection &c) {
+    while (http_req *req = co_await c.next_request()) {
+        mm_err err = MM_SUCCESS;
+        if (is_websock_request(req, &err)) {
+            err = c.accept_websock(req);
+            if (err != MM_SUCCESS) {
+                std::fprintf(stderr, "Could not accept websocket: %s\n", err);
+                co_return;
+            }
+            break;
+        }
+
+        err = co_await c.send(HELLO_RESPONSE);
+        if (err != MM_SUCCESS) co_return;
+    }
+
+    //Websocket mode (or closed, in which case this returns right away)
+    while (websock_pkt *pkt = co_await c.next_message()) {
+        mm_err err = co_await c.send_message(pkt->type, {pkt->payload, pkt->payload_len});
+        if (err != MM_SUCCESS) co_return;
+    }
+}
+
+int main(int argc, char **argv) {
+    char const *port = "2345";
+    if (argc > 1) port = argv[1];
+
+    srv_params params;
+    srv_default_params(&params);
+    params.metrics_path = "/metrics";
+
+    mm_err err = MM_SUCCESS;
+    mm::co_server server{port, handle, &params, &err};
+    if (err != MM_SUCCESS) {
+        std::fprintf(stderr, "Error: %s\n", err);
+        return 1;
+    }
+    srv = &server;
+
+    //No SA_RESTART, so that epoll_wait gets interrupted
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    server.run(&err);
+    if (err != MM_SUCCESS) {
+        std::fprintf(stderr, "Error: %s\n", err);
+        return 1;
+    }
+
+    return 0;
+}
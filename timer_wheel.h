@@ -0,0 +1,339 @@
+//Hierarchical timing wheel, in the style of the old Linux kernel timers.
+//Arming, cancelling, and expiring a timer are all O(1) (well, expiring is
+//amortized O(1) because of cascading), and timers are intrusive so there
+//are no allocations at all once the wheel exists. This is what lets us keep
+//a timeout on every connection without needing a timerfd or heap entry for
+//each one.
+//
+//The wheel doesn't know anything about real time. It only counts "ticks",
+//and the caller decides how long a tick is and calls tw_advance from its
+//event loop.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef TIMER_WHEEL_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define TIMER_WHEEL_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef TIMER_WHEEL_H
+        #define SHOULD_INCLUDE 1
+        #define TIMER_WHEEL_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "timer_wheel.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Each level of the wheel has 2^TW_BITS slots. With 4 levels of 64
+    //slots, timers can be up to 2^24 ticks in the future (a bit under two
+    //days with 10 ms ticks). Anything further out just gets clamped.
+    #define TW_BITS 6
+    #define TW_SLOTS (1 << TW_BITS)
+    #define TW_MASK (TW_SLOTS - 1)
+    #define TW_LEVELS 4
+    #define TW_MAX_TICKS ((1UL << (TW_BITS * TW_LEVELS)) - 1)
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(TW_OOM, "out of memory");
+
+///////////////////////////
+// Timer wheel structs   //
+///////////////////////////
+#ifndef MM_IMPLEMENT
+    //Intrusive doubly-linked list node. Each wheel slot has a sentinel one of
+    //these, so unlinking a timer never needs to know which slot it's in
+    typedef struct _tw_link {
+        struct _tw_link *next;
+        struct _tw_link *prev;
+    } tw_link;
+
+    struct _tw_timer;
+    typedef void tw_cb(struct _tw_timer *t, void *arg);
+
+    //Embed one of these wherever you need a timeout. Use init_tw_timer before
+    //arming it for the first time
+    typedef struct _tw_timer {
+        tw_link link; //Must be first! Both pointers are NULL if not armed
+        unsigned long expires; //Absolute tick
+        tw_cb *cb;
+        void *arg;
+    } tw_timer;
+
+    typedef struct _tw_wheel {
+        //The tick the wheel has processed up to (but not including)
+        unsigned long now;
+
+        //Number of timers currently armed. Handy for deciding whether the
+        //event loop needs to wake up at all
+        int num_armed;
+
+        //Internal fields. Don't touch!
+        struct {
+            tw_link slots[TW_LEVELS][TW_SLOTS];
+        } __internal;
+    } tw_wheel;
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+static void tw_list_init(tw_link *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void tw_list_add(tw_link *head, tw_link *l) {
+    l->prev = head->prev;
+    l->next = head;
+    head->prev->next = l;
+    head->prev = l;
+}
+
+static void tw_list_del(tw_link *l) {
+    l->prev->next = l->next;
+    l->next->prev = l->prev;
+    l->next = NULL;
+    l->prev = NULL;
+}
+
+//Moves everything in src onto the (empty) dst list, leaving src empty
+static void tw_list_take(tw_link *dst, tw_link *src) {
+    if (src->next == src) {
+        tw_list_init(dst);
+        return;
+    }
+
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    tw_list_init(src);
+}
+
+//Puts t into the correct slot based on how far in the future it expires.
+//This is the only place that decides which level a timer lives on
+static void tw_place(tw_wheel *w, tw_timer *t) {
+    unsigned long delta = t->expires - w->now;
+    tw_link *slot;
+
+    if ((long) delta < 0) {
+        //Already expired. Stick it in the slot we're about to process
+        slot = &w->__internal.slots[0][w->now & TW_MASK];
+    } else {
+        //Clamp anything that is too far into the future
+        if (delta > TW_MAX_TICKS) {
+            delta = TW_MAX_TICKS;
+            t->expires = w->now + delta;
+        }
+
+        int lvl = 0;
+        while (delta >= (1UL << (TW_BITS * (lvl + 1)))) lvl++;
+
+        int idx = (t->expires >> (TW_BITS * lvl)) & TW_MASK;
+        slot = &w->__internal.slots[lvl][idx];
+    }
+
+    tw_list_add(slot, &t->link);
+}
+
+//Redistributes all the timers in one slot of a higher level into the
+//lower levels. Returns the index of the slot, so that the caller can tell
+//whether it wrapped around (and the next level up needs cascading too)
+static int tw_cascade(tw_wheel *w, int lvl) {
+    int idx = (w->now >> (TW_BITS * lvl)) & TW_MASK;
+
+    tw_link tmp;
+    tw_list_take(&tmp, &w->__internal.slots[lvl][idx]);
+
+    while (tmp.next != &tmp) {
+        tw_timer *t = (tw_timer *) tmp.next;
+        tw_list_del(&t->link);
+        tw_place(w, t);
+    }
+
+    return idx;
+}
+
+#endif
+
+//////////////////////////////////
+// Managing timers and wheels   //
+//////////////////////////////////
+
+//Initializes a timer so it can be armed. cb is called (with arg) when the
+//timer expires. Assumes t is non-NULL
+void init_tw_timer(tw_timer *t, tw_cb *cb, void *arg)
+#ifdef MM_IMPLEMENT
+{
+    t->link.next = NULL;
+    t->link.prev = NULL;
+    t->expires = 0;
+    t->cb = cb;
+    t->arg = arg;
+}
+#else
+;
+#endif
+
+//Returns a newly allocated timer wheel whose current time is now (in
+//ticks). Use del_tw_wheel to free it. Returns NULL and sets *err on error
+tw_wheel *new_tw_wheel(unsigned long now, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    tw_wheel *ret = malloc(sizeof(tw_wheel));
+    if (!ret) {
+        *err = TW_OOM;
+        return NULL;
+    }
+
+    ret->now = now;
+    ret->num_armed = 0;
+
+    int i, j;
+    for (i = 0; i < TW_LEVELS; i++) {
+        for (j = 0; j < TW_SLOTS; j++) {
+            tw_list_init(&ret->__internal.slots[i][j]);
+        }
+    }
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Frees a timer wheel. Any timers still armed are simply forgotten about
+//(their memory belongs to you). Gracefully ignores NULL input
+void del_tw_wheel(tw_wheel *w)
+#ifdef MM_IMPLEMENT
+{
+    free(w);
+}
+#else
+;
+#endif
+
+//Returns 1 if t is currently armed
+int tw_armed(tw_timer const *t)
+#ifdef MM_IMPLEMENT
+{
+    return t->link.next != NULL;
+}
+#else
+;
+#endif
+
+//Disarms t. Harmless if t is not armed. Assumes w and t are non-NULL
+void tw_cancel(tw_wheel *w, tw_timer *t)
+#ifdef MM_IMPLEMENT
+{
+    if (!tw_armed(t)) return;
+    tw_list_del(&t->link);
+    w->num_armed--;
+}
+#else
+;
+#endif
+
+//Arms t to expire ticks ticks from now. If t was already armed, it is
+//re-armed with the new expiry. Assumes w and t are non-NULL
+void tw_arm(tw_wheel *w, tw_timer *t, unsigned long ticks)
+#ifdef MM_IMPLEMENT
+{
+    tw_cancel(w, t);
+
+    //A timer for "zero ticks from now" still has to wait for the next tick;
+    //otherwise re-arming from inside a callback could loop forever
+    if (ticks == 0) ticks = 1;
+
+    t->expires = w->now + ticks;
+    tw_place(w, t);
+    w->num_armed++;
+}
+#else
+;
+#endif
+
+/* tw_advance:
+
+Processes every tick up to (and including) the tick given by now, calling
+the callbacks for all the timers that expire. The expired timers in each
+tick are unhooked from the wheel as a batch before any callbacks run, and
+each timer is disarmed just before its callback is called. This means
+callbacks are free to re-arm their own timer, or cancel/arm any other
+timer.
+
+Returns the number of timers that expired.
+
+If nothing is armed, this skips straight to now without walking the empty
+slots.
+*/
+int tw_advance(tw_wheel *w, unsigned long now)
+#ifdef MM_IMPLEMENT
+{
+    int num_expired = 0;
+
+    while ((long) (now - w->now) >= 0) {
+        if (w->num_armed == 0) {
+            w->now = now + 1;
+            break;
+        }
+
+        //Cascade higher levels every time a lower level wraps around
+        int idx = w->now & TW_MASK;
+        int lvl;
+        for (lvl = 1; lvl < TW_LEVELS && idx == 0; lvl++) {
+            idx = tw_cascade(w, lvl);
+        }
+
+        //Grab the whole batch of timers that are due this tick
+        tw_link batch;
+        tw_list_take(&batch, &w->__internal.slots[0][w->now & TW_MASK]);
+        w->now++;
+
+        while (batch.next != &batch) {
+            tw_timer *t = (tw_timer *) batch.next;
+            tw_list_del(&t->link);
+            w->num_armed--;
+            num_expired++;
+
+            t->cb(t, t->arg);
+        }
+    }
+
+    return num_expired;
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif
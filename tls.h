@@ -0,0 +1,365 @@
+//TLS for the server, so HTTPS and WSS don't need a proxy in front. OpenSSL
+//does the handshake. After that, if the kernel supports it (the "tls" ULP,
+//i.e. modprobe tls), OpenSSL hands the session keys to kernel TLS and the
+//records are encrypted and decrypted in the kernel. Once that happens for
+//sending, the socket can be written to directly again (sendmsg, sendfile),
+//and the data gets encrypted on its way out. Reads always go through
+//SSL_read, which with kTLS on is a thin wrapper around recvmsg (it's there
+//to deal with the odd alert or KeyUpdate). Either way, the parsers only
+//ever see plaintext.
+//
+//Without kTLS, everything falls back to plain old userspace TLS.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef TLS_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define TLS_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef TLS_H
+        #define SHOULD_INCLUDE 1
+        #define TLS_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "tls.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "mm_err.h"
+#include "write_queue.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Biggest plaintext we hand to one SSL_write. Bigger writes just get
+    //split into 16K records anyway
+    #define TLS_MAX_WRITE (64 * 1024)
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(TLS_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(TLS_OOM, "out of memory");
+MM_ERR(TLS_CTX_ERROR, "could not set up TLS (check the certificate and key files)");
+MM_ERR(TLS_HANDSHAKE_ERROR, "TLS handshake failed");
+MM_ERR(TLS_IO_ERROR, "TLS connection error");
+
+/////////////////
+// TLS structs //
+/////////////////
+#ifndef MM_IMPLEMENT
+    typedef struct _tls_ctx {
+        //Whether to ask OpenSSL for kTLS at all
+        int use_ktls;
+
+        //Counters. Only touched from the event loop
+        unsigned long handshakes;
+        unsigned long failed;
+        //Connections where the kernel took over sending/receiving
+        unsigned long ktls_tx;
+        unsigned long ktls_rx;
+
+        //Internal fields. Don't touch!
+        struct {
+            SSL_CTX *ssl_ctx;
+        } __internal;
+    } tls_ctx;
+
+    typedef struct _tls_conn {
+        //Set once the handshake is done
+        int established;
+        //Whether the kernel is doing the record layer in each direction
+        int ktls_tx;
+        int ktls_rx;
+        //The handshake is stuck until the socket is writable
+        int want_write;
+
+        //Internal fields. Don't touch!
+        struct {
+            tls_ctx *ctx;
+            SSL *ssl;
+            int fd;
+        } __internal;
+    } tls_conn;
+#endif
+
+/////////////////////////////////
+// Setting up and tearing down //
+/////////////////////////////////
+
+//Returns a new context that serves the given certificate chain and private
+//key (PEM files). If use_ktls is set, connections try to move to kernel TLS
+//after the handshake. Returns NULL and sets *err on error
+tls_ctx *new_tls_ctx(char const *cert_file, char const *key_file, int use_ktls, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!cert_file || !key_file) {
+        *err = TLS_NULL_ARG;
+        return NULL;
+    }
+
+    tls_ctx *ret = calloc(1, sizeof(tls_ctx));
+    if (!ret) {
+        *err = TLS_OOM;
+        return NULL;
+    }
+    ret->use_ktls = use_ktls;
+
+    SSL_CTX *sc = SSL_CTX_new(TLS_server_method());
+    ret->__internal.ssl_ctx = sc;
+    if (!sc
+        || !SSL_CTX_set_min_proto_version(sc, TLS1_2_VERSION)
+        || SSL_CTX_use_certificate_chain_file(sc, cert_file) != 1
+        || SSL_CTX_use_PrivateKey_file(sc, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(sc) != 1
+    ) {
+        ERR_clear_error();
+        SSL_CTX_free(sc);
+        free(ret);
+        *err = TLS_CTX_ERROR;
+        return NULL;
+    }
+
+    //Partial writes and moving buffers are what let SSL_write work with the
+    //write queue: whatever doesn't go out gets queued and retried later,
+    //possibly from a different address
+    SSL_CTX_set_mode(sc, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    if (use_ktls) SSL_CTX_set_options(sc, SSL_OP_ENABLE_KTLS);
+
+    return ret;
+}
+#else
+;
+#endif
+
+//Gracefully ignores NULL input. Any tls_conns using ctx must be gone first
+void del_tls_ctx(tls_ctx *ctx)
+#ifdef MM_IMPLEMENT
+{
+    if (!ctx) return;
+    SSL_CTX_free(ctx->__internal.ssl_ctx);
+    free(ctx);
+}
+#else
+;
+#endif
+
+//Starts a server-side TLS session on fd (a connected, non-blocking socket).
+//Call tls_handshake until it says it's done
+tls_conn *new_tls_conn(tls_ctx *ctx, int fd, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (!ctx) {
+        *err = TLS_NULL_ARG;
+        return NULL;
+    }
+
+    tls_conn *ret = calloc(1, sizeof(tls_conn));
+    if (!ret) {
+        *err = TLS_OOM;
+        return NULL;
+    }
+
+    SSL *ssl = SSL_new(ctx->__internal.ssl_ctx);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1) {
+        ERR_clear_error();
+        SSL_free(ssl);
+        free(ret);
+        *err = TLS_OOM;
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+
+    ret->__internal.ctx = ctx;
+    ret->__internal.ssl = ssl;
+    ret->__internal.fd = fd;
+    return ret;
+}
+#else
+;
+#endif
+
+//Sends a close_notify if it can (without waiting for anything) and frees t.
+//Doesn't close the socket. Gracefully ignores NULL input
+void del_tls_conn(tls_conn *t)
+#ifdef MM_IMPLEMENT
+{
+    if (!t) return;
+    if (t->established) SSL_shutdown(t->__internal.ssl);
+    ERR_clear_error();
+    SSL_free(t->__internal.ssl);
+    free(t);
+}
+#else
+;
+#endif
+
+///////////////////////
+// Using connections //
+///////////////////////
+
+//Moves the handshake along. Returns 1 once it's done, 0 if it's waiting on
+//the socket (want_write says which way), or -1 and sets *err if it failed
+int tls_handshake(tls_conn *t, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!t) {
+        *err = TLS_NULL_ARG;
+        return -1;
+    }
+    if (t->established) return 1;
+
+    tls_ctx *ctx = t->__internal.ctx;
+    t->want_write = 0;
+
+    int rc = SSL_do_handshake(t->__internal.ssl);
+    if (rc != 1) {
+        switch (SSL_get_error(t->__internal.ssl, rc)) {
+        case SSL_ERROR_WANT_READ:
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            t->want_write = 1;
+            return 0;
+        default:
+            ERR_clear_error();
+            ctx->failed++;
+            *err = TLS_HANDSHAKE_ERROR;
+            return -1;
+        }
+    }
+
+    t->established = 1;
+    ctx->handshakes++;
+
+    //OpenSSL tries to switch on kTLS by itself during the handshake, when
+    //SSL_OP_ENABLE_KTLS is set. All we have to do is see if it worked
+    BIO *wbio = SSL_get_wbio(t->__internal.ssl);
+    BIO *rbio = SSL_get_rbio(t->__internal.ssl);
+    t->ktls_tx = BIO_get_ktls_send(wbio);
+    t->ktls_rx = BIO_get_ktls_recv(rbio);
+    if (t->ktls_tx) ctx->ktls_tx++;
+    if (t->ktls_rx) ctx->ktls_rx++;
+
+    return 1;
+}
+#else
+;
+#endif
+
+//Reads up to len bytes of plaintext. Returns how many, or 0 if the other
+//end closed the connection. Returns -1 if there's nothing to read right now
+//(*err is left alone) or if something went wrong (*err says what)
+int tls_read(tls_conn *t, char *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!t || !buf) {
+        *err = TLS_NULL_ARG;
+        return -1;
+    }
+
+    int rc = SSL_read(t->__internal.ssl, buf, len);
+    if (rc > 0) return rc;
+
+    switch (SSL_get_error(t->__internal.ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        //EOF without a close_notify. Lots of clients do this
+        if (errno == 0 || errno == ECONNRESET) {
+            ERR_clear_error();
+            return 0;
+        }
+        //Fall through
+    default:
+        ERR_clear_error();
+        *err = TLS_IO_ERROR;
+        return -1;
+    }
+}
+#else
+;
+#endif
+
+//Bytes already decrypted and waiting inside OpenSSL. epoll can't see these,
+//so keep calling tls_read while this is nonzero
+int tls_pending(tls_conn const *t)
+#ifdef MM_IMPLEMENT
+{
+    return SSL_pending(t->__internal.ssl);
+}
+#else
+;
+#endif
+
+//A wq_send_fn (see write_queue.h) for a TLS connection; arg is the
+//tls_conn. With kTLS on for sending, this is just a sendmsg (the kernel
+//does the encryption), so gather writes still work. Otherwise each buffer
+//goes through SSL_write
+long tls_writev(void *arg, struct iovec const *iov, int n)
+#ifdef MM_IMPLEMENT
+{
+    tls_conn *t = arg;
+
+    if (t->ktls_tx) return wq_send_socket((void *) (long) t->__internal.fd, iov, n);
+    
+    long total = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        char const *p = iov[i].iov_base;
+        long left = iov[i].iov_len;
+        while (left > 0) {
+            int chunk = left < TLS_MAX_WRITE ? left : TLS_MAX_WRITE;
+            int rc = SSL_write(t->__internal.ssl, p, chunk);
+            if (rc <= 0) {
+                int e = SSL_get_error(t->__internal.ssl, rc);
+                if (e == SSL_ERROR_WANT_WRITE || e == SSL_ERROR_WANT_READ) return total;
+                ERR_clear_error();
+                return -1;
+            }
+            p += rc;
+            left -= rc;
+            total += rc;
+        }
+    }
+    return total;
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
@@ -0,0 +1,531 @@
+//Per-request latency tracing. When a p99 goes bad, this tells you which
+//part of handling a request got slow. Every HTTP request or websocket
+//message gets a timestamp at each of these points:
+//
+//    TRACE_FIRST_BYTE     the first of its bytes was read
+//    TRACE_PARSED         the parser said it was complete
+//    TRACE_HANDLER_START  the callback (or the cache, or /metrics) got it
+//    TRACE_HANDLER_END    the callback returned (or srv_release was called)
+//    TRACE_WRITTEN        the last byte of the response left the queue
+//
+//"Written" means handed to the kernel. For HTTP/2, a response the client's
+//flow control window is holding back counts as written once the part that
+//fit is out.
+//
+//The time between each pair goes in a histogram for that stage, plus one
+//for the whole thing. Like metrics.h, each thread has its own histograms
+//that only it writes, and trace_snapshot adds them up without taking any
+//locks. One in every trace_set_sampling requests is also copied into a
+//per-thread ring buffer, which trace_write_chrome dumps in the Chrome trace
+//format (load it in chrome://tracing or ui.perfetto.dev).
+//
+//Timestamps come from metrics_now, i.e. the TSC on x86. server.h does all
+//of this for you when you set params.trace.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef TRACE_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define TRACE_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef TRACE_H
+        #define SHOULD_INCLUDE 1
+        #define TRACE_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "trace.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mm_err.h"
+#include "metrics.h"
+#include "histogram.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    //Sampled requests each thread remembers. Older ones get overwritten
+    #define TRACE_RING_SIZE 1024
+    //Responses a connection can have waiting in its output queue and still
+    //get traced. Past this (a client pipelining a lot and reading slowly),
+    //requests just aren't timed
+    #define TRACE_MAX_PENDING 4
+    #define TRACE_DEFAULT_SAMPLING 100
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(TRACE_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(TRACE_OOM, "out of memory");
+MM_ERR(TRACE_BUF_TOO_SMALL, "buffer too small for trace output");
+MM_ERR(TRACE_IO_ERROR, "could not write trace (check errno)");
+
+/////////////////////////
+// Trace structs/enums //
+/////////////////////////
+#ifndef MM_IMPLEMENT
+    #define TRACE_POINT_IDS \
+        X(TRACE_FIRST_BYTE), \
+        X(TRACE_PARSED), \
+        X(TRACE_HANDLER_START), \
+        X(TRACE_HANDLER_END), \
+        X(TRACE_WRITTEN)
+
+    typedef enum _trace_point_t {
+    #define X(x) x
+        TRACE_POINT_IDS
+    #undef X
+    } trace_point_t;
+
+    #define TRACE_NUM_POINTS (TRACE_WRITTEN + 1)
+
+    //Stage i is from point i to point i+1, except TRACE_TOTAL, which is
+    //from the first point to the last
+    #define TRACE_STAGE_IDS \
+        X(TRACE_PARSE, "parse"), \
+        X(TRACE_QUEUE, "queue"), \
+        X(TRACE_HANDLER, "handler"), \
+        X(TRACE_WRITE, "write"), \
+        X(TRACE_TOTAL, "total")
+
+    typedef enum _trace_stage_t {
+    #define X(x, name) x
+        TRACE_STAGE_IDS
+    #undef X
+    } trace_stage_t;
+
+    #define TRACE_NUM_STAGES (TRACE_TOTAL + 1)
+
+    extern char const *const trace_stage_names[];
+
+    #define TRACE_KIND_IDS \
+        X(TRACE_HTTP, "http"), \
+        X(TRACE_WEBSOCK, "websocket"), \
+        X(TRACE_H2, "h2")
+
+    typedef enum _trace_kind_t {
+    #define X(x, name) x
+        TRACE_KIND_IDS
+    #undef X
+    } trace_kind_t;
+
+    extern char const *const trace_kind_names[];
+
+    //One request or message. Timestamps are in metrics_now ticks, 0 for
+    //points not reached yet
+    typedef struct _trace_span {
+        unsigned long t[TRACE_NUM_POINTS];
+        unsigned long conn;
+        trace_kind_t kind;
+    } trace_span;
+
+    //What a connection needs to keep track of. Responses that are still
+    //in the output queue wait in pending until the queue has sent
+    //everything up to their last byte
+    typedef struct _trace_conn {
+        trace_span cur;
+        //When we last read from the connection
+        unsigned long last_read;
+        trace_span pending[TRACE_MAX_PENDING];
+        //Queue's "sent" count once the matching span's response is out
+        unsigned long targets[TRACE_MAX_PENDING];
+        int num_pending;
+    } trace_conn;
+
+    //One of these per thread that finishes spans
+    typedef struct _trace_local {
+        histogram hists[TRACE_NUM_STAGES];
+        //Spans that couldn't be timed (see TRACE_MAX_PENDING)
+        unsigned long untimed;
+        unsigned long until_sample;
+
+        //Internal fields. Don't touch!
+        struct {
+            //Ring slot for span i is i % TRACE_RING_SIZE. head is how many
+            //spans were ever put in
+            trace_span ring[TRACE_RING_SIZE];
+            unsigned long head;
+            int thread;
+            struct _trace_local *next;
+        } __internal;
+    } trace_local;
+
+    extern __thread struct _trace_local *trace_tls;
+#else
+    #define X(x, name) name
+    char const *const trace_stage_names[] = {
+        TRACE_STAGE_IDS
+    };
+    char const *const trace_kind_names[] = {
+        TRACE_KIND_IDS
+    };
+    #undef X
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+__thread trace_local *trace_tls = NULL;
+
+//Head of the list of every thread's block. Only ever pushed onto
+static trace_local *trace_all = NULL;
+static int trace_num_threads = 0;
+static unsigned trace_sampling = TRACE_DEFAULT_SAMPLING;
+
+static trace_local *trace_register() {
+    trace_local *t = calloc(1, sizeof(trace_local));
+    if (!t) return NULL;
+
+    int i;
+    for (i = 0; i < TRACE_NUM_STAGES; i++) reset_histogram(t->hists + i);
+    t->__internal.thread = __atomic_add_fetch(&trace_num_threads, 1, __ATOMIC_RELAXED);
+
+    //Lock-free push onto the global list
+    trace_local *head = __atomic_load_n(&trace_all, __ATOMIC_RELAXED);
+    do {
+        t->__internal.next = head;
+    } while (!__atomic_compare_exchange_n(&trace_all, &head, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    trace_tls = t;
+    return t;
+}
+
+//Puts a finished span in this thread's histograms (and maybe its ring)
+static void trace_record(trace_span const *s) {
+    trace_local *t = trace_tls ? trace_tls : trace_register();
+    if (!t) return;
+
+    double ns_per_tick = 1e9 / metrics_ticks_per_sec();
+    int i;
+    for (i = 0; i < TRACE_TOTAL; i++) {
+        hist_record_shared(t->hists + i, (s->t[i + 1] - s->t[i]) * ns_per_tick);
+    }
+    hist_record_shared(t->hists + TRACE_TOTAL, (s->t[TRACE_WRITTEN] - s->t[TRACE_FIRST_BYTE]) * ns_per_tick);
+
+    if (trace_sampling == 0 || t->until_sample-- > 0) return;
+    t->until_sample = trace_sampling - 1;
+
+    //Readers check head again after copying, and throw away anything we
+    //might have been overwriting in the meantime
+    unsigned long head = t->__internal.head;
+    unsigned long *dst = (unsigned long *) (t->__internal.ring + head % TRACE_RING_SIZE);
+    unsigned long const *src = (unsigned long const *) s;
+    for (i = 0; i < (int) (sizeof(trace_span) / sizeof(long)); i++) __atomic_store_n(dst + i, src[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&t->__internal.head, head + 1, __ATOMIC_RELEASE);
+}
+
+//Fills in points that were skipped (e.g. control frames never see a
+//handler) with the one before, so they count as taking no time, and
+//records the span
+static void trace_finish(trace_span *s, unsigned long written) {
+    s->t[TRACE_WRITTEN] = written;
+    int i;
+    for (i = 1; i < TRACE_NUM_POINTS; i++) {
+        if (s->t[i] < s->t[i - 1]) s->t[i] = s->t[i - 1];
+    }
+    trace_record(s);
+}
+
+#endif
+
+////////////////////////
+// Tracing a request  //
+////////////////////////
+
+//Sets how often a finished request is copied into the ring: 1 in every
+//sampling of them. 0 turns the ring off (the histograms still fill up)
+void trace_set_sampling(unsigned sampling)
+#ifdef MM_IMPLEMENT
+{
+    trace_sampling = sampling;
+}
+#else
+;
+#endif
+
+//Assumes tc is non-NULL
+void init_trace_conn(trace_conn *tc)
+#ifdef MM_IMPLEMENT
+{
+    memset(tc, 0, sizeof(trace_conn));
+}
+#else
+;
+#endif
+
+//Call every time something is read from the connection, before it goes to
+//the parser. Starts a new span if there isn't one going
+void trace_read(trace_conn *tc)
+#ifdef MM_IMPLEMENT
+{
+    tc->last_read = metrics_now();
+    if (!tc->cur.t[TRACE_FIRST_BYTE]) tc->cur.t[TRACE_FIRST_BYTE] = tc->last_read;
+}
+#else
+;
+#endif
+
+//Call when the parser has a complete request/message. If it started in a
+//read that had the end of the last one, that read is its first byte
+void trace_parsed(trace_conn *tc, trace_kind_t kind)
+#ifdef MM_IMPLEMENT
+{
+    trace_span *s = &tc->cur;
+    s->t[TRACE_PARSED] = metrics_now();
+    if (!s->t[TRACE_FIRST_BYTE]) s->t[TRACE_FIRST_BYTE] = tc->last_read;
+    s->kind = kind;
+}
+#else
+;
+#endif
+
+//Timestamps point p of the current span
+void trace_mark(trace_conn *tc, trace_point_t p)
+#ifdef MM_IMPLEMENT
+{
+    tc->cur.t[p] = metrics_now();
+}
+#else
+;
+#endif
+
+//Call once the current request/message has been dealt with. sent and
+//queued are the connection's write queue's counters: if nothing's queued,
+//the response is already out and the span is done now. Otherwise it waits
+//for trace_flushed. Does nothing if nothing was parsed
+void trace_done(trace_conn *tc, unsigned long conn, unsigned long sent, long queued)
+#ifdef MM_IMPLEMENT
+{
+    trace_span *s = &tc->cur;
+    if (!s->t[TRACE_PARSED]) return;
+    s->conn = conn;
+
+    if (queued == 0) {
+        trace_finish(s, metrics_now());
+    } else if (tc->num_pending < TRACE_MAX_PENDING) {
+        tc->pending[tc->num_pending] = *s;
+        tc->targets[tc->num_pending] = sent + queued;
+        tc->num_pending++;
+    } else {
+        trace_local *t = trace_tls ? trace_tls : trace_register();
+        if (t) __atomic_store_n(&t->untimed, t->untimed + 1, __ATOMIC_RELAXED);
+    }
+
+    memset(s, 0, sizeof(trace_span));
+}
+#else
+;
+#endif
+
+//Call after the connection's write queue sends something. Finishes every
+//pending span whose response is now completely out
+void trace_flushed(trace_conn *tc, unsigned long sent, long queued)
+#ifdef MM_IMPLEMENT
+{
+    if (tc->num_pending == 0) return;
+
+    unsigned long now = metrics_now();
+    int done = 0;
+    //Responses go out in order, so these do too. (If the queue dropped
+    //anything, the targets are off, but an empty queue sorts that out)
+    while (done < tc->num_pending && (queued == 0 || sent >= tc->targets[done])) {
+        trace_finish(tc->pending + done, now);
+        done++;
+    }
+    if (done == 0) return;
+
+    tc->num_pending -= done;
+    memmove(tc->pending, tc->pending + done, tc->num_pending * sizeof(trace_span));
+    memmove(tc->targets, tc->targets + done, tc->num_pending * sizeof(long));
+}
+#else
+;
+#endif
+
+///////////////////////
+// Reading the trace //
+///////////////////////
+
+//Adds up every thread's histograms into out (which must have room for
+//TRACE_NUM_STAGES of them). Never blocks the threads doing the recording.
+//Values are in nanoseconds. Returns how many spans couldn't be timed
+unsigned long trace_snapshot(histogram *out, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return 0;
+
+    if (!out) {
+        *err = TRACE_NULL_ARG;
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < TRACE_NUM_STAGES; i++) reset_histogram(out + i);
+
+    unsigned long untimed = 0;
+    trace_local *t = __atomic_load_n(&trace_all, __ATOMIC_ACQUIRE);
+    for (; t; t = t->__internal.next) {
+        for (i = 0; i < TRACE_NUM_STAGES; i++) hist_merge_shared(out + i, t->hists + i);
+        untimed += __atomic_load_n(&t->untimed, __ATOMIC_RELAXED);
+    }
+    return untimed;
+}
+#else
+;
+#endif
+
+/* trace_prometheus:
+
+Writes the stage histograms to buf as a Prometheus summary (a few
+percentiles per stage, in seconds). Returns the number of bytes written (not
+counting the NUL), or -1 and sets *err; if buf is too small, that's
+TRACE_BUF_TOO_SMALL. 4 KiB is plenty.
+*/
+int trace_prometheus(char *buf, int cap, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!buf) {
+        *err = TRACE_NULL_ARG;
+        return -1;
+    }
+
+    //Too big for the stack
+    histogram *hists = malloc(TRACE_NUM_STAGES * sizeof(histogram));
+    if (!hists) {
+        *err = TRACE_OOM;
+        return -1;
+    }
+    unsigned long untimed = trace_snapshot(hists, err);
+
+    static double const pcts[] = {50.0, 90.0, 99.0, 99.9};
+    int pos = 0;
+    #define EMIT(...) do { \
+        int n_ = snprintf(buf + pos, cap - pos, __VA_ARGS__); \
+        if (n_ < 0 || n_ >= cap - pos) { *err = TRACE_BUF_TOO_SMALL; free(hists); return -1; } \
+        pos += n_; \
+    } while (0)
+
+    EMIT("# HELP mm_request_stage_seconds Time per request/message, by stage\n# TYPE mm_request_stage_seconds summary\n");
+    int i, j;
+    for (i = 0; i < TRACE_NUM_STAGES; i++) {
+        histogram const *h = hists + i;
+        for (j = 0; j < (int) (sizeof(pcts) / sizeof(*pcts)); j++) {
+            EMIT("mm_request_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n",
+                trace_stage_names[i], pcts[j] / 100, hist_percentile(h, pcts[j]) / 1e9);
+        }
+        EMIT("mm_request_stage_seconds_sum{stage=\"%s\"} %.9f\n", trace_stage_names[i], h->sum / 1e9);
+        EMIT("mm_request_stage_seconds_count{stage=\"%s\"} %lu\n", trace_stage_names[i], h->count);
+    }
+    EMIT("# HELP mm_request_untimed_total Requests with too many responses queued to time\n# TYPE mm_request_untimed_total counter\nmm_request_untimed_total %lu\n", untimed);
+
+    #undef EMIT
+    free(hists);
+    return pos;
+}
+#else
+;
+#endif
+
+/* trace_write_chrome:
+
+Writes the sampled spans from every thread to fp, as a Chrome trace (the
+JSON trace event format). Each thread is a "process" and each connection a
+"thread" in there, so the requests on one connection line up in a row. Each
+request is one slice, with a nested slice per stage.
+
+Like trace_snapshot, this doesn't block the threads doing the recording;
+spans being overwritten while we copy them are just left out. Returns 0 on
+success, or -1 and sets *err.
+*/
+int trace_write_chrome(FILE *fp, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!fp) {
+        *err = TRACE_NULL_ARG;
+        return -1;
+    }
+
+    trace_span *spans = malloc(TRACE_RING_SIZE * sizeof(trace_span));
+    if (!spans) {
+        *err = TRACE_OOM;
+        return -1;
+    }
+
+    double us_per_tick = 1e6 / metrics_ticks_per_sec();
+    int first = 1;
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+    trace_local *t = __atomic_load_n(&trace_all, __ATOMIC_ACQUIRE);
+    for (; t; t = t->__internal.next) {
+        unsigned long head = __atomic_load_n(&t->__internal.head, __ATOMIC_ACQUIRE);
+        unsigned long start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+        unsigned long i;
+        for (i = start; i < head; i++) {
+            unsigned long const *src = (unsigned long const *) (t->__internal.ring + i % TRACE_RING_SIZE);
+            unsigned long *dst = (unsigned long *) (spans + (i - start));
+            int j;
+            for (j = 0; j < (int) (sizeof(trace_span) / sizeof(long)); j++) dst[j] = __atomic_load_n(src + j, __ATOMIC_RELAXED);
+        }
+
+        //Anything the writer got to while we were copying is garbage
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        unsigned long now_head = __atomic_load_n(&t->__internal.head, __ATOMIC_RELAXED);
+        if (now_head > TRACE_RING_SIZE && now_head - TRACE_RING_SIZE > start) start = now_head - TRACE_RING_SIZE;
+
+        for (i = start; i < head; i++) {
+            trace_span const *s = spans + (i - (head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0));
+            int pid = t->__internal.thread;
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                first ? "" : ",", trace_kind_names[s->kind], pid, s->conn,
+                s->t[TRACE_FIRST_BYTE] * us_per_tick, (s->t[TRACE_WRITTEN] - s->t[TRACE_FIRST_BYTE]) * us_per_tick);
+            first = 0;
+
+            int j;
+            for (j = 0; j < TRACE_TOTAL; j++) {
+                fprintf(fp, ",{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+                    trace_stage_names[j], pid, s->conn, s->t[j] * us_per_tick, (s->t[j + 1] - s->t[j]) * us_per_tick);
+            }
+        }
+    }
+
+    fprintf(fp, "]}\n");
+    free(spans);
+
+    if (ferror(fp)) {
+        *err = TRACE_IO_ERROR;
+        return -1;
+    }
+    return 0;
+}
+#else
+;
+#endif
+
+#else
+    #undef SHOULD_INCLUDE
+#endif
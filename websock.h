@@ -28,9 +28,12 @@
 #include <alloca.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <openssl/sha.h>
 #include <endian.h> //UGHHH endianness...
 #include "mm_err.h"
+#include "mm_alloc.h"
+#include "metrics.h"
 #include "http_parse.h"
 
 ////////////////
@@ -39,6 +42,15 @@
 #ifndef MM_IMPLEMENT
     #define WEBSOCK_MAX_PROTOCOL_LEN 32
     #define WEBSOCK_INITIAL_SIZE 256
+    
+    //Defaults for websock_limits
+    #define WEBSOCK_DEFAULT_MAX_FRAME (1 << 20)
+    #define WEBSOCK_DEFAULT_MAX_MSG (16 << 20)
+    //Frames are kept in one buffer indexed by ints, so even with no limit
+    //set, this is as big as they get (unless they're streamed)
+    #define WEBSOCK_HARD_MAX_FRAME (1 << 30)
+    //Streamed payloads are unmasked this much at a time
+    #define WEBSOCK_STREAM_SEGMENT (16 << 10)
 
     //Set up a bunch of defines used in constructing the websocket handshake 
     //response
@@ -85,6 +97,9 @@ MM_ERR(WEBSOCK_STRAGGLERS, "leftover bytes in user buffer have been ignored");
 MM_ERR(WEBSOCK_INVALID_ARG, "invalid argument");
 MM_ERR(WEBSOCK_NOT_IMPL, "not implemented");
 MM_ERR(WEBSOCK_OOM, "out of memory");
+MM_ERR(WEBSOCK_BAD_LENGTH, "websocket frame length has its top bit set");
+MM_ERR(WEBSOCK_FRAME_TOO_BIG, "websocket frame is bigger than limits.max_frame");
+MM_ERR(WEBSOCK_MSG_TOO_BIG, "websocket message is bigger than limits.max_msg");
 
 #undef xstr
 #undef str
@@ -141,49 +156,103 @@ MM_ERR(WEBSOCK_OOM, "out of memory");
 // Main websock packet structure //
 ///////////////////////////////////
 #ifndef MM_IMPLEMENT
+    //Same idea as http_limits. Zero means no limit (but see
+    //WEBSOCK_HARD_MAX_FRAME). Both are checked as soon as a frame's header
+    //is in, before making room for its payload
+    typedef struct _websock_limits {
+        unsigned long max_frame;
+        //Total payload of a fragmented message, over all its frames
+        unsigned long max_msg;
+    } websock_limits;
+    
     typedef struct _websock_pkt {
         websock_pkt_type_t type;
         int fin;
         unsigned long payload_len;
         char *payload;
+        //Set if this frame's payload went to on_data instead (in which case
+        //payload is NULL)
+        int streamed;
+        
+        //Set to the defaults by new_websock_pkt. Stays set across frames
+        websock_limits limits;
+        
+        //Streaming. If on_data is set, data frames (not control frames)
+        //with at least stream_min bytes of payload aren't buffered. Their
+        //payload is unmasked a piece at a time and handed to on_data as it
+        //comes in, with off saying where the piece goes in the frame. Then
+        //the frame finishes like any other. Nothing is buffered, so limits
+        //don't apply, and a frame can be as long as the protocol allows.
+        //Stays set across frames (NULL and 0 by default)
+        void (*on_data)(struct _websock_pkt *pkt, char const *data, int len, unsigned long off, void *arg);
+        void *on_data_arg;
+        unsigned long stream_min;
         
         struct {
             websock_parse_state_t state;
+            mm_allocator const *alloc;
             char *base;
-            int pos;
+            //Can be past the end of base for streamed frames
+            unsigned long pos;
             int cap;
             int hdr_len;
             char mask[4];
+            //Payload bytes in the message so far, including this frame
+            unsigned long msg_len;
         } __internal;
     } websock_pkt;
+    
+    //Everything a parser needs to pick up where another left off, in the
+    //middle of a frame or not (see websock_pkt_save). Fixed sizes, since
+    //this gets passed between processes
+    typedef struct _websock_pkt_state {
+        unsigned char state;
+        unsigned char type;
+        unsigned char fin;
+        unsigned char streamed;
+        char mask[4];
+        unsigned hdr_len;
+        unsigned long pos;
+        unsigned long payload_len;
+        unsigned long msg_len;
+    } websock_pkt_state;
 #endif
 
 //////////////////////////////////
 // Managing websock_pkt structs //
 //////////////////////////////////
 
-//Returns a newly allocated (and initialized) websock_pkt struct. Use 
-//del_websock_pkt to properly free it. Returns NULL and sets *err on error
-websock_pkt *new_websock_pkt(mm_err *err) 
+//Same as new_websock_pkt, but the struct and all of its internal memory
+//come from the allocator a (see mm_alloc.h). If a is NULL, malloc is used.
+//The allocator must outlive the struct
+websock_pkt *new_websock_pkt_a(mm_allocator const *a, mm_err *err) 
 #ifdef MM_IMPLEMENT
 {
     if (*err != MM_SUCCESS) return NULL;
     
-    websock_pkt *ret = malloc(sizeof(websock_pkt));
+    if (!a) a = &mm_malloc_alloc;
+    
+    websock_pkt *ret = a->alloc(a->ctx, sizeof(websock_pkt));
     if (!ret) {
         *err = WEBSOCK_OOM;
         return NULL;
     }
     
-    char *base = malloc(WEBSOCK_INITIAL_SIZE);
+    char *base = a->alloc(a->ctx, WEBSOCK_INITIAL_SIZE);
     if (!base) {
         *err = WEBSOCK_OOM;
-        free(ret);
+        a->free(a->ctx, ret, sizeof(websock_pkt));
         return NULL;
     }
     
+    ret->__internal.alloc = a;
     ret->__internal.base = base;
     ret->__internal.cap = WEBSOCK_INITIAL_SIZE;
+    ret->__internal.msg_len = 0;
+    websock_default_limits(&ret->limits);
+    ret->on_data = NULL;
+    ret->on_data_arg = NULL;
+    ret->stream_min = 0;
     
     reset_websock_pkt(ret);
     
@@ -193,6 +262,28 @@ websock_pkt *new_websock_pkt(mm_err *err)
 ;
 #endif
 
+//Fills l with the WEBSOCK_DEFAULT_* limits
+void websock_default_limits(websock_limits *l)
+#ifdef MM_IMPLEMENT
+{
+    l->max_frame = WEBSOCK_DEFAULT_MAX_FRAME;
+    l->max_msg = WEBSOCK_DEFAULT_MAX_MSG;
+}
+#else
+;
+#endif
+
+//Returns a newly allocated (and initialized) websock_pkt struct. Use 
+//del_websock_pkt to properly free it. Returns NULL and sets *err on error
+websock_pkt *new_websock_pkt(mm_err *err) 
+#ifdef MM_IMPLEMENT
+{
+    return new_websock_pkt_a(NULL, err);
+}
+#else
+;
+#endif
+
 //Resets all state in a websock_pkt struct (but does not free any internal
 //buffers). Assumes pkt is non-NULL.
 void reset_websock_pkt(websock_pkt *pkt) 
@@ -201,6 +292,7 @@ void reset_websock_pkt(websock_pkt *pkt)
     pkt->__internal.state = WEBSOCK_HDR_FIRST_TWO_BYTES;
     pkt->__internal.pos = 0;
     pkt->payload_len = -1;
+    pkt->streamed = 0;
 }
 #else
 ;
@@ -211,8 +303,9 @@ void del_websock_pkt(websock_pkt *pkt)
 #ifdef MM_IMPLEMENT
 {
     if (!pkt) return;
-    free(pkt->__internal.base);
-    free(pkt);
+    mm_allocator const *a = pkt->__internal.alloc;
+    a->free(a->ctx, pkt->__internal.base, pkt->__internal.cap);
+    a->free(a->ctx, pkt, sizeof(websock_pkt));
 }
 #else
 ;
@@ -237,16 +330,22 @@ static void expand_pkt_mem_to(websock_pkt *pkt, int min_sz, mm_err *err) {
     //Quit early if no expansion needed
     if (pkt->__internal.cap >= min_sz) return;
     
+    //Keep doubling until we're big enough
+    int new_cap = pkt->__internal.cap;
+    while (new_cap < min_sz) new_cap *= 2;
+    
     //Resize the memory buffer
-    char *new_base = realloc(pkt->__internal.base, pkt->__internal.cap * 2);
+    mm_allocator const *a = pkt->__internal.alloc;
+    char *new_base = a->realloc(a->ctx, pkt->__internal.base, pkt->__internal.cap, new_cap);
+    METRIC_ADD(reallocs, 1);
     if (!new_base) {
-        *err = HTTP_OOM;
+        *err = WEBSOCK_OOM;
         return;
     }
     
     //Update internal bookkeeping
     pkt->__internal.base = new_base;
-    pkt->__internal.cap *= 2;
+    pkt->__internal.cap = new_cap;
 }
 
 //What a pain! Why does websockets have such an inconvenient length format?
@@ -259,7 +358,8 @@ static void process_websock_hdr_length(websock_pkt *pkt, mm_err *err) {
         return;
     }
     
-    char length_code = pkt->__internal.base[1] & 0xFF;
+    //The top bit is the mask bit, not part of the length
+    char length_code = pkt->__internal.base[1] & 0x7F;
     
     switch (length_code) {
         case 126:
@@ -310,13 +410,44 @@ static void process_websock_hdr(websock_pkt *pkt, mm_err *err) {
     hdr += 2;
     
     if (len == 126) {
-        len = be16toh(*(unsigned short*)(hdr));
+        unsigned short len16;
+        memcpy(&len16, hdr, 2);
+        len = be16toh(len16);
         hdr += 2;
     } else if (len == 127) {
-        len = be64toh(*(unsigned short*)(hdr));
+        unsigned long long len64;
+        memcpy(&len64, hdr, 8);
+        len64 = be64toh(len64);
+        if (len64 >> 63) {
+            *err = WEBSOCK_BAD_LENGTH;
+            return;
+        }
+        len = len64;
         hdr += 8;
     }
     
+    //Control frames always get buffered, since we have to look at them
+    pkt->streamed = pkt->on_data && opcode < WEBSOCK_CLOSE && len >= pkt->stream_min;
+    
+    //Check the limits now, while all we've used is the header
+    unsigned long max_frame = pkt->limits.max_frame;
+    if (max_frame == 0 || max_frame > WEBSOCK_HARD_MAX_FRAME) max_frame = WEBSOCK_HARD_MAX_FRAME;
+    if (len > max_frame && !pkt->streamed) {
+        *err = WEBSOCK_FRAME_TOO_BIG;
+        return;
+    }
+    //Control frames can show up in the middle of a fragmented message, and
+    //aren't part of it. Anything else that isn't a continuation starts a new
+    //message
+    if (opcode < WEBSOCK_CLOSE && !pkt->streamed) {
+        if (opcode != WEBSOCK_CONT) pkt->__internal.msg_len = 0;
+        pkt->__internal.msg_len += len;
+        if (pkt->limits.max_msg > 0 && pkt->__internal.msg_len > pkt->limits.max_msg) {
+            *err = WEBSOCK_MSG_TOO_BIG;
+            return;
+        }
+    }
+    
     pkt->payload_len = len;
     
     //Masking key
@@ -329,11 +460,140 @@ static void process_websock_hdr(websock_pkt *pkt, mm_err *err) {
     pkt->__internal.state = WEBSOCK_PAYLOAD;
     pkt->__internal.pos = 0;
     
-    return;
+    //Now we know how much room the payload needs. Streamed frames only
+    //need room for one segment
+    if (pkt->streamed && len > WEBSOCK_STREAM_SEGMENT) len = WEBSOCK_STREAM_SEGMENT;
+    expand_pkt_mem_to(pkt, len, err);
 }
 
 #endif
 
+//Same idea as http_req_reserve. sz can't be more than
+//WEBSOCK_HARD_MAX_FRAME, since no frame we'd parse could need it
+void websock_pkt_reserve(websock_pkt *pkt, int sz, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+    
+    if (!pkt) {
+        *err = WEBSOCK_NULL_ARG;
+        return;
+    } else if (sz < 0 || sz > WEBSOCK_HARD_MAX_FRAME) {
+        *err = WEBSOCK_INVALID_ARG;
+        return;
+    }
+    
+    expand_pkt_mem_to(pkt, sz, err);
+}
+#else
+;
+#endif
+
+//Saves pkt's parse state into st, e.g. to hand the connection to another
+//process. The bytes at *data (returns how many) go with it: the part of the
+//header or (already unmasked) payload we have so far. Streamed frames have
+//already handed theirs to on_data, so there's nothing for them. Assumes
+//its arguments are non-NULL
+unsigned long websock_pkt_save(websock_pkt const *pkt, websock_pkt_state *st, char const **data)
+#ifdef MM_IMPLEMENT
+{
+    memset(st, 0, sizeof(websock_pkt_state));
+    st->state = pkt->__internal.state;
+    st->type = pkt->type;
+    st->fin = pkt->fin;
+    st->streamed = pkt->streamed;
+    memcpy(st->mask, pkt->__internal.mask, 4);
+    st->hdr_len = pkt->__internal.hdr_len;
+    st->pos = pkt->__internal.pos;
+    st->payload_len = pkt->payload_len;
+    st->msg_len = pkt->__internal.msg_len;
+    
+    *data = pkt->__internal.base;
+    return pkt->streamed && pkt->__internal.state == WEBSOCK_PAYLOAD ? 0 : pkt->__internal.pos;
+}
+#else
+;
+#endif
+
+//Undoes websock_pkt_save: puts st and its len bytes of data into pkt, so
+//the next write carries on from there. pkt's limits and on_data should be
+//set first. They're checked again, since they might not be the same as
+//where st came from
+void websock_pkt_restore(websock_pkt *pkt, websock_pkt_state const *st, char const *data, unsigned long len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return;
+    
+    if (!pkt || !st || (len > 0 && !data)) {
+        *err = WEBSOCK_NULL_ARG;
+        return;
+    }
+    
+    reset_websock_pkt(pkt);
+    //msg_len carries over between the frames of a fragmented message, so
+    //it counts whatever state we're in
+    if (pkt->limits.max_msg > 0 && st->msg_len > pkt->limits.max_msg) {
+        *err = WEBSOCK_MSG_TOO_BIG;
+        return;
+    }
+    if (st->state != WEBSOCK_PAYLOAD) {
+        unsigned long hdr_end = st->state == WEBSOCK_HDR_FIRST_TWO_BYTES ? 2 : st->hdr_len;
+        //(hdr_len means nothing until the first two bytes are in, and
+        //after that it's never less than those two)
+        if (st->state > WEBSOCK_REST_OF_HDR || hdr_end > WEBSOCK_MAX_HDR_SIZE
+            || st->pos > hdr_end || len != st->pos
+            || (st->state == WEBSOCK_REST_OF_HDR && (st->hdr_len < 2 || st->pos < 2))
+        ) {
+            *err = WEBSOCK_INVALID_ARG;
+            return;
+        }
+        //The header always fits in the initial buffer
+        memcpy(pkt->__internal.base, data, len);
+    } else {
+        if (websock_pkt_type_strs[st->type & 0xF] == websock_badop || st->pos > st->payload_len) {
+            *err = WEBSOCK_INVALID_ARG;
+            return;
+        }
+        
+        unsigned long room = st->payload_len;
+        if (st->streamed) {
+            if (!pkt->on_data || len != 0) {
+                *err = WEBSOCK_INVALID_ARG;
+                return;
+            }
+            if (room > WEBSOCK_STREAM_SEGMENT) room = WEBSOCK_STREAM_SEGMENT;
+        } else {
+            unsigned long max_frame = pkt->limits.max_frame;
+            if (max_frame == 0 || max_frame > WEBSOCK_HARD_MAX_FRAME) max_frame = WEBSOCK_HARD_MAX_FRAME;
+            if (st->payload_len > max_frame) {
+                *err = WEBSOCK_FRAME_TOO_BIG;
+                return;
+            }
+            if (len != st->pos) {
+                *err = WEBSOCK_INVALID_ARG;
+                return;
+            }
+        }
+        
+        expand_pkt_mem_to(pkt, room, err);
+        if (*err != MM_SUCCESS) return;
+        memcpy(pkt->__internal.base, data, len);
+    }
+    
+    pkt->__internal.state = (websock_parse_state_t) st->state;
+    pkt->type = (websock_pkt_type_t) st->type;
+    pkt->fin = st->fin;
+    pkt->streamed = st->streamed;
+    memcpy(pkt->__internal.mask, st->mask, 4);
+    pkt->__internal.hdr_len = st->hdr_len;
+    pkt->__internal.pos = st->pos;
+    pkt->payload_len = st->payload_len;
+    pkt->__internal.msg_len = st->msg_len;
+}
+#else
+;
+#endif
+
 //Says whether this is a websocket request. Returns 1 if true.
 int is_websock_request(http_req const *req, mm_err *err)
 #ifdef MM_IMPLEMENT
@@ -344,13 +604,13 @@ int is_websock_request(http_req const *req, mm_err *err)
     {
     char *cxn_args = get_args(req, "Connection", err);
     if (!cxn_args) return 0;
-    if (strcmp(cxn_args, "Upgrade")) return 0;
+    if (!has_token(cxn_args, "Upgrade")) return 0;
     }
     
     {
     char *upgrade_args = get_args(req, "Upgrade", err);
     if (!upgrade_args) return 0;
-    if (strcmp(upgrade_args, "websocket")) return 0;
+    if (!has_token(upgrade_args, "websocket")) return 0;
     }
     
     {
@@ -413,12 +673,9 @@ void to_b64(unsigned char *dst, unsigned char const *src, int len)
 ;
 #endif
 
-//Same semantics as write_to_http_parser
-int write_to_websock_parser(websock_pkt *pkt, char const *buf, int len, mm_err *err)
 #ifdef MM_IMPLEMENT
-{
-    if (*err != MM_SUCCESS) return -1;
-    
+//The guts of write_to_websock_parser
+static int websock_parse_chunk(websock_pkt *pkt, char const *buf, int len, mm_err *err) {
     //Sanity-check inputs
     if (!pkt || !buf) {
         *err = WEBSOCK_NULL_ARG;
@@ -429,12 +686,11 @@ int write_to_websock_parser(websock_pkt *pkt, char const *buf, int len, mm_err *
         return -1;
     }
     
-    //Make sure internal buffer has enough room for this new input
-    expand_pkt_mem_to(pkt, pkt->__internal.pos + len, err);
-    if (*err != MM_SUCCESS) return -1;
-    
+    //No need to make room here: the header always fits in the initial
+    //buffer, and process_websock_hdr makes room for the payload once it
+    //knows the length (and that it's within limits)
     char *base = pkt->__internal.base; //For convenience
-    int *pos = &(pkt->__internal.pos); //For convenience
+    unsigned long *pos = &(pkt->__internal.pos); //For convenience
     
     int rd_pos = 0;
     
@@ -460,19 +716,36 @@ int write_to_websock_parser(websock_pkt *pkt, char const *buf, int len, mm_err *
         if (*pos == pkt->__internal.hdr_len) {
             process_websock_hdr(pkt, err);
             if (*err != MM_SUCCESS) return -1;
+            //That might have moved the buffer
+            base = pkt->__internal.base;
         }
     }
     
     //This is deliberately NOT an else if
     if (pkt->__internal.state == WEBSOCK_PAYLOAD) {
-        while (rd_pos < len && (*pos) < pkt->payload_len) {
-            base[*pos] = buf[rd_pos++] ^ pkt->__internal.mask[(*pos)&0x3]; //Unmask payload (why does websockets have this?)
-            (*pos)++;
+        //Unmask payload (why does websockets have this?)
+        if (pkt->streamed) {
+            //A segment at a time, and the user gets each one right away
+            while (rd_pos < len && (*pos) < pkt->payload_len) {
+                unsigned long n = len - rd_pos;
+                if (n > pkt->payload_len - *pos) n = pkt->payload_len - *pos;
+                if (n > (unsigned long) pkt->__internal.cap) n = pkt->__internal.cap;
+                websock_mask(base, buf + rd_pos, n, pkt->__internal.mask, *pos);
+                pkt->on_data(pkt, base, n, *pos, pkt->on_data_arg);
+                rd_pos += n;
+                (*pos) += n;
+            }
+        } else {
+            unsigned long n = len - rd_pos;
+            if (n > pkt->payload_len - *pos) n = pkt->payload_len - *pos;
+            websock_mask(base + *pos, buf + rd_pos, n, pkt->__internal.mask, *pos);
+            rd_pos += n;
+            (*pos) += n;
         }
         
         if (*pos == pkt->payload_len) {
             //Done reading payload. Make sure user-facing fields are in order
-            pkt->payload = pkt->__internal.base;
+            pkt->payload = pkt->streamed ? NULL : pkt->__internal.base;
             
             //Reset pos and parse state in case user wants to reuse this 
             //struct
@@ -491,6 +764,19 @@ int write_to_websock_parser(websock_pkt *pkt, char const *buf, int len, mm_err *
     
     return 1; //No error, but not done
 }
+#endif
+
+//Same semantics as write_to_http_parser
+int write_to_websock_parser(websock_pkt *pkt, char const *buf, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+    
+    METRIC_TIME_START(t0);
+    int rc = websock_parse_chunk(pkt, buf, len, err);
+    METRIC_PARSE_DONE(METRICS_WEBSOCK, len, rc, *err, *err == WEBSOCK_STRAGGLERS, t0);
+    return rc;
+}
 #else
 ;
 #endif
@@ -583,35 +869,66 @@ int construct_websock_hdr(char *dst, websock_pkt_type_t type, int fin, unsigned
     //Write FIN + OPCODE portion
     *dst++ = (fin ? 0x80 : 0) | type;
     
-    //Write length portion
+    //Write length portion. It has to be the shortest encoding that fits
     if (len < 126) {
         *dst++ = (len & 0xFF);
-    } else if (len < 0xFFFF) {
+    } else if (len <= 0xFFFF) {
         *dst++ = 126;
-        //WARNING WARNING WARNING This assumes the host machine is little endian!
-        char *bytes = (char*)&len;
-        *dst++ = bytes[1];
-        *dst++ = bytes[0];
+        *dst++ = (len >> 8) & 0xFF;
+        *dst++ = len & 0xFF;
     } else {
         *dst++ = 127;
-        //WARNING WARNING WARNING This assumes the host machine is little endian!
-        char *bytes = (char*)&len;
-        *dst++ = bytes[7];
-        *dst++ = bytes[6];
-        *dst++ = bytes[5];
-        *dst++ = bytes[4];
-        *dst++ = bytes[3];
-        *dst++ = bytes[2];
-        *dst++ = bytes[1];
-        *dst++ = bytes[0];
+        int i;
+        for (i = 7; i >= 0; i--) *dst++ = (len >> (8*i)) & 0xFF;
     }
     
+    //Frames sent by the server must not be masked, so the MASK bit is left
+    //clear and there is no masking key
     
-    //Push zero bytes for the mask
-    *dst++ = 0;
-    *dst++ = 0;
-    *dst++ = 0;
-    *dst++ = 0;
+    return dst - dst_saved;
+}
+#else
+;
+#endif
+
+//Same as construct_websock_hdr, but for frames going from a client to a
+//server, which have to be masked. The 4 bytes of mask are copied into the
+//header; you still have to mask the payload yourself (see websock_mask).
+//dst must have at least WEBSOCK_MAX_HDR_SIZE bytes of space. Returns number
+//of bytes written, or negative on error
+int construct_websock_client_hdr(char *dst, websock_pkt_type_t type, int fin, unsigned long len, char const *mask, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+    
+    if (!dst || !mask) {
+        *err = WEBSOCK_NULL_ARG;
+        return -1;
+    }
+    if (type > 15 || websock_pkt_type_strs[type] == websock_badop || (len>>63)) {
+        *err = WEBSOCK_INVALID_ARG;
+        return -1;
+    }
+    
+    char *dst_saved = dst;
+    
+    *dst++ = (fin ? 0x80 : 0) | type;
+    
+    //Same length format as always, but with the MASK bit set
+    if (len < 126) {
+        *dst++ = 0x80 | len;
+    } else if (len <= 0xFFFF) {
+        *dst++ = 0x80 | 126;
+        *dst++ = (len >> 8) & 0xFF;
+        *dst++ = len & 0xFF;
+    } else {
+        *dst++ = 0x80 | 127;
+        int i;
+        for (i = 7; i >= 0; i--) *dst++ = (len >> (8*i)) & 0xFF;
+    }
+    
+    memcpy(dst, mask, 4);
+    dst += 4;
     
     return dst - dst_saved;
 }
@@ -619,6 +936,35 @@ int construct_websock_hdr(char *dst, websock_pkt_type_t type, int fin, unsigned
 ;
 #endif
 
+//XORs len bytes of src with mask and writes them to dst (which can be the
+//same as src). off is the offset of src within the payload, so you can mask
+//a payload in several pieces. Assumes all pointers are non-NULL
+void websock_mask(char *dst, char const *src, unsigned long len, char const *mask, unsigned long off)
+#ifdef MM_IMPLEMENT
+{
+    unsigned long i = 0;
+    
+    //Eight bytes at a time, with the mask lined up to where we are
+    if (len >= 16) {
+        char m8[8];
+        int j;
+        for (j = 0; j < 8; j++) m8[j] = mask[(off + j) & 0x3];
+        unsigned long long m;
+        memcpy(&m, m8, 8);
+        for (; i + 8 <= len; i += 8) {
+            unsigned long long w;
+            memcpy(&w, src + i, 8);
+            w ^= m;
+            memcpy(dst + i, &w, 8);
+        }
+    }
+    
+    for (; i < len; i++) dst[i] = src[i] ^ mask[(off + i) & 0x3];
+}
+#else
+;
+#endif
+
 
 #else
 #undef SHOULD_INCLUDE
@@ -0,0 +1,569 @@
+//Per-connection outbound queues. Each queue holds references to
+//reference-counted buffers (so the same message can sit on thousands of
+//connections without being copied), and keeps track of how many unsent
+//bytes it is holding on to.
+//
+//Producers are told to back off through the on_stop/on_resume callbacks
+//(high and low watermarks). If a producer ignores that and the queue hits
+//its hard limit, the queue's policy decides what happens to the slow
+//consumer: drop the new message, coalesce it with older unsent messages,
+//or give up on the connection. There is also a process-wide cap on queued
+//bytes, so a bunch of slow clients together can't eat all the memory
+//either.
+
+//There's a special place in hell for preprocessor sinners like me...
+//This is my way of doing "#pragma once"
+#ifdef MM_IMPLEMENT
+    #ifndef WRITE_QUEUE_H_IMPLEMENTED
+        #define SHOULD_INCLUDE 1
+        #define WRITE_QUEUE_H_IMPLEMENTED 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#else
+    #ifndef WRITE_QUEUE_H
+        #define SHOULD_INCLUDE 1
+        #define WRITE_QUEUE_H 1
+    #else
+        #define SHOULD_INCLUDE 0
+    #endif
+#endif
+
+#if SHOULD_INCLUDE
+#undef SHOULD_INCLUDE //Don't accidentally mess up other header files
+
+#ifdef MM_IMPLEMENT
+#undef MM_IMPLEMENT
+#include "write_queue.h"
+#define MM_IMPLEMENT
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "mm_err.h"
+
+////////////////
+// Parameters //
+////////////////
+#ifndef MM_IMPLEMENT
+    #define WQ_DEFAULT_HIGH_WM (256 * 1024)
+    #define WQ_DEFAULT_LOW_WM (64 * 1024)
+    #define WQ_DEFAULT_MAX_BYTES (1024 * 1024)
+    //Number of entries the ring starts with the first time something is
+    //queued. Most connections never queue anything, so they never pay for
+    //this
+    #define WQ_INITIAL_ENTRIES 8
+    //Max number of buffers handed to the kernel in one sendmsg
+    #define WQ_MAX_IOVS 64
+#endif
+
+/////////////////
+// Error codes //
+/////////////////
+
+MM_ERR(WQ_NULL_ARG, "NULL argument where non-NULL expected");
+MM_ERR(WQ_INVALID_ARG, "invalid argument");
+MM_ERR(WQ_OOM, "out of memory");
+MM_ERR(WQ_DROPPED, "consumer too slow; message dropped");
+MM_ERR(WQ_SLOW_CONSUMER, "consumer too slow; connection should be closed");
+MM_ERR(WQ_WRITE_ERROR, "could not write queued data (check errno)");
+
+///////////////////////////////
+// Write queue structs/enums //
+///////////////////////////////
+#ifndef MM_IMPLEMENT
+    //What to do when a queue would go over its hard limit
+    #define WQ_POLICY_IDS \
+        X(WQ_POLICY_DROP), \
+        X(WQ_POLICY_COALESCE), \
+        X(WQ_POLICY_DISCONNECT)
+
+    typedef enum _wq_policy_t {
+    #define X(x) x
+        WQ_POLICY_IDS
+    #undef X
+    } wq_policy_t;
+
+    extern char const *const wq_policy_strs[];
+
+    //Reference-counted buffer. The data lives right after the header, so
+    //each one is a single allocation
+    typedef struct _wq_buf {
+        int refs;
+        int len;
+        char data[];
+    } wq_buf;
+
+    typedef struct _wq_entry {
+        wq_buf *buf;
+        int off; //Bytes of buf already sent (or skipped)
+        unsigned key; //Coalescing key. 0 means "never coalesce"
+    } wq_entry;
+
+    struct _write_queue;
+    typedef void wq_signal_cb(struct _write_queue *q, void *arg);
+    
+    //Something that can take a gather write, like sendmsg on a socket.
+    //Returns the number of bytes it took (0 if it can't take any right now)
+    //or negative if the connection is dead. See wq_flush_to
+    typedef long wq_send_fn(void *arg, struct iovec const *iov, int n);
+
+    typedef struct _write_queue {
+        //Unsent bytes currently queued
+        long bytes;
+        //Bytes that have gone out of the queue, ever. Together with bytes,
+        //tells you when something you queued has been sent
+        unsigned long sent;
+
+        //Crossing high_wm calls on_stop; draining back down to low_wm calls
+        //on_resume. max_bytes is the hard limit where the policy kicks in
+        //(zero means no limit)
+        long high_wm;
+        long low_wm;
+        long max_bytes;
+        wq_policy_t policy;
+
+        //1 between on_stop and on_resume
+        int stopped;
+        wq_signal_cb *on_stop;
+        wq_signal_cb *on_resume;
+        void *arg;
+
+        //Internal fields. Don't touch!
+        struct {
+            //Ring buffer of entries
+            wq_entry *ents;
+            int head;
+            int num;
+            int cap;
+        } __internal;
+    } write_queue;
+#else
+    #define X(x) #x
+    char const *const wq_policy_strs[] = {
+        WQ_POLICY_IDS
+    };
+    #undef X
+
+    //Process-wide count of queued bytes, and the cap on it (0 = no cap).
+    //Several event loops could be sharing these, so they are only touched
+    //with atomics
+    static long wq_global_bytes_ = 0;
+    static long wq_global_cap_ = 0;
+#endif
+
+//////////////////////
+// Static functions //
+//////////////////////
+#ifdef MM_IMPLEMENT
+
+static wq_entry *wq_at(write_queue *q, int i) {
+    return q->__internal.ents + ((q->__internal.head + i) % q->__internal.cap);
+}
+
+static void wq_account(write_queue *q, long delta) {
+    q->bytes += delta;
+    __atomic_add_fetch(&wq_global_bytes_, delta, __ATOMIC_RELAXED);
+}
+
+//Would adding n more bytes put us over either limit?
+static int wq_over_limit(write_queue const *q, long n) {
+    if (q->max_bytes > 0 && q->bytes + n > q->max_bytes) return 1;
+
+    long cap = __atomic_load_n(&wq_global_cap_, __ATOMIC_RELAXED);
+    if (cap > 0 && __atomic_load_n(&wq_global_bytes_, __ATOMIC_RELAXED) + n > cap) return 1;
+
+    return 0;
+}
+
+static void wq_check_resume(write_queue *q) {
+    if (q->stopped && q->bytes <= q->low_wm) {
+        q->stopped = 0;
+        if (q->on_resume) q->on_resume(q, q->arg);
+    }
+}
+
+//Throws away every queued message with the given key that hasn't started
+//going out yet. (A partly-sent message has to be finished, or the stream
+//would be corrupted)
+static void wq_coalesce(write_queue *q, unsigned key) {
+    int rd, wr = 0;
+    int num = q->__internal.num;
+
+    for (rd = 0; rd < num; rd++) {
+        wq_entry *e = wq_at(q, rd);
+        if (e->key == key && e->off == 0) {
+            wq_account(q, -(long) e->buf->len);
+            wq_buf_unref(e->buf);
+            continue;
+        }
+        if (rd != wr) *wq_at(q, wr) = *e;
+        wr++;
+    }
+
+    q->__internal.num = wr;
+}
+
+static void wq_grow(write_queue *q, mm_err *err) {
+    if (*err != MM_SUCCESS) return;
+
+    int new_cap = q->__internal.cap ? q->__internal.cap * 2 : WQ_INITIAL_ENTRIES;
+    wq_entry *ents = malloc(new_cap * sizeof(wq_entry));
+    if (!ents) {
+        *err = WQ_OOM;
+        return;
+    }
+
+    //Unwrap the ring while copying
+    int i;
+    for (i = 0; i < q->__internal.num; i++) ents[i] = *wq_at(q, i);
+
+    free(q->__internal.ents);
+    q->__internal.ents = ents;
+    q->__internal.head = 0;
+    q->__internal.cap = new_cap;
+}
+
+#endif
+
+//////////////////////////
+// Managing wq_bufs     //
+//////////////////////////
+
+//Returns a new buffer with room for len bytes and a reference count of one.
+//Fill in ->data yourself. Returns NULL and sets *err on error
+wq_buf *new_wq_buf(int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (len < 0) {
+        *err = WQ_INVALID_ARG;
+        return NULL;
+    }
+
+    wq_buf *ret = malloc(sizeof(wq_buf) + len);
+    if (!ret) {
+        *err = WQ_OOM;
+        return NULL;
+    }
+
+    ret->refs = 1;
+    ret->len = len;
+    return ret;
+}
+#else
+;
+#endif
+
+//Same as new_wq_buf, but copies len bytes of data into the new buffer
+wq_buf *new_wq_buf_from(char const *data, int len, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return NULL;
+
+    if (len > 0 && !data) {
+        *err = WQ_NULL_ARG;
+        return NULL;
+    }
+
+    wq_buf *ret = new_wq_buf(len, err);
+    if (*err != MM_SUCCESS) return NULL;
+
+    memcpy(ret->data, data, len);
+    return ret;
+}
+#else
+;
+#endif
+
+//Takes another reference on b. Safe to call from any thread. Assumes b is
+//non-NULL
+void wq_buf_ref(wq_buf *b)
+#ifdef MM_IMPLEMENT
+{
+    __atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+#else
+;
+#endif
+
+//Drops a reference on b, freeing it if that was the last one. Safe to call
+//from any thread. Gracefully ignores NULL input
+void wq_buf_unref(wq_buf *b)
+#ifdef MM_IMPLEMENT
+{
+    if (!b) return;
+    if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0) free(b);
+}
+#else
+;
+#endif
+
+//////////////////////////////
+// Managing write queues    //
+//////////////////////////////
+
+//Initializes an (embedded) write queue with the default limits and the
+//drop policy. Nothing is allocated until the first message is queued.
+//Assumes q is non-NULL
+void init_write_queue(write_queue *q)
+#ifdef MM_IMPLEMENT
+{
+    q->bytes = 0;
+    q->sent = 0;
+    q->high_wm = WQ_DEFAULT_HIGH_WM;
+    q->low_wm = WQ_DEFAULT_LOW_WM;
+    q->max_bytes = WQ_DEFAULT_MAX_BYTES;
+    q->policy = WQ_POLICY_DROP;
+    q->stopped = 0;
+    q->on_stop = NULL;
+    q->on_resume = NULL;
+    q->arg = NULL;
+    q->__internal.ents = NULL;
+    q->__internal.head = 0;
+    q->__internal.num = 0;
+    q->__internal.cap = 0;
+}
+#else
+;
+#endif
+
+//Drops everything in the queue (without calling any callbacks) and frees
+//its internal memory. The queue can still be reused afterwards. Assumes q
+//is non-NULL
+void clear_write_queue(write_queue *q)
+#ifdef MM_IMPLEMENT
+{
+    int i;
+    for (i = 0; i < q->__internal.num; i++) {
+        wq_entry *e = wq_at(q, i);
+        wq_account(q, -(long) (e->buf->len - e->off));
+        wq_buf_unref(e->buf);
+    }
+
+    free(q->__internal.ents);
+    q->__internal.ents = NULL;
+    q->__internal.head = 0;
+    q->__internal.num = 0;
+    q->__internal.cap = 0;
+    q->stopped = 0;
+}
+#else
+;
+#endif
+
+//Returns 1 if there is nothing waiting to be sent
+int wq_empty(write_queue const *q)
+#ifdef MM_IMPLEMENT
+{
+    return q->__internal.num == 0;
+}
+#else
+;
+#endif
+
+/* wq_push:
+
+Queues the bytes of b starting at offset off. On success the queue takes
+its own reference to b (so you still have to unref yours) and 0 is
+returned.
+
+If the message would put the queue over max_bytes (or put the whole process
+over the global cap), the policy decides what happens:
+
+ - WQ_POLICY_DROP: the message is not queued, and *err is set to WQ_DROPPED.
+   The connection is still fine.
+ - WQ_POLICY_COALESCE: if key is nonzero, older messages with the same key
+   that haven't started sending yet are thrown out to make room (i.e. the
+   newest value wins). If that isn't enough, this behaves like DROP.
+ - WQ_POLICY_DISCONNECT: *err is set to WQ_SLOW_CONSUMER. You should close
+   the connection.
+
+In all of these cases -1 is returned.
+
+Crossing the high watermark calls on_stop (once, until on_resume).
+*/
+int wq_push(write_queue *q, wq_buf *b, int off, unsigned key, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!q || !b) {
+        *err = WQ_NULL_ARG;
+        return -1;
+    }
+    if (off < 0 || off > b->len) {
+        *err = WQ_INVALID_ARG;
+        return -1;
+    }
+
+    long n = b->len - off;
+    if (n == 0) return 0;
+
+    if (wq_over_limit(q, n)) {
+        switch (q->policy) {
+        case WQ_POLICY_DISCONNECT:
+            *err = WQ_SLOW_CONSUMER;
+            return -1;
+        case WQ_POLICY_COALESCE:
+            if (key != 0) {
+                wq_coalesce(q, key);
+                if (!wq_over_limit(q, n)) break;
+            }
+            *err = WQ_DROPPED;
+            return -1;
+        default:
+            *err = WQ_DROPPED;
+            return -1;
+        }
+    }
+
+    if (q->__internal.num == q->__internal.cap) {
+        wq_grow(q, err);
+        if (*err != MM_SUCCESS) return -1;
+    }
+
+    wq_entry *e = wq_at(q, q->__internal.num++);
+    e->buf = b;
+    e->off = off;
+    e->key = key;
+    wq_buf_ref(b);
+    wq_account(q, n);
+
+    if (!q->stopped && q->bytes >= q->high_wm) {
+        q->stopped = 1;
+        if (q->on_stop) q->on_stop(q, q->arg);
+    }
+
+    //Coalescing could have brought us back under the low watermark
+    wq_check_resume(q);
+
+    return 0;
+}
+#else
+;
+#endif
+
+//The wq_send_fn wq_flush uses: sendmsg on a socket, without blocking. arg
+//is the fd, cast to a pointer
+long wq_send_socket(void *arg, struct iovec const *iov, int n)
+#ifdef MM_IMPLEMENT
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = n;
+    
+    while (1) {
+        long rc = sendmsg((int) (long) arg, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (rc >= 0) return rc;
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+        return -1;
+    }
+}
+#else
+;
+#endif
+
+//Same as wq_flush, but the bytes go to send instead of straight to a
+//socket (e.g. so they can be encrypted first)
+long wq_flush_to(write_queue *q, wq_send_fn *send, void *arg, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    if (*err != MM_SUCCESS) return -1;
+
+    if (!q || !send) {
+        *err = WQ_NULL_ARG;
+        return -1;
+    }
+
+    while (q->__internal.num > 0) {
+        struct iovec iov[WQ_MAX_IOVS];
+        int n = q->__internal.num < WQ_MAX_IOVS ? q->__internal.num : WQ_MAX_IOVS;
+        long total = 0;
+
+        int i;
+        for (i = 0; i < n; i++) {
+            wq_entry *e = wq_at(q, i);
+            iov[i].iov_base = e->buf->data + e->off;
+            iov[i].iov_len = e->buf->len - e->off;
+            total += iov[i].iov_len;
+        }
+
+        long rc = send(arg, iov, n);
+        if (rc < 0) {
+            *err = WQ_WRITE_ERROR;
+            return -1;
+        }
+
+        wq_account(q, -rc);
+        q->sent += rc;
+        long sent = rc;
+
+        //Pop everything that was completely sent
+        while (rc > 0) {
+            wq_entry *e = wq_at(q, 0);
+            long left = e->buf->len - e->off;
+            if (rc < left) {
+                e->off += rc;
+                break;
+            }
+            rc -= left;
+            wq_buf_unref(e->buf);
+            q->__internal.head = (q->__internal.head + 1) % q->__internal.cap;
+            q->__internal.num--;
+        }
+
+        //Short write means the socket buffer is full
+        if (sent < total) break;
+    }
+
+    wq_check_resume(q);
+
+    return q->bytes;
+}
+#else
+;
+#endif
+
+//Writes as much of the queue to fd (which must be a socket) as the kernel
+//will take without blocking. Returns the number of bytes still queued, or
+//negative on error (in which case the connection is probably dead).
+//Draining below the low watermark calls on_resume
+long wq_flush(write_queue *q, int fd, mm_err *err)
+#ifdef MM_IMPLEMENT
+{
+    return wq_flush_to(q, wq_send_socket, (void *) (long) fd, err);
+}
+#else
+;
+#endif
+
+//Sets the process-wide cap on queued bytes (0 means no cap)
+void wq_set_global_cap(long cap)
+#ifdef MM_IMPLEMENT
+{
+    __atomic_store_n(&wq_global_cap_, cap, __ATOMIC_RELAXED);
+}
+#else
+;
+#endif
+
+//Returns the number of bytes queued across every write queue in the process
+long wq_global_bytes()
+#ifdef MM_IMPLEMENT
+{
+    return __atomic_load_n(&wq_global_bytes_, __ATOMIC_RELAXED);
+}
+#else
+;
+#endif
+
+#else
+#undef SHOULD_INCLUDE
+#endif